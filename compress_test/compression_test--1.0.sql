@@ -12,6 +12,20 @@ CREATE FUNCTION get_raw_page(IN relid oid,
 AS 'MODULE_PATHNAME'
 LANGUAGE C STRICT;
 
+-- Same as get_raw_page for a range of blocks, returning one row per block.
+-- All the blocks up to the end of the relation are returned if nblocks
+-- is NULL.
+CREATE FUNCTION get_raw_pages(IN relid oid,
+	IN start_blk bigint,
+	IN nblocks bigint,
+	IN with_hole bool,
+	OUT blkno bigint,
+	OUT page bytea,
+	OUT hole_offset smallint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
 -- Routine useful for decompression to get size of a bytea field
 CREATE FUNCTION bytea_size(bytea)
 RETURNS int
@@ -40,3 +54,49 @@ CREATE FUNCTION decompress_data(bytea, smallint)
 RETURNS bytea
 AS 'MODULE_PATHNAME'
 LANGUAGE C STRICT;
+
+-- Benchmark of compression algorithms on the pages of a relation, or a
+-- sample of them, with page holes filled with zeros or removed. All the
+-- algorithms available in this build are used by default.
+CREATE FUNCTION compression_benchmark(IN relid regclass,
+	IN sample_pct float8 DEFAULT 100,
+	IN algorithms text[] DEFAULT NULL,
+	OUT algorithm text,
+	OUT with_hole bool,
+	OUT pages bigint,
+	OUT raw_bytes bigint,
+	OUT compressed_bytes bigint,
+	OUT ratio float8,
+	OUT compress_mbps float8,
+	OUT decompress_mbps float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- Compression of a set of hole-stripped pages into a single frame, with
+-- an optional zstd dictionary built by train_dictionary().
+CREATE FUNCTION compress_pages(IN pages bytea[],
+	IN hole_offsets smallint[],
+	IN algorithm text DEFAULT 'pglz',
+	IN dictionary bytea DEFAULT NULL)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- Decompression of a frame built by compress_pages(), returning each
+-- page with its hole filled with zeros.
+CREATE FUNCTION decompress_pages(IN frame bytea,
+	IN dictionary bytea DEFAULT NULL,
+	OUT pageno int,
+	OUT page bytea)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- Build a zstd dictionary from a sample of the pages of a relation.
+CREATE FUNCTION train_dictionary(IN relid regclass,
+	IN sample_pct float8 DEFAULT 10,
+	IN dict_size int DEFAULT 112640)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
@@ -13,16 +13,30 @@
 
 #include "postgres.h"
 
+#include <math.h>
+
+#ifdef COMPRESSION_TEST_LZ4
+#include <lz4.h>
+#endif
+#ifdef COMPRESSION_TEST_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
 #include "access/htup_details.h"
+#include "executor/executor.h"
 #include "catalog/catalog.h"
 #include "catalog/namespace.h"
 #include "catalog/pg_type.h"
 #include "common/pg_lzcompress.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
 #include "storage/bufmgr.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/rel.h"
+#include "utils/sampling.h"
 
 PG_MODULE_MAGIC;
 
@@ -30,40 +44,134 @@ PG_MODULE_MAGIC;
 #define PGLZ_MAX_BLCKSZ		PGLZ_MAX_OUTPUT(BLCKSZ)
 
 PG_FUNCTION_INFO_V1(get_raw_page);
+PG_FUNCTION_INFO_V1(get_raw_pages);
 PG_FUNCTION_INFO_V1(compress_data);
 PG_FUNCTION_INFO_V1(decompress_data);
 PG_FUNCTION_INFO_V1(bytea_size);
+PG_FUNCTION_INFO_V1(compression_benchmark);
+PG_FUNCTION_INFO_V1(compress_pages);
+PG_FUNCTION_INFO_V1(decompress_pages);
+PG_FUNCTION_INFO_V1(train_dictionary);
 
 /*
- * get_raw_page
- *
- * Returns a copy of a page from shared buffers as a bytea, with hole
- * filled with zeros or simply without hole, with the length of the page
- * offset to be able to reconstitute the page entirely using the data
- * returned by this function.
+ * Compression algorithms available for benchmarks. Compression routines
+ * return the size of the compressed data, or -1 if the data could not be
+ * compressed in the given space, and decompression routines return the
+ * size of the decompressed data, or -1 on failure.
  */
-Datum
-get_raw_page(PG_FUNCTION_ARGS)
+typedef struct CompressionAlgorithm
 {
-	Oid			relid = PG_GETARG_OID(0);
-	uint32		blkno = PG_GETARG_UINT32(1);
-	bool		with_hole = PG_GETARG_BOOL(2);
-	bytea	   *raw_page;
-	Relation	rel;
-	char	    raw_page_data[BLCKSZ];
-	Buffer		buf;
-	TupleDesc	tupdesc;
-	Datum       result;
-	Datum		values[2];
-	bool		nulls[2];
-	HeapTuple	tuple;
-	PageHeader	page_header;
-	int16		hole_offset, hole_length;
+	const char *name;
+	int			(*bound) (int srclen);
+	int			(*compress) (const char *src, int srclen,
+							 char *dst, int dstlen);
+	int			(*decompress) (const char *src, int srclen,
+							   char *dst, int rawlen);
+} CompressionAlgorithm;
 
-	if (!superuser())
+static int
+pglz_bound(int srclen)
+{
+	return PGLZ_MAX_OUTPUT(srclen);
+}
+
+static int
+pglz_compress_data(const char *src, int srclen, char *dst, int dstlen)
+{
+	Assert(dstlen >= PGLZ_MAX_OUTPUT(srclen));
+	return pglz_compress(src, srclen, dst, PGLZ_strategy_always);
+}
+
+static int
+pglz_decompress_data(const char *src, int srclen, char *dst, int rawlen)
+{
+	return pglz_decompress(src, srclen, dst, rawlen);
+}
+
+#ifdef COMPRESSION_TEST_LZ4
+static int
+lz4_bound(int srclen)
+{
+	return LZ4_compressBound(srclen);
+}
+
+static int
+lz4_compress_data(const char *src, int srclen, char *dst, int dstlen)
+{
+	int			len = LZ4_compress_default(src, dst, srclen, dstlen);
+
+	return len > 0 ? len : -1;
+}
+
+static int
+lz4_decompress_data(const char *src, int srclen, char *dst, int rawlen)
+{
+	return LZ4_decompress_safe(src, dst, srclen, rawlen);
+}
+#endif
+
+#ifdef COMPRESSION_TEST_ZSTD
+/* contexts are kept around, as creating them is costly */
+static ZSTD_CCtx *zstd_cctx = NULL;
+static ZSTD_DCtx *zstd_dctx = NULL;
+
+static int
+zstd_bound(int srclen)
+{
+	return ZSTD_compressBound(srclen);
+}
+
+static int
+zstd_compress_data(const char *src, int srclen, char *dst, int dstlen)
+{
+	size_t		len;
+
+	if (zstd_cctx == NULL && (zstd_cctx = ZSTD_createCCtx()) == NULL)
 		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 (errmsg("must be superuser to use raw functions"))));
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	len = ZSTD_compressCCtx(zstd_cctx, dst, dstlen, src, srclen,
+							ZSTD_CLEVEL_DEFAULT);
+	return ZSTD_isError(len) ? -1 : (int) len;
+}
+
+static int
+zstd_decompress_data(const char *src, int srclen, char *dst, int rawlen)
+{
+	size_t		len;
+
+	if (zstd_dctx == NULL && (zstd_dctx = ZSTD_createDCtx()) == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	len = ZSTD_decompressDCtx(zstd_dctx, dst, rawlen, src, srclen);
+	return ZSTD_isError(len) ? -1 : (int) len;
+}
+#endif
+
+static const CompressionAlgorithm compression_algorithms[] =
+{
+	{"pglz", pglz_bound, pglz_compress_data, pglz_decompress_data},
+#ifdef COMPRESSION_TEST_LZ4
+	{"lz4", lz4_bound, lz4_compress_data, lz4_decompress_data},
+#endif
+#ifdef COMPRESSION_TEST_ZSTD
+	{"zstd", zstd_bound, zstd_compress_data, zstd_decompress_data},
+#endif
+	{NULL, NULL, NULL, NULL}
+};
+
+/*
+ * open_raw_relation
+ *
+ * Open the given relation, checking that its raw pages can be read.
+ */
+static Relation
+open_raw_relation(Oid relid)
+{
+	Relation	rel;
 
 	rel = relation_open(relid, AccessShareLock);
 
@@ -83,6 +191,11 @@ get_raw_page(PG_FUNCTION_ARGS)
 				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
 				 errmsg("cannot get raw page from foreign table \"%s\"",
 						RelationGetRelationName(rel))));
+	if (rel->rd_rel->relkind == RELKIND_PARTITIONED_TABLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("cannot get raw page from partitioned table \"%s\"",
+						RelationGetRelationName(rel))));
 
 	/*
 	 * Reject attempts to read non-local temporary relations; we would be
@@ -94,6 +207,98 @@ get_raw_page(PG_FUNCTION_ARGS)
 				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 				 errmsg("cannot access temporary tables of other sessions")));
 
+	return rel;
+}
+
+/*
+ * read_raw_page
+ *
+ * Take a copy of a block of the main fork of a relation, read with the
+ * given buffer access strategy.
+ */
+static void
+read_raw_page(Relation rel, BlockNumber blkno, BufferAccessStrategy strategy,
+			  char *dst)
+{
+	Buffer		buf;
+
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	memcpy(dst, BufferGetPage(buf), BLCKSZ);
+	LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+	ReleaseBuffer(buf);
+}
+
+/*
+ * page_image
+ *
+ * Build in dst the image of a page, with its hole filled with zeros or
+ * removed, the same way as full-page images are built in WAL. The hole
+ * offset is returned in *hole_offset, being pd_lower as for get_raw_page()
+ * even if the hole is empty, or 0 if the page header is not valid. The
+ * result is the size of the image.
+ */
+static int
+page_image(const char *page, bool with_hole, char *dst, int16 *hole_offset)
+{
+	PageHeader	page_header = (PageHeader) page;
+	uint16		lower = page_header->pd_lower;
+	uint16		upper = page_header->pd_upper;
+
+	/* Page with an invalid hole, copied as a whole */
+	if (lower < SizeOfPageHeaderData || lower > upper || upper > BLCKSZ)
+	{
+		lower = upper = BLCKSZ;
+		*hole_offset = 0;
+	}
+	else
+		*hole_offset = lower;
+
+	if (with_hole)
+	{
+		memcpy(dst, page, BLCKSZ);
+		MemSet(dst + lower, 0, upper - lower);
+		return BLCKSZ;
+	}
+
+	memcpy(dst, page, lower);
+	memcpy(dst + lower, page + upper, BLCKSZ - upper);
+	return BLCKSZ - (upper - lower);
+}
+
+/*
+ * get_raw_page
+ *
+ * Returns a copy of a page from shared buffers as a bytea, with hole
+ * filled with zeros or simply without hole, with the length of the page
+ * offset to be able to reconstitute the page entirely using the data
+ * returned by this function.
+ */
+Datum
+get_raw_page(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	uint32		blkno = PG_GETARG_UINT32(1);
+	bool		with_hole = PG_GETARG_BOOL(2);
+	bytea	   *raw_page;
+	Relation	rel;
+	char	    raw_page_data[BLCKSZ];
+	Buffer		buf;
+	TupleDesc	tupdesc;
+	Datum       result;
+	Datum		values[2];
+	bool		nulls[2];
+	HeapTuple	tuple;
+	PageHeader	page_header;
+	int16		hole_offset, hole_length;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use raw functions"))));
+
+	rel = open_raw_relation(relid);
+
 	if (blkno >= RelationGetNumberOfBlocksInFork(rel, MAIN_FORKNUM))
 		ereport(ERROR,
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
@@ -151,6 +356,169 @@ get_raw_page(PG_FUNCTION_ARGS)
 	PG_RETURN_DATUM(result);
 }
 
+/*
+ * State of get_raw_pages across calls.
+ */
+typedef struct RawPagesState
+{
+	Relation	rel;			/* NULL once closed */
+	BufferAccessStrategy strategy;
+	BlockNumber blkno;			/* next block to return */
+	BlockNumber end_blkno;		/* block where to stop */
+	BlockNumber prefetch_blkno; /* next block to prefetch */
+	bool		with_hole;
+	ExprContext *econtext;
+} RawPagesState;
+
+/*
+ * Callback closing the relation read by get_raw_pages at the end of the
+ * query, in case the scan has not reached its end.
+ */
+static void
+get_raw_pages_shutdown(Datum arg)
+{
+	RawPagesState *state = (RawPagesState *) DatumGetPointer(arg);
+
+	if (state->rel != NULL)
+	{
+		relation_close(state->rel, AccessShareLock);
+		state->rel = NULL;
+	}
+	if (state->strategy != NULL)
+	{
+		FreeAccessStrategy(state->strategy);
+		state->strategy = NULL;
+	}
+}
+
+/*
+ * get_raw_pages
+ *
+ * Returns copies of a range of pages of a relation, one row per page,
+ * in the same format as get_raw_page(). The relation is opened once for
+ * the whole scan, blocks are read with a ring of buffers to not evict
+ * the contents of shared buffers, and blocks ahead of the one returned
+ * are prefetched.
+ */
+Datum
+get_raw_pages(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	RawPagesState *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+		Oid			relid;
+		int64		start_blk;
+		int64		nblocks;
+		BlockNumber rel_nblocks;
+		TupleDesc	tupdesc;
+		MemoryContext oldcontext;
+
+		if (!superuser())
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+					 (errmsg("must be superuser to use raw functions"))));
+
+		if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(3))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("relation, start block and hole option cannot be NULL")));
+
+		relid = PG_GETARG_OID(0);
+		start_blk = PG_GETARG_INT64(1);
+		nblocks = PG_ARGISNULL(2) ? -1 : PG_GETARG_INT64(2);
+
+		if (start_blk < 0 || start_blk > MaxBlockNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid start block number " INT64_FORMAT,
+							start_blk)));
+		if (!PG_ARGISNULL(2) && nblocks < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("number of blocks cannot be negative")));
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		state = (RawPagesState *) palloc0(sizeof(RawPagesState));
+		state->rel = open_raw_relation(relid);
+		state->strategy = GetAccessStrategy(BAS_BULKREAD);
+		state->with_hole = PG_GETARG_BOOL(3);
+		state->econtext = rsinfo->econtext;
+
+		/* Blocks beyond the end of the relation are ignored */
+		rel_nblocks = RelationGetNumberOfBlocksInFork(state->rel, MAIN_FORKNUM);
+		state->blkno = (BlockNumber) Min(start_blk, (int64) rel_nblocks);
+		if (nblocks < 0 || start_blk + nblocks > (int64) rel_nblocks)
+			state->end_blkno = rel_nblocks;
+		else
+			state->end_blkno = (BlockNumber) (start_blk + nblocks);
+		state->prefetch_blkno = state->blkno;
+
+		RegisterExprContextCallback(rsinfo->econtext, get_raw_pages_shutdown,
+									PointerGetDatum(state));
+		funcctx->user_fctx = state;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (RawPagesState *) funcctx->user_fctx;
+
+	if (state->blkno < state->end_blkno)
+	{
+		PGAlignedBlock page;
+		bytea	   *raw_page;
+		int16		hole_offset;
+		int			len;
+		Datum		values[3];
+		bool		nulls[3];
+		HeapTuple	tuple;
+
+#ifdef USE_PREFETCH
+		/* Keep prefetching blocks ahead of the one being read */
+		if (state->prefetch_blkno <= state->blkno)
+			state->prefetch_blkno = state->blkno + 1;
+		while (state->prefetch_blkno < state->end_blkno &&
+			   state->prefetch_blkno <= state->blkno + target_prefetch_pages)
+		{
+			PrefetchBuffer(state->rel, MAIN_FORKNUM, state->prefetch_blkno);
+			state->prefetch_blkno++;
+		}
+#endif
+
+		read_raw_page(state->rel, state->blkno, state->strategy, page.data);
+
+		raw_page = (bytea *) palloc(BLCKSZ + VARHDRSZ);
+		len = page_image(page.data, state->with_hole, VARDATA(raw_page),
+						 &hole_offset);
+		SET_VARSIZE(raw_page, len + VARHDRSZ);
+
+		values[0] = Int64GetDatum((int64) state->blkno);
+		values[1] = PointerGetDatum(raw_page);
+		values[2] = Int16GetDatum(state->with_hole ? 0 : hole_offset);
+		memset(nulls, 0, sizeof(nulls));
+
+		state->blkno++;
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	/* The state is freed when we are done, so close everything now */
+	get_raw_pages_shutdown(PointerGetDatum(state));
+	UnregisterExprContextCallback(state->econtext, get_raw_pages_shutdown,
+								  PointerGetDatum(state));
+	SRF_RETURN_DONE(funcctx);
+}
+
 /*
  * compress_data
  *
@@ -239,3 +607,771 @@ bytea_size(PG_FUNCTION_ARGS)
 
 	PG_RETURN_INT32(VARSIZE(data) - VARHDRSZ);
 }
+
+/*
+ * Results of a benchmark for one algorithm, with or without page holes.
+ */
+typedef struct BenchmarkResult
+{
+	const CompressionAlgorithm *algorithm;
+	bool		with_hole;
+	int64		pages;
+	int64		raw_bytes;
+	int64		compressed_bytes;
+	int64		decompressed_bytes;
+	instr_time	compress_time;
+	instr_time	decompress_time;
+	char	   *compressed;		/* buffer for compressed data */
+} BenchmarkResult;
+
+/*
+ * Find a compression algorithm by its name.
+ */
+static const CompressionAlgorithm *
+find_compression_algorithm(const char *name)
+{
+	const CompressionAlgorithm *algorithm;
+
+	for (algorithm = compression_algorithms; algorithm->name; algorithm++)
+	{
+		if (pg_strcasecmp(algorithm->name, name) == 0)
+			return algorithm;
+	}
+
+	if (pg_strcasecmp(name, "lz4") == 0 || pg_strcasecmp(name, "zstd") == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("compression algorithm \"%s\" is not supported by this build",
+						name)));
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unrecognized compression algorithm \"%s\"", name)));
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Throughput in MB/s for the given amount of data processed in the given
+ * time, NULL if there is no time to count on.
+ */
+static Datum
+benchmark_throughput(int64 bytes, instr_time time, bool *isnull)
+{
+	double		secs = INSTR_TIME_GET_DOUBLE(time);
+
+	if (secs <= 0)
+	{
+		*isnull = true;
+		return (Datum) 0;
+	}
+
+	*isnull = false;
+	return Float8GetDatum((double) bytes / (1024.0 * 1024.0) / secs);
+}
+
+/*
+ * compression_benchmark
+ *
+ * Compress the pages of a relation, or a sample of them, with each given
+ * compression algorithm, once with page holes filled with zeros and once
+ * with them removed, and report for each the size of the compressed data
+ * as well as the compression and decompression throughputs. Each page is
+ * decompressed and checked to match its original image.
+ */
+Datum
+compression_benchmark(PG_FUNCTION_ARGS)
+{
+	Oid			relid;
+	double		sample_pct;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	Relation	rel;
+	BlockNumber nblocks;
+	BlockSamplerData bs;
+	BufferAccessStrategy strategy;
+	BenchmarkResult *results;
+	int			nresults = 0;
+	PGAlignedBlock page;
+	char		image[BLCKSZ];
+	char		decompressed[BLCKSZ];
+	int			i;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use raw functions"))));
+
+	if (PG_ARGISNULL(0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("relation cannot be NULL")));
+	relid = PG_GETARG_OID(0);
+	sample_pct = PG_ARGISNULL(1) ? 100.0 : PG_GETARG_FLOAT8(1);
+	if (!(sample_pct > 0 && sample_pct <= 100))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample percentage must be between 0 and 100")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Build the list of algorithms to test, all of them by default */
+	if (PG_ARGISNULL(2))
+	{
+		const CompressionAlgorithm *algorithm;
+
+		results = palloc0(sizeof(BenchmarkResult) * 2 *
+						  lengthof(compression_algorithms));
+		for (algorithm = compression_algorithms; algorithm->name; algorithm++)
+		{
+			results[nresults++].algorithm = algorithm;
+			results[nresults++].algorithm = algorithm;
+		}
+	}
+	else
+	{
+		ArrayType  *array = PG_GETARG_ARRAYTYPE_P(2);
+		Datum	   *elems;
+		bool	   *elem_nulls;
+		int			nelems;
+
+		deconstruct_array(array, TEXTOID, -1, false, 'i',
+						  &elems, &elem_nulls, &nelems);
+		if (nelems == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("at least one compression algorithm is needed")));
+
+		results = palloc0(sizeof(BenchmarkResult) * 2 * nelems);
+		for (i = 0; i < nelems; i++)
+		{
+			const CompressionAlgorithm *algorithm;
+
+			if (elem_nulls[i])
+				ereport(ERROR,
+						(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+						 errmsg("compression algorithm cannot be NULL")));
+
+			algorithm = find_compression_algorithm(TextDatumGetCString(elems[i]));
+			results[nresults++].algorithm = algorithm;
+			results[nresults++].algorithm = algorithm;
+		}
+	}
+
+	/* Each algorithm is tested with and without page holes */
+	for (i = 0; i < nresults; i++)
+	{
+		results[i].with_hole = (i % 2 == 0);
+		INSTR_TIME_SET_ZERO(results[i].compress_time);
+		INSTR_TIME_SET_ZERO(results[i].decompress_time);
+		results[i].compressed = palloc(results[i].algorithm->bound(BLCKSZ));
+	}
+
+	rel = open_raw_relation(relid);
+	nblocks = RelationGetNumberOfBlocksInFork(rel, MAIN_FORKNUM);
+
+	/* Blocks are sampled in order, and read with a ring of buffers */
+	BlockSampler_Init(&bs, nblocks,
+					  (int) ceil(nblocks * sample_pct / 100.0),
+					  random());
+	strategy = GetAccessStrategy(BAS_BULKREAD);
+
+	while (BlockSampler_HasMore(&bs))
+	{
+		BlockNumber blkno = BlockSampler_Next(&bs);
+
+		CHECK_FOR_INTERRUPTS();
+
+		read_raw_page(rel, blkno, strategy, page.data);
+
+		for (i = 0; i < nresults; i++)
+		{
+			BenchmarkResult *result = &results[i];
+			const CompressionAlgorithm *algorithm = result->algorithm;
+			int16		hole_offset;
+			int			raw_len;
+			int			len;
+			instr_time	start;
+			instr_time	end;
+
+			raw_len = page_image(page.data, result->with_hole, image, &hole_offset);
+
+			INSTR_TIME_SET_CURRENT(start);
+			len = algorithm->compress(image, raw_len, result->compressed,
+									  algorithm->bound(BLCKSZ));
+			INSTR_TIME_SET_CURRENT(end);
+			INSTR_TIME_ACCUM_DIFF(result->compress_time, end, start);
+
+			result->pages++;
+			result->raw_bytes += raw_len;
+
+			/* Incompressible pages are counted as stored as-is */
+			if (len < 0)
+			{
+				result->compressed_bytes += raw_len;
+				continue;
+			}
+			result->compressed_bytes += len;
+
+			INSTR_TIME_SET_CURRENT(start);
+			len = algorithm->decompress(result->compressed, len,
+										decompressed, raw_len);
+			INSTR_TIME_SET_CURRENT(end);
+			INSTR_TIME_ACCUM_DIFF(result->decompress_time, end, start);
+			result->decompressed_bytes += raw_len;
+
+			if (len != raw_len || memcmp(image, decompressed, raw_len) != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("decompressed image of block %u of relation \"%s\" does not match original with %s",
+								blkno, RelationGetRelationName(rel),
+								algorithm->name)));
+		}
+	}
+
+	FreeAccessStrategy(strategy);
+	relation_close(rel, AccessShareLock);
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < nresults; i++)
+	{
+		BenchmarkResult *result = &results[i];
+		Datum		values[8];
+		bool		nulls[8];
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(result->algorithm->name);
+		values[1] = BoolGetDatum(result->with_hole);
+		values[2] = Int64GetDatum(result->pages);
+		values[3] = Int64GetDatum(result->raw_bytes);
+		values[4] = Int64GetDatum(result->compressed_bytes);
+		if (result->compressed_bytes > 0)
+			values[5] = Float8GetDatum((double) result->raw_bytes /
+									   (double) result->compressed_bytes);
+		else
+			nulls[5] = true;
+		values[6] = benchmark_throughput(result->raw_bytes,
+										 result->compress_time, &nulls[6]);
+		values[7] = benchmark_throughput(result->decompressed_bytes,
+										 result->decompress_time, &nulls[7]);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Frame of pages compressed together by compress_pages(). The header is
+ * followed by the hole offset and length of each page, then by the
+ * compressed contents of all the pages, hole-stripped and concatenated.
+ */
+#define PAGES_FRAME_MAGIC		0x50435446	/* "PCTF" */
+#define PAGES_FRAME_NAMELEN		8
+#define PAGES_FRAME_DICTIONARY	0x0001		/* compressed with dictionary */
+
+typedef struct PagesFrameHeader
+{
+	uint32		magic;
+	uint16		blcksz;
+	uint16		flags;
+	char		algorithm[PAGES_FRAME_NAMELEN];	/* "none" if uncompressed */
+	uint32		dict_id;		/* zstd dictionary ID, 0 if none */
+	uint32		npages;
+	uint32		raw_len;		/* total size of hole-stripped pages */
+	uint32		compressed_len;
+} PagesFrameHeader;
+
+typedef struct PagesFrameEntry
+{
+	uint16		hole_offset;
+	uint16		hole_length;
+} PagesFrameEntry;
+
+/* maximum number of pages in a frame, leaving room for compression */
+#define PAGES_FRAME_MAX_PAGES	((MaxAllocSize / 4) / BLCKSZ)
+
+#ifdef COMPRESSION_TEST_ZSTD
+/*
+ * Compress or decompress with a zstd dictionary, returning -1 on failure,
+ * like the other compression routines.
+ */
+static int
+zstd_compress_dict(const char *src, int srclen, char *dst, int dstlen,
+				   const char *dict, int dictlen)
+{
+	size_t		len;
+
+	if (zstd_cctx == NULL && (zstd_cctx = ZSTD_createCCtx()) == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	len = ZSTD_compress_usingDict(zstd_cctx, dst, dstlen, src, srclen,
+								  dict, dictlen, ZSTD_CLEVEL_DEFAULT);
+	return ZSTD_isError(len) ? -1 : (int) len;
+}
+
+static int
+zstd_decompress_dict(const char *src, int srclen, char *dst, int rawlen,
+					 const char *dict, int dictlen)
+{
+	size_t		len;
+
+	if (zstd_dctx == NULL && (zstd_dctx = ZSTD_createDCtx()) == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	len = ZSTD_decompress_usingDict(zstd_dctx, dst, rawlen, src, srclen,
+									dict, dictlen);
+	return ZSTD_isError(len) ? -1 : (int) len;
+}
+#endif
+
+/*
+ * compress_pages
+ *
+ * Compress a set of pages, as returned by get_raw_page() or get_raw_pages()
+ * with their holes removed, into a single frame, so as the redundancy
+ * across pages is used by the compression. With zstd, a dictionary built
+ * by train_dictionary() can be used as well.
+ */
+Datum
+compress_pages(PG_FUNCTION_ARGS)
+{
+	ArrayType  *pages_array;
+	ArrayType  *holes_array;
+	char	   *algorithm_name;
+	const CompressionAlgorithm *algorithm;
+	bytea	   *dict = NULL;
+	Datum	   *pages;
+	bool	   *pages_nulls;
+	int			npages;
+	Datum	   *holes;
+	bool	   *holes_nulls;
+	int			nholes;
+	PagesFrameHeader header;
+	PagesFrameEntry *entries;
+	char	   *raw;
+	char	   *compressed;
+	int			bound;
+	int			len;
+	bytea	   *result;
+	char	   *ptr;
+	int			i;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pages, hole offsets and algorithm cannot be NULL")));
+
+	pages_array = PG_GETARG_ARRAYTYPE_P(0);
+	holes_array = PG_GETARG_ARRAYTYPE_P(1);
+	algorithm_name = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	if (!PG_ARGISNULL(3))
+		dict = PG_GETARG_BYTEA_P(3);
+
+	algorithm = find_compression_algorithm(algorithm_name);
+	if (dict != NULL && strcmp(algorithm->name, "zstd") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("compression algorithm \"%s\" does not support dictionaries",
+						algorithm->name)));
+
+	deconstruct_array(pages_array, BYTEAOID, -1, false, 'i',
+					  &pages, &pages_nulls, &npages);
+	deconstruct_array(holes_array, INT2OID, sizeof(int16), true, 's',
+					  &holes, &holes_nulls, &nholes);
+	if (npages != nholes)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("number of pages and hole offsets do not match")));
+	if (npages == 0 || npages > PAGES_FRAME_MAX_PAGES)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("number of pages must be between 1 and %d",
+						(int) PAGES_FRAME_MAX_PAGES)));
+
+	/* Concatenate the hole-stripped pages */
+	entries = (PagesFrameEntry *) palloc(sizeof(PagesFrameEntry) * npages);
+	raw = palloc((Size) npages * BLCKSZ);
+	len = 0;
+	for (i = 0; i < npages; i++)
+	{
+		bytea	   *page;
+		int			page_len;
+		int16		hole_offset;
+
+		if (pages_nulls[i] || holes_nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("page %d or its hole offset is NULL", i + 1)));
+
+		page = DatumGetByteaPP(pages[i]);
+		page_len = VARSIZE_ANY_EXHDR(page);
+		hole_offset = DatumGetInt16(holes[i]);
+		if (page_len > BLCKSZ || hole_offset < 0 || hole_offset > page_len ||
+			(hole_offset == 0 && page_len != BLCKSZ))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid page %d of size %d with hole offset %d",
+							i + 1, page_len, hole_offset)));
+
+		entries[i].hole_offset = hole_offset;
+		entries[i].hole_length = BLCKSZ - page_len;
+		memcpy(raw + len, VARDATA_ANY(page), page_len);
+		len += page_len;
+	}
+
+	MemSet(&header, 0, sizeof(header));
+	header.magic = PAGES_FRAME_MAGIC;
+	header.blcksz = BLCKSZ;
+	header.npages = npages;
+	header.raw_len = len;
+
+	/* Compress everything in one go */
+	bound = algorithm->bound(header.raw_len);
+	compressed = palloc(bound);
+#ifdef COMPRESSION_TEST_ZSTD
+	if (dict != NULL)
+	{
+		len = zstd_compress_dict(raw, header.raw_len, compressed, bound,
+								 VARDATA(dict), VARSIZE(dict) - VARHDRSZ);
+		header.flags |= PAGES_FRAME_DICTIONARY;
+		header.dict_id = ZSTD_getDictID_fromDict(VARDATA(dict),
+												 VARSIZE(dict) - VARHDRSZ);
+	}
+	else
+#endif
+		len = algorithm->compress(raw, header.raw_len, compressed, bound);
+
+	/* Store the data as-is if it cannot be compressed */
+	if (len < 0 || len >= header.raw_len)
+	{
+		pfree(compressed);
+		compressed = raw;
+		len = header.raw_len;
+		header.flags = 0;
+		header.dict_id = 0;
+		strlcpy(header.algorithm, "none", PAGES_FRAME_NAMELEN);
+	}
+	else
+		strlcpy(header.algorithm, algorithm->name, PAGES_FRAME_NAMELEN);
+	header.compressed_len = len;
+
+	/* Build the frame */
+	result = (bytea *) palloc(VARHDRSZ + sizeof(PagesFrameHeader) +
+							  sizeof(PagesFrameEntry) * npages + len);
+	SET_VARSIZE(result, VARHDRSZ + sizeof(PagesFrameHeader) +
+				sizeof(PagesFrameEntry) * npages + len);
+	ptr = VARDATA(result);
+	memcpy(ptr, &header, sizeof(PagesFrameHeader));
+	ptr += sizeof(PagesFrameHeader);
+	memcpy(ptr, entries, sizeof(PagesFrameEntry) * npages);
+	ptr += sizeof(PagesFrameEntry) * npages;
+	memcpy(ptr, compressed, len);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * decompress_pages
+ *
+ * Decompress a frame built by compress_pages(), returning each page it
+ * contains with its hole filled with zeros. The dictionary used for the
+ * compression needs to be given if any.
+ */
+Datum
+decompress_pages(PG_FUNCTION_ARGS)
+{
+	bytea	   *frame;
+	bytea	   *dict = NULL;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PagesFrameHeader header;
+	PagesFrameEntry *entries;
+	char	   *data;
+	Size		frame_len;
+	char	   *raw;
+	char	   *ptr;
+	int			len;
+	int			i;
+
+	if (PG_ARGISNULL(0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("frame cannot be NULL")));
+	frame = PG_GETARG_BYTEA_P(0);
+	if (!PG_ARGISNULL(1))
+		dict = PG_GETARG_BYTEA_P(1);
+
+	/* Check the frame header and its page entries */
+	frame_len = VARSIZE(frame) - VARHDRSZ;
+	if (frame_len < sizeof(PagesFrameHeader))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("frame of pages is too short")));
+	memcpy(&header, VARDATA(frame), sizeof(PagesFrameHeader));
+	if (header.magic != PAGES_FRAME_MAGIC)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid magic number %08X in frame of pages",
+						header.magic)));
+	if (header.blcksz != BLCKSZ)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("frame of pages has block size %u, server has %d",
+						header.blcksz, BLCKSZ)));
+	if (header.npages == 0 || header.npages > PAGES_FRAME_MAX_PAGES ||
+		header.raw_len > (Size) header.npages * BLCKSZ ||
+		frame_len != sizeof(PagesFrameHeader) +
+		sizeof(PagesFrameEntry) * header.npages + header.compressed_len)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid size of frame of pages")));
+	header.algorithm[PAGES_FRAME_NAMELEN - 1] = '\0';
+
+	entries = (PagesFrameEntry *) palloc(sizeof(PagesFrameEntry) * header.npages);
+	memcpy(entries, VARDATA(frame) + sizeof(PagesFrameHeader),
+		   sizeof(PagesFrameEntry) * header.npages);
+	len = 0;
+	for (i = 0; i < header.npages; i++)
+	{
+		if (entries[i].hole_length > BLCKSZ ||
+			entries[i].hole_offset > BLCKSZ - entries[i].hole_length)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid hole of page %d in frame of pages",
+							i + 1)));
+		len += BLCKSZ - entries[i].hole_length;
+	}
+	if (len != header.raw_len)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid size of frame of pages")));
+	data = VARDATA(frame) + sizeof(PagesFrameHeader) +
+		sizeof(PagesFrameEntry) * header.npages;
+
+	/* Decompress all the pages */
+	if (strcmp(header.algorithm, "none") == 0)
+	{
+		if (header.compressed_len != header.raw_len)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid size of frame of pages")));
+		raw = data;
+	}
+	else
+	{
+		const CompressionAlgorithm *algorithm;
+
+		algorithm = find_compression_algorithm(header.algorithm);
+		raw = palloc(header.raw_len);
+
+		if ((header.flags & PAGES_FRAME_DICTIONARY) != 0)
+		{
+#ifdef COMPRESSION_TEST_ZSTD
+			if (dict == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("frame of pages has been compressed with dictionary %u",
+								header.dict_id)));
+			if (ZSTD_getDictID_fromDict(VARDATA(dict),
+										VARSIZE(dict) - VARHDRSZ) != header.dict_id)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("dictionary given does not match dictionary %u of frame of pages",
+								header.dict_id)));
+			len = zstd_decompress_dict(data, header.compressed_len,
+									   raw, header.raw_len,
+									   VARDATA(dict), VARSIZE(dict) - VARHDRSZ);
+#else
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("compression dictionaries are not supported by this build")));
+#endif
+		}
+		else
+			len = algorithm->decompress(data, header.compressed_len,
+										raw, header.raw_len);
+
+		if (len != header.raw_len)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("could not decompress frame of pages with %s",
+							algorithm->name)));
+	}
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Rebuild each page, filling its hole with zeros */
+	ptr = raw;
+	for (i = 0; i < header.npages; i++)
+	{
+		PagesFrameEntry *entry = &entries[i];
+		int			page_len = BLCKSZ - entry->hole_length;
+		bytea	   *page;
+		Datum		values[2];
+		bool		nulls[2];
+
+		page = (bytea *) palloc(BLCKSZ + VARHDRSZ);
+		SET_VARSIZE(page, BLCKSZ + VARHDRSZ);
+		memcpy(VARDATA(page), ptr, entry->hole_offset);
+		MemSet(VARDATA(page) + entry->hole_offset, 0, entry->hole_length);
+		memcpy(VARDATA(page) + entry->hole_offset + entry->hole_length,
+			   ptr + entry->hole_offset, page_len - entry->hole_offset);
+		ptr += page_len;
+
+		values[0] = Int32GetDatum(i + 1);
+		values[1] = PointerGetDatum(page);
+		memset(nulls, 0, sizeof(nulls));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		pfree(page);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * train_dictionary
+ *
+ * Build a zstd dictionary of the given maximum size from the hole-stripped
+ * pages of a relation, or a sample of them, to be used with compress_pages()
+ * for the pages of the same relation or of relations with similar data.
+ */
+Datum
+train_dictionary(PG_FUNCTION_ARGS)
+{
+#ifdef COMPRESSION_TEST_ZSTD
+	Oid			relid = PG_GETARG_OID(0);
+	double		sample_pct = PG_GETARG_FLOAT8(1);
+	int32		dict_size = PG_GETARG_INT32(2);
+	Relation	rel;
+	BlockNumber nblocks;
+	BlockSamplerData bs;
+	BufferAccessStrategy strategy;
+	PGAlignedBlock page;
+	char	   *samples;
+	size_t	   *sample_sizes;
+	int			nsamples = 0;
+	Size		samples_len = 0;
+	int			target;
+	size_t		len;
+	bytea	   *result;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use raw functions"))));
+
+	if (!(sample_pct > 0 && sample_pct <= 100))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample percentage must be between 0 and 100")));
+	if (dict_size < 1024 || dict_size > MaxAllocSize - VARHDRSZ)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("dictionary size must be between 1024 and %d bytes",
+						(int) (MaxAllocSize - VARHDRSZ))));
+
+	rel = open_raw_relation(relid);
+	nblocks = RelationGetNumberOfBlocksInFork(rel, MAIN_FORKNUM);
+	target = (int) ceil(nblocks * sample_pct / 100.0);
+	if (target > PAGES_FRAME_MAX_PAGES)
+		target = PAGES_FRAME_MAX_PAGES;
+
+	samples = palloc((Size) Max(target, 1) * BLCKSZ);
+	sample_sizes = palloc(sizeof(size_t) * Max(target, 1));
+
+	BlockSampler_Init(&bs, nblocks, target, random());
+	strategy = GetAccessStrategy(BAS_BULKREAD);
+	while (BlockSampler_HasMore(&bs))
+	{
+		BlockNumber blkno = BlockSampler_Next(&bs);
+		int16		hole_offset;
+
+		CHECK_FOR_INTERRUPTS();
+
+		read_raw_page(rel, blkno, strategy, page.data);
+		sample_sizes[nsamples] = page_image(page.data, false,
+											samples + samples_len,
+											&hole_offset);
+		samples_len += sample_sizes[nsamples];
+		nsamples++;
+	}
+	FreeAccessStrategy(strategy);
+	relation_close(rel, AccessShareLock);
+
+	result = (bytea *) palloc(VARHDRSZ + dict_size);
+	len = ZDICT_trainFromBuffer(VARDATA(result), dict_size,
+								samples, sample_sizes, nsamples);
+	if (ZDICT_isError(len))
+		ereport(ERROR,
+				(errmsg("could not train dictionary from %d pages: %s",
+						nsamples, ZDICT_getErrorName(len))));
+	SET_VARSIZE(result, VARHDRSZ + len);
+
+	pfree(samples);
+	pfree(sample_sizes);
+	PG_RETURN_BYTEA_P(result);
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("compression dictionaries are not supported by this build")));
+	PG_RETURN_NULL();			/* keep compiler quiet */
+#endif
+}
@@ -0,0 +1,13 @@
+/* count_relations/count_relations--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION count_relations" to load this file. \quit
+
+-- Number of relations per database and relkind, as kept in shared memory
+CREATE FUNCTION count_relations(
+	OUT datid oid,
+	OUT relkind "char",
+	OUT relations bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
@@ -1,8 +1,14 @@
 /*-------------------------------------------------------------------------
  *
  * count_relations.c
- *		Simple background worker code scanning the number of relations
- *		present in database.
+ *		Background worker and hooks counting the number of relations
+ *		present in each database.
+ *
+ * Counters are kept in shared memory per database and per relkind. They
+ * are initialized by a census of pg_class in each database run once by
+ * the background worker, and are then updated by an object access hook
+ * when relations are created or dropped, so as reading them costs no
+ * catalog scan.
  *
  * Copyright (c) 1996-2018, PostgreSQL Global Development Group
  *
@@ -16,7 +22,9 @@
 /* These are always necessary for a bgworker */
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "port/atomics.h"
 #include "postmaster/bgworker.h"
+#include "storage/condition_variable.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/lwlock.h"
@@ -24,19 +32,110 @@
 #include "storage/shmem.h"
 
 /* these headers are used by this particular worker's code */
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
 #include "access/xact.h"
-#include "executor/spi.h"
+#include "catalog/indexing.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_database.h"
 #include "fmgr.h"
-#include "lib/stringinfo.h"
+#include "funcapi.h"
 #include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/snapmgr.h"
+#include "utils/tqual.h"
 
 PG_MODULE_MAGIC;
 
 void _PG_init(void);
 void count_relations_main(Datum main_arg) pg_attribute_noreturn();
+void count_relations_census_main(Datum main_arg) pg_attribute_noreturn();
+
+PG_FUNCTION_INFO_V1(count_relations);
+
+/* Relation kinds tracked, one counter for each */
+static const char count_relkinds[] = {
+	RELKIND_RELATION,
+	RELKIND_INDEX,
+	RELKIND_SEQUENCE,
+	RELKIND_TOASTVALUE,
+	RELKIND_VIEW,
+	RELKIND_MATVIEW,
+	RELKIND_COMPOSITE_TYPE,
+	RELKIND_FOREIGN_TABLE,
+	RELKIND_PARTITIONED_TABLE,
+	RELKIND_PARTITIONED_INDEX
+};
+#define NUM_RELKINDS	lengthof(count_relkinds)
+
+/*
+ * Counters of a database, usable once its census is done.
+ */
+typedef struct CountRelationsDatabase
+{
+	Oid			dbid;			/* InvalidOid if the slot is free */
+	bool		census_done;
+	int64		counts[NUM_RELKINDS];
+} CountRelationsDatabase;
+
+typedef struct CountRelationsShared
+{
+	LWLock	   *lock;			/* protects everything below */
+	Latch	   *worker_latch;	/* latch of the main worker, if running */
+	bool		census_requested;	/* new database created */
+	bool		overflow_reported;
+	bool		census_waiting;	/* census waiting for "committing" */
+	/* transactions whose changes are applied, not yet visible */
+	pg_atomic_uint32 committing;
+	ConditionVariable cv;		/* "committing" or census_waiting changed */
+	CountRelationsDatabase databases[FLEXIBLE_ARRAY_MEMBER];
+} CountRelationsShared;
+
+static CountRelationsShared *count_shared = NULL;
+
+/* GUC variables */
+static int	count_max_databases = 64;
+
+/* Saved hook values in case of unload */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static object_access_hook_type prev_object_access_hook = NULL;
+
+/*
+ * Changes done by the current transaction, applied to the counters when
+ * it commits, and forgotten if the (sub)transaction doing them aborts.
+ * They are applied just before the commit, and reverted if the transaction
+ * aborts after that.
+ */
+typedef enum PendingChangeType
+{
+	PENDING_RELATION,			/* relation created or dropped */
+	PENDING_DROP_DATABASE,		/* database dropped */
+	PENDING_CREATE_DATABASE		/* database created */
+} PendingChangeType;
+
+typedef struct PendingChange
+{
+	PendingChangeType type;
+	Oid			dbid;
+	int			relkind_idx;	/* for PENDING_RELATION */
+	int			delta;			/* for PENDING_RELATION */
+	int			nestlevel;		/* subtransaction doing the change */
+	bool		applied;		/* delta applied to the counters? */
+} PendingChange;
+
+static bool count_in_commit = false;	/* counted in "committing" */
+static bool count_in_census = false;	/* census_waiting set by us */
+static PendingChange *pending_changes = NULL;
+static int	num_pending_changes = 0;
+static int	max_pending_changes = 0;
 
 static volatile sig_atomic_t got_sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
 
 static void
 count_relations_sigterm(SIGNAL_ARGS)
@@ -53,9 +152,542 @@ count_relations_sigterm(SIGNAL_ARGS)
 static void
 count_relations_sighup(SIGNAL_ARGS)
 {
-	elog(LOG, "got sighup");
+	int			save_errno = errno;
+
+	got_sighup = true;
 	if (MyProc)
 		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Size of shared memory used by the counters.
+ */
+static Size
+count_relations_shmem_size(void)
+{
+	return add_size(offsetof(CountRelationsShared, databases),
+					mul_size(count_max_databases,
+							 sizeof(CountRelationsDatabase)));
+}
+
+/*
+ * Allocate or attach to the shared memory used for the counters.
+ */
+static void
+count_relations_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	count_shared = ShmemInitStruct("count_relations",
+								   count_relations_shmem_size(),
+								   &found);
+	if (!found)
+	{
+		MemSet(count_shared, 0, count_relations_shmem_size());
+		count_shared->lock = &(GetNamedLWLockTranche("count_relations"))->lock;
+		pg_atomic_init_u32(&count_shared->committing, 0);
+		ConditionVariableInit(&count_shared->cv);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Get the index of a relkind in the counters, -1 if not tracked.
+ */
+static int
+relkind_index(char relkind)
+{
+	int			i;
+
+	for (i = 0; i < NUM_RELKINDS; i++)
+	{
+		if (count_relkinds[i] == relkind)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Find the counters of a database, or create them if wanted. The lock
+ * needs to be held exclusively when creating.
+ */
+static CountRelationsDatabase *
+find_database(Oid dbid, bool create)
+{
+	CountRelationsDatabase *free_slot = NULL;
+	int			i;
+
+	for (i = 0; i < count_max_databases; i++)
+	{
+		CountRelationsDatabase *db = &count_shared->databases[i];
+
+		if (db->dbid == dbid)
+			return db;
+		if (free_slot == NULL && !OidIsValid(db->dbid))
+			free_slot = db;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (free_slot == NULL)
+	{
+		if (!count_shared->overflow_reported)
+			ereport(WARNING,
+					(errmsg("count_relations: no free slot for database %u", dbid),
+					 errhint("Increase count_relations.max_databases.")));
+		count_shared->overflow_reported = true;
+		return NULL;
+	}
+
+	MemSet(free_slot, 0, sizeof(CountRelationsDatabase));
+	free_slot->dbid = dbid;
+	return free_slot;
+}
+
+/*
+ * Remember a change to apply at commit.
+ */
+static void
+add_pending_change(PendingChangeType type, Oid dbid, int relkind_idx,
+				   int delta)
+{
+	PendingChange *change;
+
+	if (num_pending_changes >= max_pending_changes)
+	{
+		if (pending_changes == NULL)
+		{
+			max_pending_changes = 16;
+			pending_changes = MemoryContextAlloc(TopMemoryContext,
+												 sizeof(PendingChange) * max_pending_changes);
+		}
+		else
+		{
+			max_pending_changes *= 2;
+			pending_changes = repalloc(pending_changes,
+									   sizeof(PendingChange) * max_pending_changes);
+		}
+	}
+
+	change = &pending_changes[num_pending_changes++];
+	change->type = type;
+	change->dbid = dbid;
+	change->relkind_idx = relkind_idx;
+	change->delta = delta;
+	change->nestlevel = GetCurrentTransactionNestLevel();
+	change->applied = false;
+}
+
+/*
+ * Get the relkind of a relation just created, which is not visible yet
+ * in the catalog snapshot.
+ */
+static char
+get_new_relkind(Oid relid)
+{
+	Relation	rel;
+	ScanKeyData skey;
+	SysScanDesc scan;
+	HeapTuple	tuple;
+	char		relkind = '\0';
+
+	rel = heap_open(RelationRelationId, AccessShareLock);
+	ScanKeyInit(&skey,
+				ObjectIdAttributeNumber,
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(relid));
+	scan = systable_beginscan(rel, ClassOidIndexId, true,
+							  SnapshotSelf, 1, &skey);
+	tuple = systable_getnext(scan);
+	if (HeapTupleIsValid(tuple))
+		relkind = ((Form_pg_class) GETSTRUCT(tuple))->relkind;
+	systable_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	return relkind;
+}
+
+/*
+ * Object access hook, tracking creation and drop of relations and
+ * databases.
+ */
+static void
+count_relations_object_access(ObjectAccessType access, Oid classId,
+							  Oid objectId, int subId, void *arg)
+{
+	if (prev_object_access_hook)
+		prev_object_access_hook(access, classId, objectId, subId, arg);
+
+	/* Columns are not interesting */
+	if (subId != 0)
+		return;
+
+	if (classId == RelationRelationId &&
+		(access == OAT_POST_CREATE || access == OAT_DROP))
+	{
+		char		relkind;
+		int			idx;
+
+		if (access == OAT_POST_CREATE)
+			relkind = get_new_relkind(objectId);
+		else
+			relkind = get_rel_relkind(objectId);
+
+		idx = relkind_index(relkind);
+		if (idx >= 0)
+			add_pending_change(PENDING_RELATION, MyDatabaseId, idx,
+							   access == OAT_POST_CREATE ? 1 : -1);
+	}
+	else if (classId == DatabaseRelationId && access == OAT_DROP)
+		add_pending_change(PENDING_DROP_DATABASE, objectId, -1, 0);
+	else if (classId == DatabaseRelationId && access == OAT_POST_CREATE)
+		add_pending_change(PENDING_CREATE_DATABASE, objectId, -1, 0);
+}
+
+/*
+ * Apply the changes of the transaction about to commit to the counters.
+ * This is done before the commit, while the transaction is still seen as
+ * in progress by other snapshots, so it is counted in "committing" until
+ * it has ended. A census waits for those transactions before taking its
+ * snapshot, while the next ones wait for the census to be done, so as it
+ * sees all the transactions whose changes have been applied or reverted
+ * before it, and none of the ones applied after it.
+ */
+static void
+apply_pending_changes(void)
+{
+	int			i;
+
+	LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+	while (count_shared->census_waiting)
+	{
+		LWLockRelease(count_shared->lock);
+		ConditionVariableSleep(&count_shared->cv, PG_WAIT_EXTENSION);
+		LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+	}
+	ConditionVariableCancelSleep();
+
+	for (i = 0; i < num_pending_changes; i++)
+	{
+		PendingChange *change = &pending_changes[i];
+		CountRelationsDatabase *db;
+
+		if (change->type != PENDING_RELATION)
+			continue;
+
+		/* Changes are counted by the census if not done yet */
+		db = find_database(change->dbid, false);
+		if (db != NULL && db->census_done)
+		{
+			db->counts[change->relkind_idx] += change->delta;
+			change->applied = true;
+		}
+	}
+	pg_atomic_fetch_add_u32(&count_shared->committing, 1);
+	count_in_commit = true;
+	LWLockRelease(count_shared->lock);
+}
+
+/*
+ * Finish the commit or the abort of a transaction whose changes have been
+ * applied, reverting them in case of abort. The counters of a database
+ * dropped are only reset once the drop is committed, and a census is
+ * requested for the databases created.
+ */
+static void
+finish_pending_changes(bool commit)
+{
+	bool		census = false;
+	int			i;
+
+	LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < num_pending_changes; i++)
+	{
+		PendingChange *change = &pending_changes[i];
+		CountRelationsDatabase *db;
+
+		switch (change->type)
+		{
+			case PENDING_RELATION:
+				if (commit || !change->applied)
+					break;
+				db = find_database(change->dbid, false);
+				if (db != NULL && db->census_done)
+					db->counts[change->relkind_idx] -= change->delta;
+				break;
+			case PENDING_DROP_DATABASE:
+				db = find_database(change->dbid, false);
+				if (commit && db != NULL)
+					MemSet(db, 0, sizeof(CountRelationsDatabase));
+				break;
+			case PENDING_CREATE_DATABASE:
+				census |= commit;
+				break;
+		}
+	}
+
+	if (count_in_commit)
+	{
+		pg_atomic_fetch_sub_u32(&count_shared->committing, 1);
+		count_in_commit = false;
+	}
+
+	/* Let the worker run a census for new databases */
+	if (census)
+	{
+		count_shared->census_requested = true;
+		if (count_shared->worker_latch)
+			SetLatch(count_shared->worker_latch);
+	}
+	LWLockRelease(count_shared->lock);
+
+	/* Wake up a census waiting for this transaction */
+	ConditionVariableBroadcast(&count_shared->cv);
+	num_pending_changes = 0;
+}
+
+static void
+count_relations_xact_callback(XactEvent event, void *arg)
+{
+	if (num_pending_changes == 0 && !count_in_commit)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			apply_pending_changes();
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+
+			/*
+			 * The counters cannot follow a prepared transaction, whose
+			 * outcome is only known once this session is gone.
+			 */
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot PREPARE a transaction that has created or dropped relations"),
+					 errdetail("count_relations cannot track the relations of prepared transactions.")));
+			break;
+		case XACT_EVENT_COMMIT:
+			finish_pending_changes(true);
+			break;
+		case XACT_EVENT_ABORT:
+			if (count_in_commit)
+				finish_pending_changes(false);
+			num_pending_changes = 0;
+			break;
+		case XACT_EVENT_PREPARE:
+			num_pending_changes = 0;
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+count_relations_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+								 SubTransactionId parentSubid, void *arg)
+{
+	int			nestlevel = GetCurrentTransactionNestLevel();
+	int			i;
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
+		/* Forget the changes of the aborted subtransaction */
+		while (num_pending_changes > 0 &&
+			   pending_changes[num_pending_changes - 1].nestlevel >= nestlevel)
+			num_pending_changes--;
+	}
+	else if (event == SUBXACT_EVENT_COMMIT_SUB)
+	{
+		/* Changes now belong to the parent */
+		for (i = 0; i < num_pending_changes; i++)
+		{
+			if (pending_changes[i].nestlevel >= nestlevel)
+				pending_changes[i].nestlevel = nestlevel - 1;
+		}
+	}
+}
+
+/*
+ * Let the transactions waiting for a census go on if it stops before
+ * being done.
+ */
+static void
+count_relations_census_exit(int code, Datum arg)
+{
+	if (!count_in_census)
+		return;
+
+	LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+	count_shared->census_waiting = false;
+	LWLockRelease(count_shared->lock);
+	ConditionVariableBroadcast(&count_shared->cv);
+	count_in_census = false;
+}
+
+/*
+ * Entry point of the workers running the census of a database, whose OID
+ * is given as argument. pg_class is scanned with a snapshot taken once all
+ * the transactions whose changes have been applied or reverted are visible,
+ * transactions committing changes meanwhile waiting for the census to be
+ * done, see apply_pending_changes().
+ */
+void
+count_relations_census_main(Datum main_arg)
+{
+	Oid			dbid = DatumGetObjectId(main_arg);
+	int64		counts[NUM_RELKINDS];
+	CountRelationsDatabase *db;
+	Relation	rel;
+	SysScanDesc scan;
+	HeapTuple	tuple;
+	Snapshot	snapshot;
+
+	BackgroundWorkerUnblockSignals();
+	BackgroundWorkerInitializeConnectionByOid(dbid, InvalidOid,
+											  BGWORKER_BYPASS_ALLOWCONN);
+
+	MemSet(counts, 0, sizeof(counts));
+
+	StartTransactionCommand();
+	pgstat_report_activity(STATE_RUNNING, "census of relations");
+
+	rel = heap_open(RelationRelationId, AccessShareLock);
+
+	/* Stop the next commits, and wait for the ones in progress */
+	on_shmem_exit(count_relations_census_exit, (Datum) 0);
+	LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+	count_shared->census_waiting = true;
+	count_in_census = true;
+	LWLockRelease(count_shared->lock);
+	while (pg_atomic_read_u32(&count_shared->committing) > 0)
+		ConditionVariableSleep(&count_shared->cv, PG_WAIT_EXTENSION);
+	ConditionVariableCancelSleep();
+
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	scan = systable_beginscan(rel, InvalidOid, false, snapshot, 0, NULL);
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		int			idx;
+
+		idx = relkind_index(((Form_pg_class) GETSTRUCT(tuple))->relkind);
+		if (idx >= 0)
+			counts[idx]++;
+	}
+	systable_endscan(scan);
+	UnregisterSnapshot(snapshot);
+
+	LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+	db = find_database(dbid, true);
+	if (db != NULL)
+	{
+		memcpy(db->counts, counts, sizeof(counts));
+		db->census_done = true;
+	}
+	count_shared->census_waiting = false;
+	count_in_census = false;
+	LWLockRelease(count_shared->lock);
+	ConditionVariableBroadcast(&count_shared->cv);
+	heap_close(rel, AccessShareLock);
+
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	elog(DEBUG1, "count_relations: census of database %u done", dbid);
+	proc_exit(0);
+}
+
+/*
+ * Run the census of all the databases not counted yet, one worker at a
+ * time.
+ */
+static void
+count_relations_run_census(void)
+{
+	List	   *dbids = NIL;
+	ListCell   *lc;
+	Relation	rel;
+	HeapScanDesc scan;
+	HeapTuple	tuple;
+
+	/* Get the list of databases missing a census */
+	StartTransactionCommand();
+	(void) GetTransactionSnapshot();
+	rel = heap_open(DatabaseRelationId, AccessShareLock);
+	scan = heap_beginscan_catalog(rel, 0, NULL);
+	LWLockAcquire(count_shared->lock, LW_SHARED);
+	while (HeapTupleIsValid(tuple = heap_getnext(scan, ForwardScanDirection)))
+	{
+		Oid			dbid = HeapTupleGetOid(tuple);
+		CountRelationsDatabase *db = find_database(dbid, false);
+
+		if (db == NULL || !db->census_done)
+			dbids = lappend_oid(dbids, dbid);
+	}
+	LWLockRelease(count_shared->lock);
+	heap_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	/* Keep the list around */
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		dbids = list_copy(dbids);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	CommitTransactionCommand();
+
+	foreach(lc, dbids)
+	{
+		BackgroundWorker worker;
+		BackgroundWorkerHandle *handle;
+
+		MemSet(&worker, 0, sizeof(BackgroundWorker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "count_relations");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "count_relations_census_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "count relations census %u",
+				 lfirst_oid(lc));
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		worker.bgw_main_arg = ObjectIdGetDatum(lfirst_oid(lc));
+		worker.bgw_notify_pid = MyProcPid;
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		{
+			ereport(WARNING,
+					(errmsg("count_relations: could not start census of database %u",
+							lfirst_oid(lc)),
+					 errhint("You may need to increase max_worker_processes.")));
+			continue;
+		}
+
+		if (WaitForBackgroundWorkerShutdown(handle) == BGWH_POSTMASTER_DIED)
+			proc_exit(1);
+		pfree(handle);
+
+		if (got_sigterm)
+			break;
+	}
+
+	list_free(dbids);
+}
+
+static void
+count_relations_worker_exit(int code, Datum arg)
+{
+	LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+	count_shared->worker_latch = NULL;
+	LWLockRelease(count_shared->lock);
 }
 
 void
@@ -68,14 +700,36 @@ count_relations_main(Datum main_arg)
 	/* We're now ready to receive signals */
 	BackgroundWorkerUnblockSignals();
 
-	/* Connect to our database */
-	BackgroundWorkerInitializeConnection("postgres", NULL);
+	/* Connect without database, only shared catalogs are needed */
+	BackgroundWorkerInitializeConnection(NULL, NULL, 0);
+
+	/* Advertise our latch, to be woken up when databases are created */
+	LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+	count_shared->worker_latch = &MyProc->procLatch;
+	LWLockRelease(count_shared->lock);
+	on_shmem_exit(count_relations_worker_exit, (Datum) 0);
 
 	while (!got_sigterm)
 	{
-		int		ret;
 		int		rc;
-		StringInfoData	buf;
+
+		/* Count the relations of databases not known yet */
+		LWLockAcquire(count_shared->lock, LW_EXCLUSIVE);
+		count_shared->census_requested = false;
+		LWLockRelease(count_shared->lock);
+		count_relations_run_census();
+
+		/*
+		 * Waiting for census workers may have consumed a wakeup, so check
+		 * if a database has been created in the meantime.
+		 */
+		LWLockAcquire(count_shared->lock, LW_SHARED);
+		if (count_shared->census_requested)
+		{
+			LWLockRelease(count_shared->lock);
+			continue;
+		}
+		LWLockRelease(count_shared->lock);
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
@@ -84,8 +738,8 @@ count_relations_main(Datum main_arg)
 		 * background process goes away immediately in an emergency.
 		 */
 		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   1000L,
+					   WL_LATCH_SET | WL_POSTMASTER_DEATH,
+					   0L,
 					   PG_WAIT_EXTENSION);
 		ResetLatch(&MyProc->procLatch);
 
@@ -93,40 +747,88 @@ count_relations_main(Datum main_arg)
 		if (rc & WL_POSTMASTER_DEATH)
 			proc_exit(1);
 
-		StartTransactionCommand();
-		SPI_connect();
-		PushActiveSnapshot(GetTransactionSnapshot());
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
 
-		initStringInfo(&buf);
+	proc_exit(0);
+}
 
-		/* Build the query string */
-		appendStringInfo(&buf,
-						 "SELECT count(*) FROM pg_class;");
+/*
+ * count_relations
+ *
+ * Return the number of relations of each kind per database, as kept in
+ * shared memory. Databases whose census is not done are not listed.
+ */
+Datum
+count_relations(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	int			i;
+
+	if (count_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("count_relations must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-		ret = SPI_execute(buf.data, true, 0);
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(count_shared->lock, LW_SHARED);
+	for (i = 0; i < count_max_databases; i++)
+	{
+		CountRelationsDatabase *db = &count_shared->databases[i];
+		int			j;
 
-		/* Some error messages in case of incorrect handling */
-		if (ret != SPI_OK_SELECT)
-			elog(FATAL, "SPI_execute failed: error code %d", ret);
+		if (!OidIsValid(db->dbid) || !db->census_done)
+			continue;
 
-		if (SPI_processed > 0)
+		for (j = 0; j < NUM_RELKINDS; j++)
 		{
-			int32	count;
-			bool	isnull;
-
-			count = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
-												 SPI_tuptable->tupdesc,
-												 1, &isnull));
-			elog(LOG, "Currently %d relations in database",
-				 count);
-		}
+			Datum		values[3];
+			bool		nulls[3];
 
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
+			MemSet(nulls, 0, sizeof(nulls));
+			values[0] = ObjectIdGetDatum(db->dbid);
+			values[1] = CharGetDatum(count_relkinds[j]);
+			values[2] = Int64GetDatum(db->counts[j]);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
 	}
+	LWLockRelease(count_shared->lock);
 
-	proc_exit(0);
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
 }
 
 /*
@@ -137,6 +839,33 @@ _PG_init(void)
 {
 	BackgroundWorker	worker;
 
+	/* Counters and hooks only make sense when preloaded */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("count_relations.max_databases",
+							"Maximum number of databases whose relations are counted.",
+							NULL,
+							&count_max_databases,
+							64,
+							1,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	/* shared memory and hooks */
+	RequestAddinShmemSpace(count_relations_shmem_size());
+	RequestNamedLWLockTranche("count_relations", 1);
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = count_relations_shmem_startup;
+	prev_object_access_hook = object_access_hook;
+	object_access_hook = count_relations_object_access;
+	RegisterXactCallback(count_relations_xact_callback, NULL);
+	RegisterSubXactCallback(count_relations_subxact_callback, NULL);
+
 	/* register the worker processes */
 	MemSet(&worker, 0, sizeof(BackgroundWorker));
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
@@ -14,20 +14,35 @@
 
 #include "postgres.h"
 
+#include <ctype.h>
+#include <float.h>
+#include <fnmatch.h>
+#include <math.h>
+
 #include "access/genam.h"
+#include "access/htup_details.h"
 #include "access/sysattr.h"
 #include "catalog/pg_class.h"
 #include "catalog/pg_type.h"
+#include "libpq/pqformat.h"
+#include "miscadmin.h"
 #include "nodes/parsenodes.h"
 #include "replication/output_plugin.h"
 #include "replication/logical.h"
+#include "replication/origin.h"
 #include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/float.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 #include "utils/typcache.h"
+#include "utils/uuid.h"
 
 
 PG_MODULE_MAGIC;
@@ -42,9 +57,136 @@ extern void		_PG_output_plugin_init(OutputPluginCallbacks *cb);
 typedef struct
 {
 	MemoryContext context;
+	MemoryContext cache_context;	/* context of relation cache */
+	HTAB	   *relentries;			/* relation cache, see below */
 	bool		include_transaction;
+	bool		binary_output;		/* use binary protocol, see below */
+
+	/* Filtering of relations, columns and origins */
+	List	   *include_tables;		/* patterns of relations to include */
+	List	   *exclude_tables;		/* patterns of relations to exclude */
+	List	   *column_filters;		/* list of DecoderRawColumnFilter */
+	bool		only_local;			/* skip changes from other origins */
+
+	/* Batching of consecutive INSERTs into multi-row INSERT queries */
+	bool		batch_inserts;
+	int			batch_max_rows;		/* rows in batch before flushing */
+	int			batch_max_bytes;	/* size of batch before flushing */
+	StringInfoData batch;			/* pending multi-row INSERT query */
+	int			batch_rows;			/* number of rows in pending batch */
+	Oid			batch_relid;		/* relation of pending batch */
+	uint32		batch_generation;	/* generation of relation entry */
 } DecoderRawData;
 
+/*
+ * List of columns to decode for relations matching a pattern.
+ */
+typedef struct
+{
+	char	   *pattern;		/* pattern of relations */
+	List	   *columns;		/* names of columns to decode */
+} DecoderRawColumnFilter;
+
+/*
+ * Way a value is printed as a literal, depending on its type.
+ */
+typedef enum
+{
+	DECODER_RAW_LITERAL_BOOL,		/* true or false */
+	DECODER_RAW_LITERAL_INTEGER,	/* printed as-is */
+	DECODER_RAW_LITERAL_FLOAT,		/* quoted only for special values */
+	DECODER_RAW_LITERAL_BIT,		/* B'...' */
+	DECODER_RAW_LITERAL_QUOTED		/* quoted and escaped */
+} DecoderRawLiteral;
+
+/*
+ * Output information cached for an attribute of a relation.
+ */
+typedef struct
+{
+	bool		skip;			/* dropped or system column */
+	bool		iskey;			/* part of replica identity? */
+	char	   *name;			/* attribute name */
+	char	   *quoted_name;	/* quoted attribute name */
+	Oid			typid;			/* type of attribute */
+	int32		typmod;			/* type modifier of attribute */
+	bool		typisvarlena;	/* is type varlena? */
+	DecoderRawLiteral literal;	/* way to print the type */
+	FmgrInfo	typoutput;		/* output function of type */
+	FmgrInfo	typsend;		/* send function of type, for binary output */
+} DecoderRawAttr;
+
+/*
+ * Entry of the relation cache, keyed by relation OID. Everything needed
+ * to generate queries for a relation is computed once and kept here
+ * until the relation, its namespace, or one of the types it uses gets
+ * invalidated. All the data of an entry is allocated in its own memory
+ * context, so as it can be rebuilt easily.
+ */
+typedef struct
+{
+	Oid			relid;			/* hash key, must be first */
+	bool		valid;			/* false if entry needs to be rebuilt */
+	uint32		generation;		/* incremented at each rebuild */
+	MemoryContext context;		/* context of this entry's data */
+	bool		filtered;		/* changes of relation are skipped? */
+	bool		schema_sent;	/* relation message sent in binary output? */
+	char	   *nspname;		/* namespace name */
+	char	   *name;			/* relation name */
+	char	   *relname;		/* quoted, schema-qualified relation name */
+	char		replident;		/* replica identity of relation */
+	int			natts;			/* number of attributes */
+	DecoderRawAttr *attrs;		/* array of natts attributes */
+	bool		is_selective;	/* UPDATE and DELETE can be generated? */
+	int			nkeyatts;		/* number of replica identity attributes */
+	AttrNumber *keyatts;		/* replica identity attribute numbers */
+} DecoderRawRelEntry;
+
+/*
+ * Message types of the binary output format. All integers are sent in
+ * network byte order, and strings are null-terminated.
+ *
+ * - BEGIN, only with include_transaction: final LSN (int64), commit time
+ *   (int64) and transaction ID (uint32).
+ * - COMMIT, only with include_transaction: commit LSN (int64), end LSN
+ *   (int64) and commit time (int64).
+ * - RELATION, sent before the first change of a relation, and again after
+ *   the relation has been invalidated: relation OID (uint32), namespace
+ *   name (string), relation name (string), replica identity (uint8),
+ *   number of columns (uint16), then for each column flags (uint8, see
+ *   DECODER_RAW_BINARY_COLUMN_KEY), name (string), type OID (uint32) and
+ *   type modifier (int32).
+ * - INSERT: relation OID (uint32), then a NEW tuple.
+ * - UPDATE: relation OID (uint32), then a KEY tuple and a NEW tuple.
+ * - DELETE: relation OID (uint32), then a KEY tuple.
+ *
+ * A tuple is made of its marker (KEY or NEW), its number of columns
+ * (uint16), a bitmap of NULL columns, a bitmap of unchanged TOAST columns,
+ * each bitmap using one bit per column with the lowest bit first, and
+ * then the length (uint32) and contents of each other column, as produced
+ * by the send function of its type. A NEW tuple has all the columns of
+ * the RELATION message, and a KEY tuple only its key columns, in the same
+ * order.
+ */
+#define DECODER_RAW_BINARY_BEGIN		'B'
+#define DECODER_RAW_BINARY_COMMIT		'C'
+#define DECODER_RAW_BINARY_RELATION		'R'
+#define DECODER_RAW_BINARY_INSERT		'I'
+#define DECODER_RAW_BINARY_UPDATE		'U'
+#define DECODER_RAW_BINARY_DELETE		'D'
+#define DECODER_RAW_BINARY_TUPLE_KEY	'K'
+#define DECODER_RAW_BINARY_TUPLE_NEW	'N'
+#define DECODER_RAW_BINARY_COLUMN_KEY	0x01
+
+/*
+ * Relation cache of the plugin, which is the same as the one saved in
+ * DecoderRawData. This is needed here as invalidation callbacks cannot
+ * be unregistered and may be called even after the decoding context has
+ * been freed.
+ */
+static HTAB *decoder_raw_relentries = NULL;
+static bool decoder_raw_callbacks_registered = false;
+
 static void decoder_raw_startup(LogicalDecodingContext *ctx,
 								OutputPluginOptions *opt,
 								bool is_init);
@@ -57,6 +199,12 @@ static void decoder_raw_commit_txn(LogicalDecodingContext *ctx,
 static void decoder_raw_change(LogicalDecodingContext *ctx,
 							   ReorderBufferTXN *txn, Relation rel,
 							   ReorderBufferChange *change);
+static bool decoder_raw_filter_by_origin(LogicalDecodingContext *ctx,
+										 RepOriginId origin_id);
+static void decoder_raw_relcache_cb(Datum arg, Oid relid);
+static void decoder_raw_cache_reset_cb(void *arg);
+static void decoder_raw_syscache_cb(Datum arg, int cacheid,
+									uint32 hashvalue);
 
 void
 _PG_init(void)
@@ -74,10 +222,124 @@ _PG_output_plugin_init(OutputPluginCallbacks *cb)
 	cb->begin_cb = decoder_raw_begin_txn;
 	cb->change_cb = decoder_raw_change;
 	cb->commit_cb = decoder_raw_commit_txn;
+	cb->filter_by_origin_cb = decoder_raw_filter_by_origin;
 	cb->shutdown_cb = decoder_raw_shutdown;
 }
 
 
+/*
+ * Parse the value of an option expecting a strictly positive integer.
+ */
+static int
+parse_option_int(DefElem *elem)
+{
+	char	   *endptr;
+	long		val;
+
+	if (elem->arg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("No value specified for parameter \"%s\"",
+						elem->defname)));
+
+	errno = 0;
+	val = strtol(strVal(elem->arg), &endptr, 10);
+	if (errno != 0 || *endptr != '\0' || endptr == strVal(elem->arg) ||
+		val <= 0 || val > PG_INT32_MAX)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Incorrect value \"%s\" for parameter \"%s\"",
+						strVal(elem->arg), elem->defname)));
+
+	return (int) val;
+}
+
+/*
+ * Split a comma-separated list of elements given as value of an option,
+ * trimming whitespaces around each element.
+ */
+static List *
+parse_option_list(DefElem *elem, const char *value)
+{
+	List	   *result = NIL;
+	char	   *rawstring = pstrdup(value);
+	char	   *token;
+	char	   *saveptr;
+
+	for (token = strtok_r(rawstring, ",", &saveptr);
+		 token != NULL;
+		 token = strtok_r(NULL, ",", &saveptr))
+	{
+		char	   *end;
+
+		while (isspace((unsigned char) *token))
+			token++;
+		end = token + strlen(token);
+		while (end > token && isspace((unsigned char) end[-1]))
+			*--end = '\0';
+
+		if (*token == '\0')
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("Incorrect value \"%s\" for parameter \"%s\"",
+							value, elem->defname)));
+
+		result = lappend(result, token);
+	}
+
+	return result;
+}
+
+/*
+ * Parse a column filter, whose format is "pattern:col1,col2,...".
+ */
+static DecoderRawColumnFilter *
+parse_column_filter(DefElem *elem)
+{
+	DecoderRawColumnFilter *filter;
+	char	   *value;
+	char	   *sep;
+
+	if (elem->arg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("No value specified for parameter \"%s\"",
+						elem->defname)));
+
+	value = pstrdup(strVal(elem->arg));
+	sep = strchr(value, ':');
+	if (sep == NULL || sep == value)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Incorrect value \"%s\" for parameter \"%s\"",
+						strVal(elem->arg), elem->defname)));
+	*sep = '\0';
+
+	filter = palloc(sizeof(DecoderRawColumnFilter));
+	filter->pattern = value;
+	filter->columns = parse_option_list(elem, sep + 1);
+
+	return filter;
+}
+
+/*
+ * Check if a schema-qualified relation name matches one of the given
+ * patterns, which can use shell-style wildcards.
+ */
+static bool
+relation_matches(List *patterns, const char *qualname)
+{
+	ListCell   *lc;
+
+	foreach(lc, patterns)
+	{
+		if (fnmatch((char *) lfirst(lc), qualname, 0) == 0)
+			return true;
+	}
+
+	return false;
+}
+
 /* initialize this plugin */
 static void
 decoder_raw_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
@@ -85,12 +347,61 @@ decoder_raw_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
 {
 	ListCell   *option;
 	DecoderRawData *data;
+	HASHCTL		hash_ctl;
+	MemoryContextCallback *cache_cb;
 
 	data = palloc(sizeof(DecoderRawData));
 	data->context = AllocSetContextCreate(ctx->context,
 										  "Raw decoder context",
 										  ALLOCSET_DEFAULT_SIZES);
+	data->cache_context = AllocSetContextCreate(ctx->context,
+												"Raw decoder cache context",
+												ALLOCSET_DEFAULT_SIZES);
 	data->include_transaction = false;
+	data->binary_output = false;
+	data->include_tables = NIL;
+	data->exclude_tables = NIL;
+	data->column_filters = NIL;
+	data->only_local = false;
+	data->batch_inserts = false;
+	data->batch_max_rows = 100;
+	data->batch_max_bytes = 65536;
+	initStringInfo(&data->batch);
+	data->batch_rows = 0;
+	data->batch_relid = InvalidOid;
+	data->batch_generation = 0;
+
+	/* Relation cache, filled as relations are found while decoding */
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(DecoderRawRelEntry);
+	hash_ctl.hcxt = data->cache_context;
+	data->relentries = hash_create("Raw decoder relation cache", 128,
+								   &hash_ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	decoder_raw_relentries = data->relentries;
+
+	/*
+	 * Forget the relation cache once its context goes away. This matters
+	 * when decoding fails, as the decoding context is freed without the
+	 * shutdown callback being called.
+	 */
+	cache_cb = MemoryContextAlloc(data->cache_context,
+								  sizeof(MemoryContextCallback));
+	cache_cb->func = decoder_raw_cache_reset_cb;
+	cache_cb->arg = NULL;
+	MemoryContextRegisterResetCallback(data->cache_context, cache_cb);
+
+	/* Invalidation callbacks can only be registered once per process */
+	if (!decoder_raw_callbacks_registered)
+	{
+		CacheRegisterRelcacheCallback(decoder_raw_relcache_cb, (Datum) 0);
+		CacheRegisterSyscacheCallback(NAMESPACEOID,
+									  decoder_raw_syscache_cb, (Datum) 0);
+		CacheRegisterSyscacheCallback(TYPEOID,
+									  decoder_raw_syscache_cb, (Datum) 0);
+		decoder_raw_callbacks_registered = true;
+	}
 
 	ctx->output_plugin_private = data;
 
@@ -114,6 +425,54 @@ decoder_raw_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
 						 errmsg("could not parse value \"%s\" for parameter \"%s\"",
 								strVal(elem->arg), elem->defname)));
 		}
+		else if (strcmp(elem->defname, "batch_inserts") == 0)
+		{
+			/* if option does not provide a value, it means its value is true */
+			if (elem->arg == NULL)
+				data->batch_inserts = true;
+			else if (!parse_bool(strVal(elem->arg), &data->batch_inserts))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("could not parse value \"%s\" for parameter \"%s\"",
+								strVal(elem->arg), elem->defname)));
+		}
+		else if (strcmp(elem->defname, "include_tables") == 0 ||
+				 strcmp(elem->defname, "exclude_tables") == 0)
+		{
+			List	   *patterns;
+
+			if (elem->arg == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("No value specified for parameter \"%s\"",
+								elem->defname)));
+
+			patterns = parse_option_list(elem, strVal(elem->arg));
+			if (strcmp(elem->defname, "include_tables") == 0)
+				data->include_tables = list_concat(data->include_tables,
+												   patterns);
+			else
+				data->exclude_tables = list_concat(data->exclude_tables,
+												   patterns);
+		}
+		else if (strcmp(elem->defname, "columns") == 0)
+			data->column_filters = lappend(data->column_filters,
+										   parse_column_filter(elem));
+		else if (strcmp(elem->defname, "only_local") == 0)
+		{
+			/* if option does not provide a value, it means its value is true */
+			if (elem->arg == NULL)
+				data->only_local = true;
+			else if (!parse_bool(strVal(elem->arg), &data->only_local))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("could not parse value \"%s\" for parameter \"%s\"",
+								strVal(elem->arg), elem->defname)));
+		}
+		else if (strcmp(elem->defname, "batch_max_rows") == 0)
+			data->batch_max_rows = parse_option_int(elem);
+		else if (strcmp(elem->defname, "batch_max_bytes") == 0)
+			data->batch_max_bytes = parse_option_int(elem);
 		else if (strcmp(elem->defname, "output_format") == 0)
 		{
 			char	   *format = NULL;
@@ -145,6 +504,8 @@ decoder_raw_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
 							elem->arg ? strVal(elem->arg) : "(null)")));
 		}
 	}
+
+	data->binary_output = (opt->output_type == OUTPUT_PLUGIN_BINARY_OUTPUT);
 }
 
 /* cleanup this plugin's resources */
@@ -155,6 +516,300 @@ decoder_raw_shutdown(LogicalDecodingContext *ctx)
 
 	/* cleanup our own resources via memory context reset */
 	MemoryContextDelete(data->context);
+	MemoryContextDelete(data->cache_context);
+}
+
+/*
+ * Origin filter callback, skipping the changes replayed from other
+ * origins if requested.
+ */
+static bool
+decoder_raw_filter_by_origin(LogicalDecodingContext *ctx,
+							 RepOriginId origin_id)
+{
+	DecoderRawData *data = ctx->output_plugin_private;
+
+	return data->only_local && origin_id != InvalidRepOriginId;
+}
+
+/*
+ * Reset callback of the cache context, the relation cache is gone with it.
+ */
+static void
+decoder_raw_cache_reset_cb(void *arg)
+{
+	decoder_raw_relentries = NULL;
+}
+
+/*
+ * Relcache invalidation callback, marking as invalid the entry of the
+ * relation involved, or all of them if no relation is specified.
+ */
+static void
+decoder_raw_relcache_cb(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	DecoderRawRelEntry *entry;
+
+	/* Nothing to do if decoding is not running */
+	if (decoder_raw_relentries == NULL)
+		return;
+
+	if (OidIsValid(relid))
+	{
+		entry = hash_search(decoder_raw_relentries, &relid,
+							HASH_FIND, NULL);
+		if (entry != NULL)
+			entry->valid = false;
+		return;
+	}
+
+	hash_seq_init(&status, decoder_raw_relentries);
+	while ((entry = (DecoderRawRelEntry *) hash_seq_search(&status)) != NULL)
+		entry->valid = false;
+}
+
+/*
+ * Syscache invalidation callback, for namespaces and types. Those are
+ * not tracked per relation, so invalidate all the entries.
+ */
+static void
+decoder_raw_syscache_cb(Datum arg, int cacheid, uint32 hashvalue)
+{
+	decoder_raw_relcache_cb(arg, InvalidOid);
+}
+
+/*
+ * Determine the way values of type `typid' are printed as literals.
+ */
+static DecoderRawLiteral
+get_literal_type(Oid typid)
+{
+	switch (typid)
+	{
+		case BOOLOID:
+			return DECODER_RAW_LITERAL_BOOL;
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+			return DECODER_RAW_LITERAL_INTEGER;
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			return DECODER_RAW_LITERAL_FLOAT;
+		case BITOID:
+		case VARBITOID:
+			return DECODER_RAW_LITERAL_BIT;
+		default:
+			break;
+	}
+
+	return DECODER_RAW_LITERAL_QUOTED;
+}
+
+/*
+ * Get the cache entry of a relation, building it if necessary.
+ */
+static DecoderRawRelEntry *
+get_relentry(DecoderRawData *data, Relation relation)
+{
+	Oid			relid = RelationGetRelid(relation);
+	TupleDesc	tupdesc = RelationGetDescr(relation);
+	char		replident = relation->rd_rel->relreplident;
+	DecoderRawRelEntry *entry;
+	MemoryContext old;
+	bool		found;
+	int			natt;
+	char	   *qualname = NULL;
+	ListCell   *lc;
+
+	entry = hash_search(data->relentries, &relid, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->valid = false;
+		entry->generation = 0;
+		entry->context = NULL;
+	}
+
+	if (entry->valid)
+		return entry;
+
+	entry->generation++;
+
+	/* (Re)build the entry from scratch */
+	if (entry->context != NULL)
+		MemoryContextDelete(entry->context);
+	entry->context = AllocSetContextCreate(data->cache_context,
+										   "Raw decoder relation entry",
+										   ALLOCSET_SMALL_SIZES);
+	old = MemoryContextSwitchTo(entry->context);
+
+	entry->schema_sent = false;
+	entry->nspname = get_namespace_name(RelationGetNamespace(relation));
+	entry->name = pstrdup(RelationGetRelationName(relation));
+	entry->relname = quote_qualified_identifier(entry->nspname, entry->name);
+	entry->replident = replident;
+
+	/*
+	 * Check if the relation is filtered, in which case nothing else is
+	 * needed as its changes are discarded.
+	 */
+	if (data->include_tables != NIL || data->exclude_tables != NIL ||
+		data->column_filters != NIL)
+		qualname = psprintf("%s.%s", entry->nspname, entry->name);
+	entry->filtered =
+		(data->include_tables != NIL &&
+		 !relation_matches(data->include_tables, qualname)) ||
+		(data->exclude_tables != NIL &&
+		 relation_matches(data->exclude_tables, qualname));
+	if (entry->filtered)
+	{
+		entry->natts = 0;
+		entry->attrs = NULL;
+		entry->is_selective = false;
+		entry->nkeyatts = 0;
+		entry->keyatts = NULL;
+		MemoryContextSwitchTo(old);
+		entry->valid = true;
+		return entry;
+	}
+
+	/* Attributes */
+	entry->natts = tupdesc->natts;
+	entry->attrs = palloc0(sizeof(DecoderRawAttr) * tupdesc->natts);
+	for (natt = 0; natt < tupdesc->natts; natt++)
+	{
+		Form_pg_attribute	attr = TupleDescAttr(tupdesc, natt);
+		DecoderRawAttr	   *rawattr = &entry->attrs[natt];
+		Oid					typoutput;
+
+		/* Skip dropped columns and system columns */
+		if (attr->attisdropped || attr->attnum < 0)
+		{
+			rawattr->skip = true;
+			continue;
+		}
+
+		rawattr->skip = false;
+		rawattr->iskey = false;
+		rawattr->name = pstrdup(NameStr(attr->attname));
+		rawattr->quoted_name = pstrdup(quote_identifier(rawattr->name));
+		rawattr->typid = attr->atttypid;
+		rawattr->typmod = attr->atttypmod;
+		rawattr->literal = get_literal_type(attr->atttypid);
+		getTypeOutputInfo(attr->atttypid, &typoutput, &rawattr->typisvarlena);
+		fmgr_info_cxt(typoutput, &rawattr->typoutput, entry->context);
+
+		/* Send function is only needed for binary output */
+		if (data->binary_output)
+		{
+			Oid			typsend;
+
+			getTypeBinaryOutputInfo(attr->atttypid, &typsend,
+									&rawattr->typisvarlena);
+			fmgr_info_cxt(typsend, &rawattr->typsend, entry->context);
+		}
+	}
+
+	/*
+	 * Determine if relation is selective enough for WHERE clause generation
+	 * in UPDATE and DELETE cases. A non-selective relation uses REPLICA
+	 * IDENTITY set as NOTHING, or DEFAULT without an available replica
+	 * identity index.
+	 */
+	RelationGetIndexList(relation);
+	entry->is_selective = !(replident == REPLICA_IDENTITY_NOTHING ||
+							(replident == REPLICA_IDENTITY_DEFAULT &&
+							 !OidIsValid(relation->rd_replidindex)));
+	entry->nkeyatts = 0;
+	entry->keyatts = NULL;
+
+	if (OidIsValid(relation->rd_replidindex))
+	{
+		Relation	indexRel;
+		int			key;
+
+		/* Use all the attributes associated with the index */
+		indexRel = index_open(relation->rd_replidindex, AccessShareLock);
+		entry->keyatts = palloc(sizeof(AttrNumber) *
+								indexRel->rd_index->indnatts);
+		for (key = 0; key < indexRel->rd_index->indnatts; key++)
+			entry->keyatts[entry->nkeyatts++] =
+				indexRel->rd_index->indkey.values[key];
+		index_close(indexRel, NoLock);
+	}
+	else if (replident == REPLICA_IDENTITY_FULL)
+	{
+		/* Use all the attributes of the relation */
+		entry->keyatts = palloc(sizeof(AttrNumber) * tupdesc->natts);
+		for (natt = 0; natt < tupdesc->natts; natt++)
+		{
+			if (!entry->attrs[natt].skip)
+				entry->keyatts[entry->nkeyatts++] = natt + 1;
+		}
+	}
+
+	for (natt = 0; natt < entry->nkeyatts; natt++)
+		entry->attrs[entry->keyatts[natt] - 1].iskey = true;
+
+	/*
+	 * Apply the first column filter matching this relation, if any. Columns
+	 * of the replica identity are always kept, as they are needed for the
+	 * WHERE clause of UPDATE and DELETE queries.
+	 */
+	foreach(lc, data->column_filters)
+	{
+		DecoderRawColumnFilter *filter = lfirst(lc);
+
+		if (fnmatch(filter->pattern, qualname, 0) != 0)
+			continue;
+
+		for (natt = 0; natt < entry->natts; natt++)
+		{
+			DecoderRawAttr *rawattr = &entry->attrs[natt];
+			ListCell   *lc2;
+			bool		listed = false;
+
+			if (rawattr->skip || rawattr->iskey)
+				continue;
+
+			foreach(lc2, filter->columns)
+			{
+				if (strcmp((char *) lfirst(lc2), rawattr->name) == 0)
+				{
+					listed = true;
+					break;
+				}
+			}
+			rawattr->skip = !listed;
+		}
+		break;
+	}
+
+	MemoryContextSwitchTo(old);
+	entry->valid = true;
+
+	return entry;
+}
+
+/*
+ * Write the pending multi-row INSERT query, if any.
+ */
+static void
+flush_batch(LogicalDecodingContext *ctx, DecoderRawData *data)
+{
+	if (data->batch_rows == 0)
+		return;
+
+	OutputPluginPrepareWrite(ctx, true);
+	appendBinaryStringInfo(ctx->out, data->batch.data, data->batch.len);
+	appendStringInfoChar(ctx->out, ';');
+	OutputPluginWrite(ctx, true);
+
+	resetStringInfo(&data->batch);
+	data->batch_rows = 0;
+	data->batch_relid = InvalidOid;
 }
 
 /* BEGIN callback */
@@ -163,11 +818,22 @@ decoder_raw_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
 {
 	DecoderRawData *data = ctx->output_plugin_private;
 
+	/* Nothing should remain from a previous transaction */
+	Assert(data->batch_rows == 0);
+
 	/* Write to the plugin only if there is */
 	if (data->include_transaction)
 	{
 		OutputPluginPrepareWrite(ctx, true);
-		appendStringInfoString(ctx->out, "BEGIN;");
+		if (data->binary_output)
+		{
+			pq_sendbyte(ctx->out, DECODER_RAW_BINARY_BEGIN);
+			pq_sendint64(ctx->out, txn->final_lsn);
+			pq_sendint64(ctx->out, txn->commit_time);
+			pq_sendint32(ctx->out, txn->xid);
+		}
+		else
+			appendStringInfoString(ctx->out, "BEGIN;");
 		OutputPluginWrite(ctx, true);
 	}
 }
@@ -179,46 +845,52 @@ decoder_raw_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 {
 	DecoderRawData *data = ctx->output_plugin_private;
 
+	/* Rows of this transaction still pending are sent now */
+	flush_batch(ctx, data);
+
 	/* Write to the plugin only if there is */
 	if (data->include_transaction)
 	{
 		OutputPluginPrepareWrite(ctx, true);
-		appendStringInfoString(ctx->out, "COMMIT;");
+		if (data->binary_output)
+		{
+			pq_sendbyte(ctx->out, DECODER_RAW_BINARY_COMMIT);
+			pq_sendint64(ctx->out, commit_lsn);
+			pq_sendint64(ctx->out, txn->end_lsn);
+			pq_sendint64(ctx->out, txn->commit_time);
+		}
+		else
+			appendStringInfoString(ctx->out, "COMMIT;");
 		OutputPluginWrite(ctx, true);
 	}
 }
 
 /*
- * Print literal `outputstr' already represented as string of type `typid'
- * into stringbuf `s'.
+ * Print literal `outputstr' already represented as string into stringbuf
+ * `s', the way `literal' tells.
  *
  * Some builtin types aren't quoted, the rest is quoted. Escaping is done as
  * if standard_conforming_strings were enabled.
  */
 static void
-print_literal(StringInfo s, Oid typid, char *outputstr)
+print_literal(StringInfo s, DecoderRawLiteral literal, char *outputstr)
 {
 	const char *valptr;
 
-	switch (typid)
+	switch (literal)
 	{
-		case BOOLOID:
+		case DECODER_RAW_LITERAL_BOOL:
 			if (outputstr[0] == 't')
 				appendStringInfoString(s, "true");
 			else
 				appendStringInfoString(s, "false");
 			break;
 
-		case INT2OID:
-		case INT4OID:
-		case INT8OID:
-		case OIDOID:
+		case DECODER_RAW_LITERAL_INTEGER:
 			/* NB: We don't care about Inf, NaN et al. */
 			appendStringInfoString(s, outputstr);
 			break;
-		case FLOAT4OID:
-		case FLOAT8OID:
-		case NUMERICOID:
+		case DECODER_RAW_LITERAL_FLOAT:
 			/*
 			 * Numeric can have NaN. Float can have Nan, Infinity and
 			 * -Infinity. These need to be quoted.
@@ -230,12 +902,11 @@ print_literal(StringInfo s, Oid typid, char *outputstr)
 			else
 				appendStringInfoString(s, outputstr);
 			break;
-		case BITOID:
-		case VARBITOID:
+		case DECODER_RAW_LITERAL_BIT:
 			appendStringInfo(s, "B'%s'", outputstr);
 			break;
 
-		default:
+		case DECODER_RAW_LITERAL_QUOTED:
 			appendStringInfoChar(s, '\'');
 			for (valptr = outputstr; *valptr; valptr++)
 			{
@@ -251,37 +922,178 @@ print_literal(StringInfo s, Oid typid, char *outputstr)
 }
 
 /*
- * Print a relation name into the StringInfo provided by caller.
+ * Print a text value as a quoted literal. Runs of characters without
+ * quotes are found with memchr() and copied at once, as quotes are the
+ * only characters needing escaping with standard_conforming_strings.
  */
 static void
-print_relname(StringInfo s, Relation rel)
+print_text(StringInfo s, Datum val)
 {
-	Form_pg_class	class_form = RelationGetForm(rel);
+	text	   *txt = DatumGetTextPP(val);
+	const char *ptr = VARDATA_ANY(txt);
+	const char *end = ptr + VARSIZE_ANY_EXHDR(txt);
+
+	enlargeStringInfo(s, end - ptr + 2);
+	appendStringInfoChar(s, '\'');
+	while (ptr < end)
+	{
+		const char *quote = memchr(ptr, '\'', end - ptr);
+
+		if (quote == NULL)
+		{
+			appendBinaryStringInfo(s, ptr, end - ptr);
+			break;
+		}
+
+		/* Copy up to the quote included, and double it */
+		appendBinaryStringInfo(s, ptr, quote - ptr + 1);
+		appendStringInfoChar(s, '\'');
+		ptr = quote + 1;
+	}
+	appendStringInfoChar(s, '\'');
+}
 
-	appendStringInfoString(s,
-		quote_qualified_identifier(
-				get_namespace_name(
-						   get_rel_namespace(RelationGetRelid(rel))),
-			NameStr(class_form->relname)));
+/*
+ * Print a timestamp value, with or without time zone, as a quoted literal.
+ * This does the same work as the output functions of those types but
+ * without allocating the result.
+ */
+static void
+print_timestamp(StringInfo s, Timestamp timestamp, bool with_tz)
+{
+	struct pg_tm tt,
+			   *tm = &tt;
+	fsec_t		fsec;
+	int			tz = 0;
+	const char *tzn = NULL;
+	char		buf[MAXDATELEN + 1];
+
+	if (TIMESTAMP_IS_NOBEGIN(timestamp))
+		appendStringInfoString(s, "'-infinity'");
+	else if (TIMESTAMP_IS_NOEND(timestamp))
+		appendStringInfoString(s, "'infinity'");
+	else if (timestamp2tm(timestamp, with_tz ? &tz : NULL, tm, &fsec,
+						  with_tz ? &tzn : NULL, NULL) == 0)
+	{
+		EncodeDateTime(tm, fsec, with_tz, tz, tzn, DateStyle, buf);
+		appendStringInfo(s, "'%s'", buf);
+	}
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+				 errmsg("timestamp out of range")));
 }
 
 /*
- * Print a value into the StringInfo provided by caller.
+ * Print a UUID value as a quoted literal.
  */
 static void
-print_value(StringInfo s, Datum origval, Oid typid, bool isnull)
+print_uuid(StringInfo s, pg_uuid_t *uuid)
+{
+	static const char hex_chars[] = "0123456789abcdef";
+	char		buf[2 * UUID_LEN + 6 + 1];
+	char	   *ptr = buf;
+	int			i;
+
+	*ptr++ = '\'';
+	for (i = 0; i < UUID_LEN; i++)
+	{
+		/* Same format as uuid_out(), with hyphens between groups */
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			*ptr++ = '-';
+		*ptr++ = hex_chars[(uuid->data[i] >> 4) & 0x0F];
+		*ptr++ = hex_chars[uuid->data[i] & 0x0F];
+	}
+	*ptr++ = '\'';
+	appendBinaryStringInfo(s, buf, ptr - buf);
+}
+
+/*
+ * Print directly a value of some common types into the StringInfo provided
+ * by caller, bypassing the output function of the type and the quoting
+ * done by print_literal(). Returns false if the type is not handled here.
+ */
+static bool
+print_value_fast(StringInfo s, DecoderRawAttr *attr, Datum val)
 {
-	Oid					typoutput;
-	bool				typisvarlena;
+	/* Large enough for all the integer and float types handled here */
+	char		buf[64];
+
+	switch (attr->typid)
+	{
+		case BOOLOID:
+			appendStringInfoString(s, DatumGetBool(val) ? "true" : "false");
+			return true;
+		case INT2OID:
+			pg_itoa(DatumGetInt16(val), buf);
+			break;
+		case INT4OID:
+			pg_ltoa(DatumGetInt32(val), buf);
+			break;
+		case INT8OID:
+			pg_lltoa(DatumGetInt64(val), buf);
+			break;
+		case OIDOID:
+			snprintf(buf, sizeof(buf), "%u", DatumGetObjectId(val));
+			break;
+#if PG_VERSION_NUM < 120000
+		case FLOAT8OID:
+			{
+				float8		num = DatumGetFloat8(val);
+				int			ndig = DBL_DIG + extra_float_digits;
+
+				/* Special values need to be quoted */
+				if (isnan(num))
+				{
+					appendStringInfoString(s, "'NaN'");
+					return true;
+				}
+				if (isinf(num))
+				{
+					appendStringInfoString(s, num > 0 ?
+										   "'Infinity'" : "'-Infinity'");
+					return true;
+				}
+
+				/* Same logic as float8out() */
+				if (ndig < 1)
+					ndig = 1;
+				snprintf(buf, sizeof(buf), "%.*g", ndig, num);
+				break;
+			}
+#endif
+		case TIMESTAMPOID:
+			print_timestamp(s, DatumGetTimestamp(val), false);
+			return true;
+		case TIMESTAMPTZOID:
+			print_timestamp(s, DatumGetTimestampTz(val), true);
+			return true;
+		case UUIDOID:
+			print_uuid(s, DatumGetUUIDP(val));
+			return true;
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+			print_text(s, val);
+			return true;
+		default:
+			return false;
+	}
 
-	/* Query output function */
-	getTypeOutputInfo(typid,
-					  &typoutput, &typisvarlena);
+	appendStringInfoString(s, buf);
+	return true;
+}
 
+/*
+ * Print a value into the StringInfo provided by caller.
+ */
+static void
+print_value(StringInfo s, DecoderRawAttr *attr, Datum origval, bool isnull)
+{
 	/* Print value */
 	if (isnull)
 		appendStringInfoString(s, "null");
-	else if (typisvarlena && VARATT_IS_EXTERNAL_ONDISK(origval))
+	else if (attr->typisvarlena && VARATT_IS_EXTERNAL_ONDISK(origval))
 	{
 		/*
 		 * This should not happen, the column and its value can be skipped
@@ -292,15 +1104,20 @@ print_value(StringInfo s, Datum origval, Oid typid, bool isnull)
 		Assert(0);
 		appendStringInfoString(s, "unchanged-toast-datum");
 	}
-	else if (!typisvarlena)
-		print_literal(s, typid,
-					  OidOutputFunctionCall(typoutput, origval));
+	else if (print_value_fast(s, attr, origval))
+	{
+		/* Done, common type printed without its output function */
+	}
+	else if (!attr->typisvarlena)
+		print_literal(s, attr->literal,
+					  OutputFunctionCall(&attr->typoutput, origval));
 	else
 	{
 		/* Definitely detoasted Datum */
 		Datum		val;
 		val = PointerGetDatum(PG_DETOAST_DATUM(origval));
-		print_literal(s, typid, OidOutputFunctionCall(typoutput, val));
+		print_literal(s, attr->literal,
+					  OutputFunctionCall(&attr->typoutput, val));
 	}
 }
 
@@ -310,19 +1127,20 @@ print_value(StringInfo s, Datum origval, Oid typid, bool isnull)
 static void
 print_where_clause_item(StringInfo s,
 						Relation relation,
+						DecoderRawRelEntry *entry,
 						HeapTuple tuple,
 						int natt,
 						bool *first_column)
 {
-	Form_pg_attribute	attr;
+	DecoderRawAttr	   *attr;
 	Datum				origval;
 	bool				isnull;
 	TupleDesc			tupdesc = RelationGetDescr(relation);
 
-	attr = TupleDescAttr(tupdesc, natt - 1);
+	attr = &entry->attrs[natt - 1];
 
 	/* Skip dropped columns and system columns */
-	if (attr->attisdropped || attr->attnum < 0)
+	if (attr->skip)
 		return;
 
 	/* Skip comma for first colums */
@@ -332,13 +1150,13 @@ print_where_clause_item(StringInfo s,
 		*first_column = false;
 
 	/* Print attribute name */
-	appendStringInfo(s, "%s = ", quote_identifier(NameStr(attr->attname)));
+	appendStringInfo(s, "%s = ", attr->quoted_name);
 
 	/* Get Datum from tuple */
 	origval = heap_getattr(tuple, natt, tupdesc, &isnull);
 
 	/* Get output function */
-	print_value(s, origval, attr->atttypid, isnull);
+	print_value(s, attr, origval, isnull);
 }
 
 /*
@@ -347,119 +1165,164 @@ print_where_clause_item(StringInfo s,
 static void
 print_where_clause(StringInfo s,
 				   Relation relation,
+				   DecoderRawRelEntry *entry,
 				   HeapTuple oldtuple,
 				   HeapTuple newtuple)
 {
-	TupleDesc		tupdesc = RelationGetDescr(relation);
-	int				natt;
+	int				key;
 	bool			first_column = true;
 
 	Assert(relation->rd_rel->relreplident == REPLICA_IDENTITY_DEFAULT ||
 		   relation->rd_rel->relreplident == REPLICA_IDENTITY_FULL ||
 		   relation->rd_rel->relreplident == REPLICA_IDENTITY_INDEX);
 
+	/* We need absolutely some values for tuple selectivity with FULL */
+	Assert(oldtuple != NULL ||
+		   relation->rd_rel->relreplident != REPLICA_IDENTITY_FULL);
+
 	/* Build the WHERE clause */
 	appendStringInfoString(s, " WHERE ");
 
-	RelationGetIndexList(relation);
-	/* Generate WHERE clause using new values of REPLICA IDENTITY */
-	if (OidIsValid(relation->rd_replidindex))
+	/*
+	 * Generate WHERE clause using the values of REPLICA IDENTITY, which are
+	 * either the columns of the index or all of them for FULL.
+	 */
+	for (key = 0; key < entry->nkeyatts; key++)
 	{
-		Relation    indexRel;
-		int			key;
+		/*
+		 * For a relation having REPLICA IDENTITY set at DEFAULT
+		 * or INDEX, if one of the columns used for tuple selectivity
+		 * is changed, the old tuple data is not NULL and need to
+		 * be used for tuple selectivity. If no such columns are
+		 * updated, old tuple data is NULL.
+		 */
+		print_where_clause_item(s, relation, entry,
+								oldtuple ? oldtuple : newtuple,
+								entry->keyatts[key], &first_column);
+	}
+}
 
-		/* Use all the values associated with the index */
-		indexRel = index_open(relation->rd_replidindex, AccessShareLock);
-		for (key = 0; key < indexRel->rd_index->indnatts; key++)
-		{
-			int	relattr = indexRel->rd_index->indkey.values[key];
+/*
+ * Print the header of an INSERT query, up to its VALUES keyword.
+ */
+static void
+print_insert_header(StringInfo s,
+					DecoderRawRelEntry *entry)
+{
+	int				natt;
+	bool			first_column = true;
 
-			/*
-			 * For a relation having REPLICA IDENTITY set at DEFAULT
-			 * or INDEX, if one of the columns used for tuple selectivity
-			 * is changed, the old tuple data is not NULL and need to
-			 * be used for tuple selectivity. If no such columns are
-			 * updated, old tuple data is NULL.
-			 */
-			print_where_clause_item(s, relation,
-									oldtuple ? oldtuple : newtuple,
-									relattr, &first_column);
-		}
-		index_close(indexRel, NoLock);
-		return;
-	}
+	/* Query header */
+	appendStringInfo(s, "INSERT INTO ");
+	appendStringInfoString(s, entry->relname);
+	appendStringInfo(s, " (");
 
-	/* We need absolutely some values for tuple selectivity now */
-	Assert(oldtuple != NULL &&
-		   relation->rd_rel->relreplident == REPLICA_IDENTITY_FULL);
+	/* Build column names */
+	for (natt = 0; natt < entry->natts; natt++)
+	{
+		DecoderRawAttr	   *attr = &entry->attrs[natt];
 
-	/*
-	 * Fallback to default case, use of old values and print WHERE clause
-	 * using all the columns. This is actually the code path for FULL.
-	 */
-	for (natt = 0; natt < tupdesc->natts; natt++)
-		print_where_clause_item(s, relation, oldtuple,
-								natt + 1, &first_column);
+		/* Skip dropped columns and system columns */
+		if (attr->skip)
+			continue;
+
+		/* Skip comma for first colums */
+		if (!first_column)
+			appendStringInfoString(s, ", ");
+		else
+			first_column = false;
+
+		/* Print attribute name */
+		appendStringInfoString(s, attr->quoted_name);
+	}
+
+	appendStringInfo(s, ") VALUES ");
 }
 
 /*
- * Decode an INSERT entry
+ * Print the list of values of an INSERT query for a tuple.
  */
 static void
-decoder_raw_insert(StringInfo s,
-				   Relation relation,
-				   HeapTuple tuple)
+print_insert_values(StringInfo s,
+					Relation relation,
+					DecoderRawRelEntry *entry,
+					HeapTuple tuple)
 {
 	TupleDesc		tupdesc = RelationGetDescr(relation);
 	int				natt;
 	bool			first_column = true;
-	StringInfo		values = makeStringInfo();
 
-	/* Initialize string info for values */
-	initStringInfo(values);
+	appendStringInfoChar(s, '(');
 
-	/* Query header */
-	appendStringInfo(s, "INSERT INTO ");
-	print_relname(s, relation);
-	appendStringInfo(s, " (");
-
-	/* Build column names and values */
+	/* Build values */
 	for (natt = 0; natt < tupdesc->natts; natt++)
 	{
-		Form_pg_attribute	attr;
+		DecoderRawAttr	   *attr;
 		Datum				origval;
 		bool				isnull;
 
-		attr = TupleDescAttr(tupdesc, natt);
+		attr = &entry->attrs[natt];
 
 		/* Skip dropped columns and system columns */
-		if (attr->attisdropped || attr->attnum < 0)
+		if (attr->skip)
 			continue;
 
 		/* Skip comma for first colums */
 		if (!first_column)
-		{
 			appendStringInfoString(s, ", ");
-			appendStringInfoString(values, ", ");
-		}
 		else
 			first_column = false;
 
-		/* Print attribute name */
-		appendStringInfo(s, "%s", quote_identifier(NameStr(attr->attname)));
-
 		/* Get Datum from tuple */
 		origval = heap_getattr(tuple, natt + 1, tupdesc, &isnull);
 
 		/* Get output function */
-		print_value(values, origval, attr->atttypid, isnull);
+		print_value(s, attr, origval, isnull);
+	}
+
+	appendStringInfoChar(s, ')');
+}
+
+/*
+ * Decode an INSERT entry
+ */
+static void
+decoder_raw_insert(StringInfo s,
+				   Relation relation,
+				   DecoderRawRelEntry *entry,
+				   HeapTuple tuple)
+{
+	print_insert_header(s, entry);
+	print_insert_values(s, relation, entry, tuple);
+	appendStringInfoString(s, ";");
+}
+
+/*
+ * Add an INSERT entry to the pending multi-row INSERT query, which is
+ * flushed once it is large enough.
+ */
+static void
+decoder_raw_insert_batch(LogicalDecodingContext *ctx,
+						 DecoderRawData *data,
+						 Relation relation,
+						 DecoderRawRelEntry *entry,
+						 HeapTuple tuple)
+{
+	if (data->batch_rows == 0)
+	{
+		print_insert_header(&data->batch, entry);
+		data->batch_relid = entry->relid;
+		data->batch_generation = entry->generation;
 	}
+	else
+		appendStringInfoString(&data->batch, ", ");
 
-	/* Append values  */
-	appendStringInfo(s, ") VALUES (%s);", values->data);
+	print_insert_values(&data->batch, relation, entry, tuple);
+	data->batch_rows++;
 
-	/* Clean up */
-	resetStringInfo(values);
+	if (data->batch_rows >= data->batch_max_rows ||
+		data->batch.len >= data->batch_max_bytes)
+		flush_batch(ctx, data);
 }
 
 /*
@@ -468,17 +1331,18 @@ decoder_raw_insert(StringInfo s,
 static void
 decoder_raw_delete(StringInfo s,
 				   Relation relation,
+				   DecoderRawRelEntry *entry,
 				   HeapTuple tuple)
 {
 	appendStringInfo(s, "DELETE FROM ");
-	print_relname(s, relation);
+	appendStringInfoString(s, entry->relname);
 
 	/*
 	 * Here the same tuple is used as old and new values, selectivity will
 	 * be properly reduced by relation uses DEFAULT or INDEX as REPLICA
 	 * IDENTITY.
 	 */
-	print_where_clause(s, relation, tuple, tuple);
+	print_where_clause(s, relation, entry, tuple, tuple);
 	appendStringInfoString(s, ";");
 }
 
@@ -489,6 +1353,7 @@ decoder_raw_delete(StringInfo s,
 static void
 decoder_raw_update(StringInfo s,
 				   Relation relation,
+				   DecoderRawRelEntry *entry,
 				   HeapTuple oldtuple,
 				   HeapTuple newtuple)
 {
@@ -501,36 +1366,30 @@ decoder_raw_update(StringInfo s,
 		return;
 
 	appendStringInfo(s, "UPDATE ");
-	print_relname(s, relation);
+	appendStringInfoString(s, entry->relname);
 
 	/* Build the SET clause with the new values */
 	appendStringInfo(s, " SET ");
 	for (natt = 0; natt < tupdesc->natts; natt++)
 	{
-		Form_pg_attribute	attr;
+		DecoderRawAttr	   *attr;
 		Datum				origval;
 		bool				isnull;
-		Oid					typoutput;
-		bool				typisvarlena;
 
-		attr = TupleDescAttr(tupdesc, natt);
+		attr = &entry->attrs[natt];
 
 		/* Skip dropped columns and system columns */
-		if (attr->attisdropped || attr->attnum < 0)
+		if (attr->skip)
 			continue;
 
 		/* Get Datum from tuple */
 		origval = heap_getattr(newtuple, natt + 1, tupdesc, &isnull);
 
-		/* Get output type so we can know if it's varlena */
-		getTypeOutputInfo(attr->atttypid,
-						  &typoutput, &typisvarlena);
-
 		/*
 		 * TOASTed datum, but it is not changed so it can be skipped this in
 		 * the SET clause of this UPDATE query.
 		 */
-		if (!isnull && typisvarlena && VARATT_IS_EXTERNAL_ONDISK(origval))
+		if (!isnull && attr->typisvarlena && VARATT_IS_EXTERNAL_ONDISK(origval))
 			continue;
 
 		/* Skip comma for first colums */
@@ -542,18 +1401,211 @@ decoder_raw_update(StringInfo s,
 			first_column = false;
 
 		/* Print attribute name */
-		appendStringInfo(s, "%s = ", quote_identifier(NameStr(attr->attname)));
+		appendStringInfo(s, "%s = ", attr->quoted_name);
 
 		/* Get output function */
-		print_value(s, origval, attr->atttypid, isnull);
+		print_value(s, attr, origval, isnull);
 	}
 
 	/* Print WHERE clause */
-	print_where_clause(s, relation, oldtuple, newtuple);
+	print_where_clause(s, relation, entry, oldtuple, newtuple);
 
 	appendStringInfoString(s, ";");
 }
 
+/*
+ * Write a RELATION message of the binary output format.
+ */
+static void
+write_relation_message(StringInfo s, DecoderRawRelEntry *entry)
+{
+	int				natt;
+	int				ncols = 0;
+
+	pq_sendbyte(s, DECODER_RAW_BINARY_RELATION);
+	pq_sendint32(s, entry->relid);
+	pq_sendstring(s, entry->nspname);
+	pq_sendstring(s, entry->name);
+	pq_sendbyte(s, entry->replident);
+
+	for (natt = 0; natt < entry->natts; natt++)
+	{
+		if (!entry->attrs[natt].skip)
+			ncols++;
+	}
+	pq_sendint16(s, ncols);
+
+	for (natt = 0; natt < entry->natts; natt++)
+	{
+		DecoderRawAttr *attr = &entry->attrs[natt];
+
+		if (attr->skip)
+			continue;
+
+		pq_sendbyte(s, attr->iskey ? DECODER_RAW_BINARY_COLUMN_KEY : 0);
+		pq_sendstring(s, attr->name);
+		pq_sendint32(s, attr->typid);
+		pq_sendint32(s, attr->typmod);
+	}
+}
+
+/*
+ * Write a tuple of the binary output format, with all its columns or
+ * only its key columns.
+ */
+static void
+write_tuple(StringInfo s,
+			Relation relation,
+			DecoderRawRelEntry *entry,
+			HeapTuple tuple,
+			bool key_only)
+{
+	TupleDesc		tupdesc = RelationGetDescr(relation);
+	Datum		   *values;
+	bool		   *isnull;
+	bits8		   *nullbits;
+	bits8		   *toastbits;
+	int				nbytes;
+	int				natt;
+	int				ncols = 0;
+
+	/* Deform the tuple once for all the columns */
+	values = (Datum *) palloc(sizeof(Datum) * tupdesc->natts);
+	isnull = (bool *) palloc(sizeof(bool) * tupdesc->natts);
+	heap_deform_tuple(tuple, tupdesc, values, isnull);
+
+	/* Build the bitmaps */
+	nbytes = BITMAPLEN(tupdesc->natts);
+	nullbits = (bits8 *) palloc0(nbytes);
+	toastbits = (bits8 *) palloc0(nbytes);
+	for (natt = 0; natt < tupdesc->natts; natt++)
+	{
+		DecoderRawAttr *attr = &entry->attrs[natt];
+
+		if (attr->skip || (key_only && !attr->iskey))
+			continue;
+
+		if (isnull[natt])
+			nullbits[ncols / 8] |= 1 << (ncols % 8);
+		else if (attr->typisvarlena &&
+				 VARATT_IS_EXTERNAL_ONDISK(values[natt]))
+			toastbits[ncols / 8] |= 1 << (ncols % 8);
+		ncols++;
+	}
+	nbytes = BITMAPLEN(ncols);
+
+	pq_sendbyte(s, key_only ? DECODER_RAW_BINARY_TUPLE_KEY :
+				DECODER_RAW_BINARY_TUPLE_NEW);
+	pq_sendint16(s, ncols);
+	pq_sendbytes(s, (char *) nullbits, nbytes);
+	pq_sendbytes(s, (char *) toastbits, nbytes);
+
+	/* And the column values */
+	for (natt = 0; natt < tupdesc->natts; natt++)
+	{
+		DecoderRawAttr *attr = &entry->attrs[natt];
+		Datum			val;
+		bytea		   *outputbytes;
+
+		if (attr->skip || (key_only && !attr->iskey))
+			continue;
+
+		if (isnull[natt])
+			continue;
+
+		val = values[natt];
+		if (attr->typisvarlena)
+		{
+			/* Unchanged TOAST datum, marked in its bitmap */
+			if (VARATT_IS_EXTERNAL_ONDISK(val))
+				continue;
+
+			/* Definitely detoasted Datum */
+			val = PointerGetDatum(PG_DETOAST_DATUM(val));
+		}
+
+		outputbytes = SendFunctionCall(&attr->typsend, val);
+		pq_sendint32(s, VARSIZE(outputbytes) - VARHDRSZ);
+		pq_sendbytes(s, VARDATA(outputbytes),
+					 VARSIZE(outputbytes) - VARHDRSZ);
+	}
+}
+
+/*
+ * Decode a change with the binary output format.
+ */
+static void
+decoder_raw_change_binary(LogicalDecodingContext *ctx,
+						  Relation relation,
+						  DecoderRawRelEntry *entry,
+						  ReorderBufferChange *change)
+{
+	HeapTuple	oldtuple = change->data.tp.oldtuple != NULL ?
+		&change->data.tp.oldtuple->tuple : NULL;
+	HeapTuple	newtuple = change->data.tp.newtuple != NULL ?
+		&change->data.tp.newtuple->tuple : NULL;
+
+	/* Filter out changes that cannot be applied, as for textual output */
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			if (newtuple == NULL)
+				return;
+			break;
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			if (!entry->is_selective || newtuple == NULL)
+				return;
+			break;
+		case REORDER_BUFFER_CHANGE_DELETE:
+			if (!entry->is_selective || oldtuple == NULL)
+				return;
+			break;
+		default:
+			/* Should not come here */
+			Assert(0);
+			return;
+	}
+
+	/* Schema of relation is sent first if the receiver does not know it */
+	if (!entry->schema_sent)
+	{
+		OutputPluginPrepareWrite(ctx, false);
+		write_relation_message(ctx->out, entry);
+		OutputPluginWrite(ctx, false);
+		entry->schema_sent = true;
+	}
+
+	OutputPluginPrepareWrite(ctx, true);
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			pq_sendbyte(ctx->out, DECODER_RAW_BINARY_INSERT);
+			pq_sendint32(ctx->out, entry->relid);
+			write_tuple(ctx->out, relation, entry, newtuple, false);
+			break;
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			/*
+			 * Old tuple is available only if one of the key columns has been
+			 * changed, or for FULL. The new tuple has the key otherwise.
+			 */
+			pq_sendbyte(ctx->out, DECODER_RAW_BINARY_UPDATE);
+			pq_sendint32(ctx->out, entry->relid);
+			write_tuple(ctx->out, relation, entry,
+						oldtuple ? oldtuple : newtuple, true);
+			write_tuple(ctx->out, relation, entry, newtuple, false);
+			break;
+		case REORDER_BUFFER_CHANGE_DELETE:
+			pq_sendbyte(ctx->out, DECODER_RAW_BINARY_DELETE);
+			pq_sendint32(ctx->out, entry->relid);
+			write_tuple(ctx->out, relation, entry, oldtuple, true);
+			break;
+		default:
+			Assert(0);
+			break;
+	}
+	OutputPluginWrite(ctx, true);
+}
+
 /*
  * Callback for individual changed tuples
  */
@@ -562,41 +1614,60 @@ decoder_raw_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 				 Relation relation, ReorderBufferChange *change)
 {
 	DecoderRawData *data;
+	DecoderRawRelEntry *entry;
 	MemoryContext	old;
-	char			replident = relation->rd_rel->relreplident;
-	bool			is_rel_non_selective;
 
 	data = ctx->output_plugin_private;
 
+	/* Fetch the cached output data of this relation */
+	entry = get_relentry(data, relation);
+
+	/* Skip filtered relations before doing any work on the tuple */
+	if (entry->filtered)
+		return;
+
 	/* Avoid leaking memory by using and resetting our own context */
 	old = MemoryContextSwitchTo(data->context);
 
+	if (data->binary_output)
+	{
+		decoder_raw_change_binary(ctx, relation, entry, change);
+		MemoryContextSwitchTo(old);
+		MemoryContextReset(data->context);
+		return;
+	}
+
 	/*
-	 * Determine if relation is selective enough for WHERE clause generation
-	 * in UPDATE and DELETE cases. A non-selective relation uses REPLICA
-	 * IDENTITY set as NOTHING, or DEFAULT without an available replica
-	 * identity index.
+	 * Pending rows are sent before anything else than an INSERT on the same
+	 * relation, whose definition has not changed since the batch began.
 	 */
-	RelationGetIndexList(relation);
-	is_rel_non_selective = (replident == REPLICA_IDENTITY_NOTHING ||
-							(replident == REPLICA_IDENTITY_DEFAULT &&
-							 !OidIsValid(relation->rd_replidindex)));
+	if (data->batch_rows > 0 &&
+		(change->action != REORDER_BUFFER_CHANGE_INSERT ||
+		 data->batch_relid != entry->relid ||
+		 data->batch_generation != entry->generation))
+		flush_batch(ctx, data);
 
 	/* Decode entry depending on its type */
 	switch (change->action)
 	{
 		case REORDER_BUFFER_CHANGE_INSERT:
-			if (change->data.tp.newtuple != NULL)
+			if (change->data.tp.newtuple != NULL && data->batch_inserts)
+				decoder_raw_insert_batch(ctx, data,
+										 relation,
+										 entry,
+										 &change->data.tp.newtuple->tuple);
+			else if (change->data.tp.newtuple != NULL)
 			{
 				OutputPluginPrepareWrite(ctx, true);
 				decoder_raw_insert(ctx->out,
 								   relation,
+								   entry,
 								   &change->data.tp.newtuple->tuple);
 				OutputPluginWrite(ctx, true);
 			}
 			break;
 		case REORDER_BUFFER_CHANGE_UPDATE:
-			if (!is_rel_non_selective)
+			if (entry->is_selective)
 			{
 				HeapTuple oldtuple = change->data.tp.oldtuple != NULL ?
 					&change->data.tp.oldtuple->tuple : NULL;
@@ -606,17 +1677,19 @@ decoder_raw_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 				OutputPluginPrepareWrite(ctx, true);
 				decoder_raw_update(ctx->out,
 								   relation,
+								   entry,
 								   oldtuple,
 								   newtuple);
 				OutputPluginWrite(ctx, true);
 			}
 			break;
 		case REORDER_BUFFER_CHANGE_DELETE:
-			if (!is_rel_non_selective)
+			if (entry->is_selective)
 			{
 				OutputPluginPrepareWrite(ctx, true);
 				decoder_raw_delete(ctx->out,
 								   relation,
+								   entry,
 								   &change->data.tp.oldtuple->tuple);
 				OutputPluginWrite(ctx, true);
 			}
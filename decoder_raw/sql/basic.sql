@@ -124,5 +124,80 @@ UPDATE tt SET t=t WHERE a=2;
 SELECT substr(data, 1, 50), substr(data, 3000, 45)
   FROM pg_logical_slot_get_changes('custom_slot', NULL, NULL, 'include_transaction', 'off');
 DROP TABLE tt;
+-- Common types printed without their output function
+CREATE TABLE aa (a int2, b int4, c int8, d oid, e float8, f timestamp,
+  g timestamptz, h uuid, i text, j varchar, k char(4));
+INSERT INTO aa VALUES (-32768, 2147483647, -9223372036854775808, 4294967295,
+  1.5, '2018-01-01 10:00:00.123456', '2018-01-01 10:00:00+00',
+  'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11', 'it''s \ ok', 'a''''b', 'ab');
+INSERT INTO aa VALUES (0, 0, 0, 0, 0.1, 'infinity', '-infinity',
+  '00000000-0000-0000-0000-000000000000', '', '''', 'abcd');
+SELECT data FROM pg_logical_slot_get_changes('custom_slot', NULL, NULL, 'include_transaction', 'off');
+DROP TABLE aa;
+-- Filtering of relations and columns
+CREATE TABLE aa (a int primary key, b text, c int);
+CREATE TABLE bb (a int primary key);
+CREATE TABLE cc (a int);
+INSERT INTO aa VALUES (1, 'aa', 1);
+INSERT INTO bb VALUES (1);
+INSERT INTO cc VALUES (1);
+UPDATE aa SET c = 2 WHERE a = 1;
+SELECT data FROM pg_logical_slot_peek_changes('custom_slot', NULL, NULL,
+  'include_transaction', 'off', 'include_tables', 'public.a*, public.bb',
+  'exclude_tables', 'public.bb', 'columns', 'public.aa:b');
+SELECT data FROM pg_logical_slot_get_changes('custom_slot', NULL, NULL,
+  'include_transaction', 'off', 'exclude_tables', 'public.aa');
+-- Filtering of changes replayed from other origins
+SELECT pg_replication_origin_create('decoder_raw_origin');
+SELECT pg_replication_origin_session_setup('decoder_raw_origin');
+INSERT INTO cc VALUES (2);
+SELECT pg_replication_origin_session_reset();
+INSERT INTO cc VALUES (3);
+SELECT data FROM pg_logical_slot_get_changes('custom_slot', NULL, NULL,
+  'include_transaction', 'off', 'only_local', 'on');
+SELECT pg_replication_origin_drop('decoder_raw_origin');
+DROP TABLE aa;
+DROP TABLE bb;
+DROP TABLE cc;
+-- Relation cache invalidation, with schema changes between changes
+CREATE TABLE aa (a int primary key, b text);
+INSERT INTO aa VALUES (1, 'aa');
+ALTER TABLE aa ADD COLUMN c int;
+INSERT INTO aa VALUES (2, 'bb', 3);
+ALTER TABLE aa RENAME TO bb;
+UPDATE bb SET c = 4 WHERE a = 2;
+ALTER TABLE bb DROP COLUMN b;
+DELETE FROM bb WHERE a = 1;
+SELECT data FROM pg_logical_slot_get_changes('custom_slot', NULL, NULL, 'include_transaction', 'off');
+DROP TABLE bb;
+-- Batching of INSERT queries
+CREATE TABLE aa (a int primary key, b text);
+CREATE TABLE bb (a int);
+-- Multi-row INSERT split into batches
+INSERT INTO aa VALUES (1, 'aa'), (2, 'bb'), (3, 'cc');
+INSERT INTO aa VALUES (4, 'dd');
+-- Batch flushed by a non-INSERT change and a relation switch
+BEGIN;
+INSERT INTO aa VALUES (5, 'ee');
+UPDATE aa SET b = 'ff' WHERE a = 5;
+INSERT INTO aa VALUES (6, 'gg');
+INSERT INTO bb VALUES (1), (2);
+INSERT INTO aa VALUES (7, 'hh');
+COMMIT;
+SELECT data FROM pg_logical_slot_get_changes('custom_slot', NULL, NULL,
+  'include_transaction', 'on', 'batch_inserts', 'on', 'batch_max_rows', '2');
+DROP TABLE aa;
+DROP TABLE bb;
+-- Binary output format, checking the type and length of messages
+CREATE TABLE aa (a int primary key, b text);
+INSERT INTO aa VALUES (1, 'aa');
+UPDATE aa SET b = 'bb' WHERE a = 1;
+-- relation message is sent again after a schema change
+ALTER TABLE aa ADD COLUMN c int;
+DELETE FROM aa WHERE a = 1;
+SELECT chr(get_byte(data, 0)) AS type, length(data) AS length
+  FROM pg_logical_slot_get_binary_changes('custom_slot', NULL, NULL,
+    'include_transaction', 'on', 'output_format', 'binary');
+DROP TABLE aa;
 -- Drop replication slot
 SELECT pg_drop_replication_slot('custom_slot');
@@ -19,7 +19,9 @@
 #include "pgstat.h"
 #include "access/xact.h"
 #include "commands/async.h"
-#include "executor/spi.h"
+#include "commands/dbcommands.h"
+#include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
 #include "postmaster/bgworker.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
@@ -27,7 +29,9 @@
 #include "storage/proc.h"
 #include "storage/shmem.h"
 #include "tcop/utility.h"
-#include "utils/snapmgr.h"
+#include "utils/json.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
 
 PG_MODULE_MAGIC;
 
@@ -77,34 +81,279 @@ hello_notify_sighup(SIGNAL_ARGS)
 }
 
 /*
- * hello_notify_build_query
+ * Query running for longer than the nap time, identified by the PID of
+ * its backend and its start time.
+ */
+typedef struct LongQuery
+{
+	int			pid;
+	TimestampTz query_start;
+	Oid			dbid;
+	Oid			userid;
+	char	   *query;			/* only set for queries found in a scan */
+} LongQuery;
+
+/* Long-running queries already reported, sorted by PID and start time */
+static LongQuery *reported_queries = NULL;
+static int	num_reported_queries = 0;
+
+/*
+ * Comparison function for sorting long-running queries.
+ */
+static int
+long_query_cmp(const void *a, const void *b)
+{
+	const LongQuery *qa = (const LongQuery *) a;
+	const LongQuery *qb = (const LongQuery *) b;
+
+	if (qa->pid != qb->pid)
+		return qa->pid < qb->pid ? -1 : 1;
+	if (qa->query_start != qb->query_start)
+		return qa->query_start < qb->query_start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * hello_notify_scan
  *
- * Build query to send notify request. Buffer used here should be
- * initialized properly before calling this function.
+ * Scan the status of backends directly from shared memory, and return
+ * the queries running for longer than the nap time, sorted by PID and
+ * start time. Their data is copied, as the snapshot of backend status is
+ * released at the end of each transaction.
+ */
+static LongQuery *
+hello_notify_scan(TimestampTz now, int *num_queries)
+{
+	LongQuery  *queries;
+	int			num_backends;
+	int			count = 0;
+	int			i;
+
+	pgstat_clear_snapshot();
+	num_backends = pgstat_fetch_stat_numbackends();
+	queries = palloc(sizeof(LongQuery) * Max(num_backends, 1));
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		PgBackendStatus *beentry = pgstat_fetch_stat_beentry(i);
+		LongQuery  *query;
+		char	   *activity;
+		char	   *start;
+		char	   *end;
+
+		if (beentry == NULL || beentry->st_procpid == 0 ||
+			beentry->st_procpid == MyProcPid ||
+			beentry->st_state != STATE_RUNNING)
+			continue;
+
+		/* Only queries running for longer than the nap time count */
+		if (beentry->st_activity_start_timestamp == 0 ||
+			!TimestampDifferenceExceeds(beentry->st_activity_start_timestamp,
+										now, notify_nap_time * 1000))
+			continue;
+
+		query = &queries[count++];
+		query->pid = beentry->st_procpid;
+		query->query_start = beentry->st_activity_start_timestamp;
+		query->dbid = beentry->st_databaseid;
+		query->userid = beentry->st_userid;
+
+		/* Copy the query string, without spaces around it */
+#if PG_VERSION_NUM >= 110000
+		activity = pgstat_clip_activity(beentry->st_activity_raw);
+#else
+		activity = pstrdup(beentry->st_activity);
+#endif
+		for (start = activity; isspace((unsigned char) *start); start++)
+			;
+		end = start + strlen(start);
+		while (end > start && isspace((unsigned char) end[-1]))
+			*(--end) = '\0';
+		query->query = start;
+	}
+
+	pgstat_clear_snapshot();
+
+	qsort(queries, count, sizeof(LongQuery), long_query_cmp);
+	*num_queries = count;
+	return queries;
+}
+
+/*
+ * hello_notify_append_event
+ *
+ * Append to buf the JSON representation of a long-running query that
+ * has been found or whose run has finished. The query string is cut to
+ * query_len bytes.
  */
 static void
-hello_notify_build_query(StringInfoData *buf)
+hello_notify_append_event(StringInfo buf, LongQuery *query, bool finished,
+						  int query_len)
 {
-	/* Leave if there is nothing here */
-	if (buf == NULL)
-		return;
+	char	   *datname = get_database_name(query->dbid);
+	char	   *usename = GetUserNameFromId(query->userid, true);
+
+	appendStringInfo(buf, "{\"event\":\"%s\",\"pid\":%d,\"database\":",
+					 finished ? "finished" : "started", query->pid);
+	if (datname)
+		escape_json(buf, datname);
+	else
+		appendStringInfoString(buf, "null");
+	appendStringInfoString(buf, ",\"username\":");
+	if (usename)
+		escape_json(buf, usename);
+	else
+		appendStringInfoString(buf, "null");
+	appendStringInfoString(buf, ",\"query_start\":");
+	escape_json(buf, timestamptz_to_str(query->query_start));
+
+	if (!finished)
+	{
+		char	   *text = query->query;
+		int			len = strlen(text);
 
-	/*
-	 * Build query depending on nap time and channel name. A notification
-	 * is only sent to queries running for longer than naptime.
-	 */
-	appendStringInfo(buf, "\
-		SELECT pg_notify('%s', row_to_json(q)::text)\
-		FROM ( \
-			SELECT datname AS database,\
-				usename AS username,\
-				state,\
-				TRIM(query) AS query\
-			FROM pg_stat_activity\
-			WHERE xact_start < NOW() - interval '%d s' AND\
-				state = 'active' AND\
-				pid != pg_backend_pid()\
-		) AS q", notify_channel, notify_nap_time);
+		if (len > query_len)
+		{
+			len = pg_mbcliplen(text, len, query_len);
+			text = pnstrdup(text, len);
+		}
+		appendStringInfoString(buf, ",\"state\":\"active\",\"query\":");
+		escape_json(buf, text);
+	}
+	appendStringInfoChar(buf, '}');
+}
+
+/*
+ * hello_notify_send_events
+ *
+ * Send the events of a cycle as JSON arrays, each one sent in a single
+ * notification whose payload is kept under the size limit of NOTIFY. This
+ * needs to be called in a transaction.
+ */
+static void
+hello_notify_send_events(LongQuery *started, int num_started,
+						 LongQuery *finished, int num_finished)
+{
+	StringInfoData payload;
+	StringInfoData event;
+	int			nevents = 0;
+	int			i;
+
+	initStringInfo(&payload);
+	initStringInfo(&event);
+
+	for (i = 0; i < num_started + num_finished; i++)
+	{
+		bool		is_finished = (i >= num_started);
+		LongQuery  *query = is_finished ?
+			&finished[i - num_started] : &started[i];
+		int			query_len = NOTIFY_PAYLOAD_MAX_LENGTH;
+
+		/*
+		 * Build the event, cutting its query string until it fits in its
+		 * own notification, with the brackets of the array.
+		 */
+		for (;;)
+		{
+			resetStringInfo(&event);
+			hello_notify_append_event(&event, query, is_finished, query_len);
+			if (event.len + 2 < NOTIFY_PAYLOAD_MAX_LENGTH || query_len == 0)
+				break;
+			query_len /= 2;
+		}
+
+		/* Send what has been accumulated if this event does not fit */
+		if (nevents > 0 &&
+			payload.len + event.len + 2 >= NOTIFY_PAYLOAD_MAX_LENGTH)
+		{
+			appendStringInfoChar(&payload, ']');
+			Async_Notify(notify_channel, payload.data);
+			resetStringInfo(&payload);
+			nevents = 0;
+		}
+
+		appendStringInfoChar(&payload, nevents == 0 ? '[' : ',');
+		appendStringInfoString(&payload, event.data);
+		nevents++;
+	}
+
+	if (nevents > 0)
+	{
+		appendStringInfoChar(&payload, ']');
+		Async_Notify(notify_channel, payload.data);
+	}
+
+	pfree(payload.data);
+	pfree(event.data);
+}
+
+/*
+ * hello_notify_process
+ *
+ * Find the long-running queries, and send notifications about the ones
+ * not reported yet and the ones that have finished since the last cycle.
+ * Returns true if notifications have been sent.
+ */
+static bool
+hello_notify_process(void)
+{
+	LongQuery  *queries;
+	int			num_queries;
+	LongQuery  *started;
+	int			num_started = 0;
+	LongQuery  *finished;
+	int			num_finished = 0;
+	int			i = 0;
+	int			j = 0;
+
+	queries = hello_notify_scan(GetCurrentTimestamp(), &num_queries);
+
+	/* Compare with the queries already reported, both lists are sorted */
+	started = palloc(sizeof(LongQuery) * Max(num_queries, 1));
+	finished = palloc(sizeof(LongQuery) * Max(num_reported_queries, 1));
+	while (i < num_queries || j < num_reported_queries)
+	{
+		int			cmp;
+
+		if (i >= num_queries)
+			cmp = 1;
+		else if (j >= num_reported_queries)
+			cmp = -1;
+		else
+			cmp = long_query_cmp(&queries[i], &reported_queries[j]);
+
+		if (cmp < 0)
+			started[num_started++] = queries[i++];
+		else if (cmp > 0)
+			finished[num_finished++] = reported_queries[j++];
+		else
+		{
+			i++;
+			j++;
+		}
+	}
+
+	if (num_started > 0 || num_finished > 0)
+	{
+		StartTransactionCommand();
+		hello_notify_send_events(started, num_started,
+								 finished, num_finished);
+		CommitTransactionCommand();
+	}
+
+	/* Remember the queries reported, without their query strings */
+	if (reported_queries)
+		pfree(reported_queries);
+	reported_queries = MemoryContextAlloc(TopMemoryContext,
+										  sizeof(LongQuery) * Max(num_queries, 1));
+	for (i = 0; i < num_queries; i++)
+	{
+		reported_queries[i] = queries[i];
+		reported_queries[i].query = NULL;
+	}
+	num_reported_queries = num_queries;
+
+	return num_started > 0 || num_finished > 0;
 }
 
 /*
@@ -115,7 +364,7 @@ hello_notify_build_query(StringInfoData *buf)
 void
 hello_notify_main(Datum main_arg)
 {
-	StringInfoData buf;
+	MemoryContext cycle_context;
 
 	/* Register functions for SIGTERM/SIGHUP management */
 	pqsignal(SIGHUP, hello_notify_sighup);
@@ -127,9 +376,9 @@ hello_notify_main(Datum main_arg)
 	/* Connect to database */
 	BackgroundWorkerInitializeConnection(notify_database, NULL);
 
-	/* Build the query string */
-	initStringInfo(&buf);
-	hello_notify_build_query(&buf);
+	cycle_context = AllocSetContextCreate(TopMemoryContext,
+										  "hello_notify cycle",
+										  ALLOCSET_DEFAULT_SIZES);
 
 	elog(LOG, "hello_notify: Started on db %s with interval %d seconds",
 			 notify_database, notify_nap_time);
@@ -137,8 +386,9 @@ hello_notify_main(Datum main_arg)
 	/* Main processing loop */
 	while (!got_sigterm)
 	{
-		int	ret, rc;
+		int	rc;
 		bool process_notifies;
+		MemoryContext oldcontext;
 
 		/* Take a nap... */
 		rc = WaitLatch(&MyProc->procLatch,
@@ -160,9 +410,6 @@ hello_notify_main(Datum main_arg)
 			elog(LOG, "bgworker hello_notify: processing SIGHUP");
 			got_sighup = false;
 			ProcessConfigFile(PGC_SIGHUP);
-
-			/* Rebuild NOTIFY query, perhaps some parameters have changed */
-			hello_notify_build_query(&buf);
 		}
 
 		/*
@@ -176,26 +423,14 @@ hello_notify_main(Datum main_arg)
 			proc_exit(0);
 		}
 
-		/* Update NOW() to return correct timestamp */
-		SetCurrentStatementStartTimestamp();
-
 		/* Show query status in pg_stat_activity */
+		SetCurrentStatementStartTimestamp();
 		pgstat_report_activity(STATE_RUNNING, "hello_notify");
-		StartTransactionCommand();
-		SPI_connect();
-		PushActiveSnapshot(GetTransactionSnapshot());
-
-		/* Execute NOTIFY requests */
-		ret = SPI_execute(buf.data, false, 0);
-		if (ret != SPI_OK_SELECT)
-			elog(FATAL, "hello_notify: SPI_execute failed with error code %d", ret);
-		process_notifies = SPI_processed > 0;
-		elog(LOG, "hello_notify: executed " UINT64_FORMAT, SPI_processed);
-
-		/* Terminate transaction */
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
+
+		oldcontext = MemoryContextSwitchTo(cycle_context);
+		process_notifies = hello_notify_process();
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(cycle_context);
 
 		/*
 		 * Send out notifications. This is mandatory after previous
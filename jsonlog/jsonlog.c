@@ -12,30 +12,171 @@
  *-------------------------------------------------------------------------
  */
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 #include "postgres.h"
 #include "libpq/libpq.h"
 #include "fmgr.h"
 #include "miscadmin.h"
+#include "pgstat.h"
+#include "access/hash.h"
 #include "access/xact.h"
 #include "access/transam.h"
 #include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
 #include "postmaster/syslogger.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
 #include "utils/elog.h"
 #include "utils/guc.h"
 #include "utils/json.h"
+#include "utils/timestamp.h"
 
 /* Allow load of this module in shared libs */
 PG_MODULE_MAGIC;
 
 void _PG_init(void);
 void _PG_fini(void);
+void jsonlog_writer_main(Datum main_arg);
 
-/* Hold previous logging hook */
+/* Hold previous logging hooks */
 static emit_log_hook_type prev_log_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/*
+ * Ring buffer in shared memory. Backends reserve space for a record by
+ * moving reserve_pos forward with a compare-and-swap, copy the record after
+ * its header, and then mark it as ready. The writer process reads ready
+ * records from read_pos, clears the space used and moves read_pos forward.
+ * Positions only increase, and are mapped to the buffer modulo its size.
+ * Records are aligned on 8 bytes, so as their header is never split.
+ */
+typedef struct JsonLogRecord
+{
+	uint32		len;			/* length of record, without header */
+	uint32		ready;			/* set once record is fully copied */
+} JsonLogRecord;
+
+#define JSONLOG_RECORD_HDR		sizeof(JsonLogRecord)
+#define JSONLOG_RECORD_SIZE(len)	TYPEALIGN(8, JSONLOG_RECORD_HDR + (len))
+
+typedef struct JsonLogRing
+{
+	pg_atomic_uint64 reserve_pos;	/* next position to reserve */
+	pg_atomic_uint64 read_pos;		/* next position to read */
+	pg_atomic_uint64 dropped;		/* records dropped */
+	Latch	   *writer_latch;	/* writer latch, NULL if not running */
+	uint64		size;			/* size of data */
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} JsonLogRing;
+
+/* Action when ring buffer is full */
+typedef enum
+{
+	JSONLOG_FULL_DROP,
+	JSONLOG_FULL_FALLBACK
+} JsonLogFullAction;
+
+static const struct config_enum_entry ring_buffer_full_options[] = {
+	{"drop", JSONLOG_FULL_DROP, false},
+	{"fallback", JSONLOG_FULL_FALLBACK, false},
+	{NULL, 0, false}
+};
+
+/* Time between two wakeups of the writer, in ms */
+#define JSONLOG_WRITER_DELAY	200
+
+/* Size of batches written by the writer */
+#define JSONLOG_WRITE_SIZE		(64 * 1024)
+
+static JsonLogRing *jsonlog_ring = NULL;
+static bool am_jsonlog_writer = false;
+
+/* GUC parameters */
+static int	jsonlog_ring_buffer_size = 0;	/* kB, 0 to disable */
+static int	jsonlog_ring_buffer_full = JSONLOG_FULL_FALLBACK;
+static char *jsonlog_directory = NULL;
+static char *jsonlog_filename = NULL;
+static int	jsonlog_rotation_age = 1440;	/* minutes */
+static int	jsonlog_rotation_size = 10240;	/* kB */
+
+/*
+ * Suppression of duplicate records. Records are identified by a hash of
+ * their SQLSTATE, message template and database, mapped to an entry of a
+ * small table local to each process, or shared by all of them. Only the
+ * first records of each entry within a window of time are emitted, and the
+ * first record of the next window counts the records suppressed. Entries
+ * whose window has expired with records suppressed are also looked for at
+ * each record logged, each one being reported in a summary record, so as
+ * the count is not lost if no record of the same kind comes after it. An
+ * entry replaced by a record of another kind is reported the same way.
+ */
+#define JSONLOG_SUPPRESS_ENTRIES	256
+#define JSONLOG_SUPPRESS_MSGLEN		256
+
+typedef struct JsonLogSuppressEntry
+{
+	bool		used;
+	uint32		msghash;		/* hash of message template */
+	int			sqlerrcode;
+	Oid			dbid;
+	int			elevel;
+	TimestampTz window_start;
+	uint32		count;			/* records emitted in window */
+	uint32		suppressed;		/* records suppressed in window */
+	char		message[JSONLOG_SUPPRESS_MSGLEN];	/* first one, clipped */
+} JsonLogSuppressEntry;
+
+typedef struct JsonLogSuppressShared
+{
+	slock_t		mutex;
+	JsonLogSuppressEntry entries[JSONLOG_SUPPRESS_ENTRIES];
+} JsonLogSuppressShared;
+
+/* Limit of records per window for a severity or a SQLSTATE */
+typedef struct JsonLogSuppressLimit
+{
+	int			elevel;			/* 0 if SQLSTATE */
+	int			sqlerrcode;
+	int			limit;
+} JsonLogSuppressLimit;
+
+typedef struct JsonLogSuppressLimits
+{
+	int			nlimits;
+	JsonLogSuppressLimit limits[FLEXIBLE_ARRAY_MEMBER];
+} JsonLogSuppressLimits;
+
+static JsonLogSuppressEntry suppress_local[JSONLOG_SUPPRESS_ENTRIES];
+static JsonLogSuppressShared *suppress_shared = NULL;
+static JsonLogSuppressEntry suppress_expired[JSONLOG_SUPPRESS_ENTRIES];
+static JsonLogSuppressEntry suppress_evicted;
+
+static int	jsonlog_suppress_window = 0;	/* ms, 0 to disable */
+static int	jsonlog_suppress_burst = 10;
+static char *jsonlog_suppress_limits = NULL;
+static JsonLogSuppressLimits *suppress_limits = NULL;
+static bool jsonlog_suppress_shared = false;
+static TimestampTz suppress_last_sweep = 0;
+
+/* Writer state */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+static int	writer_fd = -1;
+static pg_time_t writer_next_rotation = 0;
+static uint64 writer_file_size = 0;
+static uint64 writer_dropped = 0;
 
 /*
  * Track if redirection to syslogger can happen. This uses the same method
@@ -44,9 +185,27 @@ static emit_log_hook_type prev_log_hook = NULL;
  */
 extern bool redirection_done;
 
-/* Log timestamp */
+/*
+ * Log timestamp, whose parts before and after the milliseconds are cached
+ * for the current second, already escaped.
+ */
 #define LOG_TIMESTAMP_LEN 128
-static char log_time[LOG_TIMESTAMP_LEN];
+static pg_time_t log_time_sec = -1;
+static pg_tz *log_time_tz = NULL;
+static char log_time_prefix[LOG_TIMESTAMP_LEN];
+static char log_time_suffix[LOG_TIMESTAMP_LEN];
+
+/*
+ * Fields of the session, already escaped, which are the same for all the
+ * records of a process once it is connected. The cache is built again if
+ * the process or the fields available change, and the application name is
+ * cached separately as it can be changed at any time.
+ */
+static StringInfoData session_prefix = {NULL, 0, 0, 0};
+static int	session_prefix_pid = 0;
+static int	session_prefix_fields = 0;
+static char *session_appname = NULL;
+static StringInfoData session_appname_json = {NULL, 0, 0, 0};
 
 static const char *error_severity(int elevel);
 static void write_jsonlog(ErrorData *edata);
@@ -152,59 +311,819 @@ write_console(char *data, int len)
 	(void) rc;
 }
 
+/*
+ * append_json_string
+ * Append to given StringInfo a string escaped as JSON, with its quotes.
+ * Characters not needing any escaping are copied by runs, and the escaping
+ * is the same as escape_json().
+ */
+static void
+append_json_string(StringInfo buf, const char *str)
+{
+	const char *run = str;
+	const char *p;
+
+	appendStringInfoCharMacro(buf, '"');
+	for (p = str; *p; p++)
+	{
+		unsigned char c = (unsigned char) *p;
+
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		/* Flush the run of characters before this one */
+		if (p > run)
+			appendBinaryStringInfo(buf, run, p - run);
+		run = p + 1;
+
+		switch (c)
+		{
+			case '\b':
+				appendStringInfoString(buf, "\\b");
+				break;
+			case '\f':
+				appendStringInfoString(buf, "\\f");
+				break;
+			case '\n':
+				appendStringInfoString(buf, "\\n");
+				break;
+			case '\r':
+				appendStringInfoString(buf, "\\r");
+				break;
+			case '\t':
+				appendStringInfoString(buf, "\\t");
+				break;
+			case '"':
+				appendStringInfoString(buf, "\\\"");
+				break;
+			case '\\':
+				appendStringInfoString(buf, "\\\\");
+				break;
+			default:
+				appendStringInfo(buf, "\\u%04x", c);
+				break;
+		}
+	}
+	if (p > run)
+		appendBinaryStringInfo(buf, run, p - run);
+	appendStringInfoCharMacro(buf, '"');
+}
+
+/*
+ * append_json_field
+ * Append to given StringInfo a JSON field with a given key, which needs
+ * no escaping, and a value not yet made literal.
+ */
+static void
+append_json_field(StringInfo buf, const char *key, const char *value,
+				  bool is_comma)
+{
+	Assert(key && value);
+
+	appendStringInfoCharMacro(buf, '"');
+	appendStringInfoString(buf, key);
+	appendBinaryStringInfo(buf, "\":", 2);
+	append_json_string(buf, value);
+
+	/* Add comma if necessary */
+	if (is_comma)
+		appendStringInfoCharMacro(buf, ',');
+}
+
+/*
+ * append_json_escaped
+ * Append to given StringInfo a JSON field whose value is already escaped.
+ */
 static void
-setup_formatted_log_time(void)
+append_json_escaped(StringInfo buf, const char *key, const char *json,
+					int len)
+{
+	appendStringInfoCharMacro(buf, '"');
+	appendStringInfoString(buf, key);
+	appendBinaryStringInfo(buf, "\":", 2);
+	appendBinaryStringInfo(buf, json, len);
+	appendStringInfoCharMacro(buf, ',');
+}
+
+/*
+ * append_log_time
+ * Append the timestamp field of a record, with the current time. The
+ * formatting of the current second is cached.
+ */
+static void
+append_log_time(StringInfo buf)
 {
 	struct timeval tv;
-	pg_time_t   stamp_time;
 	char		msbuf[8];
 
 	gettimeofday(&tv, NULL);
-	stamp_time = (pg_time_t) tv.tv_sec;
 
-	/*
-	 * Note: we expect that guc.c will ensure that log_timezone is set up (at
-	 * least with a minimal GMT value) before Log_line_prefix can become
-	 * nonempty or CSV mode can be selected.
-	 */
-	pg_strftime(log_time, LOG_TIMESTAMP_LEN,
-				/* leave room for milliseconds... */
-				"%Y-%m-%d %H:%M:%S	 %Z",
-				pg_localtime(&stamp_time, log_timezone));
+	if ((pg_time_t) tv.tv_sec != log_time_sec || log_timezone != log_time_tz)
+	{
+		pg_time_t	stamp_time = (pg_time_t) tv.tv_sec;
+		struct pg_tm *tm;
+		char		formatted[LOG_TIMESTAMP_LEN];
+		StringInfoData escaped;
+
+		/*
+		 * Note: we expect that guc.c will ensure that log_timezone is set
+		 * up (at least with a minimal GMT value) before any record can be
+		 * generated.
+		 */
+		tm = pg_localtime(&stamp_time, log_timezone);
+		pg_strftime(log_time_prefix, LOG_TIMESTAMP_LEN,
+					"%Y-%m-%d %H:%M:%S", tm);
 
-	/* 'paste' milliseconds into place... */
-	sprintf(msbuf, ".%03d", (int) (tv.tv_usec / 1000));
-	strncpy(log_time + 19, msbuf, 4);
+		/* Time zone abbreviation, escaped with its closing quote */
+		pg_strftime(formatted, LOG_TIMESTAMP_LEN, " %Z", tm);
+		initStringInfo(&escaped);
+		append_json_string(&escaped, formatted);
+		strlcpy(log_time_suffix, escaped.data + 1, LOG_TIMESTAMP_LEN);
+		pfree(escaped.data);
+
+		log_time_sec = stamp_time;
+		log_time_tz = log_timezone;
+	}
+
+	snprintf(msbuf, sizeof(msbuf), ".%03d", (int) (tv.tv_usec / 1000));
+	appendStringInfoString(buf, "\"timestamp\":\"");
+	appendStringInfoString(buf, log_time_prefix);
+	appendStringInfoString(buf, msbuf);
+	appendStringInfoString(buf, log_time_suffix);
+	appendStringInfoCharMacro(buf, ',');
 }
 
 /*
- * appendJSONLiteral
- * Append to given StringInfo a JSON with a given key and a value
- * not yet made literal.
+ * append_session_prefix
+ * Append the fields of the session, building them if necessary.
  */
 static void
-appendJSONLiteral(StringInfo buf, char *key, char *value, bool is_comma)
+append_session_prefix(StringInfo buf)
 {
-	StringInfoData literal_json;
+	int			fields = 0;
 
-	initStringInfo(&literal_json);
-	Assert(key && value);
+	/* Check which fields are available */
+	if (MyProcPort && MyProcPort->user_name)
+		fields |= 0x01;
+	if (MyProcPort && MyProcPort->database_name)
+		fields |= 0x02;
+	if (MyProcPort && MyProcPort->remote_host)
+		fields |= 0x04;
+	if (MyProcPort && MyProcPort->remote_port &&
+		MyProcPort->remote_port[0] != '\0')
+		fields |= 0x08;
 
-	/*
-	 * Call in-core function able to generate wanted strings, there is
-	 * no need to reinvent the wheel.
-	 */
-	escape_json(&literal_json, value);
+	if (session_prefix.data == NULL ||
+		session_prefix_pid != MyProcPid ||
+		session_prefix_fields != fields)
+	{
+		MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
 
-	/* Now append the field */
-	appendStringInfo(buf, "\"%s\":%s", key, literal_json.data);
+		if (session_prefix.data == NULL)
+			initStringInfo(&session_prefix);
+		else
+			resetStringInfo(&session_prefix);
+		MemoryContextSwitchTo(old);
 
-	/* Add comma if necessary */
-	if (is_comma)
-		appendStringInfoChar(buf, ',');
+		/* Username */
+		if ((fields & 0x01) != 0)
+			append_json_field(&session_prefix, "user",
+							  MyProcPort->user_name, true);
+
+		/* Database name */
+		if ((fields & 0x02) != 0)
+			append_json_field(&session_prefix, "dbname",
+							  MyProcPort->database_name, true);
+
+		/* Process ID */
+		if (MyProcPid != 0)
+			appendStringInfo(&session_prefix, "\"pid\":%d,", MyProcPid);
+
+		/* Remote host and port */
+		if ((fields & 0x04) != 0)
+		{
+			append_json_field(&session_prefix, "remote_host",
+							  MyProcPort->remote_host, true);
+			if ((fields & 0x08) != 0)
+				append_json_field(&session_prefix, "remote_port",
+								  MyProcPort->remote_port, true);
+		}
+
+		/* Session id */
+		if (MyProcPid != 0)
+			appendStringInfo(&session_prefix, "\"session_id\":\"%lx.%x\",",
+							 (long) MyStartTime, MyProcPid);
+
+		session_prefix_pid = MyProcPid;
+		session_prefix_fields = fields;
+	}
+
+	appendBinaryStringInfo(buf, session_prefix.data, session_prefix.len);
+}
+
+/*
+ * append_application_name
+ * Append the application name, escaping it only when it changes.
+ */
+static void
+append_application_name(StringInfo buf)
+{
+	if (application_name == NULL || application_name[0] == '\0')
+		return;
+
+	if (session_appname == NULL ||
+		strcmp(session_appname, application_name) != 0)
+	{
+		MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
+
+		if (session_appname != NULL)
+			pfree(session_appname);
+		session_appname = pstrdup(application_name);
+		if (session_appname_json.data == NULL)
+			initStringInfo(&session_appname_json);
+		else
+			resetStringInfo(&session_appname_json);
+		append_json_string(&session_appname_json, session_appname);
+		MemoryContextSwitchTo(old);
+	}
+
+	append_json_escaped(buf, "application_name", session_appname_json.data,
+						session_appname_json.len);
+}
+
+/*
+ * jsonlog_shmem_size
+ * Size of shared memory used by the ring buffer.
+ */
+static Size
+jsonlog_shmem_size(void)
+{
+	return add_size(offsetof(JsonLogRing, data),
+					mul_size(jsonlog_ring_buffer_size, 1024));
+}
+
+/*
+ * jsonlog_suppress_shmem_size
+ * Size of shared memory used by the table of duplicate records.
+ */
+static Size
+jsonlog_suppress_shmem_size(void)
+{
+	return sizeof(JsonLogSuppressShared);
+}
+
+/*
+ * jsonlog_shmem_startup
+ * Allocate or attach to the ring buffer in shared memory.
+ */
+static void
+jsonlog_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	if (jsonlog_ring_buffer_size > 0)
+	{
+		jsonlog_ring = ShmemInitStruct("jsonlog", jsonlog_shmem_size(),
+									   &found);
+		if (!found)
+		{
+			pg_atomic_init_u64(&jsonlog_ring->reserve_pos, 0);
+			pg_atomic_init_u64(&jsonlog_ring->read_pos, 0);
+			pg_atomic_init_u64(&jsonlog_ring->dropped, 0);
+			jsonlog_ring->writer_latch = NULL;
+			jsonlog_ring->size = (uint64) jsonlog_ring_buffer_size * 1024;
+			MemSet(jsonlog_ring->data, 0, jsonlog_ring->size);
+		}
+	}
+	if (jsonlog_suppress_shared)
+	{
+		suppress_shared = ShmemInitStruct("jsonlog suppress",
+										  jsonlog_suppress_shmem_size(),
+										  &found);
+		if (!found)
+		{
+			MemSet(suppress_shared, 0, jsonlog_suppress_shmem_size());
+			SpinLockInit(&suppress_shared->mutex);
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * ring_copy_in / ring_copy_out / ring_clear
+ * Copy data to and from the ring buffer, or clear it, at the given position
+ * and wrapping around its end.
+ */
+static void
+ring_copy_in(uint64 pos, const char *data, uint64 len)
+{
+	uint64		offset = pos % jsonlog_ring->size;
+	uint64		first = Min(len, jsonlog_ring->size - offset);
+
+	memcpy(jsonlog_ring->data + offset, data, first);
+	if (first < len)
+		memcpy(jsonlog_ring->data, data + first, len - first);
+}
+
+static void
+ring_copy_out(uint64 pos, StringInfo buf, uint64 len)
+{
+	uint64		offset = pos % jsonlog_ring->size;
+	uint64		first = Min(len, jsonlog_ring->size - offset);
+
+	appendBinaryStringInfo(buf, jsonlog_ring->data + offset, first);
+	if (first < len)
+		appendBinaryStringInfo(buf, jsonlog_ring->data, len - first);
+}
+
+static void
+ring_clear(uint64 pos, uint64 len)
+{
+	uint64		offset = pos % jsonlog_ring->size;
+	uint64		first = Min(len, jsonlog_ring->size - offset);
+
+	memset(jsonlog_ring->data + offset, 0, first);
+	if (first < len)
+		memset(jsonlog_ring->data, 0, len - first);
+}
+
+/*
+ * ring_insert
+ * Insert a record in the ring buffer, without waiting. Returns false if
+ * there is not enough space.
+ */
+static bool
+ring_insert(const char *data, int len)
+{
+	uint64		total = JSONLOG_RECORD_SIZE(len);
+	uint64		pos;
+	uint64		read;
+	volatile JsonLogRecord *record;
+	Latch	   *latch;
+
+	if (total > jsonlog_ring->size / 2)
+		return false;
+
+	/* Reserve space, a stale read position being only more conservative */
+	for (;;)
+	{
+		read = pg_atomic_read_u64(&jsonlog_ring->read_pos);
+		pos = pg_atomic_read_u64(&jsonlog_ring->reserve_pos);
+		if (pos + total - read > jsonlog_ring->size)
+			return false;
+		if (pg_atomic_compare_exchange_u64(&jsonlog_ring->reserve_pos,
+										   &pos, pos + total))
+			break;
+	}
+
+	/* Copy record, and mark it as ready once done */
+	ring_copy_in(pos + JSONLOG_RECORD_HDR, data, len);
+	record = (JsonLogRecord *) (jsonlog_ring->data +
+								pos % jsonlog_ring->size);
+	record->len = len;
+	pg_write_barrier();
+	record->ready = 1;
+
+	/* Wake up writer once half of the buffer is used */
+	latch = jsonlog_ring->writer_latch;
+	if (latch != NULL && pos + total - read > jsonlog_ring->size / 2)
+		SetLatch(latch);
+
+	return true;
+}
+
+/*
+ * ring_write
+ * Send a record to the ring buffer. Returns true if the record has been
+ * handled, be it inserted or dropped, and false if it needs to be written
+ * with the default method. The postmaster does not touch shared memory,
+ * and the writer and syslogger processes write their logs directly. Nothing
+ * is inserted while the writer is not running, and PANIC records are never
+ * inserted as the writer may not be able to write them.
+ */
+static bool
+ring_write(ErrorData *edata, const char *data, int len)
+{
+	if (jsonlog_ring == NULL || !IsUnderPostmaster || am_syslogger ||
+		am_jsonlog_writer || edata->elevel >= PANIC ||
+		jsonlog_ring->writer_latch == NULL)
+		return false;
+
+	if (ring_insert(data, len))
+		return true;
+
+	if (jsonlog_ring_buffer_full == JSONLOG_FULL_FALLBACK)
+		return false;
+
+	pg_atomic_fetch_add_u64(&jsonlog_ring->dropped, 1);
+	return true;
+}
+
+/*
+ * suppress_level_class
+ * Severity used to match a limit, grouping levels as error_severity().
+ */
+static int
+suppress_level_class(int elevel)
+{
+	if (elevel <= DEBUG1)
+		return DEBUG1;
+	if (elevel == COMMERROR)
+		return LOG;
+	return elevel;
+}
+
+/*
+ * check_suppress_limits
+ * Parse the limits of records per severity or SQLSTATE, as a list of
+ * "key:limit" elements separated by commas.
+ */
+static bool
+check_suppress_limits(char **newval, void **extra, GucSource source)
+{
+	static const struct
+	{
+		const char *name;
+		int			elevel;
+	}			levels[] = {
+		{"debug", DEBUG1},
+		{"log", LOG},
+		{"info", INFO},
+		{"notice", NOTICE},
+		{"warning", WARNING},
+		{"error", ERROR},
+		{NULL, 0}
+	};
+	JsonLogSuppressLimits *result;
+	char	   *rawstring;
+	char	   *item;
+	char	   *saveptr = NULL;
+	int			maxlimits = 1;
+	char	   *c;
+
+	for (c = *newval; *c; c++)
+		if (*c == ',')
+			maxlimits++;
+
+	result = malloc(offsetof(JsonLogSuppressLimits, limits) +
+					sizeof(JsonLogSuppressLimit) * maxlimits);
+	if (result == NULL)
+		return false;
+	result->nlimits = 0;
+
+	rawstring = pstrdup(*newval);
+	for (item = strtok_r(rawstring, ",", &saveptr);
+		 item != NULL;
+		 item = strtok_r(NULL, ",", &saveptr))
+	{
+		JsonLogSuppressLimit *limit = &result->limits[result->nlimits];
+		char	   *sep = strchr(item, ':');
+		char	   *key = item;
+		char	   *endptr;
+		long		value;
+		int			i;
+
+		while (isspace((unsigned char) *key))
+			key++;
+		if (*key == '\0')
+			continue;
+		if (sep == NULL)
+			goto invalid;
+		*sep = '\0';
+		for (c = sep - 1; c >= key && isspace((unsigned char) *c); c--)
+			*c = '\0';
+
+		errno = 0;
+		value = strtol(sep + 1, &endptr, 10);
+		while (isspace((unsigned char) *endptr))
+			endptr++;
+		if (errno != 0 || *endptr != '\0' || value < 0 || value > INT_MAX)
+			goto invalid;
+		limit->limit = (int) value;
+
+		/* Severity name, or SQLSTATE */
+		limit->elevel = 0;
+		limit->sqlerrcode = 0;
+		for (i = 0; levels[i].name != NULL; i++)
+		{
+			if (pg_strcasecmp(key, levels[i].name) == 0)
+			{
+				limit->elevel = levels[i].elevel;
+				break;
+			}
+		}
+		if (limit->elevel == 0)
+		{
+			if (strlen(key) != 5 ||
+				strspn(key, "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ") != 5)
+				goto invalid;
+			limit->sqlerrcode = MAKE_SQLSTATE(key[0], key[1], key[2],
+											  key[3], key[4]);
+		}
+		result->nlimits++;
+		continue;
+
+invalid:
+		GUC_check_errdetail("Invalid element \"%s\", expected a severity or a SQLSTATE followed by a limit.",
+							item);
+		pfree(rawstring);
+		free(result);
+		return false;
+	}
+
+	pfree(rawstring);
+	*extra = result;
+	return true;
+}
+
+static void
+assign_suppress_limits(const char *newval, void *extra)
+{
+	suppress_limits = (JsonLogSuppressLimits *) extra;
+}
+
+/*
+ * suppress_limit
+ * Number of records emitted per window for a record, 0 for no limit. A
+ * limit for its SQLSTATE is used first, then for its severity.
+ */
+static int
+suppress_limit(ErrorData *edata)
+{
+	int			elevel = suppress_level_class(edata->elevel);
+	int			result = jsonlog_suppress_burst;
+	bool		found_level = false;
+	int			i;
+
+	if (suppress_limits == NULL)
+		return result;
+
+	for (i = 0; i < suppress_limits->nlimits; i++)
+	{
+		JsonLogSuppressLimit *limit = &suppress_limits->limits[i];
+
+		if (limit->elevel == 0 && limit->sqlerrcode == edata->sqlerrcode)
+			return limit->limit;
+		if (!found_level && limit->elevel == elevel)
+		{
+			result = limit->limit;
+			found_level = true;
+		}
+	}
+
+	return result;
+}
+
+/*
+ * suppress_record
+ * Check if a record should be suppressed as a duplicate. If it is
+ * emitted, *repeated is set to the number of records like it suppressed
+ * in the previous window. If the entry of the record was used by another
+ * kind of record with records suppressed, it is copied to "evicted" and
+ * *has_evicted is set, for its summary to be written. FATAL and PANIC
+ * records are always emitted.
+ */
+static bool
+suppress_record(ErrorData *edata, uint32 *repeated,
+				JsonLogSuppressEntry *evicted, bool *has_evicted)
+{
+	const char *template;
+	const char *message;
+	uint32		msghash;
+	int			limit;
+	JsonLogSuppressEntry *entry;
+	TimestampTz now;
+	bool		result;
+
+	*repeated = 0;
+	*has_evicted = false;
+	if (jsonlog_suppress_window <= 0 || edata->elevel >= FATAL)
+		return false;
+
+	limit = suppress_limit(edata);
+	if (limit == 0)
+		return false;
+
+	template = edata->message_id ? edata->message_id : edata->message;
+	if (template == NULL)
+		return false;
+	msghash = DatumGetUInt32(hash_any((const unsigned char *) template,
+									  strlen(template)));
+	now = GetCurrentTimestamp();
+
+	/* The postmaster does not touch shared memory */
+	if (suppress_shared != NULL && IsUnderPostmaster)
+	{
+		SpinLockAcquire(&suppress_shared->mutex);
+		entry = &suppress_shared->entries[(msghash ^ edata->sqlerrcode ^
+										   MyDatabaseId) %
+										  JSONLOG_SUPPRESS_ENTRIES];
+	}
+	else
+		entry = &suppress_local[(msghash ^ edata->sqlerrcode ^
+								 MyDatabaseId) %
+								JSONLOG_SUPPRESS_ENTRIES];
+
+	if (!entry->used || entry->msghash != msghash ||
+		entry->sqlerrcode != edata->sqlerrcode ||
+		entry->dbid != MyDatabaseId || entry->elevel != edata->elevel)
+	{
+		/* New entry, replacing any previous one */
+		if (entry->used && entry->suppressed > 0)
+		{
+			*evicted = *entry;
+			*has_evicted = true;
+		}
+		entry->used = true;
+		entry->msghash = msghash;
+		entry->sqlerrcode = edata->sqlerrcode;
+		entry->dbid = MyDatabaseId;
+		entry->elevel = edata->elevel;
+		entry->window_start = now;
+		entry->count = 0;
+		entry->suppressed = 0;
+		message = edata->message ? edata->message : template;
+		strlcpy(entry->message, message,
+				pg_mbcliplen(message, strlen(message),
+							 JSONLOG_SUPPRESS_MSGLEN - 1) + 1);
+	}
+	else if (TimestampDifferenceExceeds(entry->window_start, now,
+										jsonlog_suppress_window))
+	{
+		/* New window, reporting what has been suppressed */
+		*repeated = entry->suppressed;
+		entry->window_start = now;
+		entry->count = 0;
+		entry->suppressed = 0;
+	}
+
+	if (entry->count < limit)
+	{
+		entry->count++;
+		result = false;
+	}
+	else
+	{
+		entry->suppressed++;
+		result = true;
+	}
+
+	if (suppress_shared != NULL && IsUnderPostmaster)
+		SpinLockRelease(&suppress_shared->mutex);
+
+	return result;
+}
+
+/*
+ * suppress_entry_expired
+ * Check if the window of an entry has expired with records suppressed.
+ */
+static bool
+suppress_entry_expired(JsonLogSuppressEntry *entry, TimestampTz now)
+{
+	return entry->used && entry->suppressed > 0 &&
+		TimestampDifferenceExceeds(entry->window_start, now,
+								   jsonlog_suppress_window);
+}
+
+/*
+ * suppress_sweep
+ * Collect the entries whose window has expired with records suppressed,
+ * forgetting them so as they are reported once. This is done at most once
+ * per second or per window, whichever is shorter. With the shared table,
+ * the entries are first looked for holding the spinlock once, then copied
+ * taking it again for each one, as copying them all would hold it too
+ * long. Returns the number of entries copied to "expired".
+ */
+static int
+suppress_sweep(JsonLogSuppressEntry *expired)
+{
+	TimestampTz now;
+	int			indexes[JSONLOG_SUPPRESS_ENTRIES];
+	int			nindexes = 0;
+	int			nexpired = 0;
+	int			i;
+
+	if (jsonlog_suppress_window <= 0)
+		return 0;
+
+	now = GetCurrentTimestamp();
+	if (!TimestampDifferenceExceeds(suppress_last_sweep, now,
+									Min(jsonlog_suppress_window, 1000)))
+		return 0;
+	suppress_last_sweep = now;
+
+	if (suppress_shared == NULL || !IsUnderPostmaster)
+	{
+		for (i = 0; i < JSONLOG_SUPPRESS_ENTRIES; i++)
+		{
+			JsonLogSuppressEntry *entry = &suppress_local[i];
+
+			if (!suppress_entry_expired(entry, now))
+				continue;
+			expired[nexpired++] = *entry;
+			entry->used = false;
+		}
+		return nexpired;
+	}
+
+	SpinLockAcquire(&suppress_shared->mutex);
+	for (i = 0; i < JSONLOG_SUPPRESS_ENTRIES; i++)
+	{
+		if (suppress_entry_expired(&suppress_shared->entries[i], now))
+			indexes[nindexes++] = i;
+	}
+	SpinLockRelease(&suppress_shared->mutex);
+
+	/* Entries may have changed meanwhile, so check them again */
+	for (i = 0; i < nindexes; i++)
+	{
+		JsonLogSuppressEntry *entry = &suppress_shared->entries[indexes[i]];
+
+		SpinLockAcquire(&suppress_shared->mutex);
+		if (suppress_entry_expired(entry, now))
+		{
+			expired[nexpired++] = *entry;
+			entry->used = false;
+		}
+		SpinLockRelease(&suppress_shared->mutex);
+	}
+
+	return nexpired;
+}
 
-	/* Clean up */
-	pfree(literal_json.data);
+/*
+ * write_jsonlog_data
+ * Send a record to the ring buffer, or to stderr or the log file.
+ */
+static void
+write_jsonlog_data(ErrorData *edata, const char *data, int len)
+{
+	/* Send to ring buffer if enabled, or write to stderr, if enabled */
+	if (!ring_write(edata, data, len) &&
+		(Log_destination & LOG_DESTINATION_STDERR) != 0)
+	{
+		if (Logging_collector && redirection_done && !am_syslogger)
+			write_pipe_chunks((char *) data, len);
+		else
+			write_console(data, len);
+	}
+
+	/* If in the syslogger process, try to write messages direct to file */
+	if (am_syslogger)
+		write_syslogger_file(data, len, LOG_DESTINATION_STDERR);
+}
+
+/*
+ * write_suppress_summary
+ * Write a summary record for an entry with records suppressed.
+ */
+static void
+write_suppress_summary(ErrorData *edata, StringInfo buf,
+					   JsonLogSuppressEntry *entry)
+{
+	resetStringInfo(buf);
+	appendStringInfoChar(buf, '{');
+	append_log_time(buf);
+	if (OidIsValid(entry->dbid))
+		appendStringInfo(buf, "\"dbid\":%u,", entry->dbid);
+	append_json_field(buf, "error_severity",
+					  (char *) error_severity(entry->elevel), true);
+	if (entry->sqlerrcode != ERRCODE_SUCCESSFUL_COMPLETION)
+		append_json_field(buf, "state_code",
+						  unpack_sql_state(entry->sqlerrcode), true);
+	appendStringInfo(buf, "\"repeated\":%u,", entry->suppressed);
+	append_json_field(buf, "message", entry->message, false);
+	appendStringInfoChar(buf, '}');
+	appendStringInfoChar(buf, '\n');
+
+	write_jsonlog_data(edata, buf->data, buf->len);
+}
+
+/*
+ * write_suppress_summaries
+ * Write a summary record for each entry whose window has expired with
+ * records suppressed.
+ */
+static void
+write_suppress_summaries(ErrorData *edata)
+{
+	StringInfoData buf;
+	int			nexpired;
+	int			i;
+
+	nexpired = suppress_sweep(suppress_expired);
+	if (nexpired == 0)
+		return;
+
+	initStringInfo(&buf);
+	for (i = 0; i < nexpired; i++)
+		write_suppress_summary(edata, &buf, &suppress_expired[i]);
+	pfree(buf.data);
 }
 
 /*
@@ -216,6 +1135,8 @@ write_jsonlog(ErrorData *edata)
 {
 	StringInfoData	buf;
 	TransactionId	txid = GetTopTransactionIdIfAny();
+	uint32			repeated;
+	bool			has_evicted;
 
 	/*
 	 * Disable logs to server, we don't want duplicate entries in
@@ -230,42 +1151,30 @@ write_jsonlog(ErrorData *edata)
 	if (edata->elevel < log_min_messages)
 		return;
 
+	/* Report the duplicates suppressed in windows now expired */
+	write_suppress_summaries(edata);
+
+	/* Nothing to do either if this is a duplicate to suppress */
+	if (suppress_record(edata, &repeated, &suppress_evicted, &has_evicted))
+		return;
+
 	initStringInfo(&buf);
 
+	/* Report the duplicates of the entry replaced by this record */
+	if (has_evicted)
+	{
+		write_suppress_summary(edata, &buf, &suppress_evicted);
+		resetStringInfo(&buf);
+	}
+
 	/* Initialize string */
 	appendStringInfoChar(&buf, '{');
 
 	/* Timestamp */
-	if (log_time[0] == '\0')
-		setup_formatted_log_time();
-	appendJSONLiteral(&buf, "timestamp", log_time, true);
-
-	/* Username */
-	if (MyProcPort && MyProcPort->user_name)
-		appendJSONLiteral(&buf, "user", MyProcPort->user_name, true);
-
-	/* Database name */
-	if (MyProcPort && MyProcPort->database_name)
-		appendJSONLiteral(&buf, "dbname", MyProcPort->database_name, true);
-
-	/* Process ID */
-	if (MyProcPid != 0)
-		appendStringInfo(&buf, "\"pid\":%d,", MyProcPid);
-
-	/* Remote host and port */
-	if (MyProcPort && MyProcPort->remote_host)
-	{
-		appendJSONLiteral(&buf, "remote_host",
-						  MyProcPort->remote_host, true);
-		if (MyProcPort->remote_port && MyProcPort->remote_port[0] != '\0')
-			appendJSONLiteral(&buf, "remote_port",
-							  MyProcPort->remote_port, true);
-	}
+	append_log_time(&buf);
 
-	/* Session id */
-	if (MyProcPid != 0)
-		appendStringInfo(&buf, "\"session_id\":\"%lx.%x\",",
-						 (long) MyStartTime, MyProcPid);
+	/* Username, database name, process ID, remote host and session id */
+	append_session_prefix(&buf);
 
 	/* Virtual transaction id */
 	/* keep VXID format in sync with lockfuncs.c */
@@ -278,32 +1187,32 @@ write_jsonlog(ErrorData *edata)
 		appendStringInfo(&buf, "\"txid\":%u,", GetTopTransactionIdIfAny());
 
 	/* Error severity */
-	appendJSONLiteral(&buf, "error_severity",
+	append_json_field(&buf, "error_severity",
 					  (char *) error_severity(edata->elevel), true);
 
 	/* SQL state code */
 	if (edata->sqlerrcode != ERRCODE_SUCCESSFUL_COMPLETION)
-		appendJSONLiteral(&buf, "state_code",
+		append_json_field(&buf, "state_code",
 						  unpack_sql_state(edata->sqlerrcode), true);
 
 	/* Error detail or Error detail log */
 	if (edata->detail_log)
-		appendJSONLiteral(&buf, "detail_log", edata->detail_log, true);
+		append_json_field(&buf, "detail_log", edata->detail_log, true);
 	else if (edata->detail)
-		appendJSONLiteral(&buf, "detail", edata->detail, true);
+		append_json_field(&buf, "detail", edata->detail, true);
 
 	/* Error hint */
 	if (edata->hint)
-		appendJSONLiteral(&buf, "hint", edata->hint, true);
+		append_json_field(&buf, "hint", edata->hint, true);
 
 	/* Internal query */
 	if (edata->internalquery)
-		appendJSONLiteral(&buf, "internal_query",
+		append_json_field(&buf, "internal_query",
 						  edata->internalquery, true);
 
 	/* Error context */
 	if (edata->context)
-		appendJSONLiteral(&buf, "context", edata->context, true);
+		append_json_field(&buf, "context", edata->context, true);
 
 	/* File error location */
 	if (Log_error_verbosity >= PGERROR_VERBOSE)
@@ -319,34 +1228,25 @@ write_jsonlog(ErrorData *edata)
 		else if (edata->filename)
 			appendStringInfo(&msgbuf, "%s:%d",
 							 edata->filename, edata->lineno);
-		appendJSONLiteral(&buf, "file_location", msgbuf.data, true);
+		append_json_field(&buf, "file_location", msgbuf.data, true);
 		pfree(msgbuf.data);
 	}
 
 	/* Application name */
-	if (application_name && application_name[0] != '\0')
-		appendJSONLiteral(&buf, "application_name",
-						  application_name, true);
+	append_application_name(&buf);
+
+	/* Duplicates suppressed before this record */
+	if (repeated > 0)
+		appendStringInfo(&buf, "\"repeated\":%u,", repeated);
 
 	/* Error message */
-	appendJSONLiteral(&buf, "message", edata->message, false);
+	append_json_field(&buf, "message", edata->message, false);
 
 	/* Finish string */
 	appendStringInfoChar(&buf, '}');
 	appendStringInfoChar(&buf, '\n');
 
-	/* Write to stderr, if enabled */
-	if ((Log_destination & LOG_DESTINATION_STDERR) != 0)
-	{
-		if (Logging_collector && redirection_done && !am_syslogger)
-			write_pipe_chunks(buf.data, buf.len);
-		else
-			write_console(buf.data, buf.len);
-	}
-
-	/* If in the syslogger process, try to write messages direct to file */
-	if (am_syslogger)
-		write_syslogger_file(buf.data, buf.len, LOG_DESTINATION_STDERR);
+	write_jsonlog_data(edata, buf.data, buf.len);
 
 	/* Cleanup */
 	pfree(buf.data);
@@ -356,6 +1256,219 @@ write_jsonlog(ErrorData *edata)
 		(*prev_log_hook) (edata);
 }
 
+/*
+ * writer_open_file
+ * Open a new log file for the writer, based on the current time.
+ */
+static void
+writer_open_file(void)
+{
+	char		filename[MAXPGPATH];
+	char		path[MAXPGPATH];
+	pg_time_t	now = (pg_time_t) time(NULL);
+
+	if (writer_fd >= 0)
+		close(writer_fd);
+
+	/* Create directory if necessary, ignoring errors caught below */
+	(void) mkdir(jsonlog_directory, S_IRWXU);
+
+	pg_strftime(filename, sizeof(filename), jsonlog_filename,
+				pg_localtime(&now, log_timezone));
+	snprintf(path, sizeof(path), "%s/%s", jsonlog_directory, filename);
+
+	writer_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | PG_BINARY,
+					 S_IRUSR | S_IWUSR);
+	if (writer_fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open log file \"%s\": %m", path)));
+
+	writer_file_size = 0;
+	if (jsonlog_rotation_age > 0)
+		writer_next_rotation = now + (pg_time_t) jsonlog_rotation_age *
+			SECS_PER_MINUTE;
+	else
+		writer_next_rotation = 0;
+}
+
+/*
+ * writer_write
+ * Write a batch of records to the current log file.
+ */
+static void
+writer_write(StringInfo buf)
+{
+	char	   *data = buf->data;
+	int			len = buf->len;
+
+	while (len > 0)
+	{
+		ssize_t		rc = write(writer_fd, data, len);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not write to log file: %m")));
+			break;
+		}
+		data += rc;
+		len -= rc;
+	}
+
+	writer_file_size += buf->len;
+	resetStringInfo(buf);
+}
+
+/*
+ * writer_drain
+ * Write all the records ready in the ring buffer, by batches.
+ */
+static void
+writer_drain(StringInfo buf)
+{
+	uint64		read = pg_atomic_read_u64(&jsonlog_ring->read_pos);
+	uint64		dropped;
+
+	for (;;)
+	{
+		volatile JsonLogRecord *record;
+		uint64		len;
+		uint64		total;
+
+		record = (JsonLogRecord *) (jsonlog_ring->data +
+									read % jsonlog_ring->size);
+		if (record->ready == 0)
+			break;
+		pg_read_barrier();
+
+		len = record->len;
+		total = JSONLOG_RECORD_SIZE(len);
+		ring_copy_out(read + JSONLOG_RECORD_HDR, buf, len);
+		ring_clear(read, total);
+		read += total;
+
+		/* Free space before writing a batch */
+		if (buf->len >= JSONLOG_WRITE_SIZE)
+		{
+			pg_write_barrier();
+			pg_atomic_write_u64(&jsonlog_ring->read_pos, read);
+			writer_write(buf);
+		}
+	}
+
+	pg_write_barrier();
+	pg_atomic_write_u64(&jsonlog_ring->read_pos, read);
+
+	/* Report records dropped since last time */
+	dropped = pg_atomic_read_u64(&jsonlog_ring->dropped);
+	if (dropped != writer_dropped)
+	{
+		appendStringInfoChar(buf, '{');
+		append_log_time(buf);
+		appendStringInfo(buf,
+						 "\"pid\":%d,\"error_severity\":\"WARNING\","
+						 "\"message\":\"" UINT64_FORMAT " log records dropped\"}\n",
+						 MyProcPid, dropped - writer_dropped);
+		writer_dropped = dropped;
+	}
+
+	if (buf->len > 0)
+		writer_write(buf);
+}
+
+static void
+jsonlog_writer_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void
+jsonlog_writer_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+/*
+ * jsonlog_writer_exit
+ * Stop using the ring buffer once the writer is gone.
+ */
+static void
+jsonlog_writer_exit(int code, Datum arg)
+{
+	jsonlog_ring->writer_latch = NULL;
+}
+
+/*
+ * jsonlog_writer_main
+ * Main loop of the writer, writing records from the ring buffer to log
+ * files, rotated depending on their age and size.
+ */
+void
+jsonlog_writer_main(Datum main_arg)
+{
+	StringInfoData buf;
+
+	pqsignal(SIGHUP, jsonlog_writer_sighup);
+	pqsignal(SIGTERM, jsonlog_writer_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	am_jsonlog_writer = true;
+	initStringInfo(&buf);
+	writer_open_file();
+
+	on_shmem_exit(jsonlog_writer_exit, (Datum) 0);
+	jsonlog_ring->writer_latch = MyLatch;
+
+	while (!got_sigterm)
+	{
+		int			rc;
+		pg_time_t	now;
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   JSONLOG_WRITER_DELAY,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		writer_drain(&buf);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		/* Switch to a new file if parameters have changed */
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			writer_open_file();
+			continue;
+		}
+
+		now = (pg_time_t) time(NULL);
+		if ((writer_next_rotation > 0 && now >= writer_next_rotation) ||
+			(jsonlog_rotation_size > 0 &&
+			 writer_file_size >= (uint64) jsonlog_rotation_size * 1024))
+			writer_open_file();
+	}
+
+	/* Stop insertions, and write what remains */
+	jsonlog_ring->writer_latch = NULL;
+	writer_drain(&buf);
+	proc_exit(0);
+}
+
 /*
  * _PG_init
  * Entry point loading hooks
@@ -363,6 +1476,129 @@ write_jsonlog(ErrorData *edata)
 void
 _PG_init(void)
 {
+	DefineCustomIntVariable("jsonlog.ring_buffer_size",
+							"Size of the shared memory ring buffer for log records.",
+							"Records are written by a background worker, 0 disables it.",
+							&jsonlog_ring_buffer_size,
+							0, 0, MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("jsonlog.ring_buffer_full",
+							 "Action when the ring buffer is full.",
+							 "\"drop\" discards the record, \"fallback\" writes it to stderr.",
+							 &jsonlog_ring_buffer_full,
+							 JSONLOG_FULL_FALLBACK,
+							 ring_buffer_full_options,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomStringVariable("jsonlog.directory",
+							   "Directory where the ring buffer writer creates log files.",
+							   NULL,
+							   &jsonlog_directory,
+							   "log",
+							   PGC_SIGHUP,
+							   0,
+							   NULL, NULL, NULL);
+
+	DefineCustomStringVariable("jsonlog.filename",
+							   "File name pattern of log files created by the ring buffer writer.",
+							   NULL,
+							   &jsonlog_filename,
+							   "postgresql-%Y-%m-%d_%H%M%S.json",
+							   PGC_SIGHUP,
+							   0,
+							   NULL, NULL, NULL);
+
+	DefineCustomIntVariable("jsonlog.rotation_age",
+							"Automatic log file rotation will occur after N minutes.",
+							NULL,
+							&jsonlog_rotation_age,
+							1440, 0, INT_MAX / SECS_PER_MINUTE,
+							PGC_SIGHUP,
+							GUC_UNIT_MIN,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("jsonlog.rotation_size",
+							"Automatic log file rotation will occur after N kilobytes.",
+							NULL,
+							&jsonlog_rotation_size,
+							10240, 0, INT_MAX / 1024,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("jsonlog.suppress_window",
+							"Window of time used to suppress duplicate records.",
+							"0 disables suppression of duplicates.",
+							&jsonlog_suppress_window,
+							0, 0, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("jsonlog.suppress_burst",
+							"Number of duplicate records emitted per window.",
+							"0 means no limit.",
+							&jsonlog_suppress_burst,
+							10, 0, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomStringVariable("jsonlog.suppress_limits",
+							   "Number of duplicate records emitted per window for severities or SQLSTATEs.",
+							   "List of \"key:limit\" elements separated by commas.",
+							   &jsonlog_suppress_limits,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   check_suppress_limits,
+							   assign_suppress_limits,
+							   NULL);
+
+	DefineCustomBoolVariable("jsonlog.suppress_shared",
+							 "Suppress duplicate records across all processes.",
+							 NULL,
+							 &jsonlog_suppress_shared,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL, NULL, NULL);
+
+	/* Shared memory is set up at server start */
+	if (process_shared_preload_libraries_in_progress &&
+		(jsonlog_ring_buffer_size > 0 || jsonlog_suppress_shared))
+	{
+		if (jsonlog_ring_buffer_size > 0)
+			RequestAddinShmemSpace(jsonlog_shmem_size());
+		if (jsonlog_suppress_shared)
+			RequestAddinShmemSpace(jsonlog_suppress_shmem_size());
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = jsonlog_shmem_startup;
+	}
+
+	/* Ring buffer writer as well */
+	if (process_shared_preload_libraries_in_progress &&
+		jsonlog_ring_buffer_size > 0)
+	{
+		BackgroundWorker worker;
+
+		MemSet(&worker, 0, sizeof(BackgroundWorker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+		worker.bgw_restart_time = 1;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "jsonlog");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "jsonlog_writer_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "jsonlog writer");
+		worker.bgw_main_arg = (Datum) 0;
+		worker.bgw_notify_pid = 0;
+		RegisterBackgroundWorker(&worker);
+	}
+
 	prev_log_hook = emit_log_hook;
 	emit_log_hook = write_jsonlog;
 }
@@ -15,16 +15,23 @@
 /* Some general headers for custom bgworker facility */
 #include "postgres.h"
 #include "fmgr.h"
+
+#include <signal.h>
+
 #include "access/xact.h"
-#include "lib/stringinfo.h"
+#include "commands/dbcommands.h"
+#include "common/ip.h"
+#include "miscadmin.h"
 #include "pgstat.h"
-#include "executor/spi.h"
 #include "postmaster/bgworker.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
+#include "utils/acl.h"
 #include "utils/guc.h"
-#include "utils/snapmgr.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
 
 /* Allow load of this module in shared libs */
 PG_MODULE_MAGIC;
@@ -39,10 +46,28 @@ static volatile sig_atomic_t got_sighup = false;
 
 /* GUC variables */
 static int kill_max_idle_time = 5;
+static int kill_max_idle_in_transaction_time = 0;
+static char *kill_database_timeouts = NULL;
+static char *kill_role_timeouts = NULL;
 
 /* Worker name */
 static char *worker_name = "kill_idle";
 
+/*
+ * Idle timeout specific to a database or a role, as defined by
+ * kill_idle.database_timeouts and kill_idle.role_timeouts.
+ */
+typedef struct KillIdleTimeout
+{
+	Oid			oid;
+	int			timeout;		/* in seconds, 0 to never kill */
+} KillIdleTimeout;
+
+static KillIdleTimeout *database_timeouts = NULL;
+static int	num_database_timeouts = 0;
+static KillIdleTimeout *role_timeouts = NULL;
+static int	num_role_timeouts = 0;
+
 static void
 kill_idle_sigterm(SIGNAL_ARGS)
 {
@@ -63,22 +88,343 @@ kill_idle_sighup(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
+/*
+ * Parse a list of timeouts, in the shape of "name=seconds" entries
+ * separated by commas. If callback is not NULL, it is called for each
+ * entry. Returns false if the format is incorrect.
+ */
+static bool
+kill_idle_parse_timeouts(const char *value,
+						 void (*callback) (const char *name, int timeout))
+{
+	char	   *rawstring;
+	char	   *entry;
+	char	   *saveptr = NULL;
+
+	if (value == NULL)
+		return true;
+
+	rawstring = pstrdup(value);
+	for (entry = strtok_r(rawstring, ",", &saveptr);
+		 entry != NULL;
+		 entry = strtok_r(NULL, ",", &saveptr))
+	{
+		char	   *sep = strrchr(entry, '=');
+		char	   *name = entry;
+		char	   *end;
+		char	   *p;
+		long		timeout;
+
+		if (sep == NULL)
+		{
+			pfree(rawstring);
+			return false;
+		}
+		*sep = '\0';
+
+		/* Trim spaces around the name */
+		while (isspace((unsigned char) *name))
+			name++;
+		for (p = sep - 1; p >= name && isspace((unsigned char) *p); p--)
+			*p = '\0';
+
+		errno = 0;
+		timeout = strtol(sep + 1, &end, 10);
+		while (isspace((unsigned char) *end))
+			end++;
+		if (*name == '\0' || end == sep + 1 || *end != '\0' ||
+			errno != 0 || timeout < 0 || timeout > 3600)
+		{
+			pfree(rawstring);
+			return false;
+		}
+
+		if (callback)
+			callback(name, (int) timeout);
+	}
+
+	pfree(rawstring);
+	return true;
+}
+
+static bool
+kill_idle_check_timeouts(char **newval, void **extra, GucSource source)
+{
+	if (!kill_idle_parse_timeouts(*newval, NULL))
+	{
+		GUC_check_errdetail("List must contain entries of the form \"name=seconds\", with seconds between 0 and 3600.");
+		return false;
+	}
+	return true;
+}
+
+static void
+kill_idle_add_database_timeout(const char *name, int timeout)
+{
+	Oid			dbid = get_database_oid(name, true);
+
+	if (!OidIsValid(dbid))
+	{
+		ereport(WARNING,
+				(errmsg("bgworker kill_idle: database \"%s\" does not exist",
+						name)));
+		return;
+	}
+	database_timeouts[num_database_timeouts].oid = dbid;
+	database_timeouts[num_database_timeouts].timeout = timeout;
+	num_database_timeouts++;
+}
+
+static void
+kill_idle_add_role_timeout(const char *name, int timeout)
+{
+	Oid			roleid = get_role_oid(name, true);
+
+	if (!OidIsValid(roleid))
+	{
+		ereport(WARNING,
+				(errmsg("bgworker kill_idle: role \"%s\" does not exist",
+						name)));
+		return;
+	}
+	role_timeouts[num_role_timeouts].oid = roleid;
+	role_timeouts[num_role_timeouts].timeout = timeout;
+	num_role_timeouts++;
+}
+
+/*
+ * Build the lists of timeouts per database and per role, looking up the
+ * OIDs of the objects listed.
+ */
 static void
-kill_idle_build_query(StringInfoData *buf)
-{
-	appendStringInfo(buf, "SELECT pid, pg_terminate_backend(pid) "
-			   "AS status, usename, datname, client_addr "
-			   "FROM pg_stat_activity "
-			   "WHERE now() - state_change > interval '%d s' AND "
-			   "pid != pg_backend_pid();",
-					 kill_max_idle_time);
+kill_idle_load_timeouts(void)
+{
+	int			maxentries;
+
+	if (database_timeouts)
+		pfree(database_timeouts);
+	if (role_timeouts)
+		pfree(role_timeouts);
+	num_database_timeouts = 0;
+	num_role_timeouts = 0;
+
+	/* One entry at most per character, which is plenty */
+	maxentries = kill_database_timeouts ? strlen(kill_database_timeouts) : 0;
+	database_timeouts = MemoryContextAlloc(TopMemoryContext,
+										   sizeof(KillIdleTimeout) * (maxentries + 1));
+	maxentries = kill_role_timeouts ? strlen(kill_role_timeouts) : 0;
+	role_timeouts = MemoryContextAlloc(TopMemoryContext,
+									   sizeof(KillIdleTimeout) * (maxentries + 1));
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	(void) kill_idle_parse_timeouts(kill_database_timeouts,
+									kill_idle_add_database_timeout);
+	(void) kill_idle_parse_timeouts(kill_role_timeouts,
+									kill_idle_add_role_timeout);
+	CommitTransactionCommand();
+}
+
+/*
+ * Get the idle timeout of a backend in seconds, 0 if its idle time is not
+ * limited. A timeout defined for a role has priority over the one of a
+ * database.
+ */
+static int
+kill_idle_get_timeout(Oid dbid, Oid roleid, bool in_transaction)
+{
+	int			i;
+
+	if (in_transaction)
+		return kill_max_idle_in_transaction_time;
+
+	for (i = 0; i < num_role_timeouts; i++)
+	{
+		if (role_timeouts[i].oid == roleid)
+			return role_timeouts[i].timeout;
+	}
+	for (i = 0; i < num_database_timeouts; i++)
+	{
+		if (database_timeouts[i].oid == dbid)
+			return database_timeouts[i].timeout;
+	}
+
+	return kill_max_idle_time;
+}
+
+/*
+ * Get the smallest timeout defined, which is the maximum time to wait
+ * before a new scan, as a backend becoming idle after a scan may reach it.
+ */
+static int
+kill_idle_min_timeout(void)
+{
+	int			result = kill_max_idle_time;
+	int			i;
+
+	if (kill_max_idle_in_transaction_time > 0)
+		result = Min(result, kill_max_idle_in_transaction_time);
+	for (i = 0; i < num_role_timeouts; i++)
+	{
+		if (role_timeouts[i].timeout > 0)
+			result = Min(result, role_timeouts[i].timeout);
+	}
+	for (i = 0; i < num_database_timeouts; i++)
+	{
+		if (database_timeouts[i].timeout > 0)
+			result = Min(result, database_timeouts[i].timeout);
+	}
+
+	return result;
+}
+
+/*
+ * Backend to terminate, copied from its status entry as the snapshot of
+ * backend status is released at the end of any transaction.
+ */
+typedef struct KillIdleCandidate
+{
+	int			pid;
+	Oid			dbid;
+	Oid			roleid;
+	SockAddr	clientaddr;
+	bool		in_transaction;
+} KillIdleCandidate;
+
+/*
+ * Terminate a backend, the same way as pg_terminate_backend(), and log
+ * what has been disconnected. This needs to be called in a transaction.
+ */
+static void
+kill_idle_terminate(KillIdleCandidate *candidate)
+{
+	int			pid = candidate->pid;
+	char	   *datname;
+	char	   *usename;
+	char		client_addr[NI_MAXHOST];
+
+	/* Check that the process still exists */
+	if (BackendPidGetProc(pid) == NULL)
+		return;
+
+#ifdef HAVE_SETSID
+	if (kill(-pid, SIGTERM))
+#else
+	if (kill(pid, SIGTERM))
+#endif
+	{
+		ereport(WARNING,
+				(errmsg("could not send signal to process %d: %m", pid)));
+		return;
+	}
+
+	/* Names are looked up only for the log, when something is killed */
+	client_addr[0] = '\0';
+	if (candidate->clientaddr.salen > 0)
+		(void) pg_getnameinfo_all(&candidate->clientaddr.addr,
+								  candidate->clientaddr.salen,
+								  client_addr, sizeof(client_addr),
+								  NULL, 0, NI_NUMERICHOST | NI_NUMERICSERV);
+	datname = get_database_name(candidate->dbid);
+	usename = GetUserNameFromId(candidate->roleid, true);
+
+	/* Log what has been disconnected */
+	elog(LOG, "Disconnected idle%s connection: PID %d %s/%s/%s",
+		 candidate->in_transaction ? " in transaction" : "",
+		 pid, datname ? datname : "none",
+		 usename ? usename : "none",
+		 client_addr[0] != '\0' ? client_addr : "none");
+}
+
+/*
+ * Scan the status of all backends, terminating the ones idle for longer
+ * than their timeout. Returns the earliest time when a backend currently
+ * idle would reach its timeout, or 0 if there is none. Status entries are
+ * read directly, without going through pg_stat_activity, and a transaction
+ * is only needed when something is killed.
+ */
+static TimestampTz
+kill_idle_scan(TimestampTz now)
+{
+	TimestampTz next_deadline = 0;
+	KillIdleCandidate *candidates;
+	int			num_candidates = 0;
+	int			num_backends;
+	int			i;
+
+	/* Get a fresh copy of the status of all backends */
+	pgstat_clear_snapshot();
+	num_backends = pgstat_fetch_stat_numbackends();
+	candidates = palloc(sizeof(KillIdleCandidate) * Max(num_backends, 1));
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		PgBackendStatus *beentry = pgstat_fetch_stat_beentry(i);
+		bool		in_transaction;
+		int			timeout;
+		TimestampTz deadline;
+
+		if (beentry == NULL || beentry->st_procpid == 0 ||
+			beentry->st_procpid == MyProcPid)
+			continue;
+
+		/* Only regular client backends can be idle */
+		if (beentry->st_backendType != B_BACKEND)
+			continue;
+
+		if (beentry->st_state == STATE_IDLE)
+			in_transaction = false;
+		else if (beentry->st_state == STATE_IDLEINTRANSACTION ||
+				 beentry->st_state == STATE_IDLEINTRANSACTION_ABORTED)
+			in_transaction = true;
+		else
+			continue;
+
+		if (beentry->st_state_start_timestamp == 0)
+			continue;
+
+		timeout = kill_idle_get_timeout(beentry->st_databaseid,
+										beentry->st_userid,
+										in_transaction);
+		if (timeout == 0)
+			continue;
+
+		deadline = TimestampTzPlusMilliseconds(beentry->st_state_start_timestamp,
+											   timeout * 1000L);
+		if (deadline <= now)
+		{
+			KillIdleCandidate *candidate = &candidates[num_candidates++];
+
+			candidate->pid = beentry->st_procpid;
+			candidate->dbid = beentry->st_databaseid;
+			candidate->roleid = beentry->st_userid;
+			memcpy(&candidate->clientaddr, &beentry->st_clientaddr,
+				   sizeof(SockAddr));
+			candidate->in_transaction = in_transaction;
+		}
+		else if (next_deadline == 0 || deadline < next_deadline)
+			next_deadline = deadline;
+	}
+
+	/* Release the snapshot taken */
+	pgstat_clear_snapshot();
+
+	if (num_candidates > 0)
+	{
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		for (i = 0; i < num_candidates; i++)
+			kill_idle_terminate(&candidates[i]);
+		CommitTransactionCommand();
+	}
+
+	pfree(candidates);
+	return next_deadline;
 }
 
 void
 kill_idle_main(Datum main_arg)
 {
-	StringInfoData buf;
-
 	/* Register functions for SIGTERM/SIGHUP management */
 	pqsignal(SIGHUP, kill_idle_sighup);
 	pqsignal(SIGTERM, kill_idle_sigterm);
@@ -86,21 +432,39 @@ kill_idle_main(Datum main_arg)
 	/* We're now ready to receive signals */
 	BackgroundWorkerUnblockSignals();
 
-	/* Connect to a database */
+	/* Connect to a database, needed for name lookups */
 	BackgroundWorkerInitializeConnection("postgres", NULL);
 
-	/* Build query for process */
-	initStringInfo(&buf);
-	kill_idle_build_query(&buf);
+	kill_idle_load_timeouts();
 
 	while (!got_sigterm)
 	{
-		int rc, ret, i;
+		int rc;
+		TimestampTz now;
+		TimestampTz next_deadline;
+		long secs;
+		int usecs;
+		long timeout_ms;
+
+		/* Process idle connection kill */
+		now = GetCurrentTimestamp();
+		next_deadline = kill_idle_scan(now);
+
+		/*
+		 * Wait until the next backend would reach its timeout, and not
+		 * longer than the smallest timeout, which is the earliest time a
+		 * backend becoming idle after this scan could be killed.
+		 */
+		timeout_ms = kill_idle_min_timeout() * 1000L;
+		if (next_deadline != 0)
+		{
+			TimestampDifference(now, next_deadline, &secs, &usecs);
+			timeout_ms = Min(timeout_ms, secs * 1000L + usecs / 1000 + 1);
+		}
 
-		/* Wait necessary amount of time */
 		rc = WaitLatch(&MyProc->procLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   kill_max_idle_time * 1000L,
+					   timeout_ms,
 					   PG_WAIT_EXTENSION);
 		ResetLatch(&MyProc->procLatch);
 
@@ -111,22 +475,13 @@ kill_idle_main(Datum main_arg)
 		/* Process signals */
 		if (got_sighup)
 		{
-			int old_interval;
-			/* Save old value of kill interval */
-			old_interval = kill_max_idle_time;
-
 			/* Process config file */
 			ProcessConfigFile(PGC_SIGHUP);
 			got_sighup = false;
 			ereport(LOG, (errmsg("bgworker kill_idle signal: processed SIGHUP")));
 
-			/* Rebuild query if necessary */
-			if (old_interval != kill_max_idle_time)
-			{
-				resetStringInfo(&buf);
-				initStringInfo(&buf);
-				kill_idle_build_query(&buf);
-			}
+			/* Timeouts may have changed */
+			kill_idle_load_timeouts();
 		}
 
 		if (got_sigterm)
@@ -135,58 +490,6 @@ kill_idle_main(Datum main_arg)
 			ereport(LOG, (errmsg("bgworker kill_idle signal: processed SIGTERM")));
 			proc_exit(0);
 		}
-
-		/* Process idle connection kill */
-		SetCurrentStatementStartTimestamp();
-		StartTransactionCommand();
-		SPI_connect();
-		PushActiveSnapshot(GetTransactionSnapshot());
-		pgstat_report_activity(STATE_RUNNING, buf.data);
-
-		/* Statement start time */
-		SetCurrentStatementStartTimestamp();
-
-		/* Execute query */
-		ret = SPI_execute(buf.data, false, 0);
-
-		/* Some error handling */
-		if (ret != SPI_OK_SELECT)
-			elog(FATAL, "Error when trying to kill idle connections");
-
-		/* Do some processing and log stuff disconnected */
-		for (i = 0; i < SPI_processed; i++)
-		{
-			int32 pidValue;
-			bool isnull;
-			char *datname = NULL;
-			char *usename = NULL;
-			char *client_addr = NULL;
-
-			/* Fetch values */
-			pidValue = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i],
-												   SPI_tuptable->tupdesc,
-												   1, &isnull));
-			usename = DatumGetCString(SPI_getbinval(SPI_tuptable->vals[i],
-													SPI_tuptable->tupdesc,
-													3, &isnull));
-			datname = DatumGetCString(SPI_getbinval(SPI_tuptable->vals[i],
-													SPI_tuptable->tupdesc,
-													4, &isnull));
-			client_addr = DatumGetCString(SPI_getbinval(SPI_tuptable->vals[i],
-														SPI_tuptable->tupdesc,
-														5, &isnull));
-
-			/* Log what has been disconnected */
-			elog(LOG, "Disconnected idle connection: PID %d %s/%s/%s",
-				 pidValue, datname ? datname : "none",
-				 usename ? usename : "none",
-				 client_addr ? client_addr : "none");
-		}
-
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
-		pgstat_report_activity(STATE_IDLE, NULL);
 	}
 
 	/* No problems, so clean exit */
@@ -197,8 +500,8 @@ static void
 kill_idle_load_params(void)
 {
 	/*
-	 * Kill backends with idle time more than this interval, possible
-	 * candidates for execution are scanned at the same time interbal.
+	 * Kill backends with idle time more than this interval. The worker
+	 * wakes up when the first idle backend reaches it.
 	 */
 	DefineCustomIntVariable("kill_idle.max_idle_time",
                             "Maximum time allowed for backends to be idle (s).",
@@ -212,6 +515,41 @@ kill_idle_load_params(void)
                             NULL,
                             NULL,
                             NULL);
+
+	DefineCustomIntVariable("kill_idle.max_idle_in_transaction_time",
+                            "Maximum time allowed for backends to be idle in a transaction (s).",
+                            "Default of 0s, disabling it, max of 3600s",
+                            &kill_max_idle_in_transaction_time,
+                            0,
+                            0,
+                            3600,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+	DefineCustomStringVariable("kill_idle.database_timeouts",
+                               "Maximum idle times per database (s).",
+                               "List of name=seconds entries separated by commas, 0 to never kill",
+                               &kill_database_timeouts,
+                               "",
+                               PGC_SIGHUP,
+                               0,
+                               kill_idle_check_timeouts,
+                               NULL,
+                               NULL);
+
+	DefineCustomStringVariable("kill_idle.role_timeouts",
+                               "Maximum idle times per role (s).",
+                               "List of name=seconds entries separated by commas, 0 to never kill",
+                               &kill_role_timeouts,
+                               "",
+                               PGC_SIGHUP,
+                               0,
+                               kill_idle_check_timeouts,
+                               NULL,
+                               NULL);
 }
 
 /*
@@ -25,3 +25,17 @@ CREATE FUNCTION mcxtalloc_extended(size int,
 RETURNS bool
 AS 'MODULE_PATHNAME'
 LANGUAGE C STRICT;
+
+CREATE FUNCTION mcxtalloc_bench(context_type text,
+	alloc_pattern text,
+	num_ops int,
+	alloc_size int DEFAULT 64,
+	OUT allocator text,
+	OUT pattern text,
+	OUT nops int,
+	OUT ns_per_op float8,
+	OUT peak_bytes bigint,
+	OUT fragmentation float8)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
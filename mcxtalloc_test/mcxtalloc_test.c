@@ -14,6 +14,12 @@
 
 #include "postgres.h"
 #include "fmgr.h"
+#include "funcapi.h"
+
+#include "access/htup_details.h"
+#include "portability/instr_time.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
 #include "utils/palloc.h"
 
 PG_MODULE_MAGIC;
@@ -22,6 +28,7 @@ PG_FUNCTION_INFO_V1(mcxtalloc);
 PG_FUNCTION_INFO_V1(mcxtalloc_huge);
 PG_FUNCTION_INFO_V1(mcxtalloc_zero_cmp);
 PG_FUNCTION_INFO_V1(mcxtalloc_extended);
+PG_FUNCTION_INFO_V1(mcxtalloc_bench);
 
 /*
  * mcxtalloc
@@ -113,3 +120,237 @@ mcxtalloc_extended(PG_FUNCTION_ARGS)
 	}
 	PG_RETURN_BOOL(false);
 }
+
+/*
+ * Number of chunks kept allocated by the churn patterns of the benchmark,
+ * and by round of the reset pattern.
+ */
+#define BENCH_LIVE_CHUNKS	1024
+#define BENCH_HUGE_CHUNKS	16
+
+/* sizes used by the mixed pattern */
+static const Size bench_mixed_sizes[] = {
+	8, 16, 24, 40, 64, 100, 128, 250, 512, 1000, 2048, 4000, 8192
+};
+
+#if PG_VERSION_NUM >= 110000
+/*
+ * Get the total amount of memory allocated by a context.
+ */
+static Size
+bench_context_allocated(MemoryContext context)
+{
+#if PG_VERSION_NUM >= 130000
+	return MemoryContextMemAllocated(context, false);
+#else
+	MemoryContextCounters totals;
+
+	MemSet(&totals, 0, sizeof(totals));
+	context->methods->stats(context, NULL, NULL, &totals);
+	return totals.totalspace;
+#endif
+}
+#endif
+
+/*
+ * mcxtalloc_bench
+ * Run an allocation pattern in a fresh memory context of the given type,
+ * and report the time spent per allocation, the memory allocated by the
+ * context at its peak, and the part of it not used by live chunks.
+ *
+ * The patterns are:
+ * - "fixed", allocations of alloc_size bytes, freeing the oldest chunk
+ *   once BENCH_LIVE_CHUNKS chunks are allocated.
+ * - "mixed", the same with sizes cycling between 8 bytes and 8kB.
+ * - "reset", rounds of BENCH_LIVE_CHUNKS allocations of alloc_size
+ *   bytes, followed by a reset of the context, like a context used per
+ *   tuple or per change.
+ * - "huge", the fixed pattern with BENCH_HUGE_CHUNKS chunks, aimed at
+ *   allocations larger than what the allocator keeps in its blocks.
+ */
+Datum
+mcxtalloc_bench(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 110000
+	char	   *allocator = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *pattern = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	int			nops = PG_GETARG_INT32(2);
+	int			alloc_size = PG_GETARG_INT32(3);
+	MemoryContext bench_context;
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6];
+	void	  **chunks;
+	Size	   *sizes;
+	int			nchunks;
+	int			flags = 0;
+	Size		live_bytes = 0;
+	Size		peak_bytes = 0;
+	Size		peak_live_bytes = 0;
+	instr_time	start_time;
+	instr_time	total_time;
+	bool		is_mixed = false;
+	bool		is_reset = false;
+	int			i;
+
+	if (nops <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of operations must be positive")));
+	if (alloc_size <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("allocation size must be positive")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Check the pattern */
+	if (strcmp(pattern, "fixed") == 0)
+		nchunks = BENCH_LIVE_CHUNKS;
+	else if (strcmp(pattern, "mixed") == 0)
+	{
+		nchunks = BENCH_LIVE_CHUNKS;
+		is_mixed = true;
+	}
+	else if (strcmp(pattern, "reset") == 0)
+	{
+		nchunks = BENCH_LIVE_CHUNKS;
+		is_reset = true;
+	}
+	else if (strcmp(pattern, "huge") == 0)
+		nchunks = BENCH_HUGE_CHUNKS;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognized allocation pattern \"%s\"", pattern),
+				 errhint("Valid patterns are \"fixed\", \"mixed\", \"reset\" and \"huge\".")));
+
+	if ((Size) alloc_size > MaxAllocSize)
+		flags |= MCXT_ALLOC_HUGE;
+
+	/* Create the context to benchmark */
+	if (strcmp(allocator, "aset") == 0)
+		bench_context = AllocSetContextCreate(CurrentMemoryContext,
+											  "mcxtalloc bench",
+											  ALLOCSET_DEFAULT_SIZES);
+	else if (strcmp(allocator, "slab") == 0)
+	{
+		Size		block_size = SLAB_DEFAULT_BLOCK_SIZE;
+
+		if (is_mixed)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("slab contexts only support fixed-size allocations")));
+		if ((Size) alloc_size > SLAB_LARGE_BLOCK_SIZE / 32)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("allocation size %d is too large for a slab context",
+							alloc_size)));
+
+		/* fit at least 32 chunks in each block */
+		while (block_size < (Size) alloc_size * 32)
+			block_size *= 2;
+		bench_context = SlabContextCreate(CurrentMemoryContext,
+										  "mcxtalloc bench",
+										  block_size,
+										  alloc_size);
+	}
+	else if (strcmp(allocator, "generation") == 0)
+	{
+#if PG_VERSION_NUM >= 150000
+		bench_context = GenerationContextCreate(CurrentMemoryContext,
+												"mcxtalloc bench",
+												ALLOCSET_DEFAULT_SIZES);
+#else
+		bench_context = GenerationContextCreate(CurrentMemoryContext,
+												"mcxtalloc bench",
+												SLAB_LARGE_BLOCK_SIZE);
+#endif
+	}
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognized allocator \"%s\"", allocator),
+				 errhint("Valid allocators are \"aset\", \"slab\" and \"generation\".")));
+
+	chunks = (void **) palloc0(sizeof(void *) * nchunks);
+	sizes = (Size *) palloc0(sizeof(Size) * nchunks);
+	INSTR_TIME_SET_ZERO(total_time);
+
+	/*
+	 * Run the pattern. The timer is stopped while the memory used by the
+	 * context is looked at, as this can be costly, and this is done only
+	 * when the live chunks are at their maximum.
+	 */
+	INSTR_TIME_SET_CURRENT(start_time);
+	for (i = 0; i < nops; i++)
+	{
+		int			slot = i % nchunks;
+		Size		size = alloc_size;
+
+		if (is_mixed)
+			size = bench_mixed_sizes[i % lengthof(bench_mixed_sizes)];
+
+		if (chunks[slot] != NULL)
+		{
+			pfree(chunks[slot]);
+			live_bytes -= sizes[slot];
+		}
+
+		chunks[slot] = MemoryContextAllocExtended(bench_context, size, flags);
+		sizes[slot] = size;
+		live_bytes += size;
+
+		if (slot == nchunks - 1 || i == nops - 1)
+		{
+			Size		allocated;
+			instr_time	end_time;
+
+			INSTR_TIME_SET_CURRENT(end_time);
+			INSTR_TIME_ACCUM_DIFF(total_time, end_time, start_time);
+
+			allocated = bench_context_allocated(bench_context);
+			if (allocated > peak_bytes)
+			{
+				peak_bytes = allocated;
+				peak_live_bytes = live_bytes;
+			}
+
+			INSTR_TIME_SET_CURRENT(start_time);
+
+			/* end of round for the reset pattern */
+			if (is_reset)
+			{
+				MemoryContextReset(bench_context);
+				MemSet(chunks, 0, sizeof(void *) * nchunks);
+				live_bytes = 0;
+			}
+		}
+	}
+	MemoryContextDelete(bench_context);
+
+	/* Build the result */
+	MemSet(values, 0, sizeof(values));
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = CStringGetTextDatum(allocator);
+	values[1] = CStringGetTextDatum(pattern);
+	values[2] = Int32GetDatum(nops);
+	values[3] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(total_time) * 1e9 / nops);
+	values[4] = Int64GetDatum((int64) peak_bytes);
+	if (peak_bytes > 0)
+		values[5] = Float8GetDatum(1.0 - (double) peak_live_bytes / peak_bytes);
+	else
+		nulls[5] = true;
+
+	pfree(chunks);
+	pfree(sizes);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("mcxtalloc_bench requires PostgreSQL 11 or newer")));
+	PG_RETURN_NULL();
+#endif
+}
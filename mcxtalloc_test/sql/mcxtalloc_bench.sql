@@ -0,0 +1,43 @@
+--
+-- Benchmarks of memory context allocators
+--
+
+-- Timings depend on the environment, so only relative comparisons and
+-- sanity checks of the results are done.
+
+CREATE EXTENSION IF NOT EXISTS mcxtalloc_test;
+
+-- Each supported combination of allocator and pattern
+SELECT a.allocator, p.pattern, b.nops, b.ns_per_op > 0 AS has_time,
+       b.peak_bytes > 0 AS has_peak,
+       b.fragmentation >= 0 AND b.fragmentation < 1 AS valid_fragmentation
+  FROM (VALUES ('aset'), ('slab'), ('generation')) a(allocator),
+       (VALUES ('fixed'), ('mixed'), ('reset')) p(pattern),
+       LATERAL mcxtalloc_bench(a.allocator, p.pattern, 10000) b
+  WHERE NOT (a.allocator = 'slab' AND p.pattern = 'mixed')
+  ORDER BY 1, 2;
+
+-- Allocations larger than the chunk limit of an AllocSet
+SELECT allocator, pattern, peak_bytes >= 16 * 1024 * 1024 AS has_peak
+  FROM mcxtalloc_bench('aset', 'huge', 100, 1024 * 1024);
+SELECT allocator, pattern, peak_bytes >= 16 * 1024 * 1024 AS has_peak
+  FROM mcxtalloc_bench('generation', 'huge', 100, 1024 * 1024);
+
+-- Resetting a context releases its memory for the next round, so its
+-- peak stays close to what a single round needs.
+SELECT r.peak_bytes <= f.peak_bytes * 2 AS reset_bounded
+  FROM mcxtalloc_bench('aset', 'reset', 100000) r,
+       mcxtalloc_bench('aset', 'fixed', 100000) f;
+
+-- A slab context has no rounding to powers of two, so it never uses more
+-- memory than an AllocSet for fixed-size chunks of an awkward size.
+SELECT s.peak_bytes <= a.peak_bytes AS slab_smaller
+  FROM mcxtalloc_bench('slab', 'fixed', 10000, 72) s,
+       mcxtalloc_bench('aset', 'fixed', 10000, 72) a;
+
+-- Errors
+SELECT mcxtalloc_bench('slab', 'mixed', 100);
+SELECT mcxtalloc_bench('foo', 'fixed', 100);
+SELECT mcxtalloc_bench('aset', 'foo', 100);
+SELECT mcxtalloc_bench('aset', 'fixed', 0);
+SELECT mcxtalloc_bench('aset', 'fixed', 100, 0);
@@ -54,3 +54,20 @@ CREATE VIEW pg_wal_receiver_state AS
 	   latest_end_time,
 	   slot_name
     FROM pg_wal_receiver_state();
+
+-- Histograms of synchronous replication waits
+CREATE FUNCTION pg_syncrep_wait_histogram(
+    OUT standby text,
+    OUT bucket_lower_ms float8,
+    OUT bucket_upper_ms float8,
+    OUT waits bigint,
+    OUT reset_time timestamptz
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_syncrep_wait_histogram_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
@@ -1,7 +1,8 @@
 /*-------------------------------------------------------------------------
  *
  * pg_rep_state.c
- *		Fetch backend status regarding synchronous replication.
+ *		Fetch backend status regarding synchronous replication, and
+ *		sample how long backends wait for it.
  *
  * Copyright (c) 1996-2018, PostgreSQL Global Development Group
  *
@@ -17,18 +18,76 @@
 
 #include "access/htup_details.h"
 #include "catalog/pg_type.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
 #include "replication/syncrep.h"
 #include "replication/walreceiver.h"
+#include "replication/walsender.h"
+#include "replication/walsender_private.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
 #include "utils/pg_lsn.h"
 #include "utils/timestamp.h"
 
 PG_MODULE_MAGIC;
 
+void _PG_init(void);
+void pg_rep_state_sampler_main(Datum main_arg) pg_attribute_noreturn();
+
 PG_FUNCTION_INFO_V1(pg_syncrep_state);
 PG_FUNCTION_INFO_V1(pg_wal_receiver_state);
+PG_FUNCTION_INFO_V1(pg_syncrep_wait_histogram);
+PG_FUNCTION_INFO_V1(pg_syncrep_wait_histogram_reset);
+
+/*
+ * Histograms of the time spent by backends waiting for synchronous
+ * replication, filled by the sampler worker. Bucket 0 counts waits of
+ * less than 1ms, bucket N > 0 the waits between 2^(N-1)ms and 2^N ms,
+ * and the last bucket all the longer waits. There is one histogram for
+ * all the waits, and one per synchronous standby, measuring the time it
+ * took for the standby to flush the WAL waited for.
+ */
+#define SYNCREP_HIST_BUCKETS	16
+#define SYNCREP_HIST_STANDBYS	16
+
+typedef struct SyncRepStandbyHist
+{
+	char		name[NAMEDATALEN];	/* application_name, empty if unused */
+	uint64		buckets[SYNCREP_HIST_BUCKETS];
+} SyncRepStandbyHist;
+
+typedef struct SyncRepHistShared
+{
+	slock_t		mutex;
+	TimestampTz reset_time;
+	uint64		buckets[SYNCREP_HIST_BUCKETS];
+	SyncRepStandbyHist standbys[SYNCREP_HIST_STANDBYS];
+} SyncRepHistShared;
+
+static SyncRepHistShared *syncrep_hist = NULL;
+
+/* GUC variables */
+static int	sample_interval = 10;
+
+/* Saved hook values in case of unload */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
+/* flags set by signal handlers */
+static volatile sig_atomic_t got_sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
+
+/* State of a backend regarding synchronous replication */
+typedef struct SyncRepProcState
+{
+	int			pid;
+	int			syncRepState;
+	XLogRecPtr	waitLSN;
+} SyncRepProcState;
 
 /*
  * List backend status regarding synchronous replication
@@ -41,6 +100,8 @@ pg_syncrep_state(PG_FUNCTION_ARGS)
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	MemoryContext per_query_ctx;
 	MemoryContext oldcontext;
+	SyncRepProcState *states;
+	int			nstates = 0;
 	int i;
 
 	if (!superuser())
@@ -72,12 +133,18 @@ pg_syncrep_state(PG_FUNCTION_ARGS)
 	rsinfo->setDesc = tupdesc;
 	MemoryContextSwitchTo(oldcontext);
 
+	/*
+	 * Copy the fields needed while holding the locks, the rest of the
+	 * processing is done once they are released, so as commits waiting
+	 * for synchronous replication are not blocked by this scan.
+	 */
+	states = (SyncRepProcState *)
+		palloc(sizeof(SyncRepProcState) * ProcGlobal->allProcCount);
+
 	LWLockAcquire(ProcArrayLock, LW_SHARED);
 	LWLockAcquire(SyncRepLock, LW_SHARED);
 	for (i = 0; i < ProcGlobal->allProcCount; i++)
 	{
-		Datum		values[3];
-		bool		nulls[3];
 		volatile PGPROC *proc = &ProcGlobal->allProcs[i];
 
 		/* Ignore deleted entries */
@@ -104,8 +171,22 @@ pg_syncrep_state(PG_FUNCTION_ARGS)
 		if (!OidIsValid(proc->roleId))
 			continue;
 
+		states[nstates].pid = proc->pid;
+		states[nstates].syncRepState = proc->syncRepState;
+		states[nstates].waitLSN = proc->waitLSN;
+		nstates++;
+	}
+	LWLockRelease(SyncRepLock);
+	LWLockRelease(ProcArrayLock);
+
+	for (i = 0; i < nstates; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3];
+		SyncRepProcState *state = &states[i];
+
 		/* Check if process really exists */
-		if (kill(proc->pid, 0) != 0)
+		if (kill(state->pid, 0) != 0)
 			continue;
 
 		/* Initialize values and NULL flags arrays */
@@ -113,25 +194,24 @@ pg_syncrep_state(PG_FUNCTION_ARGS)
 		MemSet(nulls, 0, sizeof(nulls));
 
 		/* Fill in values */
-		values[0] = Int32GetDatum(proc->pid);
-		if (proc->syncRepState == SYNC_REP_NOT_WAITING)
+		values[0] = Int32GetDatum(state->pid);
+		if (state->syncRepState == SYNC_REP_NOT_WAITING)
 			values[1] = CStringGetTextDatum("not waiting");
-		else if (proc->syncRepState == SYNC_REP_WAITING)
+		else if (state->syncRepState == SYNC_REP_WAITING)
 			values[1] = CStringGetTextDatum("waiting");
-		else if (proc->syncRepState == SYNC_REP_WAIT_COMPLETE)
+		else if (state->syncRepState == SYNC_REP_WAIT_COMPLETE)
 			values[1] = CStringGetTextDatum("wait complete");
 		else
 			Assert(false); /* should not happen */
 
-		if (XLogRecPtrIsInvalid(proc->waitLSN))
+		if (XLogRecPtrIsInvalid(state->waitLSN))
 			nulls[2] = true;
 		else
-			values[2] = LSNGetDatum(proc->waitLSN);
+			values[2] = LSNGetDatum(state->waitLSN);
 
 		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
-	LWLockRelease(SyncRepLock);
-	LWLockRelease(ProcArrayLock);
+	pfree(states);
 
 	/* clean up and return the tuplestore */
 	tuplestore_donestoring(tupstore);
@@ -282,3 +362,458 @@ pg_wal_receiver_state(PG_FUNCTION_ARGS)
 	PG_RETURN_DATUM(HeapTupleGetDatum(
 						  heap_form_tuple(tupdesc, values, nulls)));
 }
+
+/*
+ * Allocate or attach to the shared memory used for the histograms.
+ */
+static void
+pg_rep_state_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	syncrep_hist = ShmemInitStruct("pg_rep_state",
+								   sizeof(SyncRepHistShared),
+								   &found);
+	if (!found)
+	{
+		MemSet(syncrep_hist, 0, sizeof(SyncRepHistShared));
+		SpinLockInit(&syncrep_hist->mutex);
+		syncrep_hist->reset_time = GetCurrentTimestamp();
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+pg_rep_state_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void
+pg_rep_state_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+/*
+ * Get the bucket of a histogram for the given wait time.
+ */
+static int
+syncrep_hist_bucket(TimestampTz start, TimestampTz end)
+{
+	int64		msecs = (end - start) / 1000;
+	int			bucket = 0;
+
+	while (msecs > 0 && bucket < SYNCREP_HIST_BUCKETS - 1)
+	{
+		msecs >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/*
+ * Count a wait in the histogram of a standby, found by name.
+ */
+static void
+syncrep_hist_add_standby(const char *name, int bucket)
+{
+	SyncRepStandbyHist *free_slot = NULL;
+	int			i;
+
+	SpinLockAcquire(&syncrep_hist->mutex);
+	for (i = 0; i < SYNCREP_HIST_STANDBYS; i++)
+	{
+		SyncRepStandbyHist *standby = &syncrep_hist->standbys[i];
+
+		if (standby->name[0] == '\0')
+		{
+			if (free_slot == NULL)
+				free_slot = standby;
+			continue;
+		}
+		if (strcmp(standby->name, name) == 0)
+		{
+			standby->buckets[bucket]++;
+			SpinLockRelease(&syncrep_hist->mutex);
+			return;
+		}
+	}
+
+	/* Standby not tracked yet, ignored if there is no room */
+	if (free_slot != NULL)
+	{
+		strlcpy(free_slot->name, name, NAMEDATALEN);
+		free_slot->buckets[bucket]++;
+	}
+	SpinLockRelease(&syncrep_hist->mutex);
+}
+
+/*
+ * State of a backend waiting for synchronous replication, as seen by the
+ * sampler. The standbys having reached the position waited for are kept
+ * in a bitmask indexed by WAL sender slot, so only the first slots are
+ * tracked for the histograms per standby.
+ */
+#define SYNCREP_TRACK_WALSENDERS	64
+
+typedef struct SyncRepWaitTrack
+{
+	bool		waiting;
+	XLogRecPtr	lsn;			/* LSN waited for */
+	TimestampTz start;			/* first time the wait was seen */
+	uint64		reached;		/* mask of standbys that reached lsn */
+} SyncRepWaitTrack;
+
+/*
+ * State of a WAL sender, as seen by the sampler. Standbys are identified
+ * by the application_name of their WAL sender, looked up when a new WAL
+ * sender shows up.
+ */
+typedef struct SyncRepStandbyTrack
+{
+	int			pid;
+	char		name[NAMEDATALEN];
+	XLogRecPtr	flush;
+	bool		is_sync;
+} SyncRepStandbyTrack;
+
+/*
+ * Get the application_name of a WAL sender.
+ */
+static void
+syncrep_lookup_standby_name(int pid, char *name)
+{
+	int			num_backends;
+	int			i;
+
+	strlcpy(name, "unknown", NAMEDATALEN);
+
+	pgstat_clear_snapshot();
+	num_backends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= num_backends; i++)
+	{
+		PgBackendStatus *beentry = pgstat_fetch_stat_beentry(i);
+
+		if (beentry != NULL && beentry->st_procpid == pid)
+		{
+			if (beentry->st_appname[0] != '\0')
+				strlcpy(name, beentry->st_appname, NAMEDATALEN);
+			break;
+		}
+	}
+	pgstat_clear_snapshot();
+}
+
+/*
+ * Entry point of the worker sampling the state of backends regarding
+ * synchronous replication, and measuring how long they wait.
+ */
+void
+pg_rep_state_sampler_main(Datum main_arg)
+{
+	SyncRepWaitTrack *waits;
+	SyncRepProcState *states;
+	uint64		buckets[SYNCREP_HIST_BUCKETS];
+	SyncRepStandbyTrack *standbys;
+	int			nprocs = ProcGlobal->allProcCount;
+	int			nstandbys = Min(max_wal_senders, SYNCREP_TRACK_WALSENDERS);
+
+	StaticAssertStmt(SYNCREP_TRACK_WALSENDERS <= sizeof(uint64) * BITS_PER_BYTE,
+					 "mask of standbys too small for the WAL senders tracked");
+
+	pqsignal(SIGHUP, pg_rep_state_sighup);
+	pqsignal(SIGTERM, pg_rep_state_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	waits = (SyncRepWaitTrack *) palloc0(sizeof(SyncRepWaitTrack) * nprocs);
+	states = (SyncRepProcState *) palloc0(sizeof(SyncRepProcState) * nprocs);
+	standbys = (SyncRepStandbyTrack *)
+		palloc0(sizeof(SyncRepStandbyTrack) * Max(nstandbys, 1));
+
+	while (!got_sigterm)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+		int			rc;
+		int			i;
+		int			j;
+
+		/* Get the flush position of each synchronous standby */
+		for (j = 0; j < nstandbys; j++)
+		{
+			WalSnd	   *walsnd = &WalSndCtl->walsnds[j];
+			int			pid;
+
+			SpinLockAcquire(&walsnd->mutex);
+			pid = walsnd->pid;
+			standbys[j].flush = walsnd->flush;
+			SpinLockRelease(&walsnd->mutex);
+			standbys[j].is_sync = (pid != 0 &&
+								   walsnd->sync_standby_priority > 0);
+
+			if (pid != standbys[j].pid)
+			{
+				standbys[j].pid = pid;
+				if (pid != 0)
+					syncrep_lookup_standby_name(pid, standbys[j].name);
+			}
+		}
+
+		/*
+		 * Copy the state of the backends, holding the lock only for that as
+		 * WAL senders need it to release the waiting backends.
+		 */
+		LWLockAcquire(SyncRepLock, LW_SHARED);
+		for (i = 0; i < nprocs; i++)
+		{
+			PGPROC	   *proc = &ProcGlobal->allProcs[i];
+
+			states[i].syncRepState = proc->syncRepState;
+			states[i].waitLSN = proc->waitLSN;
+		}
+		LWLockRelease(SyncRepLock);
+
+		MemSet(buckets, 0, sizeof(buckets));
+		for (i = 0; i < nprocs; i++)
+		{
+			SyncRepWaitTrack *track = &waits[i];
+			bool		waiting = (states[i].syncRepState == SYNC_REP_WAITING);
+			XLogRecPtr	lsn = states[i].waitLSN;
+
+			if (track->waiting)
+			{
+				/*
+				 * Count the standbys that have flushed the WAL waited for,
+				 * including when this is what has just ended the wait.
+				 */
+				for (j = 0; j < nstandbys; j++)
+				{
+					if (!standbys[j].is_sync ||
+						(track->reached & ((uint64) 1 << j)) != 0 ||
+						standbys[j].flush < track->lsn)
+						continue;
+
+					track->reached |= ((uint64) 1 << j);
+					syncrep_hist_add_standby(standbys[j].name,
+											 syncrep_hist_bucket(track->start, now));
+				}
+
+				/* The previous wait is finished */
+				if (!waiting || track->lsn != lsn)
+				{
+					buckets[syncrep_hist_bucket(track->start, now)]++;
+					track->waiting = false;
+				}
+			}
+
+			/* A new wait begins */
+			if (waiting && !track->waiting)
+			{
+				track->waiting = true;
+				track->lsn = lsn;
+				track->start = now;
+				track->reached = 0;
+			}
+		}
+
+		SpinLockAcquire(&syncrep_hist->mutex);
+		for (i = 0; i < SYNCREP_HIST_BUCKETS; i++)
+			syncrep_hist->buckets[i] += buckets[i];
+		SpinLockRelease(&syncrep_hist->mutex);
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   sample_interval,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Report the histograms of synchronous replication waits, one row per
+ * bucket, for all the waits and then for each standby.
+ */
+Datum
+pg_syncrep_wait_histogram(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	SyncRepHistShared hist;
+	int			i;
+	int			j;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to fetch synchronous replication state"))));
+
+	if (syncrep_hist == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_rep_state must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Take a copy of all the histograms */
+	SpinLockAcquire(&syncrep_hist->mutex);
+	memcpy(&hist, syncrep_hist, sizeof(SyncRepHistShared));
+	SpinLockRelease(&syncrep_hist->mutex);
+
+	for (j = -1; j < SYNCREP_HIST_STANDBYS; j++)
+	{
+		uint64	   *buckets;
+
+		if (j >= 0 && hist.standbys[j].name[0] == '\0')
+			continue;
+		buckets = (j < 0) ? hist.buckets : hist.standbys[j].buckets;
+
+		for (i = 0; i < SYNCREP_HIST_BUCKETS; i++)
+		{
+			Datum		values[5];
+			bool		nulls[5];
+
+			MemSet(values, 0, sizeof(values));
+			MemSet(nulls, 0, sizeof(nulls));
+
+			if (j < 0)
+				nulls[0] = true;
+			else
+				values[0] = CStringGetTextDatum(hist.standbys[j].name);
+			if (i == 0)
+				values[1] = Float8GetDatum(0.0);
+			else
+				values[1] = Float8GetDatum((double) ((int64) 1 << (i - 1)));
+			if (i == SYNCREP_HIST_BUCKETS - 1)
+				nulls[2] = true;
+			else
+				values[2] = Float8GetDatum((double) ((int64) 1 << i));
+			values[3] = Int64GetDatum((int64) buckets[i]);
+			values[4] = TimestampTzGetDatum(hist.reset_time);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Reset the histograms of synchronous replication waits.
+ */
+Datum
+pg_syncrep_wait_histogram_reset(PG_FUNCTION_ARGS)
+{
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to reset synchronous replication histograms"))));
+
+	if (syncrep_hist == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_rep_state must be loaded via shared_preload_libraries")));
+
+	SpinLockAcquire(&syncrep_hist->mutex);
+	MemSet(syncrep_hist->buckets, 0, sizeof(syncrep_hist->buckets));
+	MemSet(syncrep_hist->standbys, 0, sizeof(syncrep_hist->standbys));
+	syncrep_hist->reset_time = GetCurrentTimestamp();
+	SpinLockRelease(&syncrep_hist->mutex);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Entry point of this module, the sampler is only available when the
+ * library is loaded with shared_preload_libraries.
+ */
+void
+_PG_init(void)
+{
+	BackgroundWorker worker;
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("pg_rep_state.sample_interval",
+							"Interval between two samples of the synchronous replication waits.",
+							"0 disables sampling.",
+							&sample_interval,
+							10,
+							0,
+							1000,
+							PGC_POSTMASTER,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(SyncRepHistShared)));
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pg_rep_state_shmem_startup;
+
+	if (sample_interval == 0)
+		return;
+
+	MemSet(&worker, 0, sizeof(BackgroundWorker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_rep_state");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_rep_state_sampler_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_rep_state sampler");
+	worker.bgw_restart_time = 10;
+	worker.bgw_main_arg = (Datum) 0;
+	worker.bgw_notify_pid = 0;
+	RegisterBackgroundWorker(&worker);
+}
@@ -22,3 +22,37 @@ CREATE FUNCTION pg_statvfs(
 RETURNS record
 AS 'MODULE_PATHNAME'
 LANGUAGE C VOLATILE;
+
+-- Latest sample of each path, data directory, pg_wal and tablespaces
+CREATE FUNCTION pg_statvfs_all(
+    OUT kind text,
+    OUT spcoid oid,
+    OUT path text,
+    OUT sample_time timestamptz,
+    OUT total_bytes bigint,
+    OUT free_bytes bigint,
+    OUT avail_bytes bigint,
+    OUT total_files bigint,
+    OUT avail_files bigint,
+    OUT fill_rate float8,
+    OUT time_to_full interval
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+-- History of samples of each path
+CREATE FUNCTION pg_statvfs_history(
+    OUT kind text,
+    OUT spcoid oid,
+    OUT path text,
+    OUT sample_time timestamptz,
+    OUT total_bytes bigint,
+    OUT free_bytes bigint,
+    OUT avail_bytes bigint,
+    OUT total_files bigint,
+    OUT avail_files bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
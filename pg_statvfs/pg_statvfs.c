@@ -1,7 +1,8 @@
 /*-------------------------------------------------------------------------
  *
  * pg_statvfs.c
- *		Wrapper for system call to statvfs()
+ *		Wrapper for system call to statvfs(), and sampler of the file
+ *		systems used by the data directory, pg_wal and the tablespaces.
  *
  * Copyright (c) 1996-2018, PostgreSQL Global Development Group
  *
@@ -12,6 +13,7 @@
  */
 
 #include <sys/statvfs.h>
+#include <unistd.h>
 
 #include "postgres.h"
 #include "fmgr.h"
@@ -19,15 +21,93 @@
 #include "miscadmin.h"
 
 #include "access/htup_details.h"
+#include "access/xlog_internal.h"
 #include "catalog/pg_type.h"
+#include "postmaster/bgworker.h"
 #include "postmaster/syslogger.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lock.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
 
 PG_MODULE_MAGIC;
 
+void _PG_init(void);
+void pg_statvfs_sampler_main(Datum main_arg) pg_attribute_noreturn();
+
 PG_FUNCTION_INFO_V1(pg_statvfs);
+PG_FUNCTION_INFO_V1(pg_statvfs_all);
+PG_FUNCTION_INFO_V1(pg_statvfs_history);
+
+/*
+ * Paths sampled by the worker, with their history of samples kept in
+ * shared memory. The data directory, pg_wal and each tablespace have
+ * their own entry, even if some of them share the same file system.
+ */
+#define STATVFS_MAX_PATHS	64
+
+typedef enum StatvfsPathKind
+{
+	STATVFS_PATH_DATA,
+	STATVFS_PATH_WAL,
+	STATVFS_PATH_TABLESPACE
+} StatvfsPathKind;
+
+static const char *const statvfs_kind_names[] = {
+	"data",
+	"wal",
+	"tablespace"
+};
+
+typedef struct StatvfsSample
+{
+	TimestampTz time;
+	uint64		total_bytes;
+	uint64		free_bytes;
+	uint64		avail_bytes;
+	uint64		total_files;
+	uint64		avail_files;
+} StatvfsSample;
+
+typedef struct StatvfsPath
+{
+	bool		in_use;
+	StatvfsPathKind kind;
+	Oid			spcoid;			/* tablespace, InvalidOid if none */
+	char		path[MAXPGPATH];
+	int			nsamples;		/* number of valid samples */
+	int			next;			/* next slot of the history to fill */
+} StatvfsPath;
+
+typedef struct StatvfsShared
+{
+	LWLock	   *lock;
+	StatvfsPath paths[STATVFS_MAX_PATHS];
+	/* history of each path follows, statvfs_history_size samples each */
+} StatvfsShared;
+
+static StatvfsShared *statvfs_shared = NULL;
+
+#define StatvfsHistory(shared, i) \
+	((StatvfsSample *) ((char *) (shared) + MAXALIGN(sizeof(StatvfsShared))) + \
+	 (i) * statvfs_history_size)
+
+/* GUC variables */
+static int	statvfs_sample_interval = 10;
+static int	statvfs_history_size = 60;
+
+/* Saved hook values in case of unload */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* flags set by signal handlers */
+static volatile sig_atomic_t got_sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
 
 
 /*
@@ -150,3 +230,586 @@ pg_statvfs(PG_FUNCTION_ARGS)
 	PG_RETURN_DATUM(
 		HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
+
+/*
+ * Size of the shared memory used by the sampler.
+ */
+static Size
+pg_statvfs_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(StatvfsShared)),
+					mul_size(STATVFS_MAX_PATHS,
+							 mul_size(statvfs_history_size,
+									  sizeof(StatvfsSample))));
+}
+
+/*
+ * Allocate or attach to the shared memory used by the sampler.
+ */
+static void
+pg_statvfs_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	statvfs_shared = ShmemInitStruct("pg_statvfs",
+									 pg_statvfs_shmem_size(),
+									 &found);
+	if (!found)
+	{
+		MemSet(statvfs_shared, 0, pg_statvfs_shmem_size());
+		statvfs_shared->lock = &(GetNamedLWLockTranche("pg_statvfs"))->lock;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+pg_statvfs_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void
+pg_statvfs_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+/*
+ * Path sampled during one cycle of the worker, before being saved in
+ * shared memory.
+ */
+typedef struct StatvfsTarget
+{
+	StatvfsPathKind kind;
+	Oid			spcoid;
+	char		path[MAXPGPATH];	/* path reported */
+	char		statpath[MAXPGPATH];	/* path given to statvfs() */
+	bool		valid;
+	StatvfsSample sample;
+} StatvfsTarget;
+
+/*
+ * Get the list of paths to sample: the data directory, pg_wal and the
+ * location of each tablespace, as found in pg_tblspc so as no database
+ * connection is needed.
+ */
+static int
+pg_statvfs_get_targets(StatvfsTarget *targets)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	int			n = 0;
+
+	targets[n].kind = STATVFS_PATH_DATA;
+	targets[n].spcoid = InvalidOid;
+	strlcpy(targets[n].path, DataDir, MAXPGPATH);
+	strlcpy(targets[n].statpath, ".", MAXPGPATH);
+	n++;
+
+	targets[n].kind = STATVFS_PATH_WAL;
+	targets[n].spcoid = InvalidOid;
+	snprintf(targets[n].path, MAXPGPATH, "%s/%s", DataDir, XLOGDIR);
+	strlcpy(targets[n].statpath, XLOGDIR, MAXPGPATH);
+	n++;
+
+	dir = AllocateDir("pg_tblspc");
+	while ((de = ReadDir(dir, "pg_tblspc")) != NULL && n < STATVFS_MAX_PATHS)
+	{
+		Oid			spcoid;
+		char	   *endptr;
+		int			len;
+
+		errno = 0;
+		spcoid = (Oid) strtoul(de->d_name, &endptr, 10);
+		if (errno != 0 || *endptr != '\0' || !OidIsValid(spcoid))
+			continue;
+
+		targets[n].kind = STATVFS_PATH_TABLESPACE;
+		targets[n].spcoid = spcoid;
+		snprintf(targets[n].statpath, MAXPGPATH, "pg_tblspc/%s", de->d_name);
+
+		/* report the location of the tablespace if possible */
+		len = readlink(targets[n].statpath, targets[n].path, MAXPGPATH - 1);
+		if (len < 0)
+			snprintf(targets[n].path, MAXPGPATH, "%s/%s",
+					 DataDir, targets[n].statpath);
+		else
+			targets[n].path[len] = '\0';
+		n++;
+	}
+	FreeDir(dir);
+
+	return n;
+}
+
+/*
+ * Save the samples of one cycle in shared memory. Paths that have
+ * disappeared lose their history.
+ */
+static void
+pg_statvfs_save_samples(StatvfsTarget *targets, int ntargets)
+{
+	bool		seen[STATVFS_MAX_PATHS];
+	int			i;
+	int			j;
+
+	MemSet(seen, 0, sizeof(seen));
+
+	LWLockAcquire(statvfs_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < ntargets; i++)
+	{
+		StatvfsTarget *target = &targets[i];
+		StatvfsPath *entry = NULL;
+		int			free_slot = -1;
+
+		for (j = 0; j < STATVFS_MAX_PATHS; j++)
+		{
+			StatvfsPath *cur = &statvfs_shared->paths[j];
+
+			if (!cur->in_use)
+			{
+				if (free_slot < 0)
+					free_slot = j;
+				continue;
+			}
+			if (cur->kind == target->kind &&
+				cur->spcoid == target->spcoid &&
+				strcmp(cur->path, target->path) == 0)
+			{
+				entry = cur;
+				break;
+			}
+		}
+
+		if (entry == NULL)
+		{
+			if (free_slot < 0)
+				continue;
+			j = free_slot;
+			entry = &statvfs_shared->paths[j];
+			entry->in_use = true;
+			entry->kind = target->kind;
+			entry->spcoid = target->spcoid;
+			strlcpy(entry->path, target->path, MAXPGPATH);
+			entry->nsamples = 0;
+			entry->next = 0;
+		}
+		seen[j] = true;
+
+		if (!target->valid)
+			continue;
+
+		StatvfsHistory(statvfs_shared, j)[entry->next] = target->sample;
+		entry->next = (entry->next + 1) % statvfs_history_size;
+		if (entry->nsamples < statvfs_history_size)
+			entry->nsamples++;
+	}
+
+	for (j = 0; j < STATVFS_MAX_PATHS; j++)
+	{
+		if (!seen[j])
+			statvfs_shared->paths[j].in_use = false;
+	}
+	LWLockRelease(statvfs_shared->lock);
+}
+
+/*
+ * Check if a path is in a list of paths whose previous sample failed.
+ */
+static bool
+pg_statvfs_path_failed(char (*failed)[MAXPGPATH], int nfailed,
+					   const char *path)
+{
+	int			i;
+
+	for (i = 0; i < nfailed; i++)
+	{
+		if (strcmp(failed[i], path) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Entry point of the worker sampling the file systems. Failures are
+ * remembered by path, as the position of a tablespace in the list of
+ * paths changes when others are created or dropped.
+ */
+void
+pg_statvfs_sampler_main(Datum main_arg)
+{
+	StatvfsTarget *targets;
+	char		(*failed)[MAXPGPATH];
+	char		(*new_failed)[MAXPGPATH];
+	int			nfailed = 0;
+
+	pqsignal(SIGHUP, pg_statvfs_sighup);
+	pqsignal(SIGTERM, pg_statvfs_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	targets = (StatvfsTarget *) palloc(sizeof(StatvfsTarget) * STATVFS_MAX_PATHS);
+	failed = palloc(MAXPGPATH * STATVFS_MAX_PATHS);
+	new_failed = palloc(MAXPGPATH * STATVFS_MAX_PATHS);
+
+	while (!got_sigterm)
+	{
+		int			ntargets;
+		int			new_nfailed = 0;
+		char		(*swap)[MAXPGPATH];
+		int			rc;
+		int			i;
+
+		/* Do the system calls with no lock held */
+		ntargets = pg_statvfs_get_targets(targets);
+		for (i = 0; i < ntargets; i++)
+		{
+			StatvfsTarget *target = &targets[i];
+			struct statvfs fsdata;
+
+			target->valid = (statvfs(target->statpath, &fsdata) == 0);
+			if (!target->valid)
+			{
+				/* complain once until the path works again */
+				if (!pg_statvfs_path_failed(failed, nfailed, target->path))
+					ereport(LOG,
+							(errcode_for_file_access(),
+							 errmsg("could not stat filesystem path \"%s\": %m",
+									target->path)));
+				strlcpy(new_failed[new_nfailed++], target->path, MAXPGPATH);
+				continue;
+			}
+
+			target->sample.time = GetCurrentTimestamp();
+			target->sample.total_bytes = (uint64) fsdata.f_blocks * fsdata.f_frsize;
+			target->sample.free_bytes = (uint64) fsdata.f_bfree * fsdata.f_frsize;
+			target->sample.avail_bytes = (uint64) fsdata.f_bavail * fsdata.f_frsize;
+			target->sample.total_files = (uint64) fsdata.f_files;
+			target->sample.avail_files = (uint64) fsdata.f_favail;
+		}
+
+		swap = failed;
+		failed = new_failed;
+		new_failed = swap;
+		nfailed = new_nfailed;
+
+		pg_statvfs_save_samples(targets, ntargets);
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   statvfs_sample_interval * 1000L,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Copy of the state of one path, taken from shared memory.
+ */
+typedef struct StatvfsPathCopy
+{
+	StatvfsPath entry;
+	StatvfsSample *samples;		/* from the oldest to the newest */
+} StatvfsPathCopy;
+
+/*
+ * Initialize a materialized SRF, and take a copy of the sampled paths
+ * so as the lock is not held while building tuples.
+ */
+static int
+pg_statvfs_copy_paths(FunctionCallInfo fcinfo, Tuplestorestate **tupstore,
+					  TupleDesc *tupdesc, StatvfsPathCopy **copies)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			ncopies = 0;
+	int			i;
+	int			j;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to read filesystem statistics"))));
+
+	if (statvfs_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_statvfs must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	*tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = *tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	*copies = (StatvfsPathCopy *) palloc(sizeof(StatvfsPathCopy) * STATVFS_MAX_PATHS);
+
+	LWLockAcquire(statvfs_shared->lock, LW_SHARED);
+	for (i = 0; i < STATVFS_MAX_PATHS; i++)
+	{
+		StatvfsPath *entry = &statvfs_shared->paths[i];
+		StatvfsSample *history = StatvfsHistory(statvfs_shared, i);
+		StatvfsPathCopy *copy = &(*copies)[ncopies];
+		int			first;
+
+		if (!entry->in_use)
+			continue;
+
+		copy->entry = *entry;
+		copy->samples = (StatvfsSample *)
+			palloc(sizeof(StatvfsSample) * Max(entry->nsamples, 1));
+
+		/* oldest sample is at "next" once the history has wrapped */
+		first = (entry->nsamples < statvfs_history_size) ? 0 : entry->next;
+		for (j = 0; j < entry->nsamples; j++)
+			copy->samples[j] = history[(first + j) % statvfs_history_size];
+		ncopies++;
+	}
+	LWLockRelease(statvfs_shared->lock);
+
+	return ncopies;
+}
+
+/*
+ * Fill in the values describing a path.
+ */
+static void
+pg_statvfs_path_values(StatvfsPath *entry, Datum *values, bool *nulls)
+{
+	values[0] = CStringGetTextDatum(statvfs_kind_names[entry->kind]);
+	if (OidIsValid(entry->spcoid))
+		values[1] = ObjectIdGetDatum(entry->spcoid);
+	else
+		nulls[1] = true;
+	values[2] = CStringGetTextDatum(entry->path);
+}
+
+/*
+ * pg_statvfs_all
+ * Latest sample of each path, with the rate at which its file system is
+ * being filled and the estimated time until it is full, both computed
+ * from the oldest and newest samples of the history.
+ */
+Datum
+pg_statvfs_all(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	StatvfsPathCopy *copies;
+	int			ncopies;
+	int			i;
+
+	ncopies = pg_statvfs_copy_paths(fcinfo, &tupstore, &tupdesc, &copies);
+
+	for (i = 0; i < ncopies; i++)
+	{
+		StatvfsPathCopy *copy = &copies[i];
+		StatvfsSample *first;
+		StatvfsSample *last;
+		Datum		values[11];
+		bool		nulls[11];
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		pg_statvfs_path_values(&copy->entry, values, nulls);
+
+		if (copy->entry.nsamples == 0)
+		{
+			int			j;
+
+			for (j = 3; j < 11; j++)
+				nulls[j] = true;
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			continue;
+		}
+
+		first = &copy->samples[0];
+		last = &copy->samples[copy->entry.nsamples - 1];
+
+		values[3] = TimestampTzGetDatum(last->time);
+		values[4] = Int64GetDatum((int64) last->total_bytes);
+		values[5] = Int64GetDatum((int64) last->free_bytes);
+		values[6] = Int64GetDatum((int64) last->avail_bytes);
+		values[7] = Int64GetDatum((int64) last->total_files);
+		values[8] = Int64GetDatum((int64) last->avail_files);
+
+		/* Rate in bytes per second, positive when space is consumed */
+		if (last->time > first->time)
+		{
+			double		secs = (double) (last->time - first->time) / USECS_PER_SEC;
+			double		rate;
+
+			rate = ((double) first->avail_bytes - (double) last->avail_bytes) / secs;
+			values[9] = Float8GetDatum(rate);
+
+			if (rate > 0 &&
+				(double) last->avail_bytes / rate < (double) PG_INT64_MAX / USECS_PER_SEC)
+			{
+				Interval   *interval = (Interval *) palloc0(sizeof(Interval));
+
+				interval->time = (TimeOffset)
+					((double) last->avail_bytes / rate * USECS_PER_SEC);
+				values[10] = IntervalPGetDatum(interval);
+			}
+			else
+				nulls[10] = true;
+		}
+		else
+		{
+			nulls[9] = true;
+			nulls[10] = true;
+		}
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * pg_statvfs_history
+ * All the samples kept for each path, from the oldest to the newest.
+ */
+Datum
+pg_statvfs_history(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	StatvfsPathCopy *copies;
+	int			ncopies;
+	int			i;
+	int			j;
+
+	ncopies = pg_statvfs_copy_paths(fcinfo, &tupstore, &tupdesc, &copies);
+
+	for (i = 0; i < ncopies; i++)
+	{
+		StatvfsPathCopy *copy = &copies[i];
+
+		for (j = 0; j < copy->entry.nsamples; j++)
+		{
+			StatvfsSample *sample = &copy->samples[j];
+			Datum		values[9];
+			bool		nulls[9];
+
+			MemSet(values, 0, sizeof(values));
+			MemSet(nulls, 0, sizeof(nulls));
+
+			pg_statvfs_path_values(&copy->entry, values, nulls);
+			values[3] = TimestampTzGetDatum(sample->time);
+			values[4] = Int64GetDatum((int64) sample->total_bytes);
+			values[5] = Int64GetDatum((int64) sample->free_bytes);
+			values[6] = Int64GetDatum((int64) sample->avail_bytes);
+			values[7] = Int64GetDatum((int64) sample->total_files);
+			values[8] = Int64GetDatum((int64) sample->avail_files);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Entry point of this module, the sampler is only available when the
+ * library is loaded with shared_preload_libraries.
+ */
+void
+_PG_init(void)
+{
+	BackgroundWorker worker;
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("pg_statvfs.sample_interval",
+							"Interval between two samples of the file systems.",
+							NULL,
+							&statvfs_sample_interval,
+							10,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_statvfs.history_size",
+							"Number of samples kept for each path.",
+							NULL,
+							&statvfs_history_size,
+							60,
+							2,
+							10000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	RequestAddinShmemSpace(pg_statvfs_shmem_size());
+	RequestNamedLWLockTranche("pg_statvfs", 1);
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pg_statvfs_shmem_startup;
+
+	MemSet(&worker, 0, sizeof(BackgroundWorker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_statvfs");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_statvfs_sampler_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_statvfs sampler");
+	worker.bgw_restart_time = 10;
+	worker.bgw_main_arg = (Datum) 0;
+	worker.bgw_notify_pid = 0;
+	RegisterBackgroundWorker(&worker);
+}
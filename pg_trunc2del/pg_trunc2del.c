@@ -13,10 +13,23 @@
 
 #include "postgres.h"
 
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits_fn.h"
+#include "catalog/pg_type.h"
 #include "executor/spi.h"
 #include "fmgr.h"
+#include "nodes/makefuncs.h"
+#include "storage/bufmgr.h"
+#include "storage/itemptr.h"
 #include "tcop/utility.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
 #include "utils/snapmgr.h"
 
 PG_MODULE_MAGIC;
@@ -28,6 +41,105 @@ void	_PG_fini(void);
 
 static ProcessUtility_hook_type prev_utility_hook = NULL;
 
+/*
+ * Maximum number of blocks per DELETE, keeping the array of ctids built
+ * for each range, of MaxHeapTuplesPerPage items per block, small.
+ */
+#define TRUNC2DEL_MAX_CHUNK_SIZE	10000
+
+/* GUC variables */
+static int	trunc2del_chunk_size = 0;
+static int	trunc2del_truncate_threshold = -1;
+
+/*
+ * Delete all the tuples of a relation. If chunk_size is set, the
+ * deletion is done with one DELETE per range of chunk_size blocks, each
+ * one scanning only the wanted blocks with a TID scan on an array of all
+ * the ctids the range can hold.
+ */
+static void
+trunc2del_relation(Relation rel)
+{
+	StringInfoData	buf;
+	char		   *relname;
+	BlockNumber		nblocks;
+	BlockNumber		blkno;
+	SPIPlanPtr		plan;
+	Oid				argtypes[1];
+	ItemPointerData *tids;
+	Datum		   *tiddatums;
+
+	relname = quote_qualified_identifier(
+					get_namespace_name(RelationGetNamespace(rel)),
+					RelationGetRelationName(rel));
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "DELETE FROM ONLY %s", relname);
+
+	if (trunc2del_chunk_size == 0 ||
+		rel->rd_rel->relkind != RELKIND_RELATION)
+	{
+		if (SPI_execute(buf.data, false, 0) != SPI_OK_DELETE)
+			elog(ERROR, "Error while executing TRUNCATE (really?)");
+		return;
+	}
+
+	/*
+	 * No tuples can be added behind our back as the relation is locked,
+	 * so the number of blocks can be fetched once.
+	 */
+	nblocks = RelationGetNumberOfBlocks(rel);
+	appendStringInfoString(&buf, " WHERE ctid = ANY ($1)");
+
+	argtypes[0] = get_array_type(TIDOID);
+	plan = SPI_prepare(buf.data, 1, argtypes);
+	if (plan == NULL)
+		elog(ERROR, "SPI_prepare failed for \"%s\"", buf.data);
+
+	tids = (ItemPointerData *)
+		palloc(sizeof(ItemPointerData) * trunc2del_chunk_size *
+			   MaxHeapTuplesPerPage);
+	tiddatums = (Datum *)
+		palloc(sizeof(Datum) * trunc2del_chunk_size * MaxHeapTuplesPerPage);
+
+	for (blkno = 0; blkno < nblocks; blkno += trunc2del_chunk_size)
+	{
+		Datum		values[1];
+		ArrayType  *tidarray;
+		BlockNumber	last;
+		BlockNumber	b;
+		int			ntids = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		last = Min(nblocks, blkno + trunc2del_chunk_size) - 1;
+		for (b = blkno; b <= last; b++)
+		{
+			OffsetNumber	off;
+
+			for (off = FirstOffsetNumber; off <= MaxHeapTuplesPerPage; off++)
+			{
+				ItemPointerSet(&tids[ntids], b, off);
+				tiddatums[ntids] = PointerGetDatum(&tids[ntids]);
+				ntids++;
+			}
+		}
+
+		tidarray = construct_array(tiddatums, ntids, TIDOID,
+								   sizeof(ItemPointerData), false, 's');
+		values[0] = PointerGetDatum(tidarray);
+
+		if (SPI_execute_plan(plan, values, NULL, false, 0) != SPI_OK_DELETE)
+			elog(ERROR, "Error while executing TRUNCATE (really?)");
+
+		pfree(tidarray);
+	}
+
+	pfree(tids);
+	pfree(tiddatums);
+	SPI_freeplan(plan);
+}
+
 static void
 trunc2del(Node *parsetree,
 		  const char *queryString,
@@ -47,40 +159,91 @@ trunc2del(Node *parsetree,
 		case T_TruncateStmt:
 		{
 			TruncateStmt   *stmt = (TruncateStmt *) parsetree;
-			RangeVar	   *rv = (RangeVar *) linitial(stmt->relations);
-			int				ret;
-			StringInfoData	buf;
-			Relation		rel;
+			List		   *relids = NIL;
+			List		   *truncate_rels = NIL;
+			ListCell	   *cell;
 
 			/*
-			 * Check existence of relation queried, this is important in case
-			 * of an unexistent relation to not let the user know of this
-			 * run switch. As we are faking a TRUNCATE, it is as well important
-			 * to take a exclusive lock on the relation operated on.
+			 * Check existence of relations queried, this is important in
+			 * case of an unexistent relation to not let the user know of
+			 * this run switch. As we are faking a TRUNCATE, it is as well
+			 * important to take a exclusive lock on each relation operated
+			 * on, including the inheritance children which a TRUNCATE
+			 * would process as well.
 			 */
-			rel = heap_openrv(rv, AccessExclusiveLock);
+			foreach(cell, stmt->relations)
+			{
+				RangeVar   *rv = (RangeVar *) lfirst(cell);
+				Oid			relid;
+
+				relid = RangeVarGetRelid(rv, AccessExclusiveLock, false);
+				if (rv->inh)
+				{
+					List	   *children;
+					ListCell   *child;
+
+					children = find_all_inheritors(relid, AccessExclusiveLock,
+												   NULL);
+					foreach(child, children)
+						relids = list_append_unique_oid(relids,
+														lfirst_oid(child));
+				}
+				else
+					relids = list_append_unique_oid(relids, relid);
+			}
 
 			SPI_connect();
-			initStringInfo(&buf);
 
-			appendStringInfo(&buf, "DELETE FROM ");
+			foreach(cell, relids)
+			{
+				Relation	rel;
+
+				/* lock already taken */
+				rel = heap_open(lfirst_oid(cell), NoLock);
 
-			if (rv->schemaname)
-				appendStringInfo(&buf,"%s.",
-								 quote_identifier(rv->schemaname));
+#ifdef RELKIND_PARTITIONED_TABLE
+				/* no tuples stored, its partitions are in the list */
+				if (rel->rd_rel->relkind == RELKIND_PARTITIONED_TABLE)
+				{
+					heap_close(rel, NoLock);
+					continue;
+				}
+#endif
 
-			appendStringInfo(&buf, "%s;", quote_identifier(rv->relname));
+				/*
+				 * Relations larger than the threshold are really truncated,
+				 * deleting all their tuples would take too long.
+				 */
+				if (trunc2del_truncate_threshold >= 0 &&
+					rel->rd_rel->relkind == RELKIND_RELATION &&
+					(int64) RelationGetNumberOfBlocks(rel) * (BLCKSZ / 1024) >
+					trunc2del_truncate_threshold)
+				{
+					RangeVar   *rv;
 
-			ret = SPI_execute(buf.data, false, 0);
+					rv = makeRangeVar(get_namespace_name(RelationGetNamespace(rel)),
+									  pstrdup(RelationGetRelationName(rel)),
+									  -1);
+					rv->inh = false;
+					truncate_rels = lappend(truncate_rels, rv);
+				}
+				else
+					trunc2del_relation(rel);
 
-			if (ret != SPI_OK_DELETE)
-				elog(ERROR, "Error while executing TRUNCATE (really?)");
+				/* keep lock until the end of transaction */
+				heap_close(rel, NoLock);
+			}
 
 			SPI_finish();
 
-			/* keep lock until the end of transaction */
-			heap_close(rel, NoLock);
-			return;
+			if (truncate_rels == NIL)
+				return;
+
+			/* Let the remaining relations go through a real TRUNCATE */
+			stmt = (TruncateStmt *) copyObject(stmt);
+			stmt->relations = truncate_rels;
+			parsetree = (Node *) stmt;
+			break;
 		}
 		default:
 			break;
@@ -103,6 +266,32 @@ trunc2del(Node *parsetree,
 void
 _PG_init(void)
 {
+	DefineCustomIntVariable("pg_trunc2del.chunk_size",
+							"Number of blocks deleted by each DELETE run for a TRUNCATE.",
+							"0 means one DELETE per relation.",
+							&trunc2del_chunk_size,
+							0,
+							0,
+							TRUNC2DEL_MAX_CHUNK_SIZE,
+							PGC_SUSET,
+							GUC_UNIT_BLOCKS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_trunc2del.truncate_threshold",
+							"Relation size above which TRUNCATE is really run instead of DELETE.",
+							"-1 means that DELETE is always used.",
+							&trunc2del_truncate_threshold,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
 	prev_utility_hook = ProcessUtility_hook;
 	ProcessUtility_hook = trunc2del;
 }
@@ -0,0 +1,113 @@
+/*-------------------------------------------------------------------------
+ *
+ * block_map.h
+ *		Binary format of the block maps written by pg_wal_blocks --output,
+ *		also used for the summary files of wal_summarizer.
+ *
+ * The format is made of a header, followed by one entry per relation fork
+ * with its truncation and its ranges of touched blocks, each made of a
+ * first block and a count, all in native byte order.
+ *
+ * Writing goes through a callback, so as this can be included by frontend
+ * and backend code alike, each one reporting write failures its own way.
+ *
+ * Copyright (c) 1996-2018, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		pg_wal_blocks/block_map.h
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef BLOCK_MAP_H
+#define BLOCK_MAP_H
+
+#include "access/xlogdefs.h"
+#include "common/relpath.h"
+#include "storage/block.h"
+#include "storage/relfilenode.h"
+
+#define BLOCK_MAP_MAGIC		0x42574750	/* "PGWB" */
+#define BLOCK_MAP_VERSION	1
+
+typedef struct BlockMapFileHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint64		start_lsn;
+	uint64		end_lsn;
+	uint32		nentries;
+	uint32		reserved;		/* always zero, pads the header to 32 bytes */
+} BlockMapFileHeader;
+
+typedef struct BlockMapFileEntry
+{
+	Oid			spcNode;
+	Oid			dbNode;
+	Oid			relNode;
+	int32		forknum;
+	BlockNumber truncated;
+	uint32		nranges;
+} BlockMapFileEntry;
+
+/* Callback writing data to a block map */
+typedef void (*BlockMapWriteCB) (const void *data, size_t len, void *arg);
+
+/*
+ * Write the header of a block map covering the given WAL range.
+ */
+static inline void
+block_map_write_header(BlockMapWriteCB write_cb, void *arg,
+					   XLogRecPtr start_lsn, XLogRecPtr end_lsn,
+					   uint32 nentries)
+{
+	BlockMapFileHeader header;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = BLOCK_MAP_MAGIC;
+	header.version = BLOCK_MAP_VERSION;
+	header.start_lsn = start_lsn;
+	header.end_lsn = end_lsn;
+	header.nentries = nentries;
+	write_cb(&header, sizeof(header), arg);
+}
+
+/*
+ * Write the entry of a relation fork, followed by its ranges of blocks.
+ * The block numbers given need to be sorted, without duplicates.
+ */
+static inline void
+block_map_write_entry(BlockMapWriteCB write_cb, void *arg,
+					  const RelFileNode *rnode, ForkNumber forknum,
+					  BlockNumber truncated, const BlockNumber *blocks,
+					  uint32 nblocks)
+{
+	BlockMapFileEntry fentry;
+	uint32		i;
+
+	fentry.spcNode = rnode->spcNode;
+	fentry.dbNode = rnode->dbNode;
+	fentry.relNode = rnode->relNode;
+	fentry.forknum = forknum;
+	fentry.truncated = truncated;
+	fentry.nranges = 0;
+	for (i = 0; i < nblocks; i++)
+	{
+		if (i == 0 || blocks[i] != blocks[i - 1] + 1)
+			fentry.nranges++;
+	}
+	write_cb(&fentry, sizeof(fentry), arg);
+
+	for (i = 0; i < nblocks;)
+	{
+		BlockNumber range[2];
+
+		range[0] = blocks[i];
+		range[1] = 1;
+		while (++i < nblocks && blocks[i] == range[0] + range[1])
+			range[1]++;
+		write_cb(range, sizeof(range), arg);
+	}
+}
+
+#endif							/* BLOCK_MAP_H */
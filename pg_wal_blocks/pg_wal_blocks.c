@@ -14,8 +14,30 @@
 #include "postgres_fe.h"
 #include "getopt_long.h"
 
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
+#include "access/rmgr.h"
 #include "access/xlogdefs.h"
 #include "access/xlog_internal.h"
+#include "catalog/storage_xlog.h"
+#include "common/relpath.h"
+
+#include "block_map.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef WAL_BLOCKS_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef WAL_BLOCKS_ZSTD
+#include <zstd.h>
+#endif
 
 #define PG_WAL_BLOCKS_VERSION "0.1"
 
@@ -23,19 +45,96 @@ const char *progname;
 
 /* Global parameters */
 static bool verbose = false;
-static char *full_path = NULL;
-static uint32 WalSegSz = DEFAULT_XLOG_SEG_SIZE;	/* should be settable */
+static char *wal_dir = NULL;
+static uint32 WalSegSz = 0;		/* detected from first segment */
+static int num_jobs = 1;
+static bool end_of_wal_ok = false;	/* stop quietly at the end of WAL */
+
+/* Output of block information, stderr or a temporary file for a job */
+static FILE *block_output = NULL;
+
+/*
+ * Timelines followed when scanning WAL, built from a timeline history file
+ * or made of a single timeline. The last entry has no end.
+ */
+typedef struct WalTimeline
+{
+	TimeLineID	tli;
+	XLogRecPtr	begin;
+	XLogRecPtr	end;
+} WalTimeline;
+
+static WalTimeline *timelines = NULL;
+static int	ntimelines = 0;
+
+/*
+ * Reading of WAL segments, compressed or not.
+ *
+ * Uncompressed segments are read in chunks of up to WAL_READ_CHUNK_SIZE
+ * bytes, pages being served from the chunk in memory. Compressed segments
+ * are decompressed as a stream in memory, as far as the pages requested,
+ * without going through the disk.
+ */
+#define WAL_READ_CHUNK_SIZE		(16 * 1024 * 1024)
+#define WAL_READ_INPUT_SIZE		(128 * 1024)
+
+typedef enum WalCompression
+{
+	WAL_COMPRESSION_NONE,
+	WAL_COMPRESSION_GZIP,
+	WAL_COMPRESSION_LZ4,
+	WAL_COMPRESSION_ZSTD
+} WalCompression;
 
-/* Data regarding input WAL to parse */
-static XLogSegNo segno = 0;
+static const struct
+{
+	const char *suffix;
+	WalCompression compression;
+}			wal_suffixes[] =
+{
+	{"", WAL_COMPRESSION_NONE},
+	{".gz", WAL_COMPRESSION_GZIP},
+	{".lz4", WAL_COMPRESSION_LZ4},
+	{".zst", WAL_COMPRESSION_ZSTD}
+};
+
+#define NUM_WAL_SUFFIXES	lengthof(wal_suffixes)
+
+typedef struct WalSegmentStream
+{
+	int			fd;				/* -1 if not opened */
+	WalCompression compression;
+	char		path[MAXPGPATH];
+
+	/* Data of segment in memory, beginning at segment offset buf_start */
+	char	   *buf;
+	size_t		buf_size;
+	off_t		buf_start;
+	size_t		buf_len;
 
-/* Parsing status */
-static int xlogreadfd = -1; /* File descriptor of opened WAL segment */
+	/* Compressed input, for compressed segments */
+	char	   *inbuf;
+	size_t		in_len;
+	size_t		in_pos;
+	bool		in_eof;
+	bool		eof;			/* end of decompressed stream */
+#ifdef HAVE_LIBZ
+	z_stream	zs;
+#endif
+#ifdef WAL_BLOCKS_LZ4
+	LZ4F_decompressionContext_t lz4ctx;
+#endif
+#ifdef WAL_BLOCKS_ZSTD
+	ZSTD_DStream *zstdctx;
+#endif
+} WalSegmentStream;
 
 /* Structures for XLOG reader callback */
 typedef struct XLogReadBlockPrivate
 {
-	const char	   *full_path;
+	WalSegmentStream stream;	/* Opened WAL segment */
+	XLogSegNo	segno;			/* Segment number of opened WAL segment */
+	TimeLineID	tli;			/* Timeline of opened WAL segment */
 } XLogReadBlockPrivate;
 static int XLogReadPageBlock(XLogReaderState *xlogreader,
 							 XLogRecPtr targetPagePtr,
@@ -46,11 +145,21 @@ static void
 usage(const char *progname)
 {
 	printf("%s tracks relation blocks touched by WAL records.\n\n", progname);
-	printf("Usage:\n %s [OPTION] [WAL_SEGMENT]...\n\n", progname);
+	printf("Usage:\n %s [OPTION]... [STARTSEG [ENDSEG]]\n\n", progname);
 	printf("Options:\n");
-	printf("  -v             write some progress messages as well\n");
-	printf("  -V, --version  output version information, then exit\n");
-	printf("  -?, --help     show this help, then exit\n");
+	printf("  -e, --end=RECPTR       stop reading at WAL location RECPTR\n");
+	printf("  -H, --history=FILE     follow timelines of given history file\n");
+	printf("  -j, --jobs=NUM         number of segment ranges scanned in parallel\n");
+	printf("  -o, --output=FILE      write block map to FILE in binary format\n");
+	printf("  -p, --path=PATH        directory in which to find WAL segment files\n");
+	printf("  -s, --start=RECPTR     start reading at WAL location RECPTR\n");
+	printf("  -S, --summary=FORMAT   write summary of block map to stdout, in\n");
+	printf("                         \"text\" or \"json\" format\n");
+	printf("  -t, --timeline=TLI     timeline to read WAL from, or target timeline\n");
+	printf("                         with a history file\n");
+	printf("  -v                     write some progress messages as well\n");
+	printf("  -V, --version          output version information, then exit\n");
+	printf("  -?, --help             show this help, then exit\n");
 	printf("\n");
 	printf("Report bugs to https://github.com/michaelpq/pg_plugins.\n");
 }
@@ -85,6 +194,571 @@ split_path(const char *path, char **dir, char **fname)
 	}
 }
 
+/*
+ * Parse a WAL location, like "0/16B3748".
+ */
+static XLogRecPtr
+parse_lsn(const char *str)
+{
+	uint32		hi;
+	uint32		lo;
+
+	if (sscanf(str, "%X/%X", &hi, &lo) != 2)
+	{
+		fprintf(stderr, "%s: could not parse WAL location \"%s\"\n",
+				progname, str);
+		exit(1);
+	}
+
+	return ((uint64) hi) << 32 | lo;
+}
+
+/*
+ * Check if a file name is the one of a WAL segment, compressed or not.
+ */
+static bool
+is_segment_file_name(const char *fname)
+{
+	char		segname[MAXFNAMELEN];
+	int			i;
+
+	for (i = 0; i < NUM_WAL_SUFFIXES; i++)
+	{
+		size_t		len = strlen(wal_suffixes[i].suffix);
+
+		if (strlen(fname) != XLOG_FNAME_LEN + len ||
+			strcmp(fname + XLOG_FNAME_LEN, wal_suffixes[i].suffix) != 0)
+			continue;
+
+		memcpy(segname, fname, XLOG_FNAME_LEN);
+		segname[XLOG_FNAME_LEN] = '\0';
+		if (!IsXLogFileName(segname))
+			continue;
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Open a WAL segment in the WAL directory, looking for its uncompressed
+ * and compressed flavors. Returns false if not found.
+ */
+static bool
+segment_open(WalSegmentStream *stream, const char *fname)
+{
+	int			i;
+
+	memset(stream, 0, sizeof(WalSegmentStream));
+	stream->fd = -1;
+
+	for (i = 0; i < NUM_WAL_SUFFIXES; i++)
+	{
+		snprintf(stream->path, MAXPGPATH, "%s/%s%s",
+				 wal_dir, fname, wal_suffixes[i].suffix);
+		stream->fd = open(stream->path, O_RDONLY | PG_BINARY, 0);
+		if (stream->fd >= 0)
+		{
+			stream->compression = wal_suffixes[i].compression;
+			break;
+		}
+		if (errno != ENOENT)
+		{
+			fprintf(stderr, "%s: could not open file \"%s\": %s\n",
+					progname, stream->path, strerror(errno));
+			return false;
+		}
+	}
+
+	if (stream->fd < 0)
+	{
+		fprintf(stderr, "%s: could not find WAL segment \"%s\" in \"%s\"\n",
+				progname, fname, wal_dir);
+		return false;
+	}
+
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+	(void) posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	switch (stream->compression)
+	{
+		case WAL_COMPRESSION_NONE:
+			return true;
+		case WAL_COMPRESSION_GZIP:
+#ifdef HAVE_LIBZ
+			/* 16 is added to the window size to decode a gzip header */
+			if (inflateInit2(&stream->zs, 15 + 16) != Z_OK)
+			{
+				fprintf(stderr, "%s: could not initialize gzip decompression\n",
+						progname);
+				exit(1);
+			}
+			break;
+#else
+			fprintf(stderr, "%s: cannot read \"%s\": gzip is not supported by this build\n",
+					progname, stream->path);
+			exit(1);
+#endif
+		case WAL_COMPRESSION_LZ4:
+#ifdef WAL_BLOCKS_LZ4
+			if (LZ4F_isError(LZ4F_createDecompressionContext(&stream->lz4ctx,
+															 LZ4F_VERSION)))
+			{
+				fprintf(stderr, "%s: could not initialize LZ4 decompression\n",
+						progname);
+				exit(1);
+			}
+			break;
+#else
+			fprintf(stderr, "%s: cannot read \"%s\": LZ4 is not supported by this build\n",
+					progname, stream->path);
+			exit(1);
+#endif
+		case WAL_COMPRESSION_ZSTD:
+#ifdef WAL_BLOCKS_ZSTD
+			stream->zstdctx = ZSTD_createDStream();
+			if (stream->zstdctx == NULL)
+			{
+				fprintf(stderr, "%s: could not initialize zstd decompression\n",
+						progname);
+				exit(1);
+			}
+			break;
+#else
+			fprintf(stderr, "%s: cannot read \"%s\": zstd is not supported by this build\n",
+					progname, stream->path);
+			exit(1);
+#endif
+	}
+
+	stream->inbuf = pg_malloc(WAL_READ_INPUT_SIZE);
+	return true;
+}
+
+static void
+segment_close(WalSegmentStream *stream)
+{
+	if (stream->fd < 0)
+		return;
+
+	switch (stream->compression)
+	{
+		case WAL_COMPRESSION_NONE:
+			break;
+		case WAL_COMPRESSION_GZIP:
+#ifdef HAVE_LIBZ
+			inflateEnd(&stream->zs);
+#endif
+			break;
+		case WAL_COMPRESSION_LZ4:
+#ifdef WAL_BLOCKS_LZ4
+			LZ4F_freeDecompressionContext(stream->lz4ctx);
+#endif
+			break;
+		case WAL_COMPRESSION_ZSTD:
+#ifdef WAL_BLOCKS_ZSTD
+			ZSTD_freeDStream(stream->zstdctx);
+#endif
+			break;
+	}
+
+	close(stream->fd);
+	stream->fd = -1;
+	if (stream->buf)
+		pg_free(stream->buf);
+	if (stream->inbuf)
+		pg_free(stream->inbuf);
+	stream->buf = NULL;
+	stream->inbuf = NULL;
+}
+
+/*
+ * Decompress a compressed segment until at least "upto" bytes are in
+ * memory or the stream ends. Returns false on error.
+ */
+static bool
+segment_decompress(WalSegmentStream *stream, size_t upto)
+{
+	while (stream->buf_len < upto && !stream->eof)
+	{
+		size_t		out_size;
+		size_t		consumed = 0;
+		size_t		produced = 0;
+
+		/* Make room for more decompressed data */
+		if (stream->buf_size - stream->buf_len < WAL_READ_INPUT_SIZE)
+		{
+			stream->buf_size = Max(stream->buf_size * 2,
+								   stream->buf_len + WAL_READ_INPUT_SIZE);
+			stream->buf = pg_realloc(stream->buf, stream->buf_size);
+		}
+		out_size = stream->buf_size - stream->buf_len;
+
+		/* Get more compressed data */
+		if (stream->in_pos == stream->in_len && !stream->in_eof)
+		{
+			ssize_t		n = read(stream->fd, stream->inbuf, WAL_READ_INPUT_SIZE);
+
+			if (n < 0)
+			{
+				fprintf(stderr, "%s: could not read file \"%s\": %s\n",
+						progname, stream->path, strerror(errno));
+				return false;
+			}
+			stream->in_len = n;
+			stream->in_pos = 0;
+			stream->in_eof = (n == 0);
+		}
+
+		switch (stream->compression)
+		{
+			case WAL_COMPRESSION_NONE:
+				Assert(false);
+				break;
+			case WAL_COMPRESSION_GZIP:
+#ifdef HAVE_LIBZ
+				{
+					int			ret;
+
+					stream->zs.next_in = (Bytef *) stream->inbuf + stream->in_pos;
+					stream->zs.avail_in = stream->in_len - stream->in_pos;
+					stream->zs.next_out = (Bytef *) stream->buf + stream->buf_len;
+					stream->zs.avail_out = out_size;
+					ret = inflate(&stream->zs, Z_NO_FLUSH);
+					if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+					{
+						fprintf(stderr, "%s: could not decompress file \"%s\": %s\n",
+								progname, stream->path,
+								stream->zs.msg ? stream->zs.msg : "unknown error");
+						return false;
+					}
+					consumed = (stream->in_len - stream->in_pos) - stream->zs.avail_in;
+					produced = out_size - stream->zs.avail_out;
+					if (ret == Z_STREAM_END)
+						stream->eof = true;
+				}
+#endif
+				break;
+			case WAL_COMPRESSION_LZ4:
+#ifdef WAL_BLOCKS_LZ4
+				{
+					size_t		ret;
+
+					consumed = stream->in_len - stream->in_pos;
+					produced = out_size;
+					ret = LZ4F_decompress(stream->lz4ctx,
+										  stream->buf + stream->buf_len, &produced,
+										  stream->inbuf + stream->in_pos, &consumed,
+										  NULL);
+					if (LZ4F_isError(ret))
+					{
+						fprintf(stderr, "%s: could not decompress file \"%s\": %s\n",
+								progname, stream->path, LZ4F_getErrorName(ret));
+						return false;
+					}
+					if (ret == 0)
+						stream->eof = true;
+				}
+#endif
+				break;
+			case WAL_COMPRESSION_ZSTD:
+#ifdef WAL_BLOCKS_ZSTD
+				{
+					ZSTD_inBuffer in;
+					ZSTD_outBuffer out;
+					size_t		ret;
+
+					in.src = stream->inbuf + stream->in_pos;
+					in.size = stream->in_len - stream->in_pos;
+					in.pos = 0;
+					out.dst = stream->buf + stream->buf_len;
+					out.size = out_size;
+					out.pos = 0;
+					ret = ZSTD_decompressStream(stream->zstdctx, &out, &in);
+					if (ZSTD_isError(ret))
+					{
+						fprintf(stderr, "%s: could not decompress file \"%s\": %s\n",
+								progname, stream->path, ZSTD_getErrorName(ret));
+						return false;
+					}
+					consumed = in.pos;
+					produced = out.pos;
+					if (ret == 0)
+						stream->eof = true;
+				}
+#endif
+				break;
+		}
+
+		stream->in_pos += consumed;
+		stream->buf_len += produced;
+
+		/* Input is exhausted without the end of the stream */
+		if (stream->in_eof && consumed == 0 && produced == 0)
+			stream->eof = true;
+	}
+
+	return true;
+}
+
+/*
+ * Read "len" bytes at offset "off" of an opened segment. Returns false if
+ * the data could not be read.
+ */
+static bool
+segment_read(WalSegmentStream *stream, off_t off, char *dst, size_t len)
+{
+	if (stream->compression != WAL_COMPRESSION_NONE)
+	{
+		if (!segment_decompress(stream, off + len))
+			return false;
+	}
+	else if (off < stream->buf_start ||
+			 off + len > stream->buf_start + stream->buf_len)
+	{
+		size_t		chunk_size = WAL_READ_CHUNK_SIZE;
+		ssize_t		n;
+
+		/*
+		 * Read a new chunk beginning at the data requested, only what is
+		 * requested if the segment size is not known yet.
+		 */
+		if (WalSegSz != 0)
+			chunk_size = Min(chunk_size, WalSegSz - off);
+		else
+			chunk_size = len;
+		chunk_size = Max(chunk_size, len);
+		if (stream->buf_size < chunk_size)
+		{
+			stream->buf_size = chunk_size;
+			stream->buf = pg_realloc(stream->buf, chunk_size);
+		}
+
+		stream->buf_start = off;
+		stream->buf_len = 0;
+		n = pread(stream->fd, stream->buf, chunk_size, off);
+		if (n < 0)
+		{
+			fprintf(stderr, "%s: could not read file \"%s\": %s\n",
+					progname, stream->path, strerror(errno));
+			return false;
+		}
+		stream->buf_len = n;
+	}
+
+	if (off + len > stream->buf_start + stream->buf_len)
+	{
+		fprintf(stderr, "%s: could not read file \"%s\": read %d of %zu bytes at offset %u\n",
+				progname, stream->path,
+				(int) Max(0, (stream->buf_start + (off_t) stream->buf_len) - off),
+				len, (uint32) off);
+		return false;
+	}
+
+	memcpy(dst, stream->buf + (off - stream->buf_start), len);
+	return true;
+}
+
+/*
+ * Read the WAL segment size from the long page header at the beginning of
+ * the given segment.
+ */
+static uint32
+read_seg_size(const char *fname)
+{
+	PGAlignedXLogBlock buf;
+	XLogLongPageHeader longhdr = (XLogLongPageHeader) buf.data;
+	WalSegmentStream stream;
+
+	if (!segment_open(&stream, fname) ||
+		!segment_read(&stream, 0, buf.data, XLOG_BLCKSZ))
+		exit(1);
+
+	if ((longhdr->std.xlp_info & XLP_LONG_HEADER) == 0 ||
+		!IsValidWalSegSize(longhdr->xlp_seg_size))
+	{
+		fprintf(stderr, "%s: invalid WAL segment size in header of file \"%s\"\n",
+				progname, stream.path);
+		exit(1);
+	}
+	segment_close(&stream);
+
+	return longhdr->xlp_seg_size;
+}
+
+/*
+ * Find any WAL segment in the WAL directory to detect the segment size.
+ */
+static uint32
+find_seg_size(void)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	uint32		result = 0;
+
+	dir = opendir(wal_dir);
+	if (dir == NULL)
+	{
+		fprintf(stderr, "%s: could not open directory \"%s\": %s\n",
+				progname, wal_dir, strerror(errno));
+		exit(1);
+	}
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		char		fname[MAXFNAMELEN];
+
+		if (!is_segment_file_name(de->d_name))
+			continue;
+
+		strlcpy(fname, de->d_name, XLOG_FNAME_LEN + 1);
+		result = read_seg_size(fname);
+		break;
+	}
+	closedir(dir);
+
+	if (result == 0)
+	{
+		fprintf(stderr, "%s: could not find any WAL segment in directory \"%s\"\n",
+				progname, wal_dir);
+		exit(1);
+	}
+
+	return result;
+}
+
+/*
+ * Parse the contents of a timeline history file, and build the list of
+ * timelines up to the target timeline. This uses the same logic as
+ * parseTimeLineHistory() in wal_utils.
+ */
+static void
+parse_history_file(const char *path, TimeLineID target_tli)
+{
+	FILE	   *fd;
+	char		fline[MAXPGPATH];
+	TimeLineID	lasttli = 0;
+	XLogRecPtr	prevend = InvalidXLogRecPtr;
+	int			maxtimelines = 16;
+
+	fd = fopen(path, "r");
+	if (fd == NULL)
+	{
+		fprintf(stderr, "%s: could not open file \"%s\": %s\n",
+				progname, path, strerror(errno));
+		exit(1);
+	}
+
+	timelines = pg_malloc(sizeof(WalTimeline) * maxtimelines);
+	ntimelines = 0;
+
+	while (fgets(fline, sizeof(fline), fd) != NULL)
+	{
+		char	   *ptr;
+		TimeLineID	tli;
+		uint32		switchpoint_hi;
+		uint32		switchpoint_lo;
+		int			nfields;
+
+		/* skip leading whitespace and check for # comment */
+		for (ptr = fline; *ptr; ptr++)
+		{
+			if (!isspace((unsigned char) *ptr))
+				break;
+		}
+		if (*ptr == '\0' || *ptr == '#')
+			continue;
+
+		nfields = sscanf(fline, "%u\t%X/%X", &tli, &switchpoint_hi, &switchpoint_lo);
+
+		if (nfields != 3)
+		{
+			fprintf(stderr, "%s: syntax error in history file: %s\n",
+					progname, fline);
+			exit(1);
+		}
+		if (tli <= lasttli || tli >= target_tli)
+		{
+			fprintf(stderr, "%s: invalid data in history file: %s\n",
+					progname, fline);
+			exit(1);
+		}
+		lasttli = tli;
+
+		if (ntimelines + 1 >= maxtimelines)
+		{
+			maxtimelines *= 2;
+			timelines = pg_realloc(timelines,
+								   sizeof(WalTimeline) * maxtimelines);
+		}
+		timelines[ntimelines].tli = tli;
+		timelines[ntimelines].begin = prevend;
+		timelines[ntimelines].end =
+			((uint64) (switchpoint_hi)) << 32 | (uint64) switchpoint_lo;
+		prevend = timelines[ntimelines].end;
+		ntimelines++;
+
+		/* we ignore the remainder of each line */
+	}
+	fclose(fd);
+
+	/* Add the target timeline */
+	timelines[ntimelines].tli = target_tli;
+	timelines[ntimelines].begin = prevend;
+	timelines[ntimelines].end = InvalidXLogRecPtr;
+	ntimelines++;
+}
+
+/*
+ * Get the timeline of the segment to read for a given segment number. When
+ * a timeline switch happens in the middle of a segment, the segment of the
+ * new timeline includes the records of the old timeline up to the switch,
+ * so the newest timeline beginning before the end of the segment is used.
+ */
+static TimeLineID
+segment_timeline(XLogSegNo segno)
+{
+	XLogRecPtr	segend;
+	int			i;
+
+	XLogSegNoOffsetToRecPtr(segno + 1, 0, segend, WalSegSz);
+
+	for (i = ntimelines - 1; i > 0; i--)
+	{
+		if (timelines[i].begin < segend)
+			break;
+	}
+
+	return timelines[i].tli;
+}
+
+/*
+ * Check if a WAL segment exists in the WAL directory, compressed or not.
+ */
+static bool
+segment_exists(XLogSegNo segno)
+{
+	char		fname[MAXFNAMELEN];
+	int			i;
+
+	XLogFileName(fname, segment_timeline(segno), segno, WalSegSz);
+
+	for (i = 0; i < NUM_WAL_SUFFIXES; i++)
+	{
+		char		path[MAXPGPATH];
+		struct stat st;
+
+		snprintf(path, MAXPGPATH, "%s/%s%s", wal_dir, fname,
+				 wal_suffixes[i].suffix);
+		if (stat(path, &st) == 0)
+			return true;
+	}
+
+	return false;
+}
+
 /* XLogreader callback function, to read a WAL page */
 static int
 XLogReadPageBlock(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
@@ -94,56 +768,476 @@ XLogReadPageBlock(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 	XLogReadBlockPrivate *private =
 		(XLogReadBlockPrivate *) xlogreader->private_data;
 	uint32      targetPageOff;
+	XLogSegNo	targetSegNo;
+	char		fname[MAXFNAMELEN];
+
+	XLByteToSeg(targetPagePtr, targetSegNo, WalSegSz);
+	targetPageOff = XLogSegmentOffset(targetPagePtr, WalSegSz);
 
-	targetPageOff = targetPagePtr % WalSegSz;
+	/* Switch to the segment of the page if needed */
+	if (private->stream.fd >= 0 && private->segno != targetSegNo)
+		segment_close(&private->stream);
 
-	if (xlogreadfd < 0)
+	if (private->stream.fd < 0)
 	{
-		xlogreadfd = open(private->full_path, O_RDONLY | PG_BINARY, 0);
+		private->segno = targetSegNo;
+		private->tli = segment_timeline(targetSegNo);
+		XLogFileName(fname, private->tli, targetSegNo, WalSegSz);
 
-		if (xlogreadfd < 0)
-		{
-			fprintf(stderr, "could not open file \"%s\": %s\n",
-					private->full_path,
-					strerror(errno));
+		if (!segment_open(&private->stream, fname))
 			return -1;
-		}
+
+		if (verbose)
+			fprintf(stderr, "%s: reading segment \"%s\"\n", progname, fname);
 	}
 
-	/*
-	 * At this point, we have the right segment open.
-	 */
-	Assert(xlogreadfd != -1);
+	/* Read the requested page, from the data in memory if possible */
+	if (!segment_read(&private->stream, (off_t) targetPageOff, readBuf,
+					  XLOG_BLCKSZ))
+		return -1;
+
+	*pageTLI = private->tli;
+	return XLOG_BLCKSZ;
+}
+
+/*
+ * Block map, deduplicating the block references found in WAL for each
+ * relation fork. Block numbers of an entry are appended as found, and
+ * sorted with duplicates removed each time the array gets full, so as
+ * memory is bounded by the number of distinct blocks touched.
+ */
+typedef struct BlockMapEntry
+{
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	bool		used;
+	BlockNumber truncated;		/* smallest size truncated to, or
+								 * InvalidBlockNumber */
+	BlockNumber *blocks;		/* block numbers touched */
+	uint32		nblocks;
+	uint32		maxblocks;
+} BlockMapEntry;
+
+static BlockMapEntry *block_map = NULL;
+static uint32 block_map_size = 0;	/* always a power of 2 */
+static uint32 block_map_used = 0;
+static BlockMapEntry *block_map_last = NULL;	/* last entry looked up */
+
+/* WAL range covered by the block map */
+static XLogRecPtr block_map_start = InvalidXLogRecPtr;
+static XLogRecPtr block_map_end = InvalidXLogRecPtr;
 
-	/* Read the requested page */
-	if (lseek(xlogreadfd, (off_t) targetPageOff, SEEK_SET) < 0)
+/* Formats available for the block map */
+static bool block_map_mode = false;
+static char *map_file = NULL;
+static char *summary_format = NULL;
+
+static uint32
+block_map_hash(const RelFileNode *rnode, ForkNumber forknum)
+{
+	uint32		h = 2166136261u;
+
+	h = (h ^ rnode->spcNode) * 16777619u;
+	h = (h ^ rnode->dbNode) * 16777619u;
+	h = (h ^ rnode->relNode) * 16777619u;
+	h = (h ^ (uint32) forknum) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+/*
+ * Find the entry of a relation fork in the block map, creating it if
+ * necessary.
+ */
+static BlockMapEntry *
+block_map_lookup(const RelFileNode *rnode, ForkNumber forknum)
+{
+	BlockMapEntry *entry;
+	uint32		pos;
+
+	/* Records touch the same relation in a row more often than not */
+	if (block_map_last != NULL &&
+		RelFileNodeEquals(block_map_last->rnode, *rnode) &&
+		block_map_last->forknum == forknum)
+		return block_map_last;
+
+	/* Grow the table when it gets three quarters full */
+	if ((block_map_used + 1) * 4 > block_map_size * 3)
 	{
-		fprintf(stderr, "could not seek in file \"%s\": %s\n",
-				private->full_path,
-				strerror(errno));
-		return -1;
+		BlockMapEntry *old_map = block_map;
+		uint32		old_size = block_map_size;
+		uint32		i;
+
+		block_map_size = old_size == 0 ? 1024 : old_size * 2;
+		block_map = pg_malloc0(sizeof(BlockMapEntry) * block_map_size);
+
+		for (i = 0; i < old_size; i++)
+		{
+			if (!old_map[i].used)
+				continue;
+			pos = block_map_hash(&old_map[i].rnode, old_map[i].forknum) &
+				(block_map_size - 1);
+			while (block_map[pos].used)
+				pos = (pos + 1) & (block_map_size - 1);
+			block_map[pos] = old_map[i];
+		}
+		if (old_map)
+			pg_free(old_map);
+		block_map_last = NULL;
 	}
 
-	if (read(xlogreadfd, readBuf, XLOG_BLCKSZ) != XLOG_BLCKSZ)
+	pos = block_map_hash(rnode, forknum) & (block_map_size - 1);
+	for (;;)
 	{
-		fprintf(stderr, "could not read from file \"%s\": %s\n",
-				private->full_path,
-				strerror(errno));
+		entry = &block_map[pos];
+		if (!entry->used)
+			break;
+		if (RelFileNodeEquals(entry->rnode, *rnode) &&
+			entry->forknum == forknum)
+		{
+			block_map_last = entry;
+			return entry;
+		}
+		pos = (pos + 1) & (block_map_size - 1);
+	}
+
+	entry->used = true;
+	entry->rnode = *rnode;
+	entry->forknum = forknum;
+	entry->truncated = InvalidBlockNumber;
+	entry->blocks = NULL;
+	entry->nblocks = 0;
+	entry->maxblocks = 0;
+	block_map_used++;
+
+	block_map_last = entry;
+	return entry;
+}
+
+static int
+blocknum_cmp(const void *a, const void *b)
+{
+	BlockNumber ba = *(const BlockNumber *) a;
+	BlockNumber bb = *(const BlockNumber *) b;
+
+	if (ba < bb)
 		return -1;
+	if (ba > bb)
+		return 1;
+	return 0;
+}
+
+/* Sort the blocks of an entry and remove duplicates */
+static void
+block_map_compact(BlockMapEntry *entry)
+{
+	uint32		i;
+	uint32		n = 0;
+
+	if (entry->nblocks <= 1)
+		return;
+
+	qsort(entry->blocks, entry->nblocks, sizeof(BlockNumber), blocknum_cmp);
+	for (i = 1; i < entry->nblocks; i++)
+	{
+		if (entry->blocks[i] != entry->blocks[n])
+			entry->blocks[++n] = entry->blocks[i];
 	}
+	entry->nblocks = n + 1;
+}
 
-	return XLOG_BLCKSZ;
+static void
+block_map_add_block(BlockMapEntry *entry, BlockNumber blkno)
+{
+	/* Cheap check for the same block touched in a row */
+	if (entry->nblocks > 0 && entry->blocks[entry->nblocks - 1] == blkno)
+		return;
+
+	if (entry->nblocks >= entry->maxblocks)
+	{
+		block_map_compact(entry);
+
+		/* Grow the array only if compaction did not free enough space */
+		if (entry->nblocks >= entry->maxblocks / 2)
+		{
+			entry->maxblocks = entry->maxblocks == 0 ? 64 : entry->maxblocks * 2;
+			entry->blocks = pg_realloc(entry->blocks,
+									   sizeof(BlockNumber) * entry->maxblocks);
+		}
+	}
+
+	entry->blocks[entry->nblocks++] = blkno;
+}
+
+static void
+block_map_truncate(const RelFileNode *rnode, ForkNumber forknum,
+				   BlockNumber nblocks)
+{
+	BlockMapEntry *entry = block_map_lookup(rnode, forknum);
+
+	if (entry->truncated == InvalidBlockNumber || nblocks < entry->truncated)
+		entry->truncated = nblocks;
+}
+
+static int
+block_map_entry_cmp(const void *a, const void *b)
+{
+	const BlockMapEntry *ea = *(BlockMapEntry *const *) a;
+	const BlockMapEntry *eb = *(BlockMapEntry *const *) b;
+
+	if (ea->rnode.spcNode != eb->rnode.spcNode)
+		return ea->rnode.spcNode < eb->rnode.spcNode ? -1 : 1;
+	if (ea->rnode.dbNode != eb->rnode.dbNode)
+		return ea->rnode.dbNode < eb->rnode.dbNode ? -1 : 1;
+	if (ea->rnode.relNode != eb->rnode.relNode)
+		return ea->rnode.relNode < eb->rnode.relNode ? -1 : 1;
+	if (ea->forknum != eb->forknum)
+		return ea->forknum < eb->forknum ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Get all the entries of the block map, compacted and sorted by relation
+ * fork. The result is palloc'd, with the number of entries in *nentries.
+ */
+static BlockMapEntry **
+block_map_sorted(uint32 *nentries)
+{
+	BlockMapEntry **entries;
+	uint32		i;
+	uint32		n = 0;
+
+	entries = pg_malloc(sizeof(BlockMapEntry *) * (block_map_used + 1));
+	for (i = 0; i < block_map_size; i++)
+	{
+		if (!block_map[i].used)
+			continue;
+		block_map_compact(&block_map[i]);
+		entries[n++] = &block_map[i];
+	}
+	qsort(entries, n, sizeof(BlockMapEntry *), block_map_entry_cmp);
+
+	*nentries = n;
+	return entries;
+}
+
+/* fwrite() callback of the block map writer, errors are checked at the end */
+static void
+block_map_fwrite(const void *data, size_t len, void *arg)
+{
+	fwrite(data, len, 1, (FILE *) arg);
+}
+
+/*
+ * Write the block map in binary format. This is used for the map file, and
+ * to pass the map of a parallel job to its parent.
+ */
+static void
+write_block_map(FILE *fp, const char *name)
+{
+	BlockMapEntry **entries;
+	uint32		nentries;
+	uint32		i;
+
+	entries = block_map_sorted(&nentries);
+
+	block_map_write_header(block_map_fwrite, fp, block_map_start,
+						   block_map_end, nentries);
+
+	for (i = 0; i < nentries; i++)
+	{
+		BlockMapEntry *entry = entries[i];
+
+		block_map_write_entry(block_map_fwrite, fp, &entry->rnode,
+							  entry->forknum, entry->truncated,
+							  entry->blocks, entry->nblocks);
+	}
+
+	if (fflush(fp) != 0 || ferror(fp))
+	{
+		fprintf(stderr, "%s: could not write block map to \"%s\": %s\n",
+				progname, name, strerror(errno));
+		exit(1);
+	}
+
+	pg_free(entries);
+}
+
+/*
+ * Read a block map in binary format, merging it with the existing one.
+ */
+static void
+read_block_map(FILE *fp, const char *name)
+{
+	BlockMapFileHeader header;
+	uint32		i;
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		header.magic != BLOCK_MAP_MAGIC ||
+		header.version != BLOCK_MAP_VERSION)
+	{
+		fprintf(stderr, "%s: invalid block map in \"%s\"\n", progname, name);
+		exit(1);
+	}
+
+	if (XLogRecPtrIsInvalid(block_map_start) ||
+		header.start_lsn < block_map_start)
+		block_map_start = header.start_lsn;
+	if (header.end_lsn > block_map_end)
+		block_map_end = header.end_lsn;
+
+	for (i = 0; i < header.nentries; i++)
+	{
+		BlockMapFileEntry fentry;
+		BlockMapEntry *entry;
+		RelFileNode rnode;
+		uint32		j;
+
+		if (fread(&fentry, sizeof(fentry), 1, fp) != 1)
+		{
+			fprintf(stderr, "%s: truncated block map in \"%s\"\n",
+					progname, name);
+			exit(1);
+		}
+
+		rnode.spcNode = fentry.spcNode;
+		rnode.dbNode = fentry.dbNode;
+		rnode.relNode = fentry.relNode;
+		entry = block_map_lookup(&rnode, (ForkNumber) fentry.forknum);
+		if (fentry.truncated != InvalidBlockNumber)
+			block_map_truncate(&rnode, (ForkNumber) fentry.forknum,
+							   fentry.truncated);
+
+		for (j = 0; j < fentry.nranges; j++)
+		{
+			BlockNumber range[2];
+			BlockNumber blkno;
+
+			if (fread(range, sizeof(range), 1, fp) != 1)
+			{
+				fprintf(stderr, "%s: truncated block map in \"%s\"\n",
+						progname, name);
+				exit(1);
+			}
+			for (blkno = range[0]; blkno - range[0] < range[1]; blkno++)
+				block_map_add_block(entry, blkno);
+		}
+	}
+}
+
+/*
+ * Write a summary of the block map, in text or JSON format.
+ */
+static void
+write_block_map_summary(FILE *fp)
+{
+	BlockMapEntry **entries;
+	uint32		nentries;
+	uint32		i;
+	bool		json = strcmp(summary_format, "json") == 0;
+
+	entries = block_map_sorted(&nentries);
+
+	if (json)
+		fprintf(fp, "{\"start_lsn\":\"%X/%X\",\"end_lsn\":\"%X/%X\",\"relations\":[",
+				(uint32) (block_map_start >> 32), (uint32) block_map_start,
+				(uint32) (block_map_end >> 32), (uint32) block_map_end);
+	else
+		fprintf(fp, "WAL range: %X/%X - %X/%X\n",
+				(uint32) (block_map_start >> 32), (uint32) block_map_start,
+				(uint32) (block_map_end >> 32), (uint32) block_map_end);
+
+	for (i = 0; i < nentries; i++)
+	{
+		BlockMapEntry *entry = entries[i];
+		uint32		j;
+
+		if (json)
+		{
+			fprintf(fp, "%s{\"spcnode\":%u,\"dbnode\":%u,\"relnode\":%u,\"fork\":\"%s\",",
+					i == 0 ? "" : ",",
+					entry->rnode.spcNode, entry->rnode.dbNode,
+					entry->rnode.relNode, forkNames[entry->forknum]);
+			if (entry->truncated != InvalidBlockNumber)
+				fprintf(fp, "\"truncated\":%u,", entry->truncated);
+			else
+				fprintf(fp, "\"truncated\":null,");
+			fprintf(fp, "\"nblocks\":%u,\"ranges\":[", entry->nblocks);
+		}
+		else
+		{
+			fprintf(fp, "relation %u/%u/%u fork %s: %u blocks",
+					entry->rnode.spcNode, entry->rnode.dbNode,
+					entry->rnode.relNode, forkNames[entry->forknum],
+					entry->nblocks);
+			if (entry->truncated != InvalidBlockNumber)
+				fprintf(fp, ", truncated to %u blocks", entry->truncated);
+			if (entry->nblocks > 0)
+				fprintf(fp, ":");
+		}
+
+		for (j = 0; j < entry->nblocks;)
+		{
+			BlockNumber first = entry->blocks[j];
+			BlockNumber last = first;
+			bool		is_first = (j == 0);
+
+			while (++j < entry->nblocks && entry->blocks[j] == last + 1)
+				last++;
+
+			if (json)
+				fprintf(fp, "%s[%u,%u]", is_first ? "" : ",", first, last);
+			else if (first == last)
+				fprintf(fp, "%s%u", is_first ? " " : ",", first);
+			else
+				fprintf(fp, "%s%u-%u", is_first ? " " : ",", first, last);
+		}
+
+		if (json)
+			fprintf(fp, "]}");
+		else
+			fprintf(fp, "\n");
+	}
+
+	if (json)
+		fprintf(fp, "]}\n");
+
+	pg_free(entries);
 }
 
 /*
  * extract_block_info
- * Extract block information for given record.
+ * Extract block information for given record, as well as relation
+ * truncations.
  */
 static void
 extract_block_info(XLogReaderState *record)
 {
 	int block_id;
 
+	if (XLogRecGetRmid(record) == RM_SMGR_ID &&
+		(XLogRecGetInfo(record) & ~XLR_INFO_MASK) == XLOG_SMGR_TRUNCATE)
+	{
+		xl_smgr_truncate *xlrec = (xl_smgr_truncate *) XLogRecGetData(record);
+
+		if (!block_map_mode)
+			fprintf(block_output, "Relation truncated: dboid = %u, relid = %u, block = %u\n",
+					xlrec->rnode.dbNode, xlrec->rnode.relNode, xlrec->blkno);
+		else
+		{
+			/*
+			 * The size the free space map and the visibility map get
+			 * truncated to is not in the record, so track them as
+			 * truncated to nothing, to copy them completely.
+			 */
+			if ((xlrec->flags & SMGR_TRUNCATE_HEAP) != 0)
+				block_map_truncate(&xlrec->rnode, MAIN_FORKNUM, xlrec->blkno);
+			if ((xlrec->flags & SMGR_TRUNCATE_FSM) != 0)
+				block_map_truncate(&xlrec->rnode, FSM_FORKNUM, 0);
+			if ((xlrec->flags & SMGR_TRUNCATE_VM) != 0)
+				block_map_truncate(&xlrec->rnode, VISIBILITYMAP_FORKNUM, 0);
+		}
+	}
+
 	for (block_id = 0; block_id <= record->max_block_id; block_id++)
 	{
 		RelFileNode rnode;
@@ -153,75 +1247,272 @@ extract_block_info(XLogReaderState *record)
 		if (!XLogRecGetBlockTag(record, block_id, &rnode, &forknum, &blkno))
 			continue;
 
+		/* All forks are tracked in the block map */
+		if (block_map_mode)
+		{
+			block_map_add_block(block_map_lookup(&rnode, forknum), blkno);
+			continue;
+		}
+
 		/* We only care about the main fork */
 		if (forknum != MAIN_FORKNUM)
 			continue;
 
 		/*
 		 * Print information of block touched.
-		 * TODO: more advanced logic (really needed?)
 		 */
-		fprintf(stderr, "Block touched: dboid = %u, relid = %u, block = %u\n",
+		fprintf(block_output, "Block touched: dboid = %u, relid = %u, block = %u\n",
 				rnode.dbNode, rnode.relNode, blkno);
 	}
 }
 
 /*
  * do_wal_parsing
- * Central part where the actual parsing work happens.
+ * Central part where the actual parsing work happens, for all the records
+ * beginning between the start and the end positions. Records crossing the
+ * end position are read up to their end, so as ranges can be scanned
+ * independently. An invalid end position means that WAL is read until its
+ * end. Returns false if a record could not be read before the end.
  */
-static void
-do_wal_parsing(void)
+static bool
+do_wal_parsing(XLogRecPtr startptr, XLogRecPtr endptr)
 {
 	XLogReadBlockPrivate private;
 	XLogRecord *record;
 	XLogReaderState *xlogreader;
 	char *errormsg;
 	XLogRecPtr first_record;
+	bool		result = true;
 
-	private.full_path = full_path;
+	private.stream.fd = -1;
+	private.segno = 0;
+	private.tli = 0;
 
 	/* Set the first record to look at */
-	XLogSegNoOffsetToRecPtr(segno, 0, first_record, WalSegSz);
 	xlogreader = XLogReaderAllocate(WalSegSz, XLogReadPageBlock, &private);
-	first_record = XLogFindNextRecord(xlogreader, first_record);
+	first_record = XLogFindNextRecord(xlogreader, startptr);
+	if (XLogRecPtrIsInvalid(first_record))
+	{
+		fprintf(stderr, "%s: could not find a valid record after %X/%X\n",
+				progname, (uint32) (startptr >> 32), (uint32) startptr);
+		XLogReaderFree(xlogreader);
+		return false;
+	}
+	block_map_start = startptr;
 
 	/* Loop through all the records */
-	do
+	for (;;)
 	{
+		/*
+		 * Stop before reading a record beginning at or after the end, as
+		 * it may be in a segment not available, like the one following the
+		 * last segment to scan.
+		 */
+		if (!XLogRecPtrIsInvalid(endptr) &&
+			XLogRecPtrIsInvalid(first_record) &&
+			xlogreader->EndRecPtr >= endptr)
+			break;
+
 		/* Move on to next record */
 		record = XLogReadRecord(xlogreader, first_record, &errormsg);
-		if (errormsg)
-			fprintf(stderr, "error reading xlog record: %s\n", errormsg);
+		if (record == NULL)
+		{
+			/*
+			 * Reaching the end of WAL is fine if no end was given, or if
+			 * only the start segment was.
+			 */
+			if ((!XLogRecPtrIsInvalid(endptr) && !end_of_wal_ok) || verbose)
+				fprintf(stderr, "error reading xlog record: %s\n",
+						errormsg ? errormsg : "no error message");
+			if (!XLogRecPtrIsInvalid(endptr) && !end_of_wal_ok)
+				result = false;
+			break;
+		}
+
+		/* Stop if the record begins after the end within a page header */
+		if (!XLogRecPtrIsInvalid(endptr) && xlogreader->ReadRecPtr >= endptr)
+			break;
 
 		/* after reading the first record, continue at next one */
 		first_record = InvalidXLogRecPtr;
 
 		/* extract block information for this record */
 		extract_block_info(xlogreader);
-	} while (record != NULL);
+		block_map_end = xlogreader->EndRecPtr;
+	}
 
 	XLogReaderFree(xlogreader);
-	if (xlogreadfd != -1)
+	segment_close(&private.stream);
+
+	return result;
+}
+
+/*
+ * do_parallel_parsing
+ * Split the range to scan in ranges of whole segments, scanned by as many
+ * processes. Each process writes its output in a temporary file, copied
+ * in order once all are done, so as output is the same as a serial scan.
+ * With a block map, the maps of all the processes are merged instead.
+ */
+static bool
+do_parallel_parsing(XLogRecPtr startptr, XLogRecPtr endptr)
+{
+#ifndef WIN32
+	XLogSegNo	startsegno;
+	XLogSegNo	endsegno;
+	uint64		nsegs;
+	FILE	  **outputs;
+	pid_t	   *pids;
+	bool		result = true;
+	bool		merging = true;
+	int			njobs;
+	int			i;
+
+	XLByteToSeg(startptr, startsegno, WalSegSz);
+	XLByteToPrevSeg(endptr, endsegno, WalSegSz);
+	nsegs = endsegno - startsegno + 1;
+	njobs = (int) Min((uint64) num_jobs, nsegs);
+
+	outputs = pg_malloc(sizeof(FILE *) * njobs);
+	pids = pg_malloc(sizeof(pid_t) * njobs);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = 0; i < njobs; i++)
+	{
+		XLogRecPtr	jobstart;
+		XLogRecPtr	jobend;
+
+		/* Range of segments of this job */
+		if (i == 0)
+			jobstart = startptr;
+		else
+			XLogSegNoOffsetToRecPtr(startsegno + nsegs * i / njobs, 0,
+									jobstart, WalSegSz);
+		if (i == njobs - 1)
+			jobend = endptr;
+		else
+			XLogSegNoOffsetToRecPtr(startsegno + nsegs * (i + 1) / njobs, 0,
+									jobend, WalSegSz);
+
+		outputs[i] = tmpfile();
+		if (outputs[i] == NULL)
+		{
+			fprintf(stderr, "%s: could not create temporary file: %s\n",
+					progname, strerror(errno));
+			exit(1);
+		}
+
+		pids[i] = fork();
+		if (pids[i] < 0)
+		{
+			fprintf(stderr, "%s: could not fork: %s\n",
+					progname, strerror(errno));
+			exit(1);
+		}
+
+		if (pids[i] == 0)
+		{
+			bool		ok;
+
+			block_output = outputs[i];
+			ok = do_wal_parsing(jobstart, jobend);
+			if (block_map_mode)
+				write_block_map(block_output, "temporary file");
+			fflush(block_output);
+			exit(ok ? 0 : 1);
+		}
+
+		if (verbose)
+			fprintf(stderr, "%s: started job %d for %X/%X - %X/%X\n",
+					progname, i,
+					(uint32) (jobstart >> 32), (uint32) jobstart,
+					(uint32) (jobend >> 32), (uint32) jobend);
+	}
+
+	for (i = 0; i < njobs; i++)
 	{
-		close(xlogreadfd);
-		xlogreadfd = -1;
+		int			status;
+		char		buf[8192];
+		size_t		len;
+		bool		job_ok;
+		bool		exited;
+
+		/* Status is only set if waitpid() succeeded */
+		if (waitpid(pids[i], &status, 0) < 0)
+		{
+			fprintf(stderr, "%s: could not wait for job %d: %s\n",
+					progname, i, strerror(errno));
+			exited = false;
+		}
+		else
+			exited = WIFEXITED(status);
+		job_ok = exited && WEXITSTATUS(status) == 0;
+		if (!job_ok)
+			result = false;
+
+		/*
+		 * Merge the block map or copy output of this job. The maps of the
+		 * jobs are merged until the first one which failed, included as it
+		 * has written the map of what it scanned, so as the range of the
+		 * result has no holes.
+		 */
+		rewind(outputs[i]);
+		if (block_map_mode)
+		{
+			if (merging && exited)
+				read_block_map(outputs[i], "temporary file");
+			if (!job_ok)
+				merging = false;
+		}
+		else
+		{
+			while ((len = fread(buf, 1, sizeof(buf), outputs[i])) > 0)
+				fwrite(buf, 1, len, block_output);
+		}
+		fclose(outputs[i]);
 	}
+
+	pg_free(outputs);
+	pg_free(pids);
+	return result;
+#else
+	fprintf(stderr, "%s: parallel jobs are not supported on this platform\n",
+			progname);
+	exit(1);
+#endif
 }
 
 int
 main(int argc, char **argv)
 {
 	static struct option long_options[] = {
+		{"end", required_argument, NULL, 'e'},
 		{"help", no_argument, NULL, '?'},
+		{"history", required_argument, NULL, 'H'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"output", required_argument, NULL, 'o'},
+		{"path", required_argument, NULL, 'p'},
+		{"start", required_argument, NULL, 's'},
+		{"summary", required_argument, NULL, 'S'},
+		{"timeline", required_argument, NULL, 't'},
 		{"version", no_argument, NULL, 'V'},
 		{"verbose", no_argument, NULL, 'v'},
 		{NULL, 0, NULL, 0}
 	};
 	int		c;
 	int		option_index;
+	XLogRecPtr	startptr = InvalidXLogRecPtr;
+	XLogRecPtr	endptr = InvalidXLogRecPtr;
+	TimeLineID	timeline_id = 0;
+	char	   *history_file = NULL;
+	char	   *startseg = NULL;
+	char	   *endseg = NULL;
+	bool		result;
 
 	progname = get_progname(argv[0]);
+	block_output = stderr;
 
 	if (argc <= 1)
 	{
@@ -244,20 +1535,64 @@ main(int argc, char **argv)
 		}
 	}
 
-	while ((c = getopt_long(argc, argv, "v", long_options, &option_index)) != -1)
+	while ((c = getopt_long(argc, argv, "e:H:j:o:p:s:S:t:v",
+							long_options, &option_index)) != -1)
 	{
 		switch (c)
 		{
 			case '?':
 				fprintf(stderr, _("Try \"%s --help\" for more information.\n"), progname);
 				exit(1);
+			case 'e':
+				endptr = parse_lsn(optarg);
+				break;
+			case 'H':
+				history_file = pg_strdup(optarg);
+				break;
+			case 'j':
+				num_jobs = atoi(optarg);
+				if (num_jobs <= 0)
+				{
+					fprintf(stderr, "%s: invalid number of parallel jobs\n",
+							progname);
+					exit(1);
+				}
+				break;
+			case 'o':
+				map_file = pg_strdup(optarg);
+				block_map_mode = true;
+				break;
+			case 'p':
+				wal_dir = pg_strdup(optarg);
+				break;
+			case 's':
+				startptr = parse_lsn(optarg);
+				break;
+			case 'S':
+				if (strcmp(optarg, "text") != 0 && strcmp(optarg, "json") != 0)
+				{
+					fprintf(stderr, "%s: invalid summary format \"%s\", must be \"text\" or \"json\"\n",
+							progname, optarg);
+					exit(1);
+				}
+				summary_format = pg_strdup(optarg);
+				block_map_mode = true;
+				break;
+			case 't':
+				if (sscanf(optarg, "%u", &timeline_id) != 1 || timeline_id == 0)
+				{
+					fprintf(stderr, "%s: invalid timeline \"%s\"\n",
+							progname, optarg);
+					exit(1);
+				}
+				break;
 			case 'v':
 				verbose = true;
 				break;
 		}
 	}
 
-	if ((optind + 1) < argc)
+	if ((optind + 2) < argc)
 	{
 		fprintf(stderr,
 				"%s: too many command-line arguments (first is \"%s\")\n",
@@ -265,37 +1600,168 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
-	/* parse files as start/end boundaries, extract path if not specified */
+	/*
+	 * Parse files as start/end boundaries, extract path if not specified,
+	 * as well as the segment size from the start segment.
+	 */
 	if (optind < argc)
 	{
 		char	   *directory = NULL;
-		char	   *fname = NULL;
-		int			fd;
-		TimeLineID	timeline_id;
+		char	   *full_path = argv[optind];
+
+		split_path(full_path, &directory, &startseg);
+		if (wal_dir == NULL)
+			wal_dir = directory ? directory : pg_strdup(".");
+		if (optind + 1 < argc)
+		{
+			char	   *enddir = NULL;
+
+			split_path(argv[optind + 1], &enddir, &endseg);
+		}
 
-		full_path = pg_strdup(argv[optind]);
+		/* Segments can be given with a compression suffix */
+		if (is_segment_file_name(startseg))
+			startseg[XLOG_FNAME_LEN] = '\0';
+		if (endseg && is_segment_file_name(endseg))
+			endseg[XLOG_FNAME_LEN] = '\0';
+		if (IsXLogFileName(startseg))
+			WalSegSz = read_seg_size(startseg);
+	}
+
+	if (wal_dir == NULL)
+	{
+		fprintf(stderr, "%s: no input file or path defined.\n", progname);
+		exit(1);
+	}
+	if (WalSegSz == 0)
+		WalSegSz = find_seg_size();
 
-		split_path(full_path, &directory, &fname);
+	/* Segment file names take priority over LSNs */
+	if (startseg)
+	{
+		XLogSegNo	segno;
+		TimeLineID	tli;
 
-		fd = open(full_path, O_RDONLY | PG_BINARY, 0);
-		if (fd < 0)
+		if (!IsXLogFileName(startseg))
 		{
-			fprintf(stderr, "could not open file \"%s\"", fname);
+			fprintf(stderr, "%s: invalid WAL segment name \"%s\"\n",
+					progname, startseg);
 			exit(1);
 		}
-		close(fd);
+		XLogFromFileName(startseg, &tli, &segno, WalSegSz);
+		if (timeline_id == 0)
+			timeline_id = tli;
+		if (XLogRecPtrIsInvalid(startptr))
+			XLogSegNoOffsetToRecPtr(segno, 0, startptr, WalSegSz);
+	}
+	if (endseg)
+	{
+		XLogSegNo	segno;
+		TimeLineID	tli;
 
-		/* parse timeline and segment number from file name */
-		XLogFromFileName(fname, &timeline_id, &segno, WalSegSz);
+		if (!IsXLogFileName(endseg))
+		{
+			fprintf(stderr, "%s: invalid WAL segment name \"%s\"\n",
+					progname, endseg);
+			exit(1);
+		}
+		XLogFromFileName(endseg, &tli, &segno, WalSegSz);
+		if (XLogRecPtrIsInvalid(endptr))
+			XLogSegNoOffsetToRecPtr(segno + 1, 0, endptr, WalSegSz);
+		if (history_file && timeline_id < tli)
+			timeline_id = tli;
 	}
+	else if (startseg && XLogRecPtrIsInvalid(endptr))
+	{
+		XLogSegNo	segno;
 
-	if (full_path == NULL)
+		/*
+		 * Only the start segment, as in the past. It may be the last one
+		 * available and partial, or have its last record continue in the
+		 * next segment not there yet, which is fine.
+		 */
+		XLByteToSeg(startptr, segno, WalSegSz);
+		XLogSegNoOffsetToRecPtr(segno + 1, 0, endptr, WalSegSz);
+		end_of_wal_ok = true;
+	}
+
+	if (XLogRecPtrIsInvalid(startptr))
+	{
+		fprintf(stderr, "%s: no start location or segment defined.\n",
+				progname);
+		exit(1);
+	}
+	if (!XLogRecPtrIsInvalid(endptr) && endptr <= startptr)
 	{
-		fprintf(stderr, "%s: no input file defined.\n", progname);
+		fprintf(stderr, "%s: end location %X/%X is older than start location %X/%X\n",
+				progname, (uint32) (endptr >> 32), (uint32) endptr,
+				(uint32) (startptr >> 32), (uint32) startptr);
 		exit(1);
 	}
 
-	/* File to parse is here, so begin */
-	do_wal_parsing();
-	exit(0);
+	/* Build the list of timelines to follow */
+	if (history_file)
+	{
+		if (timeline_id == 0)
+		{
+			char	   *directory = NULL;
+			char	   *fname = NULL;
+
+			split_path(history_file, &directory, &fname);
+			if (sscanf(fname, "%08X.history", &timeline_id) != 1)
+			{
+				fprintf(stderr, "%s: could not find target timeline, use --timeline\n",
+						progname);
+				exit(1);
+			}
+		}
+		parse_history_file(history_file, timeline_id);
+	}
+	else
+	{
+		timelines = pg_malloc(sizeof(WalTimeline));
+		timelines[0].tli = timeline_id == 0 ? 1 : timeline_id;
+		timelines[0].begin = InvalidXLogRecPtr;
+		timelines[0].end = InvalidXLogRecPtr;
+		ntimelines = 1;
+	}
+
+	/* Find the end of WAL available to split it between jobs */
+	if (num_jobs > 1 && XLogRecPtrIsInvalid(endptr))
+	{
+		XLogSegNo	segno;
+
+		XLByteToSeg(startptr, segno, WalSegSz);
+		while (segment_exists(segno + 1))
+			segno++;
+		XLogSegNoOffsetToRecPtr(segno + 1, 0, endptr, WalSegSz);
+	}
+
+	/* Range to parse is here, so begin */
+	if (num_jobs > 1)
+		result = do_parallel_parsing(startptr, endptr);
+	else
+		result = do_wal_parsing(startptr, endptr);
+
+	/*
+	 * Write the block map and its summary, even if the scan has stopped on
+	 * an error, as they cover the range of WAL scanned until it.
+	 */
+	if (map_file)
+	{
+		FILE	   *fp = fopen(map_file, PG_BINARY_W);
+
+		if (fp == NULL)
+		{
+			fprintf(stderr, "%s: could not open file \"%s\": %s\n",
+					progname, map_file, strerror(errno));
+			exit(1);
+		}
+		write_block_map(fp, map_file);
+		fclose(fp);
+	}
+	if (summary_format)
+		write_block_map_summary(stdout);
+
+	exit(result ? 0 : 1);
 }
@@ -0,0 +1,41 @@
+/* receiver_raw/receiver_raw--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION receiver_raw" to load this file. \quit
+
+-- Statistics of changes received and applied
+CREATE FUNCTION receiver_raw_stats(
+    OUT pid int,
+    OUT messages bigint,
+    OUT bytes bigint,
+    OUT inserts bigint,
+    OUT updates bigint,
+    OUT deletes bigint,
+    OUT transactions bigint,
+    OUT local_commits bigint,
+    OUT received_lsn pg_lsn,
+    OUT applied_lsn pg_lsn,
+    OUT flushed_lsn pg_lsn,
+    OUT last_msg_send_time timestamptz,
+    OUT last_msg_receipt_time timestamptz,
+    OUT last_latency_ms float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE VIEW receiver_raw_stats AS
+    SELECT * FROM receiver_raw_stats();
+
+-- Histogram of receipt latency, in milliseconds
+CREATE FUNCTION receiver_raw_receipt_latency(
+    OUT lower_ms float8,
+    OUT upper_ms float8,
+    OUT count bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE VIEW receiver_raw_receipt_latency AS
+    SELECT * FROM receiver_raw_receipt_latency();
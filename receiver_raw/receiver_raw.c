@@ -19,18 +19,39 @@
 #include <sys/time.h>
 
 #include "fmgr.h"
+#include "funcapi.h"
 #include "libpq-fe.h"
 #include "pqexpbuffer.h"
+#include "access/hash.h"
+#include "access/transam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/namespace.h"
 #include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
+#include "nodes/makefuncs.h"
 #include "pgstat.h"
 #include "executor/spi.h"
+#include "miscadmin.h"
 #include "postmaster/bgworker.h"
+#include "replication/origin.h"
+#include "storage/dsm.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
+#include "storage/lmgr.h"
 #include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
 /* Allow load of this module in shared libs */
 PG_MODULE_MAGIC;
@@ -38,6 +59,10 @@ PG_MODULE_MAGIC;
 /* Entry point of library loading */
 void _PG_init(void);
 void receiver_raw_main(Datum main_arg);
+void receiver_raw_apply_main(Datum main_arg);
+
+PG_FUNCTION_INFO_V1(receiver_raw_stats);
+PG_FUNCTION_INFO_V1(receiver_raw_receipt_latency);
 
 /* Signal handling */
 static volatile sig_atomic_t got_sigterm = false;
@@ -49,6 +74,16 @@ static char *receiver_slot = "slot";
 static char *receiver_conn_string = "replication=database dbname=postgres application_name=receiver_raw";
 static int receiver_idle_time = 100;
 static bool receiver_sync_mode = true;
+static bool receiver_binary_apply = false;
+static int receiver_apply_workers = 0;
+static int receiver_status_interval = 10;
+static int receiver_commit_transactions = 100;
+static int receiver_commit_size = 1024;
+static int receiver_commit_delay = 100;
+static bool receiver_log_changes = false;
+
+/* Level used for messages logged for each change received */
+#define RECEIVER_CHANGE_LEVEL	(receiver_log_changes ? LOG : DEBUG1)
 
 /* Worker name */
 static char *worker_name = "receiver_raw";
@@ -57,10 +92,243 @@ static char *worker_name = "receiver_raw";
 static XLogRecPtr output_written_lsn = InvalidXLogRecPtr;
 static XLogRecPtr output_fsync_lsn = InvalidXLogRecPtr;
 static XLogRecPtr output_applied_lsn = InvalidXLogRecPtr;
+static XLogRecPtr last_fsync_lsn = InvalidXLogRecPtr;	/* last sent */
+
+/*
+ * Statistics in shared memory, updated by the main worker and the apply
+ * workers. The receipt latency is the difference between the time a
+ * message is received, before being applied or dispatched, and the time it
+ * has been sent by the server, counted in buckets whose upper bound doubles
+ * from 1ms, the last one having no upper bound. Rows applied are counted
+ * locally, and added to the shared counters with the local commit.
+ */
+#define RECEIVER_RAW_LATENCY_BUCKETS	16
+
+typedef struct
+{
+	slock_t		mutex;			/* protects all the fields below */
+	pid_t		pid;			/* main worker, 0 if not running */
+	uint64		messages;		/* messages received */
+	uint64		bytes;			/* bytes received */
+	uint64		inserts;		/* rows inserted */
+	uint64		updates;		/* rows updated */
+	uint64		deletes;		/* rows deleted */
+	uint64		transactions;	/* remote transactions applied */
+	uint64		local_commits;	/* local transactions committed */
+	XLogRecPtr	received_lsn;
+	XLogRecPtr	applied_lsn;
+	XLogRecPtr	flushed_lsn;
+	TimestampTz last_send_time;		/* of last data message, by server */
+	TimestampTz last_receipt_time;	/* of last data message, locally */
+	uint64		latency[RECEIVER_RAW_LATENCY_BUCKETS];
+} ReceiverRawStats;
+
+static ReceiverRawStats *receiver_stats = NULL;
+static uint64 stats_inserts = 0;	/* rows applied, not committed yet */
+static uint64 stats_updates = 0;
+static uint64 stats_deletes = 0;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/*
+ * Group commit. Remote transactions are applied within the same local
+ * transaction until one of the limits is reached, or until there is no more
+ * data to apply. The position of the last remote transaction applied is
+ * saved with the local commit through a replication origin.
+ */
+typedef struct
+{
+	XLogRecPtr	local_end;		/* end of local commit record */
+	XLogRecPtr	remote_end;		/* end of last remote commit included */
+} RawFlushPosition;
+
+static RepOriginId receiver_origin = InvalidRepOriginId;
+static bool local_xact_open = false;
+static bool remote_xact_open = false;
+static int local_xact_count = 0;
+static Size local_xact_bytes = 0;
+static TimestampTz local_xact_start = 0;
+static XLogRecPtr remote_commit_lsn = InvalidXLogRecPtr;
+static TimestampTz remote_commit_time = 0;
+static List *flush_positions = NIL;
+
+/*
+ * Column of a relation, as described by a RELATION message of the binary
+ * output format of decoder_raw, completed with its local definition.
+ */
+typedef struct
+{
+	char	   *quoted_name;	/* quoted column name */
+	bool		iskey;			/* part of replica identity? */
+	Oid			typid;			/* local type of column */
+	int32		typmod;			/* local type modifier of column */
+	Oid			typioparam;		/* type I/O parameter */
+	FmgrInfo	typreceive;		/* receive function of type */
+} RawColumn;
+
+/*
+ * Plan used to apply UPDATE changes, which depends on the set of columns
+ * whose values are sent, as unchanged TOAST values are not.
+ */
+typedef struct
+{
+	Bitmapset  *columns;		/* columns in SET clause */
+	char	   *query;			/* query of plan */
+	SPIPlanPtr	plan;
+} RawUpdatePlan;
+
+/*
+ * Relation known by this worker, keyed by the OID of the relation on the
+ * remote server. Its data is allocated in its own memory context, and
+ * everything is thrown away when a new RELATION message is received for
+ * it.
+ */
+typedef struct
+{
+	Oid			remoteid;		/* hash key, must be first */
+	MemoryContext context;		/* context of this entry's data */
+	char	   *relname;		/* quoted, schema-qualified relation name */
+	int			ncols;			/* number of columns */
+	RawColumn  *cols;			/* array of ncols columns */
+	int			nkeys;			/* number of key columns */
+	int		   *keycols;		/* index of key columns in cols */
+	char	   *insert_query;	/* query of INSERT plan */
+	SPIPlanPtr	insert_plan;	/* INSERT plan, built when needed */
+	char	   *delete_query;	/* query of DELETE plan */
+	SPIPlanPtr	delete_plan;	/* DELETE plan, built when needed */
+	List	   *update_plans;	/* list of RawUpdatePlan */
+} RawRelation;
+
+/* Relations received, and memory contexts for binary apply */
+static HTAB *raw_relations = NULL;
+static MemoryContext raw_relation_context = NULL;
+static MemoryContext raw_apply_context = NULL;
+static StringInfo raw_value_buf = NULL;
+
+/*
+ * Parallel apply. The main worker acts as a coordinator: it reads the
+ * stream, buffers each remote transaction until its commit, and sends it
+ * whole to one of the apply workers, which applies it in a single local
+ * transaction. Transactions are applied concurrently, but committed one at
+ * a time in the order of the server, each commit advancing the replication
+ * origin of the main worker, so as a remote transaction is never visible
+ * partially and replication can restart from this origin. A transaction
+ * changing rows, identified by their relation and replica identity key,
+ * changed by transactions not committed yet is sent to the worker applying
+ * the last of them, the others being waited for, so as the changes of a
+ * same row are applied in order. A transaction failing while previous ones
+ * are in progress, like on a unique constraint not covered by the replica
+ * identity or on a deadlock with another worker, is rolled back and
+ * applied again once they are committed. Transactions too large to be
+ * buffered are applied alone, once all the previous transactions are
+ * committed, and the next ones wait for them.
+ */
+#define RECEIVER_RAW_SHM_MAGIC		0x72617721
+#define RECEIVER_RAW_KEY_SHARED		0
+#define RECEIVER_RAW_KEY_QUEUE		1	/* first queue, one per worker */
+#define RECEIVER_RAW_QUEUE_SIZE		(1024 * 1024)
+#define RECEIVER_RAW_MAX_PENDING	(16 * 1024 * 1024)
+#define RECEIVER_RAW_MAX_ROWS		65536	/* rows tracked before purge */
+
+/* Transaction in progress in an apply worker */
+typedef struct
+{
+	PGPROC	   *proc;			/* set once the worker has started */
+	uint64		seq;			/* position in commit order, 0 if none */
+	TransactionId xid;			/* local XID, once applying changes */
+} RawApplyWorker;
+
+/* State shared between the coordinator and the apply workers */
+typedef struct
+{
+	PGPROC	   *coordinator;	/* latch set at each commit of a worker */
+	RepOriginId origin;			/* origin advanced by each commit */
+	int			nworkers;
+	slock_t		mutex;			/* protects all the fields below */
+	bool		coordinator_gone;	/* nothing is committed anymore */
+	uint64		committed_seq;	/* last transaction committed */
+	XLogRecPtr	committed_lsn;	/* its end position on the server */
+	XLogRecPtr	committed_end;	/* end of its local commit record */
+	uint64		retry_seq;		/* first transaction applied again */
+	RawApplyWorker workers[FLEXIBLE_ARRAY_MEMBER];
+} RawApplyShared;
+
+/* Relation as known by the coordinator, to route changes */
+typedef struct
+{
+	Oid			remoteid;		/* hash key, must be first */
+	int			ncols;			/* number of columns */
+	bool	   *iskey;			/* is column part of the key? */
+	char	   *relmsg;			/* last RELATION message received */
+	int			relmsg_len;
+	bool	   *sent;			/* relmsg sent to each worker? */
+} RawRoute;
+
+/* Last transaction dispatched changing a row, keyed by a hash of its key */
+typedef struct
+{
+	uint32		keyhash;		/* hash key, must be first */
+	int			worker;
+	uint64		seq;
+} RawRowChange;
+
+/*
+ * Message of a transaction waiting to be dispatched, or buffered by an
+ * apply worker to be applied again.
+ */
+typedef struct
+{
+	RawRoute   *route;			/* relation of message, for coordinator */
+	bool		is_relation;	/* RELATION message? */
+	int			len;
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} RawPendingMessage;
+
+/* Coordinator state */
+static RawApplyShared *raw_shared = NULL;
+static shm_mq_handle **raw_queues = NULL;
+static BackgroundWorkerHandle **raw_workers = NULL;
+static uint64 *raw_worker_seq = NULL;	/* last transaction sent per worker */
+static uint64 *raw_depend_seq = NULL;	/* dependencies per worker */
+static uint64 raw_dispatched_seq = 0;
+static uint64 raw_barrier_seq = 0;		/* waited for by next transactions */
+static XLogRecPtr raw_dispatched_lsn = InvalidXLogRecPtr;
+static XLogRecPtr raw_committed_lsn = InvalidXLogRecPtr;	/* last seen */
+static HTAB *raw_routes = NULL;
+static HTAB *raw_row_changes = NULL;
+static MemoryContext raw_txn_context = NULL;
+static List *raw_pending = NIL;
+static Size raw_pending_bytes = 0;
+static uint32 *raw_txn_keys = NULL;		/* hashes of rows changed by txn */
+static int raw_txn_nkeys = 0;
+static int raw_txn_maxkeys = 0;
+static bool raw_txn_open = false;
+static bool raw_txn_streaming = false;	/* txn sent while received */
+static int raw_txn_worker = -1;			/* worker of txn streamed */
+static StringInfo raw_key_buf = NULL;
+
+/* Apply worker state, for the transaction in progress */
+static int raw_worker_id = -1;
+static uint64 raw_apply_seq = 0;
+static bool raw_apply_alone = false;	/* not retried, so not buffered */
+static bool raw_apply_in_xact = false;
+static bool raw_apply_failed = false;	/* to apply again at commit */
+static bool raw_apply_retrying = false;
+static bool raw_apply_commit_received = false;
+static bool raw_apply_origin_held = false;
+static XLogRecPtr raw_apply_end_lsn = InvalidXLogRecPtr;
+static TimestampTz raw_apply_commit_time = 0;
+static List *raw_apply_messages = NIL;
+static MemoryContext raw_apply_txn_context = NULL;
+
+/* Connection to the server, and time of the last status update sent */
+static PGconn *receiver_conn = NULL;
+static int64 last_status = -1;
 
 /* Stream functions */
 static void fe_sendint64(int64 i, char *buf);
 static int64 fe_recvint64(char *buf);
+static int64 feGetCurrentTimestamp(void);
+static void update_applied_lsn(XLogRecPtr keepalive_lsn);
 
 static void
 receiver_raw_sigterm(SIGNAL_ARGS)
@@ -82,6 +350,151 @@ receiver_raw_sighup(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
+/*
+ * Allocate or attach to the shared memory used for statistics.
+ */
+static void
+receiver_raw_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	receiver_stats = ShmemInitStruct("receiver_raw",
+									 sizeof(ReceiverRawStats),
+									 &found);
+	if (!found)
+	{
+		MemSet(receiver_stats, 0, sizeof(ReceiverRawStats));
+		SpinLockInit(&receiver_stats->mutex);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Clean up the statistics of the main worker when it exits.
+ */
+static void
+receiver_raw_stats_exit(int code, Datum arg)
+{
+	SpinLockAcquire(&receiver_stats->mutex);
+	receiver_stats->pid = 0;
+	SpinLockRelease(&receiver_stats->mutex);
+}
+
+/*
+ * Count a message received from the server, with its latency if this is
+ * a data message.
+ */
+static void
+stats_count_message(int len, int64 sendTime, int64 now)
+{
+	int			bucket = 0;
+
+	if (receiver_stats == NULL)
+		return;
+
+	if (sendTime > 0)
+	{
+		int64		latency_ms = (now - sendTime) / 1000;
+
+		while (bucket < RECEIVER_RAW_LATENCY_BUCKETS - 1 &&
+			   latency_ms >= (INT64CONST(1) << bucket))
+			bucket++;
+	}
+
+	SpinLockAcquire(&receiver_stats->mutex);
+	receiver_stats->messages++;
+	receiver_stats->bytes += len;
+	receiver_stats->received_lsn = output_written_lsn;
+	if (sendTime > 0)
+	{
+		receiver_stats->latency[bucket]++;
+		receiver_stats->last_send_time = sendTime;
+		receiver_stats->last_receipt_time = now;
+	}
+	SpinLockRelease(&receiver_stats->mutex);
+}
+
+/*
+ * Count a row applied, based on the result of SPI. This is only published
+ * with the next local commit, see stats_count_commit().
+ */
+static void
+stats_count_row(int rc)
+{
+	if (rc == SPI_OK_INSERT)
+		stats_inserts++;
+	else if (rc == SPI_OK_UPDATE)
+		stats_updates++;
+	else if (rc == SPI_OK_DELETE)
+		stats_deletes++;
+}
+
+/*
+ * Forget the rows counted in a local transaction rolled back.
+ */
+static void
+stats_reset_rows(void)
+{
+	stats_inserts = 0;
+	stats_updates = 0;
+	stats_deletes = 0;
+}
+
+/*
+ * Count remote transactions applied and local commits, with the rows
+ * applied since the last local commit.
+ */
+static void
+stats_count_commit(int transactions, int local_commits)
+{
+	if (receiver_stats == NULL)
+		return;
+
+	SpinLockAcquire(&receiver_stats->mutex);
+	receiver_stats->inserts += stats_inserts;
+	receiver_stats->updates += stats_updates;
+	receiver_stats->deletes += stats_deletes;
+	receiver_stats->transactions += transactions;
+	receiver_stats->local_commits += local_commits;
+	SpinLockRelease(&receiver_stats->mutex);
+	stats_reset_rows();
+}
+
+/*
+ * Save the positions applied and flushed.
+ */
+static void
+stats_update_positions(void)
+{
+	if (receiver_stats == NULL)
+		return;
+
+	SpinLockAcquire(&receiver_stats->mutex);
+	receiver_stats->applied_lsn = output_applied_lsn;
+	receiver_stats->flushed_lsn = output_fsync_lsn;
+	SpinLockRelease(&receiver_stats->mutex);
+}
+
+/*
+ * Copy the statistics, checking that they are available.
+ */
+static void
+stats_get_copy(ReceiverRawStats *copy)
+{
+	if (receiver_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("receiver_raw must be loaded via shared_preload_libraries")));
+
+	SpinLockAcquire(&receiver_stats->mutex);
+	memcpy(copy, receiver_stats, sizeof(ReceiverRawStats));
+	SpinLockRelease(&receiver_stats->mutex);
+}
+
 /*
  * Send a Standby Status Update message to server.
  */
@@ -91,16 +504,18 @@ sendFeedback(PGconn *conn, int64 now)
 	char		replybuf[1 + 8 + 8 + 8 + 8 + 1];
 	int		 len = 0;
 
-	ereport(LOG, (errmsg("%s: confirming write up to %X/%X, "
-						 "flush to %X/%X (slot custom_slot), "
-						 "applied to %X/%X",
-						 worker_name,
-						 (uint32) (output_written_lsn >> 32),
-						 (uint32) output_written_lsn,
-						 (uint32) (output_fsync_lsn >> 32),
-						 (uint32) output_fsync_lsn,
-						 (uint32) (output_applied_lsn >> 32),
-						 (uint32) output_applied_lsn)));
+	ereport(RECEIVER_CHANGE_LEVEL,
+			(errmsg("%s: confirming write up to %X/%X, "
+					"flush to %X/%X (slot %s), "
+					"applied to %X/%X",
+					worker_name,
+					(uint32) (output_written_lsn >> 32),
+					(uint32) output_written_lsn,
+					(uint32) (output_fsync_lsn >> 32),
+					(uint32) output_fsync_lsn,
+					receiver_slot,
+					(uint32) (output_applied_lsn >> 32),
+					(uint32) output_applied_lsn)));
 
 	replybuf[len] = 'r';
 	len += 1;
@@ -124,82 +539,1926 @@ sendFeedback(PGconn *conn, int64 now)
 		return false;
 	}
 
-	return true;
+	last_fsync_lsn = output_fsync_lsn;
+	return true;
+}
+
+/*
+ * Converts an int64 to network byte order.
+ */
+static void
+fe_sendint64(int64 i, char *buf)
+{
+	uint32	  n32;
+
+	/* High order half first, since we're doing MSB-first */
+	n32 = (uint32) (i >> 32);
+	n32 = htonl(n32);
+	memcpy(&buf[0], &n32, 4);
+
+	/* Now the low order half */
+	n32 = (uint32) i;
+	n32 = htonl(n32);
+	memcpy(&buf[4], &n32, 4);
+}
+
+/*
+ * Converts an int64 from network byte order to native format.
+ */
+static int64
+fe_recvint64(char *buf)
+{
+	int64	   result;
+	uint32	  h32;
+	uint32	  l32;
+
+	memcpy(&h32, buf, 4);
+	memcpy(&l32, buf + 4, 4);
+	h32 = ntohl(h32);
+	l32 = ntohl(l32);
+
+	result = h32;
+	result <<= 32;
+	result |= l32;
+
+	return result;
+}
+
+static int64
+feGetCurrentTimestamp(void)
+{
+	int64	   result;
+	struct timeval tp;
+
+	gettimeofday(&tp, NULL);
+
+	result = (int64) tp.tv_sec -
+		((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY);
+
+	result = (result * USECS_PER_SEC) + tp.tv_usec;
+
+	return result;
+}
+
+static void
+feTimestampDifference(int64 start_time, int64 stop_time,
+					  long *secs, int *microsecs)
+{
+	int64	   diff = stop_time - start_time;
+
+	if (diff <= 0)
+	{
+		*secs = 0;
+		*microsecs = 0;
+	}
+	else
+	{
+		*secs = (long) (diff / USECS_PER_SEC);
+		*microsecs = (int) (diff % USECS_PER_SEC);
+	}
+}
+
+/*
+ * Log the result of a change applied, which is only done at LOG level if
+ * requested as this is costly with many changes.
+ */
+static void
+report_change(int rc, const char *query)
+{
+	stats_count_row(rc);
+
+	if (rc == SPI_OK_INSERT)
+		ereport(RECEIVER_CHANGE_LEVEL,
+				(errmsg("%s: INSERT received correctly: %s",
+						worker_name, query)));
+	else if (rc == SPI_OK_UPDATE)
+		ereport(RECEIVER_CHANGE_LEVEL,
+				(errmsg("%s: UPDATE received correctly: %s",
+						worker_name, query)));
+	else if (rc == SPI_OK_DELETE)
+		ereport(RECEIVER_CHANGE_LEVEL,
+				(errmsg("%s: DELETE received correctly: %s",
+						worker_name, query)));
+	else
+		ereport(LOG, (errmsg("%s: Error when applying change: %s",
+							 worker_name, query)));
+}
+
+/*
+ * Apply a change received as a SQL query.
+ */
+static void
+apply_sql_change(const char *query)
+{
+	int			rc;
+
+	/* Apply change to database */
+	pgstat_report_activity(STATE_RUNNING, query);
+	SetCurrentStatementStartTimestamp();
+
+	/* Execute query */
+	rc = SPI_execute(query, false, 0);
+	report_change(rc, query);
+}
+
+/*
+ * Prepare a plan for the given query and save it for the duration of the
+ * process.
+ */
+static SPIPlanPtr
+prepare_plan(const char *query, int nargs, Oid *argtypes)
+{
+	SPIPlanPtr	plan;
+
+	plan = SPI_prepare(query, nargs, argtypes);
+	if (plan == NULL)
+		ereport(ERROR,
+				(errmsg("%s: could not prepare plan for \"%s\": %s",
+						worker_name, query,
+						SPI_result_code_string(SPI_result))));
+
+	if (SPI_keepplan(plan) != 0)
+		ereport(ERROR,
+				(errmsg("%s: could not save plan for \"%s\"",
+						worker_name, query)));
+
+	return plan;
+}
+
+/*
+ * Free all the plans and data of a relation.
+ */
+static void
+free_raw_relation(RawRelation *rel)
+{
+	ListCell   *lc;
+
+	if (rel->insert_plan != NULL)
+		SPI_freeplan(rel->insert_plan);
+	if (rel->delete_plan != NULL)
+		SPI_freeplan(rel->delete_plan);
+	foreach(lc, rel->update_plans)
+	{
+		RawUpdatePlan *update = lfirst(lc);
+
+		SPI_freeplan(update->plan);
+	}
+
+	MemoryContextDelete(rel->context);
+}
+
+/*
+ * Handle a RELATION message, initializing the relation for the plans
+ * of the next changes.
+ */
+static void
+handle_relation_message(StringInfo msg)
+{
+	Oid			remoteid;
+	const char *nspname;
+	const char *relname;
+	Oid			localrelid;
+	RawRelation *rel;
+	MemoryContext old;
+	bool		found;
+	int			i;
+
+	remoteid = pq_getmsgint(msg, 4);
+	nspname = pq_getmsgstring(msg);
+	relname = pq_getmsgstring(msg);
+	(void) pq_getmsgbyte(msg);		/* replica identity */
+
+	/* Previous plans of relation become useless */
+	rel = hash_search(raw_relations, &remoteid, HASH_ENTER, &found);
+	if (found)
+		free_raw_relation(rel);
+
+	rel->context = AllocSetContextCreate(raw_relation_context,
+										 "receiver_raw relation",
+										 ALLOCSET_SMALL_SIZES);
+	rel->insert_query = NULL;
+	rel->insert_plan = NULL;
+	rel->delete_query = NULL;
+	rel->delete_plan = NULL;
+	rel->update_plans = NIL;
+
+	/* Relation is matched with the local one with the same name */
+	localrelid = RangeVarGetRelid(makeRangeVar(pstrdup(nspname),
+											   pstrdup(relname), -1),
+								  AccessShareLock, false);
+
+	old = MemoryContextSwitchTo(rel->context);
+
+	rel->relname = quote_qualified_identifier(nspname, relname);
+	rel->ncols = pq_getmsgint(msg, 2);
+	rel->cols = palloc0(sizeof(RawColumn) * rel->ncols);
+	rel->keycols = palloc0(sizeof(int) * rel->ncols);
+	rel->nkeys = 0;
+
+	for (i = 0; i < rel->ncols; i++)
+	{
+		RawColumn  *col = &rel->cols[i];
+		uint8		flags = pq_getmsgbyte(msg);
+		const char *colname = pq_getmsgstring(msg);
+		AttrNumber	attnum;
+		Oid			collid;
+		Oid			typreceive;
+
+		/* Remote type is not used, local definition matters */
+		(void) pq_getmsgint(msg, 4);	/* type OID */
+		(void) pq_getmsgint(msg, 4);	/* type modifier */
+
+		attnum = get_attnum(localrelid, colname);
+		if (attnum == InvalidAttrNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("%s: column \"%s\" of relation \"%s\" does not exist",
+							worker_name, colname, rel->relname)));
+
+		col->quoted_name = pstrdup(quote_identifier(colname));
+		col->iskey = (flags & 0x01) != 0;
+		get_atttypetypmodcoll(localrelid, attnum,
+							  &col->typid, &col->typmod, &collid);
+		getTypeBinaryInputInfo(col->typid, &typreceive, &col->typioparam);
+		fmgr_info_cxt(typreceive, &col->typreceive, rel->context);
+
+		if (col->iskey)
+			rel->keycols[rel->nkeys++] = i;
+	}
+
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * Read a tuple from a change message, with all the columns of the relation
+ * or only its key columns. Values are converted with the receive functions
+ * of the local column types.
+ */
+static void
+read_tuple(StringInfo msg, RawRelation *rel, bool key_only,
+		   Datum *values, char *nulls, bool *unchanged)
+{
+	char		marker = pq_getmsgbyte(msg);
+	int			ncols;
+	int			nbytes;
+	const char *nullbits;
+	const char *toastbits;
+	int			i;
+
+	if (marker != (key_only ? 'K' : 'N'))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("%s: incorrect tuple marker \"%c\"",
+						worker_name, marker)));
+
+	ncols = pq_getmsgint(msg, 2);
+	if (ncols != (key_only ? rel->nkeys : rel->ncols))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("%s: incorrect number of columns %d for relation \"%s\"",
+						worker_name, ncols, rel->relname)));
+
+	nbytes = (ncols + 7) / 8;
+	nullbits = pq_getmsgbytes(msg, nbytes);
+	toastbits = pq_getmsgbytes(msg, nbytes);
+
+	for (i = 0; i < ncols; i++)
+	{
+		RawColumn  *col = key_only ? &rel->cols[rel->keycols[i]] :
+			&rel->cols[i];
+		int			len;
+
+		values[i] = (Datum) 0;
+		nulls[i] = 'n';
+		unchanged[i] = false;
+
+		if ((nullbits[i / 8] & (1 << (i % 8))) != 0)
+			continue;
+
+		if ((toastbits[i / 8] & (1 << (i % 8))) != 0)
+		{
+			unchanged[i] = true;
+			continue;
+		}
+
+		/* Copy value so as it is null-terminated for receive function */
+		len = pq_getmsgint(msg, 4);
+		resetStringInfo(raw_value_buf);
+		appendBinaryStringInfo(raw_value_buf, pq_getmsgbytes(msg, len), len);
+
+		values[i] = ReceiveFunctionCall(&col->typreceive, raw_value_buf,
+										col->typioparam, col->typmod);
+		if (raw_value_buf->cursor != raw_value_buf->len)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("%s: incorrect binary data format in column %s of relation \"%s\"",
+							worker_name, col->quoted_name, rel->relname)));
+		nulls[i] = ' ';
+	}
+}
+
+/*
+ * Execute a plan for a change, and log its result.
+ */
+static void
+execute_plan(SPIPlanPtr plan, const char *query, Datum *values, char *nulls)
+{
+	int			rc;
+
+	pgstat_report_activity(STATE_RUNNING, query);
+	SetCurrentStatementStartTimestamp();
+
+	rc = SPI_execute_plan(plan, values, nulls, false, 0);
+	report_change(rc, query);
+}
+
+/*
+ * Append to a query a WHERE clause based on the key columns of a relation,
+ * whose parameters begin at the given number.
+ */
+static void
+append_where_clause(StringInfo query, RawRelation *rel, int firstparam,
+					Oid *argtypes)
+{
+	int			i;
+
+	appendStringInfoString(query, " WHERE ");
+	for (i = 0; i < rel->nkeys; i++)
+	{
+		RawColumn  *col = &rel->cols[rel->keycols[i]];
+
+		if (i > 0)
+			appendStringInfoString(query, " AND ");
+		appendStringInfo(query, "%s = $%d", col->quoted_name,
+						 firstparam + i + 1);
+		argtypes[firstparam + i] = col->typid;
+	}
+}
+
+/*
+ * Apply an INSERT change, with a plan built at its first use.
+ */
+static void
+apply_binary_insert(StringInfo msg, RawRelation *rel)
+{
+	Datum	   *values = palloc(sizeof(Datum) * rel->ncols);
+	char	   *nulls = palloc(sizeof(char) * rel->ncols);
+	bool	   *unchanged = palloc(sizeof(bool) * rel->ncols);
+
+	read_tuple(msg, rel, false, values, nulls, unchanged);
+
+	if (rel->insert_plan == NULL)
+	{
+		StringInfoData query;
+		Oid		   *argtypes = palloc(sizeof(Oid) * rel->ncols);
+		int			i;
+
+		initStringInfo(&query);
+		appendStringInfo(&query, "INSERT INTO %s (", rel->relname);
+		for (i = 0; i < rel->ncols; i++)
+		{
+			appendStringInfo(&query, "%s%s", i > 0 ? ", " : "",
+							 rel->cols[i].quoted_name);
+			argtypes[i] = rel->cols[i].typid;
+		}
+		appendStringInfoString(&query, ") VALUES (");
+		for (i = 0; i < rel->ncols; i++)
+			appendStringInfo(&query, "%s$%d", i > 0 ? ", " : "", i + 1);
+		appendStringInfoChar(&query, ')');
+
+		rel->insert_plan = prepare_plan(query.data, rel->ncols, argtypes);
+		rel->insert_query = MemoryContextStrdup(rel->context, query.data);
+	}
+
+	execute_plan(rel->insert_plan, rel->insert_query, values, nulls);
+}
+
+/*
+ * Apply a DELETE change, with a plan built at its first use.
+ */
+static void
+apply_binary_delete(StringInfo msg, RawRelation *rel)
+{
+	Datum	   *values = palloc(sizeof(Datum) * rel->nkeys);
+	char	   *nulls = palloc(sizeof(char) * rel->nkeys);
+	bool	   *unchanged = palloc(sizeof(bool) * rel->nkeys);
+
+	read_tuple(msg, rel, true, values, nulls, unchanged);
+
+	if (rel->delete_plan == NULL)
+	{
+		StringInfoData query;
+		Oid		   *argtypes = palloc(sizeof(Oid) * rel->nkeys);
+
+		initStringInfo(&query);
+		appendStringInfo(&query, "DELETE FROM %s", rel->relname);
+		append_where_clause(&query, rel, 0, argtypes);
+
+		rel->delete_plan = prepare_plan(query.data, rel->nkeys, argtypes);
+		rel->delete_query = MemoryContextStrdup(rel->context, query.data);
+	}
+
+	execute_plan(rel->delete_plan, rel->delete_query, values, nulls);
+}
+
+/*
+ * Apply an UPDATE change. Unchanged TOAST values are not part of the SET
+ * clause, so a plan is built for each set of columns found.
+ */
+static void
+apply_binary_update(StringInfo msg, RawRelation *rel)
+{
+	Datum	   *keyvalues = palloc(sizeof(Datum) * rel->nkeys);
+	char	   *keynulls = palloc(sizeof(char) * rel->nkeys);
+	bool	   *keyunchanged = palloc(sizeof(bool) * rel->nkeys);
+	Datum	   *newvalues = palloc(sizeof(Datum) * rel->ncols);
+	char	   *newnulls = palloc(sizeof(char) * rel->ncols);
+	bool	   *newunchanged = palloc(sizeof(bool) * rel->ncols);
+	Datum	   *values = palloc(sizeof(Datum) * (rel->ncols + rel->nkeys));
+	char	   *nulls = palloc(sizeof(char) * (rel->ncols + rel->nkeys));
+	Bitmapset  *columns = NULL;
+	RawUpdatePlan *update = NULL;
+	ListCell   *lc;
+	int			nparams = 0;
+	int			i;
+
+	read_tuple(msg, rel, true, keyvalues, keynulls, keyunchanged);
+	read_tuple(msg, rel, false, newvalues, newnulls, newunchanged);
+
+	/* Build the parameters, first the SET clause then the WHERE clause */
+	for (i = 0; i < rel->ncols; i++)
+	{
+		if (newunchanged[i])
+			continue;
+		columns = bms_add_member(columns, i);
+		values[nparams] = newvalues[i];
+		nulls[nparams] = newnulls[i];
+		nparams++;
+	}
+	for (i = 0; i < rel->nkeys; i++)
+	{
+		values[nparams + i] = keyvalues[i];
+		nulls[nparams + i] = keynulls[i];
+	}
+
+	foreach(lc, rel->update_plans)
+	{
+		RawUpdatePlan *plan = lfirst(lc);
+
+		if (bms_equal(plan->columns, columns))
+		{
+			update = plan;
+			break;
+		}
+	}
+
+	if (update == NULL)
+	{
+		StringInfoData query;
+		Oid		   *argtypes = palloc(sizeof(Oid) * (nparams + rel->nkeys));
+		MemoryContext old;
+		int			param = 0;
+
+		initStringInfo(&query);
+		appendStringInfo(&query, "UPDATE %s SET ", rel->relname);
+		for (i = 0; i < rel->ncols; i++)
+		{
+			if (!bms_is_member(i, columns))
+				continue;
+			appendStringInfo(&query, "%s%s = $%d", param > 0 ? ", " : "",
+							 rel->cols[i].quoted_name, param + 1);
+			argtypes[param] = rel->cols[i].typid;
+			param++;
+		}
+		append_where_clause(&query, rel, nparams, argtypes);
+
+		old = MemoryContextSwitchTo(rel->context);
+		update = palloc(sizeof(RawUpdatePlan));
+		update->columns = bms_copy(columns);
+		update->query = pstrdup(query.data);
+		update->plan = prepare_plan(query.data, nparams + rel->nkeys,
+									argtypes);
+		rel->update_plans = lappend(rel->update_plans, update);
+		MemoryContextSwitchTo(old);
+	}
+
+	execute_plan(update->plan, update->query, values, nulls);
+}
+
+/*
+ * Apply a message of the binary output format of decoder_raw. Relation
+ * messages reset the plans used for this relation, and changes are
+ * applied with plans prepared once per relation and action.
+ */
+static void
+apply_binary_change(char *data, int len)
+{
+	StringInfoData msg;
+	MemoryContext old;
+	char		action;
+
+	/* Message is read in place */
+	msg.data = data;
+	msg.len = len;
+	msg.maxlen = len;
+	msg.cursor = 0;
+
+	old = MemoryContextSwitchTo(raw_apply_context);
+
+	action = pq_getmsgbyte(&msg);
+	switch (action)
+	{
+		case 'R':
+			handle_relation_message(&msg);
+			break;
+		case 'I':
+		case 'U':
+		case 'D':
+			{
+				Oid			remoteid = pq_getmsgint(&msg, 4);
+				RawRelation *rel;
+
+				rel = hash_search(raw_relations, &remoteid, HASH_FIND, NULL);
+				if (rel == NULL)
+					ereport(ERROR,
+							(errcode(ERRCODE_PROTOCOL_VIOLATION),
+							 errmsg("%s: change received for unknown relation %u",
+									worker_name, remoteid)));
+
+				if (action == 'I')
+					apply_binary_insert(&msg, rel);
+				else if (action == 'U')
+					apply_binary_update(&msg, rel);
+				else
+					apply_binary_delete(&msg, rel);
+			}
+			break;
+		case 'B':
+		case 'C':
+			/* Transaction boundaries, nothing to do */
+			break;
+		default:
+			ereport(LOG, (errmsg("%s: Incorrect message type \"%c\"",
+								 worker_name, action)));
+			proc_exit(1);
+	}
+
+	MemoryContextSwitchTo(old);
+	MemoryContextReset(raw_apply_context);
+}
+
+/*
+ * Initialize the data needed to apply changes received in binary format.
+ */
+static void
+init_binary_apply(void)
+{
+	HASHCTL		hash_ctl;
+	MemoryContext old;
+
+	raw_relation_context = AllocSetContextCreate(TopMemoryContext,
+												 "receiver_raw relations",
+												 ALLOCSET_DEFAULT_SIZES);
+	raw_apply_context = AllocSetContextCreate(TopMemoryContext,
+											  "receiver_raw apply",
+											  ALLOCSET_DEFAULT_SIZES);
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(RawRelation);
+	hash_ctl.hcxt = raw_relation_context;
+	raw_relations = hash_create("receiver_raw relations", 128, &hash_ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	old = MemoryContextSwitchTo(raw_relation_context);
+	raw_value_buf = makeStringInfo();
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * Note that the coordinator is gone, so as the apply workers do not commit
+ * anything anymore, as it may be restarted from the last commit.
+ */
+static void
+coordinator_detach(dsm_segment *seg, Datum arg)
+{
+	SpinLockAcquire(&raw_shared->mutex);
+	raw_shared->coordinator_gone = true;
+	SpinLockRelease(&raw_shared->mutex);
+}
+
+/*
+ * Create the shared memory used for parallel apply, and start the apply
+ * workers.
+ */
+static void
+start_apply_workers(void)
+{
+	shm_toc_estimator e;
+	Size		shared_size;
+	Size		segsize;
+	dsm_segment *seg;
+	shm_toc    *toc;
+	HASHCTL		hash_ctl;
+	MemoryContext old;
+	int			i;
+
+	shared_size = add_size(offsetof(RawApplyShared, workers),
+						   mul_size(sizeof(RawApplyWorker),
+									receiver_apply_workers));
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, shared_size);
+	for (i = 0; i < receiver_apply_workers; i++)
+		shm_toc_estimate_chunk(&e, RECEIVER_RAW_QUEUE_SIZE);
+	shm_toc_estimate_keys(&e, 1 + receiver_apply_workers);
+	segsize = shm_toc_estimate(&e);
+
+	/* Segment is kept for the lifetime of this worker */
+	seg = dsm_create(segsize, 0);
+	dsm_pin_mapping(seg);
+	toc = shm_toc_create(RECEIVER_RAW_SHM_MAGIC, dsm_segment_address(seg),
+						 segsize);
+
+	raw_shared = shm_toc_allocate(toc, shared_size);
+	MemSet(raw_shared, 0, shared_size);
+	raw_shared->coordinator = MyProc;
+	raw_shared->origin = receiver_origin;
+	raw_shared->nworkers = receiver_apply_workers;
+	SpinLockInit(&raw_shared->mutex);
+	shm_toc_insert(toc, RECEIVER_RAW_KEY_SHARED, raw_shared);
+	on_dsm_detach(seg, coordinator_detach, (Datum) 0);
+
+	old = MemoryContextSwitchTo(TopMemoryContext);
+	raw_queues = palloc0(sizeof(shm_mq_handle *) * receiver_apply_workers);
+	raw_workers = palloc0(sizeof(BackgroundWorkerHandle *) *
+						  receiver_apply_workers);
+	raw_worker_seq = palloc0(sizeof(uint64) * receiver_apply_workers);
+	raw_depend_seq = palloc0(sizeof(uint64) * receiver_apply_workers);
+	raw_key_buf = makeStringInfo();
+	MemoryContextSwitchTo(old);
+
+	raw_txn_context = AllocSetContextCreate(TopMemoryContext,
+											"receiver_raw transaction",
+											ALLOCSET_DEFAULT_SIZES);
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(RawRoute);
+	hash_ctl.hcxt = TopMemoryContext;
+	raw_routes = hash_create("receiver_raw routes", 128, &hash_ctl,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(uint32);
+	hash_ctl.entrysize = sizeof(RawRowChange);
+	hash_ctl.hcxt = TopMemoryContext;
+	raw_row_changes = hash_create("receiver_raw row changes", 1024, &hash_ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	for (i = 0; i < receiver_apply_workers; i++)
+	{
+		BackgroundWorker worker;
+		shm_mq	   *mq;
+
+		mq = shm_mq_create(shm_toc_allocate(toc, RECEIVER_RAW_QUEUE_SIZE),
+						   RECEIVER_RAW_QUEUE_SIZE);
+		shm_toc_insert(toc, RECEIVER_RAW_KEY_QUEUE + i, mq);
+		shm_mq_set_sender(mq, MyProc);
+
+		/*
+		 * Apply workers are not restarted by themselves: the main worker
+		 * stops if one of them stops, and starts new ones when restarted.
+		 */
+		MemSet(&worker, 0, sizeof(BackgroundWorker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "receiver_raw");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN,
+				 "receiver_raw_apply_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "%s apply worker %d",
+				 worker_name, i);
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		memcpy(worker.bgw_extra, &i, sizeof(int));
+		worker.bgw_notify_pid = MyProcPid;
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &raw_workers[i]))
+		{
+			ereport(LOG, (errmsg("%s: could not register apply worker %d",
+								 worker_name, i)));
+			proc_exit(1);
+		}
+
+		raw_queues[i] = shm_mq_attach(mq, seg, raw_workers[i]);
+	}
+}
+
+/*
+ * Send a status update to the server if one is due. Messages from the
+ * server are not read while waiting for the apply workers, so status
+ * updates are sent at least every 10s then, even if status_interval is 0,
+ * so as wal_sender_timeout is not reached on the server.
+ */
+static void
+send_feedback_if_due(bool waiting)
+{
+	int			interval = receiver_status_interval;
+	int64		now;
+
+	if (waiting && (interval == 0 || interval > 10))
+		interval = 10;
+
+	update_applied_lsn(InvalidXLogRecPtr);
+	now = feGetCurrentTimestamp();
+	if ((interval > 0 &&
+		 (last_status < 0 || now - last_status >= interval * USECS_PER_SEC)) ||
+		(receiver_sync_mode && output_fsync_lsn != last_fsync_lsn))
+	{
+		if (!sendFeedback(receiver_conn, now))
+			proc_exit(1);
+		last_status = now;
+	}
+}
+
+/*
+ * Wait for an apply worker to commit or to read its queue, keeping the
+ * connection to the server alive meanwhile.
+ */
+static void
+wait_for_apply_event(void)
+{
+	int			rc;
+	int			i;
+
+	rc = WaitLatch(&MyProc->procLatch,
+				   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+				   1000L,
+				   PG_WAIT_EXTENSION);
+	ResetLatch(&MyProc->procLatch);
+
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+
+	if (got_sigterm)
+	{
+		ereport(LOG, (errmsg("%s: processed SIGTERM", worker_name)));
+		proc_exit(0);
+	}
+
+	for (i = 0; i < receiver_apply_workers; i++)
+	{
+		pid_t		pid;
+
+		if (GetBackgroundWorkerPid(raw_workers[i], &pid) == BGWH_STOPPED)
+		{
+			ereport(LOG, (errmsg("%s: apply worker %d has stopped",
+								 worker_name, i)));
+			proc_exit(1);
+		}
+	}
+
+	send_feedback_if_due(true);
+}
+
+/*
+ * Send a message to an apply worker. Its queue may be full while it
+ * applies a transaction, in which case this waits for the worker to read
+ * from it.
+ */
+static void
+send_to_worker(int worker, const char *data, int len)
+{
+	for (;;)
+	{
+		shm_mq_result res;
+
+		res = shm_mq_send(raw_queues[worker], len, data, true);
+		if (res == SHM_MQ_SUCCESS)
+			return;
+		if (res == SHM_MQ_DETACHED)
+		{
+			ereport(LOG, (errmsg("%s: apply worker %d has stopped",
+								 worker_name, worker)));
+			proc_exit(1);
+		}
+
+		/* Same arguments are needed for the next attempt */
+		wait_for_apply_event();
+	}
+}
+
+/*
+ * Get the position in commit order of the last transaction committed by the
+ * apply workers.
+ */
+static uint64
+get_committed_seq(void)
+{
+	uint64		seq;
+
+	SpinLockAcquire(&raw_shared->mutex);
+	seq = raw_shared->committed_seq;
+	SpinLockRelease(&raw_shared->mutex);
+
+	return seq;
+}
+
+/*
+ * Wait until the apply workers have committed all the transactions up to
+ * the given position in commit order.
+ */
+static void
+wait_for_commit(uint64 seq)
+{
+	while (get_committed_seq() < seq)
+		wait_for_apply_event();
+}
+
+/*
+ * Send a message of a transaction to an apply worker, preceded by the
+ * definition of its relation if the worker does not know about it yet.
+ */
+static void
+send_message(int worker, RawRoute *route, bool is_relation,
+			 const char *data, int len)
+{
+	if (!is_relation && route != NULL && !route->sent[worker])
+		send_to_worker(worker, route->relmsg, route->relmsg_len);
+	send_to_worker(worker, data, len);
+	if (route != NULL)
+		route->sent[worker] = true;
+}
+
+/*
+ * Start a transaction on an apply worker, giving it the next position in
+ * commit order. The BEGIN message sent to apply workers carries this
+ * position, and whether the transaction is applied alone.
+ */
+static void
+begin_worker_txn(int worker, bool alone)
+{
+	char		buf[1 + 8 + 1];
+
+	raw_dispatched_seq++;
+	raw_worker_seq[worker] = raw_dispatched_seq;
+
+	buf[0] = 'B';
+	fe_sendint64((int64) raw_dispatched_seq, &buf[1]);
+	buf[9] = alone ? 1 : 0;
+	send_to_worker(worker, buf, sizeof(buf));
+}
+
+/*
+ * Send all the pending messages of the transaction to an apply worker.
+ */
+static void
+send_pending_messages(int worker)
+{
+	ListCell   *lc;
+
+	foreach(lc, raw_pending)
+	{
+		RawPendingMessage *pending = lfirst(lc);
+
+		send_message(worker, pending->route, pending->is_relation,
+					 pending->data, pending->len);
+	}
+
+	raw_pending = NIL;
+	raw_pending_bytes = 0;
+}
+
+/*
+ * Choose the apply worker of the transaction in progress. If it changes
+ * rows changed by transactions not committed yet, it is sent to the worker
+ * having the last of them, as a worker applies its transactions in order,
+ * after waiting for the ones of the other workers. Otherwise, the worker
+ * which has been sent a transaction the least recently is chosen.
+ */
+static int
+choose_worker(void)
+{
+	uint64		committed;
+	uint64		wait_seq = 0;
+	int			worker = -1;
+	int			i;
+
+	/* Transactions applied alone are not tracked, so wait for them */
+	wait_for_commit(raw_barrier_seq);
+
+	committed = get_committed_seq();
+	for (i = 0; i < receiver_apply_workers; i++)
+		raw_depend_seq[i] = 0;
+	for (i = 0; i < raw_txn_nkeys; i++)
+	{
+		RawRowChange *change;
+
+		change = hash_search(raw_row_changes, &raw_txn_keys[i],
+							 HASH_FIND, NULL);
+		if (change != NULL && change->seq > committed)
+			raw_depend_seq[change->worker] =
+				Max(raw_depend_seq[change->worker], change->seq);
+	}
+
+	for (i = 0; i < receiver_apply_workers; i++)
+	{
+		if (raw_depend_seq[i] == 0)
+			continue;
+		if (worker < 0 || raw_depend_seq[i] > raw_depend_seq[worker])
+		{
+			if (worker >= 0)
+				wait_seq = Max(wait_seq, raw_depend_seq[worker]);
+			worker = i;
+		}
+		else
+			wait_seq = Max(wait_seq, raw_depend_seq[i]);
+	}
+
+	if (worker >= 0)
+	{
+		wait_for_commit(wait_seq);
+		return worker;
+	}
+
+	worker = 0;
+	for (i = 1; i < receiver_apply_workers; i++)
+	{
+		if (raw_worker_seq[i] < raw_worker_seq[worker])
+			worker = i;
+	}
+	return worker;
+}
+
+/*
+ * Remember the rows changed by the transaction just dispatched, and forget
+ * the ones changed by transactions committed if there are too many.
+ */
+static void
+track_row_changes(int worker)
+{
+	int			i;
+
+	for (i = 0; i < raw_txn_nkeys; i++)
+	{
+		RawRowChange *change;
+
+		change = hash_search(raw_row_changes, &raw_txn_keys[i],
+							 HASH_ENTER, NULL);
+		change->worker = worker;
+		change->seq = raw_dispatched_seq;
+	}
+
+	if (hash_get_num_entries(raw_row_changes) > RECEIVER_RAW_MAX_ROWS)
+	{
+		uint64		committed = get_committed_seq();
+		HASH_SEQ_STATUS status;
+		RawRowChange *change;
+
+		hash_seq_init(&status, raw_row_changes);
+		while ((change = hash_seq_search(&status)) != NULL)
+		{
+			if (change->seq <= committed)
+				hash_search(raw_row_changes, &change->keyhash,
+							HASH_REMOVE, NULL);
+		}
+	}
+}
+
+/*
+ * Read a tuple of a change message, adding the values of its key columns
+ * to the given buffer.
+ */
+static void
+read_tuple_key(StringInfo msg, RawRoute *route, bool key_only,
+			   StringInfo keybuf)
+{
+	int			ncols;
+	int			nbytes;
+	const char *nullbits;
+	const char *toastbits;
+	int			i;
+
+	(void) pq_getmsgbyte(msg);		/* tuple marker */
+	ncols = pq_getmsgint(msg, 2);
+	nbytes = (ncols + 7) / 8;
+	nullbits = pq_getmsgbytes(msg, nbytes);
+	toastbits = pq_getmsgbytes(msg, nbytes);
+
+	for (i = 0; i < ncols; i++)
+	{
+		bool		iskey = key_only || (i < route->ncols && route->iskey[i]);
+		int			len;
+		const char *value;
+
+		if ((nullbits[i / 8] & (1 << (i % 8))) != 0)
+		{
+			if (iskey)
+				appendStringInfoChar(keybuf, 'n');
+			continue;
+		}
+		if ((toastbits[i / 8] & (1 << (i % 8))) != 0)
+			continue;
+
+		len = pq_getmsgint(msg, 4);
+		value = pq_getmsgbytes(msg, len);
+		if (iskey)
+		{
+			appendBinaryStringInfo(keybuf, (char *) &len, sizeof(int));
+			appendBinaryStringInfo(keybuf, value, len);
+		}
+	}
+}
+
+/*
+ * Add a row to the rows changed by the transaction in progress, as the hash
+ * of its relation and replica identity key in the given buffer.
+ */
+static void
+add_txn_key(StringInfo keybuf)
+{
+	if (raw_txn_nkeys >= raw_txn_maxkeys)
+	{
+		raw_txn_maxkeys = Max(raw_txn_maxkeys * 2, 64);
+		if (raw_txn_keys == NULL)
+			raw_txn_keys = MemoryContextAlloc(raw_txn_context,
+											  sizeof(uint32) * raw_txn_maxkeys);
+		else
+			raw_txn_keys = repalloc(raw_txn_keys,
+									sizeof(uint32) * raw_txn_maxkeys);
+	}
+
+	raw_txn_keys[raw_txn_nkeys++] =
+		DatumGetUInt32(hash_any((unsigned char *) keybuf->data, keybuf->len));
+}
+
+/*
+ * Track the row changed by a change message, and for an UPDATE the new
+ * version of the row as well, whose key may have changed. Returns the route
+ * of the relation of the change.
+ */
+static RawRoute *
+route_change(const char *data, int len)
+{
+	StringInfoData msg;
+	char		action;
+	Oid			remoteid;
+	RawRoute   *route;
+
+	msg.data = (char *) data;
+	msg.len = len;
+	msg.maxlen = len;
+	msg.cursor = 0;
+
+	action = pq_getmsgbyte(&msg);
+	remoteid = pq_getmsgint(&msg, 4);
+	route = hash_search(raw_routes, &remoteid, HASH_FIND, NULL);
+	if (route == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("%s: change received for unknown relation %u",
+						worker_name, remoteid)));
+
+	resetStringInfo(raw_key_buf);
+	appendBinaryStringInfo(raw_key_buf, (char *) &remoteid, sizeof(Oid));
+	read_tuple_key(&msg, route, action != 'I', raw_key_buf);
+	add_txn_key(raw_key_buf);
+
+	if (action == 'U')
+	{
+		resetStringInfo(raw_key_buf);
+		appendBinaryStringInfo(raw_key_buf, (char *) &remoteid, sizeof(Oid));
+		read_tuple_key(&msg, route, false, raw_key_buf);
+		add_txn_key(raw_key_buf);
+	}
+
+	return route;
+}
+
+/*
+ * Save the key columns of a relation from its RELATION message, which is
+ * sent to each apply worker before the first change of this relation it
+ * receives after this point.
+ */
+static RawRoute *
+route_relation(const char *data, int len)
+{
+	StringInfoData msg;
+	Oid			remoteid;
+	RawRoute   *route;
+	bool		found;
+	int			i;
+
+	msg.data = (char *) data;
+	msg.len = len;
+	msg.maxlen = len;
+	msg.cursor = 0;
+
+	(void) pq_getmsgbyte(&msg);		/* message type */
+	remoteid = pq_getmsgint(&msg, 4);
+	(void) pq_getmsgstring(&msg);	/* namespace name */
+	(void) pq_getmsgstring(&msg);	/* relation name */
+	(void) pq_getmsgbyte(&msg);		/* replica identity */
+
+	route = hash_search(raw_routes, &remoteid, HASH_ENTER, &found);
+	if (found)
+	{
+		pfree(route->iskey);
+		pfree(route->relmsg);
+	}
+	else
+		route->sent = MemoryContextAlloc(TopMemoryContext,
+										 sizeof(bool) * receiver_apply_workers);
+	memset(route->sent, 0, sizeof(bool) * receiver_apply_workers);
+	route->relmsg = MemoryContextAlloc(TopMemoryContext, len);
+	memcpy(route->relmsg, data, len);
+	route->relmsg_len = len;
+
+	route->ncols = pq_getmsgint(&msg, 2);
+	route->iskey = MemoryContextAlloc(TopMemoryContext,
+									  sizeof(bool) * Max(route->ncols, 1));
+	for (i = 0; i < route->ncols; i++)
+	{
+		uint8		flags = pq_getmsgbyte(&msg);
+
+		route->iskey[i] = (flags & 0x01) != 0;
+		(void) pq_getmsgstring(&msg);	/* column name */
+		(void) pq_getmsgint(&msg, 4);	/* type OID */
+		(void) pq_getmsgint(&msg, 4);	/* type modifier */
+	}
+
+	return route;
+}
+
+/*
+ * Queue a message of the current transaction, or send it directly if the
+ * transaction is too large to be buffered.
+ */
+static void
+queue_message(RawRoute *route, bool is_relation, const char *data, int len)
+{
+	RawPendingMessage *pending;
+
+	if (!raw_txn_streaming &&
+		raw_pending_bytes + len > RECEIVER_RAW_MAX_PENDING)
+	{
+		/* Apply it alone, once all the previous ones are committed */
+		wait_for_commit(raw_dispatched_seq);
+		raw_txn_streaming = true;
+		raw_txn_worker = choose_worker();
+		begin_worker_txn(raw_txn_worker, true);
+		send_pending_messages(raw_txn_worker);
+	}
+
+	if (raw_txn_streaming)
+	{
+		send_message(raw_txn_worker, route, is_relation, data, len);
+		return;
+	}
+
+	pending = MemoryContextAlloc(raw_txn_context,
+								 offsetof(RawPendingMessage, data) + len);
+	pending->route = route;
+	pending->is_relation = is_relation;
+	pending->len = len;
+	memcpy(pending->data, data, len);
+	raw_pending = lappend(raw_pending, pending);
+	raw_pending_bytes += len;
+}
+
+/*
+ * Dispatch a transaction at its commit to the apply worker chosen for it,
+ * or finish sending it if it has been sent while received.
+ */
+static void
+dispatch_commit(const char *data, int len)
+{
+	StringInfoData msg;
+	XLogRecPtr	end_lsn;
+
+	msg.data = (char *) data;
+	msg.len = len;
+	msg.maxlen = len;
+	msg.cursor = 0;
+	(void) pq_getmsgbyte(&msg);		/* message type */
+	(void) pq_getmsgint64(&msg);	/* commit LSN */
+	end_lsn = pq_getmsgint64(&msg);
+
+	if (raw_txn_streaming)
+	{
+		send_to_worker(raw_txn_worker, data, len);
+		raw_barrier_seq = raw_dispatched_seq;
+	}
+	else if (raw_pending != NIL)
+	{
+		int			worker = choose_worker();
+
+		begin_worker_txn(worker, false);
+		send_pending_messages(worker);
+		send_to_worker(worker, data, len);
+		track_row_changes(worker);
+	}
+
+	raw_dispatched_lsn = end_lsn;
+	stats_count_commit(1, 0);
+
+	raw_txn_open = false;
+	raw_txn_streaming = false;
+	raw_txn_keys = NULL;
+	raw_txn_nkeys = 0;
+	raw_txn_maxkeys = 0;
+	raw_pending = NIL;
+	raw_pending_bytes = 0;
+	MemoryContextReset(raw_txn_context);
+}
+
+/*
+ * Dispatch a message received from decoder_raw to the apply workers.
+ * Changes of a transaction are buffered until its commit, where the worker
+ * applying it is chosen.
+ */
+static void
+dispatch_message(const char *data, int len)
+{
+	MemoryContext old;
+	char		action = data[0];
+
+	/* Pending messages are kept in the transaction context */
+	old = MemoryContextSwitchTo(raw_txn_context);
+
+	switch (action)
+	{
+		case 'B':
+			if (raw_txn_open)
+				ereport(ERROR,
+						(errcode(ERRCODE_PROTOCOL_VIOLATION),
+						 errmsg("%s: BEGIN received within a transaction",
+								worker_name)));
+			raw_txn_open = true;
+			raw_txn_streaming = false;
+			break;
+		case 'R':
+			queue_message(route_relation(data, len), true, data, len);
+			break;
+		case 'I':
+		case 'U':
+		case 'D':
+			if (!raw_txn_open)
+				ereport(ERROR,
+						(errcode(ERRCODE_PROTOCOL_VIOLATION),
+						 errmsg("%s: change received outside a transaction",
+								worker_name)));
+			queue_message(route_change(data, len), false, data, len);
+			break;
+		case 'C':
+			dispatch_commit(data, len);
+			break;
+		default:
+			ereport(LOG, (errmsg("%s: Incorrect message type \"%c\"",
+								 worker_name, action)));
+			proc_exit(1);
+	}
+
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * Leave if the coordinator is gone, as nothing should be committed after
+ * it has stopped: it is restarted from the last transaction committed.
+ */
+static void
+check_coordinator(void)
+{
+	bool		gone;
+
+	SpinLockAcquire(&raw_shared->mutex);
+	gone = raw_shared->coordinator_gone;
+	SpinLockRelease(&raw_shared->mutex);
+
+	if (gone)
+	{
+		ereport(LOG, (errmsg("%s: apply worker %d lost its coordinator",
+							 worker_name, raw_worker_id)));
+		proc_exit(1);
+	}
+}
+
+/*
+ * Start the local transaction of an apply worker. An XID is assigned right
+ * away and published, so as other workers can wait for this transaction.
+ */
+static void
+start_worker_xact(void)
+{
+	TransactionId xid;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	xid = GetCurrentTransactionId();
+
+	SpinLockAcquire(&raw_shared->mutex);
+	raw_shared->workers[raw_worker_id].xid = xid;
+	SpinLockRelease(&raw_shared->mutex);
+	raw_apply_in_xact = true;
+}
+
+/*
+ * Wait until all the transactions before the one of this apply worker are
+ * committed. Within a transaction, this waits on the XID of a previous
+ * transaction in progress, so as the deadlock detector finds out if that
+ * one waits for a row locked by this one. If a previous transaction is
+ * applied again after a failure, this one gives up its changes, which may
+ * block it, and is applied again as well.
+ */
+static void
+wait_for_turn(void)
+{
+	for (;;)
+	{
+		uint64		committed;
+		uint64		retry_seq;
+		TransactionId xid = InvalidTransactionId;
+		uint64		xid_seq = 0;
+		int			i;
+
+		check_coordinator();
+
+		SpinLockAcquire(&raw_shared->mutex);
+		committed = raw_shared->committed_seq;
+		retry_seq = raw_shared->retry_seq;
+		for (i = 0; i < raw_shared->nworkers; i++)
+		{
+			RawApplyWorker *other = &raw_shared->workers[i];
+
+			if (other->seq > committed && other->seq < raw_apply_seq &&
+				TransactionIdIsValid(other->xid) &&
+				(xid_seq == 0 || other->seq < xid_seq))
+			{
+				xid = other->xid;
+				xid_seq = other->seq;
+			}
+		}
+		SpinLockRelease(&raw_shared->mutex);
+
+		if (committed + 1 >= raw_apply_seq)
+			return;
+
+		if (raw_apply_in_xact && retry_seq != 0 && retry_seq < raw_apply_seq)
+			ereport(ERROR,
+					(errcode(ERRCODE_T_R_SERIALIZATION_FAILURE),
+					 errmsg("%s: apply worker %d gives way to a previous transaction applied again",
+							worker_name, raw_worker_id)));
+
+		if (raw_apply_in_xact && TransactionIdIsValid(xid))
+			XactLockTableWait(xid, NULL, NULL, XLTW_None);
+		else
+		{
+			int			rc;
+
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   100L,
+						   PG_WAIT_EXTENSION);
+			ResetLatch(&MyProc->procLatch);
+
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Commit the transaction of an apply worker once all the previous ones are
+ * committed. Commits are done one at a time in the order of the server, so
+ * each one advances in turn the origin of the main worker, from which
+ * replication restarts. They are reported as flushed by the coordinator
+ * once they are.
+ */
+static void
+commit_worker_xact(void)
+{
+	int			i;
+
+	wait_for_turn();
+	check_coordinator();
+
+	SPI_finish();
+	PopActiveSnapshot();
+	replorigin_session_setup(raw_shared->origin);
+	raw_apply_origin_held = true;
+	replorigin_session_origin_lsn = raw_apply_end_lsn;
+	replorigin_session_origin_timestamp = raw_apply_commit_time;
+	CommitTransactionCommand();
+	replorigin_session_origin_lsn = InvalidXLogRecPtr;
+	replorigin_session_origin_timestamp = 0;
+	replorigin_session_reset();
+	raw_apply_origin_held = false;
+	raw_apply_in_xact = false;
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	SpinLockAcquire(&raw_shared->mutex);
+	raw_shared->committed_seq = raw_apply_seq;
+	raw_shared->committed_lsn = raw_apply_end_lsn;
+	raw_shared->committed_end = XactLastCommitEnd;
+	if (raw_shared->retry_seq == raw_apply_seq)
+		raw_shared->retry_seq = 0;
+	raw_shared->workers[raw_worker_id].seq = 0;
+	raw_shared->workers[raw_worker_id].xid = InvalidTransactionId;
+	SpinLockRelease(&raw_shared->mutex);
+
+	/* Let the coordinator and the workers waiting for their turn know */
+	SetLatch(&raw_shared->coordinator->procLatch);
+	for (i = 0; i < raw_shared->nworkers; i++)
+	{
+		/* Set only once at startup by each worker */
+		PGPROC	   *proc = raw_shared->workers[i].proc;
+
+		if (proc != NULL && i != raw_worker_id)
+			SetLatch(&proc->procLatch);
+	}
+
+	stats_count_commit(0, 1);
+	raw_apply_commit_received = false;
+}
+
+/*
+ * Apply again a transaction which has failed, once all the previous ones
+ * are committed.
+ */
+static void
+retry_worker_xact(void)
+{
+	ListCell   *lc;
+
+	raw_apply_retrying = true;
+	wait_for_turn();
+
+	raw_apply_failed = false;
+	start_worker_xact();
+	foreach(lc, raw_apply_messages)
+	{
+		RawPendingMessage *buffered = lfirst(lc);
+
+		apply_binary_change(buffered->data, buffered->len);
+	}
+	commit_worker_xact();
+}
+
+/*
+ * Handle a message received by an apply worker. Messages of a transaction
+ * are applied as they are received, and kept until its commit unless it is
+ * applied alone, to be applied again in case of failure.
+ */
+static void
+handle_worker_message(char *data, int len)
+{
+	StringInfoData msg;
+
+	msg.data = data;
+	msg.len = len;
+	msg.maxlen = len;
+	msg.cursor = 0;
+
+	switch (pq_getmsgbyte(&msg))
+	{
+		case 'B':
+			raw_apply_seq = (uint64) pq_getmsgint64(&msg);
+			raw_apply_alone = pq_getmsgbyte(&msg) != 0;
+			raw_apply_failed = false;
+			raw_apply_retrying = false;
+			raw_apply_commit_received = false;
+			raw_apply_messages = NIL;
+			MemoryContextReset(raw_apply_txn_context);
+
+			SpinLockAcquire(&raw_shared->mutex);
+			raw_shared->workers[raw_worker_id].seq = raw_apply_seq;
+			SpinLockRelease(&raw_shared->mutex);
+			break;
+		case 'C':
+			(void) pq_getmsgint64(&msg);	/* commit LSN */
+			raw_apply_end_lsn = pq_getmsgint64(&msg);
+			raw_apply_commit_time = pq_getmsgint64(&msg);
+			raw_apply_commit_received = true;
+
+			/* A transaction having failed is applied again by the caller */
+			if (!raw_apply_failed)
+			{
+				if (!raw_apply_in_xact)
+					start_worker_xact();
+				commit_worker_xact();
+			}
+			break;
+		default:
+			if (!raw_apply_alone)
+			{
+				RawPendingMessage *buffered;
+
+				buffered = MemoryContextAlloc(raw_apply_txn_context,
+											  offsetof(RawPendingMessage, data) + len);
+				buffered->route = NULL;
+				buffered->is_relation = false;
+				buffered->len = len;
+				memcpy(buffered->data, data, len);
+				raw_apply_messages = lappend(raw_apply_messages, buffered);
+			}
+
+			if (!raw_apply_failed)
+			{
+				if (!raw_apply_in_xact)
+					start_worker_xact();
+				apply_binary_change(data, len);
+			}
+			break;
+	}
+}
+
+/*
+ * Clean up after a failure of the transaction of an apply worker, which is
+ * applied again once all the previous ones are committed. Failures of a
+ * transaction applied alone, or applied again after all the previous ones
+ * were committed, are real errors except for deadlocks, which can still
+ * happen with the next transactions, and make the worker stop.
+ */
+static void
+handle_apply_error(void)
+{
+	ErrorData  *edata;
+
+	MemoryContextSwitchTo(TopMemoryContext);
+	edata = CopyErrorData();
+
+	if (raw_apply_alone ||
+		(raw_apply_retrying &&
+		 edata->sqlerrcode != ERRCODE_T_R_DEADLOCK_DETECTED))
+		PG_RE_THROW();
+
+	HOLD_INTERRUPTS();
+	if (raw_apply_origin_held)
+	{
+		replorigin_session_reset();
+		raw_apply_origin_held = false;
+	}
+	replorigin_session_origin_lsn = InvalidXLogRecPtr;
+	replorigin_session_origin_timestamp = 0;
+	AbortOutOfAnyTransaction();
+	FlushErrorState();
+	MemoryContextReset(raw_apply_context);
+	RESUME_INTERRUPTS();
+	stats_reset_rows();
+
+	raw_apply_in_xact = false;
+	raw_apply_failed = true;
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	SpinLockAcquire(&raw_shared->mutex);
+	raw_shared->workers[raw_worker_id].xid = InvalidTransactionId;
+	if (raw_shared->retry_seq == 0 || raw_apply_seq < raw_shared->retry_seq)
+		raw_shared->retry_seq = raw_apply_seq;
+	SpinLockRelease(&raw_shared->mutex);
+
+	ereport(LOG,
+			(errmsg("%s: apply worker %d will apply transaction " UINT64_FORMAT " again once the previous ones are committed: %s",
+					worker_name, raw_worker_id, raw_apply_seq,
+					edata->message)));
+	FreeErrorData(edata);
+}
+
+/*
+ * Main entry point of apply workers, applying the transactions received
+ * from the coordinator.
+ */
+void
+receiver_raw_apply_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	Size		nbytes = 0;
+	void	   *data = NULL;
+
+	memcpy(&raw_worker_id, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	/* Default handler of SIGTERM is fine as there is no cleanup to do */
+	BackgroundWorkerUnblockSignals();
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("%s: could not map dynamic shared memory segment",
+						worker_name)));
+	dsm_pin_mapping(seg);
+
+	toc = shm_toc_attach(RECEIVER_RAW_SHM_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("%s: bad magic number in dynamic shared memory segment",
+						worker_name)));
+	raw_shared = shm_toc_lookup(toc, RECEIVER_RAW_KEY_SHARED, false);
+	mq = shm_toc_lookup(toc, RECEIVER_RAW_KEY_QUEUE + raw_worker_id, false);
+	shm_mq_set_receiver(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	/* Connect to a database */
+	BackgroundWorkerInitializeConnection(receiver_database, NULL);
+	init_binary_apply();
+	raw_apply_txn_context = AllocSetContextCreate(TopMemoryContext,
+												  "receiver_raw apply transaction",
+												  ALLOCSET_DEFAULT_SIZES);
+
+	/* Changes are marked with the origin advanced by each commit */
+	replorigin_session_origin = raw_shared->origin;
+
+	/*
+	 * Like logical replication, disable triggers and foreign key checks,
+	 * and commit asynchronously: the coordinator reports commits as flushed
+	 * to the server only once they are.
+	 */
+	SetConfigOption("session_replication_role", "replica",
+					PGC_SUSET, PGC_S_OVERRIDE);
+	SetConfigOption("synchronous_commit", "off",
+					PGC_SUSET, PGC_S_OVERRIDE);
+
+	SpinLockAcquire(&raw_shared->mutex);
+	raw_shared->workers[raw_worker_id].proc = MyProc;
+	SpinLockRelease(&raw_shared->mutex);
+
+	for (;;)
+	{
+		bool		retry = raw_apply_failed && raw_apply_commit_received;
+
+		if (!retry &&
+			shm_mq_receive(mqh, &nbytes, &data, false) != SHM_MQ_SUCCESS)
+		{
+			/* Coordinator is gone, changes not committed are lost */
+			ereport(LOG, (errmsg("%s: apply worker %d lost its coordinator",
+								 worker_name, raw_worker_id)));
+			proc_exit(1);
+		}
+
+		PG_TRY();
+		{
+			if (retry)
+				retry_worker_xact();
+			else
+				handle_worker_message((char *) data, (int) nbytes);
+		}
+		PG_CATCH();
+		{
+			handle_apply_error();
+		}
+		PG_END_TRY();
+	}
 }
 
 /*
- * Converts an int64 to network byte order.
+ * Begin a local transaction, in which remote transactions are applied
+ * until it is committed.
  */
 static void
-fe_sendint64(int64 i, char *buf)
+begin_local_xact(void)
 {
-	uint32	  n32;
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	local_xact_open = true;
+	local_xact_count = 0;
+	local_xact_bytes = 0;
+	local_xact_start = GetCurrentTimestamp();
+}
 
-	/* High order half first, since we're doing MSB-first */
-	n32 = (uint32) (i >> 32);
-	n32 = htonl(n32);
-	memcpy(&buf[0], &n32, 4);
+/*
+ * Commit the local transaction, saving with it the position of the last
+ * remote transaction applied. This position is reported as flushed to the
+ * server once the local commit is flushed.
+ */
+static void
+commit_local_xact(void)
+{
+	RawFlushPosition *pos;
+
+	SPI_finish();
+	PopActiveSnapshot();
+
+	replorigin_session_origin_lsn = remote_commit_lsn;
+	replorigin_session_origin_timestamp = remote_commit_time;
+	CommitTransactionCommand();
+	replorigin_session_origin_lsn = InvalidXLogRecPtr;
+	replorigin_session_origin_timestamp = 0;
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	pos = MemoryContextAlloc(TopMemoryContext, sizeof(RawFlushPosition));
+	pos->local_end = XactLastCommitEnd;
+	pos->remote_end = remote_commit_lsn;
+	flush_positions = lappend(flush_positions, pos);
+
+	/* Reported as applied once flushed, see update_applied_lsn() */
+	local_xact_open = false;
+	stats_count_commit(local_xact_count, 1);
+}
 
-	/* Now the low order half */
-	n32 = (uint32) i;
-	n32 = htonl(n32);
-	memcpy(&buf[4], &n32, 4);
+/*
+ * Check if the local transaction has reached one of the limits of group
+ * commit.
+ */
+static bool
+local_xact_is_full(void)
+{
+	if (receiver_commit_transactions > 0 &&
+		local_xact_count >= receiver_commit_transactions)
+		return true;
+	if (receiver_commit_size > 0 &&
+		local_xact_bytes >= (Size) receiver_commit_size * 1024)
+		return true;
+	if (receiver_commit_delay > 0 &&
+		TimestampDifferenceExceeds(local_xact_start, GetCurrentTimestamp(),
+								   receiver_commit_delay))
+		return true;
+	return false;
 }
 
 /*
- * Converts an int64 from network byte order to native format.
+ * Apply a message received from decoder_raw in the main worker, grouping
+ * remote transactions into local ones. The end position of a remote
+ * transaction is the start position of its commit message.
  */
-static int64
-fe_recvint64(char *buf)
+static void
+apply_message(char *data, int len, XLogRecPtr walStart, int64 sendTime)
 {
-	int64	   result;
-	uint32	  h32;
-	uint32	  l32;
+	bool		is_begin;
+	bool		is_commit;
 
-	memcpy(&h32, buf, 4);
-	memcpy(&l32, buf + 4, 4);
-	h32 = ntohl(h32);
-	l32 = ntohl(l32);
+	if (receiver_binary_apply)
+	{
+		is_begin = data[0] == 'B';
+		is_commit = data[0] == 'C';
+	}
+	else
+	{
+		is_begin = strcmp(data, "BEGIN;") == 0;
+		is_commit = strcmp(data, "COMMIT;") == 0;
+	}
 
-	result = h32;
-	result <<= 32;
-	result |= l32;
+	if (is_begin)
+	{
+		remote_xact_open = true;
+		return;
+	}
 
-	return result;
-}
+	if (is_commit)
+	{
+		remote_xact_open = false;
+		remote_commit_lsn = walStart;
+		remote_commit_time = sendTime;
 
-static int64
-feGetCurrentTimestamp(void)
-{
-	int64	   result;
-	struct timeval tp;
+		/* Commit timestamp is included in binary format */
+		if (receiver_binary_apply)
+		{
+			StringInfoData msg;
 
-	gettimeofday(&tp, NULL);
+			msg.data = data;
+			msg.len = len;
+			msg.maxlen = len;
+			msg.cursor = 1 + 8 + 8;		/* type, commit and end LSNs */
+			remote_commit_time = pq_getmsgint64(&msg);
+		}
 
-	result = (int64) tp.tv_sec -
-		((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY);
+		/* Nothing applied, so nothing to wait for */
+		if (!local_xact_open)
+		{
+			RawFlushPosition *pos;
+
+			pos = MemoryContextAlloc(TopMemoryContext,
+									 sizeof(RawFlushPosition));
+			pos->local_end = InvalidXLogRecPtr;
+			pos->remote_end = remote_commit_lsn;
+			flush_positions = lappend(flush_positions, pos);
+			stats_count_commit(1, 0);
+			return;
+		}
 
-	result = (result * USECS_PER_SEC) + tp.tv_usec;
+		local_xact_count++;
+		if (local_xact_is_full())
+			commit_local_xact();
+		return;
+	}
 
-	return result;
+	if (!local_xact_open)
+		begin_local_xact();
+	local_xact_bytes += len;
+
+	if (receiver_binary_apply)
+		apply_binary_change(data, len);
+	else
+		apply_sql_change(data);
 }
 
+/*
+ * Update the fsync and applied positions reported to the server. Those only
+ * move once local commits are flushed, which apply workers do in the order
+ * of the server, the coordinator following the last one. When a keepalive
+ * message is received while everything has been applied, its position can
+ * be used.
+ */
 static void
-feTimestampDifference(int64 start_time, int64 stop_time,
-					  long *secs, int *microsecs)
+update_applied_lsn(XLogRecPtr keepalive_lsn)
 {
-	int64	   diff = stop_time - start_time;
+	XLogRecPtr	flushed;
+	bool		idle;
 
-	if (diff <= 0)
+	if (receiver_apply_workers > 0)
 	{
-		*secs = 0;
-		*microsecs = 0;
+		uint64		committed_seq;
+		XLogRecPtr	committed_lsn;
+		XLogRecPtr	committed_end;
+
+		SpinLockAcquire(&raw_shared->mutex);
+		committed_seq = raw_shared->committed_seq;
+		committed_lsn = raw_shared->committed_lsn;
+		committed_end = raw_shared->committed_end;
+		SpinLockRelease(&raw_shared->mutex);
+
+		if (committed_lsn > raw_committed_lsn)
+		{
+			RawFlushPosition *pos;
+
+			pos = MemoryContextAlloc(TopMemoryContext,
+									 sizeof(RawFlushPosition));
+			pos->local_end = committed_end;
+			pos->remote_end = committed_lsn;
+			flush_positions = lappend(flush_positions, pos);
+			raw_committed_lsn = committed_lsn;
+		}
+		idle = committed_seq == raw_dispatched_seq && !raw_txn_open;
 	}
 	else
+		idle = !local_xact_open && !remote_xact_open;
+
+	flushed = GetFlushRecPtr();
+	while (flush_positions != NIL)
 	{
-		*secs = (long) (diff / USECS_PER_SEC);
-		*microsecs = (int) (diff % USECS_PER_SEC);
+		RawFlushPosition *pos = linitial(flush_positions);
+
+		if (pos->local_end > flushed)
+			break;
+		output_applied_lsn = Max(output_applied_lsn, pos->remote_end);
+		output_fsync_lsn = Max(output_fsync_lsn, pos->remote_end);
+		flush_positions = list_delete_first(flush_positions);
+		pfree(pos);
+	}
+
+	/* Transactions with nothing to apply are not committed by workers */
+	if (idle && flush_positions == NIL)
+	{
+		XLogRecPtr	applied = raw_dispatched_lsn;
+
+		if (keepalive_lsn != InvalidXLogRecPtr)
+			applied = Max(applied, keepalive_lsn);
+		output_applied_lsn = Max(output_applied_lsn, applied);
+		output_fsync_lsn = Max(output_fsync_lsn, applied);
+	}
+	stats_update_positions();
+}
+
+/*
+ * Set up the replication origin tracking the position applied, and
+ * return the position where to restart replication.
+ */
+static XLogRecPtr
+setup_origin(void)
+{
+	char		originname[NAMEDATALEN + 16];
+	XLogRecPtr	startpos;
+
+	snprintf(originname, sizeof(originname), "receiver_raw_%s",
+			 receiver_slot);
+
+	StartTransactionCommand();
+	receiver_origin = replorigin_by_name(originname, true);
+	if (receiver_origin == InvalidRepOriginId)
+		receiver_origin = replorigin_create(originname);
+
+	/* Apply workers set it up for each of their commits */
+	if (receiver_apply_workers == 0)
+	{
+		replorigin_session_setup(receiver_origin);
+		replorigin_session_origin = receiver_origin;
+		startpos = replorigin_session_get_progress(false);
 	}
+	else
+		startpos = replorigin_get_progress(receiver_origin, false);
+	CommitTransactionCommand();
+
+	ereport(LOG, (errmsg("%s: starting replication from %X/%X with origin \"%s\"",
+						 worker_name,
+						 (uint32) (startpos >> 32), (uint32) startpos,
+						 originname)));
+	return startpos;
 }
 
 void
@@ -209,6 +2468,7 @@ receiver_raw_main(Datum main_arg)
 	PQExpBuffer query;
 	PGconn *conn;
 	PGresult *res;
+	XLogRecPtr startpos;
 
 	/* Register functions for SIGTERM/SIGHUP management */
 	pqsignal(SIGHUP, receiver_raw_sighup);
@@ -229,14 +2489,56 @@ receiver_raw_main(Datum main_arg)
 							 worker_name)));
 		proc_exit(1);
 	}
+	receiver_conn = conn;
 
 	/* Query buffer for remote connection */
 	query = createPQExpBuffer();
 
-	/* Start logical replication at specified position */
-	appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL 0/0 "
-					         "(\"include_transaction\" 'off')",
-					  receiver_slot);
+	/*
+	 * Restart where the last run stopped. This creates the origin advanced
+	 * by the apply workers, so this needs to happen before starting them.
+	 */
+	startpos = setup_origin();
+	output_written_lsn = startpos;
+	output_fsync_lsn = startpos;
+	output_applied_lsn = startpos;
+
+	/*
+	 * Changes are either applied by this worker, or dispatched to apply
+	 * workers, which need to know about the relation keys.
+	 */
+	if (receiver_apply_workers > 0)
+	{
+		if (!receiver_binary_apply)
+		{
+			ereport(LOG, (errmsg("%s: receiver_raw.apply_workers requires receiver_raw.binary_apply",
+								 worker_name)));
+			proc_exit(1);
+		}
+		start_apply_workers();
+	}
+	else if (receiver_binary_apply)
+		init_binary_apply();
+
+	if (receiver_stats != NULL)
+	{
+		SpinLockAcquire(&receiver_stats->mutex);
+		receiver_stats->pid = MyProcPid;
+		SpinLockRelease(&receiver_stats->mutex);
+		on_shmem_exit(receiver_raw_stats_exit, (Datum) 0);
+	}
+
+	/*
+	 * Start logical replication at specified position. Transaction
+	 * boundaries are needed to group commits or dispatch changes to
+	 * apply workers.
+	 */
+	appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X "
+					         "(\"include_transaction\" 'on'%s)",
+					  receiver_slot,
+					  (uint32) (startpos >> 32), (uint32) startpos,
+					  receiver_binary_apply ?
+					  ", \"output_format\" 'binary'" : "");
 	res = PQexec(conn, query->data);
 	if (PQresultStatus(res) != PGRES_COPY_BOTH)
 	{
@@ -251,62 +2553,32 @@ receiver_raw_main(Datum main_arg)
 	while (!got_sigterm)
 	{
 		int rc, hdr_len;
+		int64 now;
+		long secs;
+		int usecs;
+		long timeout;
 		/* Buffer for COPY data */
 		char	*copybuf = NULL;
 
-		/* Wait necessary amount of time */
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   receiver_idle_time * 1L,
-					   PG_WAIT_EXTENSION);
-		ResetLatch(&MyProc->procLatch);
-
-		/* Process signals */
-		if (got_sighup)
-		{
-			/* Process config file */
-			ProcessConfigFile(PGC_SIGHUP);
-			got_sighup = false;
-			ereport(LOG, (errmsg("%s: processed SIGHUP", worker_name)));
-		}
-
-		if (got_sigterm)
-		{
-			/* Simply exit */
-			ereport(LOG, (errmsg("%s: processed SIGTERM", worker_name)));
-			proc_exit(0);
-		}
-
-		/* Emergency bailout if postmaster has died */
-		if (rc & WL_POSTMASTER_DEATH)
-			proc_exit(1);
-
-		/* Some cleanup */
-		if (copybuf != NULL)
-		{
-			PQfreemem(copybuf);
-			copybuf = NULL;
-		}
-
-		/*
-		 * Begin a transaction before applying any changes. All the changes
-		 * of the same batch are applied within the same transaction.
-		 */
-		SetCurrentStatementStartTimestamp();
-		StartTransactionCommand();
-		SPI_connect();
-		PushActiveSnapshot(GetTransactionSnapshot());
-
 		/*
-		 * Receive data.
+		 * Receive all the data available.
 		 */
 		while (true)
 		{
 			XLogRecPtr  walEnd, walStart;
+			int64		sendTime;
+			int64		receiptTime;
+
+			if (copybuf != NULL)
+			{
+				PQfreemem(copybuf);
+				copybuf = NULL;
+			}
 
 			rc = PQgetCopyData(conn, &copybuf, 1);
 			if (rc <= 0)
 				break;
+			receiptTime = feGetCurrentTimestamp();
 
 			/*
 			 * Check message received from server:
@@ -330,11 +2602,12 @@ receiver_raw_main(Datum main_arg)
 				 * considered as sent to this receiver.
 				 */
 				walEnd = fe_recvint64(&copybuf[pos]);
-				ereport(LOG, (errmsg("%s: keepalive message from server, "
-									 "walEnd %X/%X, ",
-									 worker_name,
-									 (uint32) (walEnd >> 32),
-									 (uint32) walEnd)));
+				ereport(RECEIVER_CHANGE_LEVEL,
+						(errmsg("%s: keepalive message from server, "
+								"walEnd %X/%X, ",
+								worker_name,
+								(uint32) (walEnd >> 32),
+								(uint32) walEnd)));
 				pos += 8;	/* read walEnd */
 				pos += 8;	/* skip sendTime */
 				if (rc < pos + 1)
@@ -347,8 +2620,8 @@ receiver_raw_main(Datum main_arg)
 
 				/* Update written position */
 				output_written_lsn = Max(walEnd, output_written_lsn);
-				output_fsync_lsn = output_written_lsn;
-				output_applied_lsn = output_written_lsn;
+				stats_count_message(rc, 0, 0);
+				update_applied_lsn(walEnd);
 
 				/*
 				 * If the server requested an immediate reply, send one.
@@ -357,11 +2630,12 @@ receiver_raw_main(Datum main_arg)
 				 */
 				if (replyRequested || receiver_sync_mode)
 				{
-					int64 now = feGetCurrentTimestamp();
+					now = feGetCurrentTimestamp();
 
 					/* Leave is feedback is not sent properly */
 					if (!sendFeedback(conn, now))
 						proc_exit(1);
+					last_status = now;
 				}
 				continue;
 			}
@@ -378,6 +2652,7 @@ receiver_raw_main(Datum main_arg)
 			hdr_len += 8;		/* dataStart */
 			walEnd = fe_recvint64(&copybuf[hdr_len]);
 			hdr_len += 8;		/* WALEnd */
+			sendTime = fe_recvint64(&copybuf[hdr_len]);
 			hdr_len += 8;		/* sendTime */
 			if (rc < hdr_len + 1)
 			{
@@ -387,110 +2662,26 @@ receiver_raw_main(Datum main_arg)
 			}
 
 			/* Log some useful information */
-			ereport(LOG, (errmsg("%s: received from server, walStart %X/%X, "
-								 "and walEnd %X/%X",
-						 worker_name,
-						 (uint32) (walStart >> 32),
-						 (uint32) walStart,
-						 (uint32) (walEnd >> 32),
-						 (uint32) walEnd)));
+			ereport(RECEIVER_CHANGE_LEVEL,
+					(errmsg("%s: received from server, walStart %X/%X, "
+							"and walEnd %X/%X",
+							worker_name,
+							(uint32) (walStart >> 32),
+							(uint32) walStart,
+							(uint32) (walEnd >> 32),
+							(uint32) walEnd)));
 
 			/* Apply change to database */
-			pgstat_report_activity(STATE_RUNNING, copybuf + hdr_len);
-			SetCurrentStatementStartTimestamp();
-
-			/* Execute query */
-			rc = SPI_execute(copybuf + hdr_len, false, 0);
-
-			if (rc == SPI_OK_INSERT)
-				ereport(LOG, (errmsg("%s: INSERT received correctly: %s",
-									 worker_name, copybuf + hdr_len)));
-			else if (rc == SPI_OK_UPDATE)
-				ereport(LOG, (errmsg("%s: UPDATE received correctly: %s",
-									 worker_name, copybuf + hdr_len)));
-			else if (rc == SPI_OK_DELETE)
-				ereport(LOG, (errmsg("%s: DELETE received correctly: %s",
-									 worker_name, copybuf + hdr_len)));
+			if (receiver_apply_workers > 0)
+				dispatch_message(copybuf + hdr_len, rc - hdr_len);
 			else
-				ereport(LOG, (errmsg("%s: Error when applying change: %s",
-									 worker_name, copybuf + hdr_len)));
+				apply_message(copybuf + hdr_len, rc - hdr_len,
+							  walStart, sendTime);
 
 			/* Update written position */
 			output_written_lsn = Max(walEnd, output_written_lsn);
-			output_fsync_lsn = output_written_lsn;
-			output_applied_lsn = output_written_lsn;
-		}
-
-		/* Finish process */
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
-		pgstat_report_activity(STATE_IDLE, NULL);
-
-		/* No data, move to next loop */
-		if (rc == 0)
-		{
-			/*
-			 * In async mode, and no data available. We block on reading but
-			 * not more than the specified timeout, so that we can send a
-			 * response back to the client.
-			 */
-			int			r;
-			fd_set	  input_mask;
-			int64	   message_target = 0;
-			int64	   fsync_target = 0;
-			struct timeval timeout;
-			struct timeval *timeoutptr = NULL;
-			int64	   targettime;
-			long		secs;
-			int		 usecs;
-			int64		now;
-
-			FD_ZERO(&input_mask);
-			FD_SET(PQsocket(conn), &input_mask);
-
-			/* Now compute when to wakeup. */
-			targettime = message_target;
-
-			if (fsync_target > 0 && fsync_target < targettime)
-				targettime = fsync_target;
-			now = feGetCurrentTimestamp();
-			feTimestampDifference(now,
-								  targettime,
-								  &secs,
-								  &usecs);
-			if (secs <= 0)
-				timeout.tv_sec = 1; /* Always sleep at least 1 sec */
-			else
-				timeout.tv_sec = secs;
-			timeout.tv_usec = usecs;
-			timeoutptr = &timeout;
-
-			r = select(PQsocket(conn) + 1, &input_mask, NULL, NULL, timeoutptr);
-			if (r == 0 || (r < 0 && errno == EINTR))
-			{
-				/*
-				 * Got a timeout or signal. Continue the loop and either
-				 * deliver a status packet to the server or just go back into
-				 * blocking.
-				 */
-				continue;
-			}
-			else if (r < 0)
-			{
-				ereport(LOG, (errmsg("%s: Incorrect status received... Leaving.",
-									 worker_name)));
-				proc_exit(1);
-			}
-
-			/* Else there is actually data on the socket */
-			if (PQconsumeInput(conn) == 0)
-			{
-				ereport(LOG, (errmsg("%s: Data remaining on the socket... Leaving.",
-									 worker_name)));
-				proc_exit(1);
-			}
-			continue;
+			stats_count_message(rc, sendTime, receiptTime);
+			update_applied_lsn(InvalidXLogRecPtr);
 		}
 
 		/* End of copy stream */
@@ -508,6 +2699,73 @@ receiver_raw_main(Datum main_arg)
 								 worker_name)));
 			proc_exit(1);
 		}
+
+		/*
+		 * No more data to apply for now, so commit what has been applied
+		 * if no remote transaction is in progress.
+		 */
+		if (local_xact_open && !remote_xact_open)
+			commit_local_xact();
+
+		/*
+		 * Send feedback once the status interval has elapsed, or in sync
+		 * mode as soon as the flush position moves.
+		 */
+		send_feedback_if_due(false);
+		now = feGetCurrentTimestamp();
+
+		/*
+		 * Wait for data on the socket, until the next status update is due,
+		 * or until local commits not flushed yet need to be checked again.
+		 */
+		timeout = -1;
+		if (receiver_status_interval > 0)
+		{
+			feTimestampDifference(now,
+								  last_status + receiver_status_interval * USECS_PER_SEC,
+								  &secs, &usecs);
+			timeout = secs * 1000 + usecs / 1000 + 1;
+		}
+		if (flush_positions != NIL &&
+			(timeout < 0 || timeout > receiver_idle_time))
+			timeout = receiver_idle_time;
+
+		rc = WaitLatchOrSocket(&MyProc->procLatch,
+							   WL_LATCH_SET | WL_SOCKET_READABLE |
+							   WL_POSTMASTER_DEATH |
+							   (timeout >= 0 ? WL_TIMEOUT : 0),
+							   PQsocket(conn),
+							   timeout,
+							   PG_WAIT_EXTENSION);
+		ResetLatch(&MyProc->procLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		/* Process signals */
+		if (got_sighup)
+		{
+			/* Process config file */
+			ProcessConfigFile(PGC_SIGHUP);
+			got_sighup = false;
+			ereport(LOG, (errmsg("%s: processed SIGHUP", worker_name)));
+		}
+
+		if (got_sigterm)
+		{
+			/* Simply exit */
+			ereport(LOG, (errmsg("%s: processed SIGTERM", worker_name)));
+			proc_exit(0);
+		}
+
+		/* Read the data available on the socket */
+		if ((rc & WL_SOCKET_READABLE) && PQconsumeInput(conn) == 0)
+		{
+			ereport(LOG, (errmsg("%s: Could not receive data from remote server: %s",
+								 worker_name, PQerrorMessage(conn))));
+			proc_exit(1);
+		}
 	}
 
 	/* No problems, so clean exit */
@@ -553,15 +2811,24 @@ receiver_raw_load_params(void)
 							   PGC_POSTMASTER,
 							   0, NULL, NULL, NULL);
 
-	/* Nap time between two loops */
+	/* Nap time before checking again local commits not flushed yet */
 	DefineCustomIntVariable("receiver_raw.idle_time",
-							"Nap time between two successive loops (ms).",
+							"Time to wait before checking again local commits not flushed yet (ms).",
 							"Default value set to 100 ms.",
 							&receiver_idle_time,
 							100, 1, 10000,
 							PGC_SIGHUP,
 							0, NULL, NULL, NULL);
 
+	/* Interval between two status updates sent to the server */
+	DefineCustomIntVariable("receiver_raw.status_interval",
+							"Maximum time between two status updates sent to the server.",
+							"Default value set to 10s, 0 disables periodic status updates.",
+							&receiver_status_interval,
+							10, 0, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S, NULL, NULL, NULL);
+
 	/* Synchronous mode */
     DefineCustomBoolVariable("receiver_raw.sync_mode",
 							 "Enforce feedback to server.",
@@ -570,6 +2837,202 @@ receiver_raw_load_params(void)
 							 true,
 							 PGC_SIGHUP,
 							 0, NULL, NULL, NULL);
+
+	/* Number of workers for parallel apply */
+	DefineCustomIntVariable("receiver_raw.apply_workers",
+							"Number of background workers applying changes in parallel.",
+							"Default value set to 0, applying changes in the main worker.",
+							&receiver_apply_workers,
+							0, 0, 64,
+							PGC_POSTMASTER,
+							0, NULL, NULL, NULL);
+
+	/* Group commit */
+	DefineCustomIntVariable("receiver_raw.commit_transactions",
+							"Maximum number of remote transactions applied in one local transaction.",
+							"Default value set to 100, 0 means no limit.",
+							&receiver_commit_transactions,
+							100, 0, INT_MAX,
+							PGC_SIGHUP,
+							0, NULL, NULL, NULL);
+	DefineCustomIntVariable("receiver_raw.commit_size",
+							"Maximum amount of changes applied in one local transaction.",
+							"Default value set to 1MB, 0 means no limit.",
+							&receiver_commit_size,
+							1024, 0, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB, NULL, NULL, NULL);
+	DefineCustomIntVariable("receiver_raw.commit_delay",
+							"Maximum time a local transaction applies changes before committing.",
+							"Default value set to 100 ms, 0 means no limit.",
+							&receiver_commit_delay,
+							100, 0, 60000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS, NULL, NULL, NULL);
+
+	/* Log each change applied */
+	DefineCustomBoolVariable("receiver_raw.log_changes",
+							 "Log each change received and applied.",
+							 NULL,
+							 &receiver_log_changes,
+							 false,
+							 PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	/* Apply changes received in binary format */
+	DefineCustomBoolVariable("receiver_raw.binary_apply",
+							 "Apply changes received in binary format with prepared plans.",
+							 NULL,
+							 &receiver_binary_apply,
+							 false,
+							 PGC_POSTMASTER,
+							 0, NULL, NULL, NULL);
+}
+
+/*
+ * Return the statistics of the receiver as a single row.
+ */
+Datum
+receiver_raw_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	ReceiverRawStats stats;
+	Datum		values[14];
+	bool		nulls[14];
+	int			i = 0;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	stats_get_copy(&stats);
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	if (stats.pid != 0)
+		values[i++] = Int32GetDatum(stats.pid);
+	else
+		nulls[i++] = true;
+	values[i++] = Int64GetDatum((int64) stats.messages);
+	values[i++] = Int64GetDatum((int64) stats.bytes);
+	values[i++] = Int64GetDatum((int64) stats.inserts);
+	values[i++] = Int64GetDatum((int64) stats.updates);
+	values[i++] = Int64GetDatum((int64) stats.deletes);
+	values[i++] = Int64GetDatum((int64) stats.transactions);
+	values[i++] = Int64GetDatum((int64) stats.local_commits);
+	if (stats.received_lsn != InvalidXLogRecPtr)
+		values[i++] = LSNGetDatum(stats.received_lsn);
+	else
+		nulls[i++] = true;
+	if (stats.applied_lsn != InvalidXLogRecPtr)
+		values[i++] = LSNGetDatum(stats.applied_lsn);
+	else
+		nulls[i++] = true;
+	if (stats.flushed_lsn != InvalidXLogRecPtr)
+		values[i++] = LSNGetDatum(stats.flushed_lsn);
+	else
+		nulls[i++] = true;
+	if (stats.last_send_time != 0)
+		values[i++] = TimestampTzGetDatum(stats.last_send_time);
+	else
+		nulls[i++] = true;
+	if (stats.last_receipt_time != 0)
+		values[i++] = TimestampTzGetDatum(stats.last_receipt_time);
+	else
+		nulls[i++] = true;
+	if (stats.last_send_time != 0)
+		values[i++] = Float8GetDatum((stats.last_receipt_time -
+									  stats.last_send_time) / 1000.0);
+	else
+		nulls[i++] = true;
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the histogram of receipt latency, one row per bucket.
+ */
+Datum
+receiver_raw_receipt_latency(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	ReceiverRawStats stats;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	stats_get_copy(&stats);
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < RECEIVER_RAW_LATENCY_BUCKETS; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3];
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = Float8GetDatum(i == 0 ? 0 : (double) (INT64CONST(1) << (i - 1)));
+		if (i < RECEIVER_RAW_LATENCY_BUCKETS - 1)
+			values[1] = Float8GetDatum((double) (INT64CONST(1) << i));
+		else
+			nulls[1] = true;
+		values[2] = Int64GetDatum((int64) stats.latency[i]);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
 }
 
 /*
@@ -582,6 +3045,15 @@ _PG_init(void)
 
 	receiver_raw_load_params();
 
+	/* Shared memory and worker are only set up at server start */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	/* Statistics in shared memory */
+	RequestAddinShmemSpace(MAXALIGN(sizeof(ReceiverRawStats)));
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = receiver_raw_shmem_startup;
+
 	/* Worker parameter and registration */
 	MemSet(&worker, 0, sizeof(BackgroundWorker));
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
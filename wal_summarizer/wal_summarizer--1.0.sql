@@ -0,0 +1,38 @@
+/* wal_summarizer/wal_summarizer--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION wal_summarizer" to load this file. \quit
+
+-- Summary files available
+CREATE FUNCTION wal_summary_files(
+    OUT start_lsn pg_lsn,
+    OUT end_lsn pg_lsn,
+    OUT filename text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+-- Blocks of a relation changed between two WAL positions
+CREATE FUNCTION wal_summary_blocks(
+    IN relation regclass,
+    IN start_lsn pg_lsn,
+    IN end_lsn pg_lsn,
+    OUT fork text,
+    OUT block bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+-- Smallest size a relation has been truncated to between two WAL positions
+CREATE FUNCTION wal_summary_truncations(
+    IN relation regclass,
+    IN start_lsn pg_lsn,
+    IN end_lsn pg_lsn,
+    OUT fork text,
+    OUT nblocks bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
@@ -0,0 +1,1096 @@
+/*-------------------------------------------------------------------------
+ *
+ * wal_summarizer.c
+ *		Background worker maintaining an index of relation blocks changed
+ *		by WAL records, and SQL functions to query it.
+ *
+ * Copyright (c) 1996-2018, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		wal_summarizer/wal_summarizer.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/rmgr.h"
+#include "access/xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xlogreader.h"
+#include "access/xlogutils.h"
+#include "catalog/storage_xlog.h"
+#include "common/relpath.h"
+#include "postmaster/bgworker.h"
+#include "replication/slot.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+#include "utils/rel.h"
+
+/* Summary files use the block map format of pg_wal_blocks */
+#include "block_map.h"
+
+PG_MODULE_MAGIC;
+
+/* Entry point of library loading */
+void _PG_init(void);
+void wal_summarizer_main(Datum main_arg) pg_attribute_noreturn();
+
+PG_FUNCTION_INFO_V1(wal_summary_files);
+PG_FUNCTION_INFO_V1(wal_summary_blocks);
+PG_FUNCTION_INFO_V1(wal_summary_truncations);
+
+/* Directory of summary files, relative to the data directory */
+#define SUMMARY_DIR			"pg_wal_summaries"
+#define SUMMARY_FILE_FORMAT	"%08X%08X-%08X%08X.summary"
+
+/* Physical replication slot retaining the WAL not summarized yet */
+#define SUMMARY_SLOT		"wal_summarizer"
+
+/* Entry of the block map built by the worker, keyed by relation fork */
+typedef struct SummaryKey
+{
+	RelFileNode rnode;
+	ForkNumber	forknum;
+} SummaryKey;
+
+typedef struct SummaryEntry
+{
+	SummaryKey	key;			/* hash key, must be first */
+	BlockNumber truncated;		/* smallest size truncated to, or
+								 * InvalidBlockNumber */
+	BlockNumber *blocks;		/* block numbers touched */
+	uint32		nblocks;
+	uint32		maxblocks;
+} SummaryEntry;
+
+/* Summary file found in the summary directory */
+typedef struct SummaryFile
+{
+	XLogRecPtr	start_lsn;
+	XLogRecPtr	end_lsn;
+	char		path[MAXPGPATH];
+} SummaryFile;
+
+/* Signal handling */
+static volatile sig_atomic_t got_sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
+
+/* GUC variables */
+static bool summarizer_enabled = true;
+static int summarizer_segments_per_file = 16;
+static int summarizer_naptime = 1000;
+
+/* Block map being built by the worker */
+static HTAB *summary_map = NULL;
+static MemoryContext summary_context = NULL;
+
+static void
+wal_summarizer_sigterm(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+	got_sigterm = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void
+wal_summarizer_sighup(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+	got_sighup = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+/*
+ * Parse the WAL range of a summary file from its name.
+ */
+static bool
+parse_summary_file_name(const char *fname, XLogRecPtr *start_lsn,
+						XLogRecPtr *end_lsn)
+{
+	uint32		start_hi, start_lo, end_hi, end_lo;
+	char		check[MAXPGPATH];
+
+	if (sscanf(fname, "%08X%08X-%08X%08X", &start_hi, &start_lo,
+			   &end_hi, &end_lo) != 4)
+		return false;
+
+	/* Check that this is exactly a summary file name */
+	snprintf(check, sizeof(check), SUMMARY_FILE_FORMAT,
+			 start_hi, start_lo, end_hi, end_lo);
+	if (strcmp(check, fname) != 0)
+		return false;
+
+	*start_lsn = ((uint64) start_hi) << 32 | start_lo;
+	*end_lsn = ((uint64) end_hi) << 32 | end_lo;
+	return true;
+}
+
+static int
+summary_file_cmp(const void *a, const void *b)
+{
+	const SummaryFile *fa = (const SummaryFile *) a;
+	const SummaryFile *fb = (const SummaryFile *) b;
+
+	if (fa->start_lsn < fb->start_lsn)
+		return -1;
+	if (fa->start_lsn > fb->start_lsn)
+		return 1;
+	return 0;
+}
+
+/*
+ * Get the list of summary files, sorted by WAL position. The result is
+ * palloc'd, with the number of files in *nfiles.
+ */
+static SummaryFile *
+get_summary_files(int *nfiles)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	SummaryFile *files;
+	int			maxfiles = 16;
+	int			n = 0;
+
+	files = palloc(sizeof(SummaryFile) * maxfiles);
+
+	dir = AllocateDir(SUMMARY_DIR);
+	if (dir == NULL && errno == ENOENT)
+	{
+		*nfiles = 0;
+		return files;
+	}
+
+	while ((de = ReadDir(dir, SUMMARY_DIR)) != NULL)
+	{
+		XLogRecPtr	start_lsn;
+		XLogRecPtr	end_lsn;
+
+		if (!parse_summary_file_name(de->d_name, &start_lsn, &end_lsn))
+			continue;
+
+		if (n >= maxfiles)
+		{
+			maxfiles *= 2;
+			files = repalloc(files, sizeof(SummaryFile) * maxfiles);
+		}
+		files[n].start_lsn = start_lsn;
+		files[n].end_lsn = end_lsn;
+		snprintf(files[n].path, MAXPGPATH, "%s/%s", SUMMARY_DIR, de->d_name);
+		n++;
+	}
+	FreeDir(dir);
+
+	qsort(files, n, sizeof(SummaryFile), summary_file_cmp);
+	*nfiles = n;
+	return files;
+}
+
+/*
+ * Create a fresh block map for the worker.
+ */
+static void
+summary_map_reset(void)
+{
+	HASHCTL		ctl;
+
+	MemoryContextReset(summary_context);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(SummaryKey);
+	ctl.entrysize = sizeof(SummaryEntry);
+	ctl.hcxt = summary_context;
+	summary_map = hash_create("wal_summarizer block map", 1024, &ctl,
+							  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+static SummaryEntry *
+summary_map_lookup(const RelFileNode *rnode, ForkNumber forknum)
+{
+	SummaryKey	key;
+	SummaryEntry *entry;
+	bool		found;
+
+	MemSet(&key, 0, sizeof(key));
+	key.rnode = *rnode;
+	key.forknum = forknum;
+
+	entry = hash_search(summary_map, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->truncated = InvalidBlockNumber;
+		entry->blocks = NULL;
+		entry->nblocks = 0;
+		entry->maxblocks = 0;
+	}
+	return entry;
+}
+
+static int
+blocknum_cmp(const void *a, const void *b)
+{
+	BlockNumber ba = *(const BlockNumber *) a;
+	BlockNumber bb = *(const BlockNumber *) b;
+
+	if (ba < bb)
+		return -1;
+	if (ba > bb)
+		return 1;
+	return 0;
+}
+
+/* Sort an array of blocks and remove duplicates, returning its new size */
+static uint32
+compact_blocks(BlockNumber *blocks, uint32 nblocks)
+{
+	uint32		i;
+	uint32		n = 0;
+
+	if (nblocks <= 1)
+		return nblocks;
+
+	qsort(blocks, nblocks, sizeof(BlockNumber), blocknum_cmp);
+	for (i = 1; i < nblocks; i++)
+	{
+		if (blocks[i] != blocks[n])
+			blocks[++n] = blocks[i];
+	}
+	return n + 1;
+}
+
+static void
+summary_map_add_block(SummaryEntry *entry, BlockNumber blkno)
+{
+	/* Cheap check for the same block touched in a row */
+	if (entry->nblocks > 0 && entry->blocks[entry->nblocks - 1] == blkno)
+		return;
+
+	if (entry->nblocks >= entry->maxblocks)
+	{
+		entry->nblocks = compact_blocks(entry->blocks, entry->nblocks);
+
+		/* Grow the array only if compaction did not free enough space */
+		if (entry->maxblocks == 0)
+		{
+			entry->maxblocks = 64;
+			entry->blocks = MemoryContextAlloc(summary_context,
+											   sizeof(BlockNumber) * entry->maxblocks);
+		}
+		else if (entry->nblocks >= entry->maxblocks / 2)
+		{
+			entry->maxblocks *= 2;
+			entry->blocks = repalloc_huge(entry->blocks,
+										  sizeof(BlockNumber) * entry->maxblocks);
+		}
+	}
+
+	entry->blocks[entry->nblocks++] = blkno;
+}
+
+static void
+summary_map_truncate(const RelFileNode *rnode, ForkNumber forknum,
+					 BlockNumber nblocks)
+{
+	SummaryEntry *entry = summary_map_lookup(rnode, forknum);
+
+	if (entry->truncated == InvalidBlockNumber || nblocks < entry->truncated)
+		entry->truncated = nblocks;
+}
+
+/*
+ * Add the block references of a record to the block map, as well as
+ * relation truncations.
+ */
+static void
+summarize_record(XLogReaderState *record)
+{
+	int			block_id;
+
+	if (XLogRecGetRmid(record) == RM_SMGR_ID &&
+		(XLogRecGetInfo(record) & ~XLR_INFO_MASK) == XLOG_SMGR_TRUNCATE)
+	{
+		xl_smgr_truncate *xlrec = (xl_smgr_truncate *) XLogRecGetData(record);
+
+		/*
+		 * The size the free space map and the visibility map get truncated
+		 * to is not in the record, so track them as truncated to nothing.
+		 */
+		if ((xlrec->flags & SMGR_TRUNCATE_HEAP) != 0)
+			summary_map_truncate(&xlrec->rnode, MAIN_FORKNUM, xlrec->blkno);
+		if ((xlrec->flags & SMGR_TRUNCATE_FSM) != 0)
+			summary_map_truncate(&xlrec->rnode, FSM_FORKNUM, 0);
+		if ((xlrec->flags & SMGR_TRUNCATE_VM) != 0)
+			summary_map_truncate(&xlrec->rnode, VISIBILITYMAP_FORKNUM, 0);
+	}
+
+	for (block_id = 0; block_id <= record->max_block_id; block_id++)
+	{
+		RelFileNode rnode;
+		ForkNumber	forknum;
+		BlockNumber blkno;
+
+		if (!XLogRecGetBlockTag(record, block_id, &rnode, &forknum, &blkno))
+			continue;
+
+		summary_map_add_block(summary_map_lookup(&rnode, forknum), blkno);
+	}
+}
+
+static int
+summary_entry_cmp(const void *a, const void *b)
+{
+	const SummaryEntry *ea = *(SummaryEntry *const *) a;
+	const SummaryEntry *eb = *(SummaryEntry *const *) b;
+
+	if (ea->key.rnode.spcNode != eb->key.rnode.spcNode)
+		return ea->key.rnode.spcNode < eb->key.rnode.spcNode ? -1 : 1;
+	if (ea->key.rnode.dbNode != eb->key.rnode.dbNode)
+		return ea->key.rnode.dbNode < eb->key.rnode.dbNode ? -1 : 1;
+	if (ea->key.rnode.relNode != eb->key.rnode.relNode)
+		return ea->key.rnode.relNode < eb->key.rnode.relNode ? -1 : 1;
+	if (ea->key.forknum != eb->key.forknum)
+		return ea->key.forknum < eb->key.forknum ? -1 : 1;
+	return 0;
+}
+
+/* Summary file being written, passed to the block map writer */
+typedef struct SummaryWriteState
+{
+	FILE	   *fp;
+	const char *path;
+} SummaryWriteState;
+
+static void
+write_summary_data(const void *data, size_t len, void *arg)
+{
+	SummaryWriteState *state = (SummaryWriteState *) arg;
+
+	if (fwrite(data, len, 1, state->fp) != 1)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", state->path)));
+}
+
+/*
+ * Write the block map built for the given WAL range to a summary file.
+ * The file is written under a temporary name, and renamed once flushed
+ * to disk, so as a summary file is either complete or missing.
+ */
+static void
+write_summary_file(XLogRecPtr start_lsn, XLogRecPtr end_lsn)
+{
+	HASH_SEQ_STATUS status;
+	SummaryEntry *entry;
+	SummaryEntry **entries;
+	SummaryWriteState state;
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	FILE	   *fp;
+	uint32		nentries = 0;
+	uint32		i;
+
+	snprintf(path, MAXPGPATH, SUMMARY_DIR "/" SUMMARY_FILE_FORMAT,
+			 (uint32) (start_lsn >> 32), (uint32) start_lsn,
+			 (uint32) (end_lsn >> 32), (uint32) end_lsn);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+
+	/* Sort the entries by relation fork */
+	entries = MemoryContextAlloc(summary_context, sizeof(SummaryEntry *) *
+								 (hash_get_num_entries(summary_map) + 1));
+	hash_seq_init(&status, summary_map);
+	while ((entry = (SummaryEntry *) hash_seq_search(&status)) != NULL)
+	{
+		entry->nblocks = compact_blocks(entry->blocks, entry->nblocks);
+		entries[nentries++] = entry;
+	}
+	qsort(entries, nentries, sizeof(SummaryEntry *), summary_entry_cmp);
+
+	fp = AllocateFile(tmppath, PG_BINARY_W);
+	if (fp == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+
+	state.fp = fp;
+	state.path = tmppath;
+	block_map_write_header(write_summary_data, &state, start_lsn, end_lsn,
+						   nentries);
+
+	for (i = 0; i < nentries; i++)
+	{
+		entry = entries[i];
+		block_map_write_entry(write_summary_data, &state, &entry->key.rnode,
+							  entry->key.forknum, entry->truncated,
+							  entry->blocks, entry->nblocks);
+	}
+
+	if (fflush(fp) != 0 || pg_fsync(fileno(fp)) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", tmppath)));
+	if (FreeFile(fp) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmppath)));
+
+	durable_rename(tmppath, path, ERROR);
+
+	ereport(DEBUG1,
+			(errmsg("wal_summarizer: wrote summary file \"%s\" with %u relation forks",
+					path, nentries)));
+}
+
+/*
+ * Page read callback of the worker, waiting for WAL to be flushed up to
+ * the requested position before reading it. Returns -1 if the worker
+ * needs to stop.
+ */
+static int
+summarizer_read_page(XLogReaderState *state, XLogRecPtr targetPagePtr,
+					 int reqLen, XLogRecPtr targetRecPtr, char *cur_page,
+					 TimeLineID *pageTLI)
+{
+	for (;;)
+	{
+		XLogRecPtr	flushptr;
+		int			rc;
+
+		if (got_sigterm)
+			return -1;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (RecoveryInProgress())
+			flushptr = GetXLogReplayRecPtr(NULL);
+		else
+			flushptr = GetFlushRecPtr();
+		if (targetPagePtr + reqLen <= flushptr)
+			break;
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   summarizer_naptime,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	return read_local_xlog_page(state, targetPagePtr, reqLen, targetRecPtr,
+								cur_page, pageTLI);
+}
+
+/*
+ * Acquire the replication slot retaining WAL for the worker, creating it
+ * if it does not exist, with WAL reserved from the redo point of the last
+ * checkpoint. WAL is not retained if replication slots cannot be used.
+ */
+static void
+summarizer_slot_acquire(void)
+{
+	bool		found = false;
+	int			i;
+
+	if (max_replication_slots == 0 || wal_level < WAL_LEVEL_REPLICA)
+	{
+		ereport(WARNING,
+				(errmsg("wal_summarizer: WAL is not retained for the worker"),
+				 errdetail("Replication slots require max_replication_slots > 0 and wal_level >= replica.")));
+		return;
+	}
+
+	LWLockAcquire(ReplicationSlotControlLock, LW_SHARED);
+	for (i = 0; i < max_replication_slots; i++)
+	{
+		ReplicationSlot *slot = &ReplicationSlotCtl->replication_slots[i];
+
+		if (slot->in_use &&
+			strcmp(NameStr(slot->data.name), SUMMARY_SLOT) == 0)
+		{
+			found = true;
+			break;
+		}
+	}
+	LWLockRelease(ReplicationSlotControlLock);
+
+	if (found)
+	{
+		ReplicationSlotAcquire(SUMMARY_SLOT, true);
+		if (SlotIsLogical(MyReplicationSlot))
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("replication slot \"%s\" is not a physical slot",
+							SUMMARY_SLOT)));
+		return;
+	}
+
+	ReplicationSlotCreate(SUMMARY_SLOT, false, RS_PERSISTENT);
+	ReplicationSlotReserveWal();
+	ReplicationSlotMarkDirty();
+	ReplicationSlotSave();
+	ReplicationSlotsComputeRequiredLSN();
+
+	ereport(LOG,
+			(errmsg("wal_summarizer: created replication slot \"%s\"",
+					SUMMARY_SLOT)));
+}
+
+/*
+ * Move the slot of the worker to the given position, the start of the
+ * summary file in progress, letting checkpoints remove the WAL before it.
+ */
+static void
+summarizer_slot_advance(XLogRecPtr lsn)
+{
+	ReplicationSlot *slot = MyReplicationSlot;
+
+	if (slot == NULL)
+		return;
+
+	SpinLockAcquire(&slot->mutex);
+	slot->data.restart_lsn = lsn;
+	SpinLockRelease(&slot->mutex);
+
+	ReplicationSlotMarkDirty();
+	ReplicationSlotSave();
+	ReplicationSlotsComputeRequiredLSN();
+}
+
+/*
+ * Get the position to start summarizing WAL from: the end of the most
+ * recent summary file, or the redo point of the last checkpoint if there
+ * is none or if WAL has been removed since. WAL is retained by the slot
+ * of the worker, so the summaries have a gap only if the slot has been
+ * dropped or cannot be used.
+ */
+static XLogRecPtr
+summarizer_start_position(void)
+{
+	SummaryFile *files;
+	int			nfiles;
+	XLogRecPtr	startptr = InvalidXLogRecPtr;
+	XLogSegNo	segno;
+
+	files = get_summary_files(&nfiles);
+	if (nfiles > 0)
+		startptr = files[nfiles - 1].end_lsn;
+	pfree(files);
+
+	if (!XLogRecPtrIsInvalid(startptr))
+	{
+		XLByteToSeg(startptr, segno, wal_segment_size);
+		if (segno > XLogGetLastRemovedSegno())
+			return startptr;
+
+		ereport(WARNING,
+				(errmsg("WAL at %X/%X has been removed, WAL summaries will have a gap",
+						(uint32) (startptr >> 32), (uint32) startptr)));
+	}
+
+	return GetRedoRecPtr();
+}
+
+void
+wal_summarizer_main(Datum main_arg)
+{
+	XLogReaderState *xlogreader;
+	XLogRecPtr	first_record;
+	XLogRecPtr	file_start;
+	XLogRecPtr	file_end;
+	XLogSegNo	segno;
+
+	/* Register functions for SIGTERM/SIGHUP management */
+	pqsignal(SIGHUP, wal_summarizer_sighup);
+	pqsignal(SIGTERM, wal_summarizer_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	if (MakePGDirectory(SUMMARY_DIR) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", SUMMARY_DIR)));
+
+	summary_context = AllocSetContextCreate(TopMemoryContext,
+											"wal_summarizer",
+											ALLOCSET_DEFAULT_SIZES);
+	summary_map_reset();
+
+	xlogreader = XLogReaderAllocate(wal_segment_size, summarizer_read_page,
+									NULL);
+	if (xlogreader == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	summarizer_slot_acquire();
+	file_start = first_record = summarizer_start_position();
+	summarizer_slot_advance(file_start);
+	ereport(LOG,
+			(errmsg("wal_summarizer: starting at %X/%X",
+					(uint32) (file_start >> 32), (uint32) file_start)));
+
+	/* Files end at a multiple of the number of segments per file */
+	XLByteToSeg(file_start, segno, wal_segment_size);
+	XLogSegNoOffsetToRecPtr((segno / summarizer_segments_per_file + 1) *
+							summarizer_segments_per_file, 0, file_end,
+							wal_segment_size);
+
+	for (;;)
+	{
+		XLogRecord *record;
+		char	   *errormsg;
+
+		record = XLogReadRecord(xlogreader, first_record, &errormsg);
+		if (record == NULL)
+		{
+			/* Data of the file in progress is summarized again at restart */
+			if (got_sigterm)
+				proc_exit(0);
+
+			if (errormsg)
+				ereport(ERROR,
+						(errmsg("could not read WAL record at %X/%X: %s",
+								(uint32) (xlogreader->EndRecPtr >> 32),
+								(uint32) xlogreader->EndRecPtr,
+								errormsg)));
+			else
+				ereport(ERROR,
+						(errmsg("could not read WAL record at %X/%X",
+								(uint32) (xlogreader->EndRecPtr >> 32),
+								(uint32) xlogreader->EndRecPtr)));
+		}
+		first_record = InvalidXLogRecPtr;
+
+		/* Switch to a new file once a record begins after the current one */
+		if (xlogreader->ReadRecPtr >= file_end)
+		{
+			write_summary_file(file_start, xlogreader->ReadRecPtr);
+			summary_map_reset();
+
+			file_start = xlogreader->ReadRecPtr;
+			summarizer_slot_advance(file_start);
+			XLByteToSeg(file_start, segno, wal_segment_size);
+			XLogSegNoOffsetToRecPtr((segno / summarizer_segments_per_file + 1) *
+									summarizer_segments_per_file, 0, file_end,
+									wal_segment_size);
+		}
+
+		summarize_record(xlogreader);
+
+		if (got_sigterm)
+			proc_exit(0);
+	}
+}
+
+/*
+ * Entry point for worker loading
+ */
+void
+_PG_init(void)
+{
+	BackgroundWorker worker;
+
+	DefineCustomBoolVariable("wal_summarizer.enabled",
+							 "Start the worker summarizing WAL.",
+							 NULL,
+							 &summarizer_enabled,
+							 true,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("wal_summarizer.segments_per_file",
+							"Number of WAL segments summarized in each summary file.",
+							NULL,
+							&summarizer_segments_per_file,
+							16,
+							1,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("wal_summarizer.naptime",
+							"Time to wait for new WAL to summarize.",
+							NULL,
+							&summarizer_naptime,
+							1000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	if (!process_shared_preload_libraries_in_progress || !summarizer_enabled)
+		return;
+
+	/* Worker parameter and registration */
+	MemSet(&worker, 0, sizeof(BackgroundWorker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "wal_summarizer");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "wal_summarizer_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "wal_summarizer");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "wal_summarizer");
+	/* Wait 10 seconds for restart before crash */
+	worker.bgw_restart_time = 10;
+	worker.bgw_main_arg = (Datum) 0;
+	worker.bgw_notify_pid = 0;
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Set up a tuplestore to materialize the result of a set-returning
+ * function.
+ */
+static Tuplestorestate *
+summary_init_tuplestore(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	Tuplestorestate *tupstore;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to read WAL summaries"))));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * Changes of a relation found in summary files, per fork.
+ */
+typedef struct RelationChanges
+{
+	BlockNumber truncated[MAX_FORKNUM + 1];
+	BlockNumber *blocks[MAX_FORKNUM + 1];
+	uint32		nblocks[MAX_FORKNUM + 1];
+	uint32		maxblocks[MAX_FORKNUM + 1];
+} RelationChanges;
+
+static void
+read_summary_data(FILE *fp, const char *path, void *data, size_t len)
+{
+	if (fread(data, len, 1, fp) != 1)
+	{
+		if (ferror(fp))
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", path)));
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("summary file \"%s\" is truncated", path)));
+	}
+}
+
+/*
+ * Collect the changes of a relation from the summary files covering the
+ * given WAL range, complaining if the range is not covered completely.
+ */
+static void
+get_relation_changes(Oid relid, XLogRecPtr start_lsn, XLogRecPtr end_lsn,
+					 RelationChanges *changes)
+{
+	Relation	rel;
+	RelFileNode rnode;
+	SummaryFile *files;
+	int			nfiles;
+	int			i;
+	int			forknum;
+	XLogRecPtr	covered = InvalidXLogRecPtr;
+
+	if (end_lsn <= start_lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("end LSN must be newer than start LSN")));
+
+	rel = relation_open(relid, AccessShareLock);
+	rnode = rel->rd_node;
+	relation_close(rel, AccessShareLock);
+
+	for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+	{
+		changes->truncated[forknum] = InvalidBlockNumber;
+		changes->blocks[forknum] = NULL;
+		changes->nblocks[forknum] = 0;
+		changes->maxblocks[forknum] = 0;
+	}
+
+	files = get_summary_files(&nfiles);
+	for (i = 0; i < nfiles; i++)
+	{
+		SummaryFile *file = &files[i];
+		BlockMapFileHeader header;
+		FILE	   *fp;
+		uint32		j;
+
+		/* Skip files not overlapping with the range */
+		if (file->end_lsn <= start_lsn || file->start_lsn >= end_lsn)
+			continue;
+
+		/* Files need to cover the range continuously */
+		if ((XLogRecPtrIsInvalid(covered) && file->start_lsn > start_lsn) ||
+			(!XLogRecPtrIsInvalid(covered) && file->start_lsn > covered))
+			break;
+		covered = file->end_lsn;
+
+		fp = AllocateFile(file->path, PG_BINARY_R);
+		if (fp == NULL)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", file->path)));
+
+		read_summary_data(fp, file->path, &header, sizeof(header));
+		if (header.magic != BLOCK_MAP_MAGIC ||
+			header.version != BLOCK_MAP_VERSION)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid summary file \"%s\"", file->path)));
+
+		for (j = 0; j < header.nentries; j++)
+		{
+			BlockMapFileEntry fentry;
+			uint32		k;
+
+			read_summary_data(fp, file->path, &fentry, sizeof(fentry));
+
+			/* Skip the ranges of other relations */
+			if (fentry.spcNode != rnode.spcNode ||
+				fentry.dbNode != rnode.dbNode ||
+				fentry.relNode != rnode.relNode ||
+				fentry.forknum < 0 || fentry.forknum > MAX_FORKNUM)
+			{
+				if (fseeko(fp, (off_t) fentry.nranges * sizeof(BlockNumber) * 2,
+						   SEEK_CUR) != 0)
+					ereport(ERROR,
+							(errcode_for_file_access(),
+							 errmsg("could not seek in file \"%s\": %m",
+									file->path)));
+				continue;
+			}
+
+			forknum = fentry.forknum;
+			if (fentry.truncated != InvalidBlockNumber &&
+				(changes->truncated[forknum] == InvalidBlockNumber ||
+				 fentry.truncated < changes->truncated[forknum]))
+				changes->truncated[forknum] = fentry.truncated;
+
+			for (k = 0; k < fentry.nranges; k++)
+			{
+				BlockNumber range[2];
+				BlockNumber blkno;
+
+				read_summary_data(fp, file->path, range, sizeof(range));
+				for (blkno = range[0]; blkno - range[0] < range[1]; blkno++)
+				{
+					if (changes->nblocks[forknum] >= changes->maxblocks[forknum])
+					{
+						changes->nblocks[forknum] =
+							compact_blocks(changes->blocks[forknum],
+										   changes->nblocks[forknum]);
+						if (changes->maxblocks[forknum] == 0)
+						{
+							changes->maxblocks[forknum] = 64;
+							changes->blocks[forknum] =
+								palloc(sizeof(BlockNumber) * 64);
+						}
+						else if (changes->nblocks[forknum] >=
+								 changes->maxblocks[forknum] / 2)
+						{
+							changes->maxblocks[forknum] *= 2;
+							changes->blocks[forknum] =
+								repalloc_huge(changes->blocks[forknum],
+											  sizeof(BlockNumber) *
+											  changes->maxblocks[forknum]);
+						}
+					}
+					changes->blocks[forknum][changes->nblocks[forknum]++] = blkno;
+				}
+			}
+		}
+
+		FreeFile(fp);
+	}
+
+	if (XLogRecPtrIsInvalid(covered) || covered < end_lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("WAL summaries do not cover range from %X/%X to %X/%X",
+						(uint32) (start_lsn >> 32), (uint32) start_lsn,
+						(uint32) (end_lsn >> 32), (uint32) end_lsn),
+				 errhint("Check the range of files with wal_summary_files().")));
+	pfree(files);
+
+	for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+		changes->nblocks[forknum] = compact_blocks(changes->blocks[forknum],
+												   changes->nblocks[forknum]);
+}
+
+/*
+ * List the summary files available.
+ */
+Datum
+wal_summary_files(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	SummaryFile *files;
+	int			nfiles;
+	int			i;
+
+	tupstore = summary_init_tuplestore(fcinfo, &tupdesc);
+
+	files = get_summary_files(&nfiles);
+	for (i = 0; i < nfiles; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3];
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = LSNGetDatum(files[i].start_lsn);
+		values[1] = LSNGetDatum(files[i].end_lsn);
+		values[2] = CStringGetTextDatum(files[i].path);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the blocks of a relation changed between two WAL positions, for
+ * all its forks. As summary files cover whole ranges of segments, this
+ * may include blocks changed a bit before and after the range.
+ */
+Datum
+wal_summary_blocks(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	XLogRecPtr	start_lsn = PG_GETARG_LSN(1);
+	XLogRecPtr	end_lsn = PG_GETARG_LSN(2);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	RelationChanges changes;
+	int			forknum;
+
+	tupstore = summary_init_tuplestore(fcinfo, &tupdesc);
+	get_relation_changes(relid, start_lsn, end_lsn, &changes);
+
+	for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+	{
+		uint32		i;
+
+		for (i = 0; i < changes.nblocks[forknum]; i++)
+		{
+			Datum		values[2];
+			bool		nulls[2];
+
+			MemSet(nulls, 0, sizeof(nulls));
+			values[0] = CStringGetTextDatum(forkNames[forknum]);
+			values[1] = Int64GetDatum((int64) changes.blocks[forknum][i]);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the smallest size each fork of a relation has been truncated to
+ * between two WAL positions.
+ */
+Datum
+wal_summary_truncations(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	XLogRecPtr	start_lsn = PG_GETARG_LSN(1);
+	XLogRecPtr	end_lsn = PG_GETARG_LSN(2);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	RelationChanges changes;
+	int			forknum;
+
+	tupstore = summary_init_tuplestore(fcinfo, &tupdesc);
+	get_relation_changes(relid, start_lsn, end_lsn, &changes);
+
+	for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+	{
+		Datum		values[2];
+		bool		nulls[2];
+
+		if (changes.truncated[forknum] == InvalidBlockNumber)
+			continue;
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(forkNames[forknum]);
+		values[1] = Int64GetDatum((int64) changes.truncated[forknum]);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
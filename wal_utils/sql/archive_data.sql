@@ -1,3 +1,13 @@
 -- Sanity check for archive_get_size
 SELECT archive_get_size('../no_parent'); -- error
 SELECT archive_get_size('/no_absolute'); -- error
+-- Sanity checks for archive_get_data_chunks and archive_copy_data
+SELECT * FROM archive_get_data_chunks('../no_parent'); -- error
+SELECT * FROM archive_get_data_chunks('/no_absolute'); -- error
+SELECT * FROM archive_get_data_chunks('file', 0); -- error
+SELECT * FROM archive_copy_data('../no_parent'); -- error
+SELECT * FROM archive_copy_data('file', -1); -- error
+-- Sanity checks for archive_verify_segments
+SELECT * FROM archive_verify_segments(1, '0/1000000'::pg_lsn, 1, NULL, NULL); -- error
+SELECT * FROM archive_verify_segments(1, '0/1000000'::pg_lsn, 1, '0/2000000'::pg_lsn, NULL, -1); -- error
+SELECT * FROM archive_verify_segments(1, '0/1000000'::pg_lsn, 1, '0/2000000'::pg_lsn, NULL, 65); -- error
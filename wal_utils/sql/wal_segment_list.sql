@@ -26,6 +26,12 @@ SELECT archive_build_segment_list(3, '0/177BEB38'::pg_lsn, 8, '0/259BEB38'::pg_l
    FROM history_data;
 -- List of segments with same timeline for origin and target
 SELECT archive_build_segment_list(1, '0/1D4F390', 1, '0/189BEB38'::pg_lsn, NULL);
+-- Non-default segment size of 64MB
+SELECT archive_build_segment_list(1, '0/06D4F389'::pg_lsn, 8, '0/259BEB38'::pg_lsn, data, 67108864)
+   FROM history_data;
+SELECT archive_build_segment_list(1, '0/1D4F390', 1, '0/189BEB38'::pg_lsn, NULL, 67108864);
+-- error, invalid segment size
+SELECT archive_build_segment_list(1, '0/1D4F390', 1, '0/189BEB38'::pg_lsn, NULL, 1000);
 -- error, target TLI older than origin TLI
 SELECT archive_build_segment_list(2, '0/09D4F389'::pg_lsn, 1, '0/259BEB38'::pg_lsn, data)
    FROM history_data;
@@ -18,12 +18,15 @@ LANGUAGE C STRICT;
 -- Build a list of WAL segments necessary to join the given origin LSN
 -- and timeline to their targets. Note that the origin needs to be a
 -- direct parent of the target as specified by the history data.
+-- segment_size is the WAL segment size in bytes, defaulting to the one
+-- of the running server when NULL.
 CREATE FUNCTION archive_build_segment_list(
 	IN origin_tli int,
 	IN origin_lsn pg_lsn,
 	IN target_tli int,
 	IN target_lsn pg_lsn,
 	IN history_data text,
+	IN segment_size int DEFAULT NULL,
 	OUT wal_segs text)
 RETURNS SETOF text
 AS 'MODULE_PATHNAME'
@@ -52,3 +55,43 @@ CREATE FUNCTION archive_get_size(
 RETURNS bigint
 AS 'MODULE_PATHNAME'
 LANGUAGE C STRICT;
+-- Read a file in archives as a set of chunks of the given size, with
+-- their offset in the file. Memory used does not depend on the size of
+-- the file.
+CREATE FUNCTION archive_get_data_chunks(
+	IN filename text,
+	IN chunk_size int DEFAULT 1048576,
+	OUT chunk_offset bigint,
+	OUT data bytea)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+-- Same as archive_get_data_chunks, with chunks returned as hexadecimal
+-- text, for use with COPY TO STDOUT.
+CREATE FUNCTION archive_copy_data(
+	IN filename text,
+	IN chunk_size int DEFAULT 1048576)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+-- Check the segments in archives necessary to join the given origin LSN
+-- and timeline to their targets, as listed by archive_build_segment_list,
+-- reporting for each one if it is present, its size and if its page
+-- headers and records are valid. readahead is the number of segments
+-- read ahead while a segment is being checked.
+CREATE FUNCTION archive_verify_segments(
+	IN origin_tli int,
+	IN origin_lsn pg_lsn,
+	IN target_tli int,
+	IN target_lsn pg_lsn,
+	IN history_data text,
+	IN readahead int DEFAULT 8,
+	IN segment_size int DEFAULT NULL,
+	OUT wal_seg text,
+	OUT present bool,
+	OUT size bigint,
+	OUT valid bool,
+	OUT error text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
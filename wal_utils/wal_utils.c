@@ -14,13 +14,21 @@
 #include "postgres.h"
 #include "fmgr.h"
 
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include "access/hash.h"
+#include "access/htup_details.h"
 #include "access/timeline.h"
+#include "access/xlog.h"
 #include "access/xlog_internal.h"
+#include "access/xlogreader.h"
 #include "catalog/pg_type.h"
+#include "executor/executor.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "storage/fd.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "utils/pg_lsn.h"
@@ -28,6 +36,7 @@
 PG_MODULE_MAGIC;
 
 static List *parseTimeLineHistory(char *buffer);
+static List *get_timeline_history(const char *history_buf);
 
 /*
  * Set of SQL-callable functions.
@@ -36,6 +45,9 @@ PG_FUNCTION_INFO_V1(archive_parse_history);
 PG_FUNCTION_INFO_V1(archive_build_segment_list);
 PG_FUNCTION_INFO_V1(archive_get_size);
 PG_FUNCTION_INFO_V1(archive_get_data);
+PG_FUNCTION_INFO_V1(archive_get_data_chunks);
+PG_FUNCTION_INFO_V1(archive_copy_data);
+PG_FUNCTION_INFO_V1(archive_verify_segments);
 
 /*
  * parseTimeLineHistory
@@ -168,8 +180,8 @@ archive_parse_history(PG_FUNCTION_ARGS)
 	rsinfo->setDesc = tupdesc;
 	MemoryContextSwitchTo(oldcontext);
 
-	/* parse the history file */
-	entries = parseTimeLineHistory(history_buf);
+	/* parse the history file, or get it from the cache */
+	entries = get_timeline_history(history_buf);
 
 	/* represent its data as a set of tuples */
 	foreach(entry, entries)
@@ -207,7 +219,104 @@ archive_parse_history(PG_FUNCTION_ARGS)
 }
 
 /*
- * archive_build_segment_list
+ * Cache of parsed history files, kept for the duration of the session.
+ * Entries are looked up with a hash of the history data, and replaced in
+ * a round-robin fashion.
+ */
+#define HISTORY_CACHE_SIZE	8
+
+typedef struct HistoryCacheEntry
+{
+	uint32		hash;
+	char	   *data;			/* history data, NULL if entry is unused */
+	List	   *entries;		/* list of TimeLineHistoryEntry */
+	MemoryContext context;		/* context of this entry's data */
+} HistoryCacheEntry;
+
+static HistoryCacheEntry history_cache[HISTORY_CACHE_SIZE];
+static int	history_cache_next = 0;
+
+/*
+ * get_timeline_history
+ *
+ * Parse the given history data, or get it from the cache if it has been
+ * parsed already. The result must not be modified by caller.
+ */
+static List *
+get_timeline_history(const char *history_buf)
+{
+	uint32		hash;
+	HistoryCacheEntry *cache;
+	MemoryContext oldcontext;
+	int			i;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) history_buf,
+								   strlen(history_buf)));
+
+	for (i = 0; i < HISTORY_CACHE_SIZE; i++)
+	{
+		cache = &history_cache[i];
+		if (cache->data != NULL && cache->hash == hash &&
+			strcmp(cache->data, history_buf) == 0)
+			return cache->entries;
+	}
+
+	/* Not found, so parse it and replace the next entry */
+	cache = &history_cache[history_cache_next];
+	if (cache->context == NULL)
+		cache->context = AllocSetContextCreate(CacheMemoryContext,
+											   "wal_utils history cache",
+											   ALLOCSET_SMALL_SIZES);
+	else
+		MemoryContextReset(cache->context);
+	cache->data = NULL;
+	cache->entries = NIL;
+
+	/* Parse a copy of the buffer, as parsing modifies it */
+	oldcontext = MemoryContextSwitchTo(cache->context);
+	cache->entries = parseTimeLineHistory(pstrdup(history_buf));
+	cache->data = pstrdup(history_buf);
+	cache->hash = hash;
+	MemoryContextSwitchTo(oldcontext);
+
+	history_cache_next = (history_cache_next + 1) % HISTORY_CACHE_SIZE;
+	return cache->entries;
+}
+
+/*
+ * Get the WAL segment size to use, given by the optional argument of a
+ * function or defaulting to the one of the running server.
+ */
+static int
+get_segment_size(FunctionCallInfo fcinfo, int argno)
+{
+	int			segsize;
+
+	if (PG_NARGS() <= argno || PG_ARGISNULL(argno))
+		return wal_segment_size;
+
+	segsize = PG_GETARG_INT32(argno);
+	if (!IsValidWalSegSize(segsize))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid WAL segment size %d", segsize),
+				 errhint("The WAL segment size must be a power of two between 1MB and 1GB.")));
+
+	return segsize;
+}
+
+/*
+ * Range of consecutive segments on the same timeline.
+ */
+typedef struct SegmentRange
+{
+	TimeLineID	tli;
+	XLogSegNo	first;
+	XLogSegNo	last;			/* included in range */
+} SegmentRange;
+
+/*
+ * build_segment_list
  *
  * Taking in input an origin timeline and LSN, as well as a target timeline
  * and LSN, build a list of WAL segments able to allow a standby pointing to
@@ -224,68 +333,23 @@ archive_parse_history(PG_FUNCTION_ARGS)
  * flexibility, still this routine checks if the target LSN is newer than
  * the last entry in the history file, as well as it checks if the last
  * timeline entry is higher than the target.
+ *
+ * The result is an array of ranges of segments, one per timeline crossed,
+ * computed from the timeline boundaries, with their number in *nranges.
  */
-Datum
-archive_build_segment_list(PG_FUNCTION_ARGS)
+static SegmentRange *
+build_segment_list(TimeLineID origin_tli, XLogRecPtr origin_lsn,
+				   TimeLineID target_tli, XLogRecPtr target_lsn,
+				   const char *history_buf, int segsize, int *nranges)
 {
-	TimeLineID	origin_tli;
-	XLogRecPtr	origin_lsn;
-	TimeLineID	target_tli;
-	XLogRecPtr	target_lsn;
-	char	   *history_buf;
-	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	MemoryContext	per_query_ctx;
-	MemoryContext	oldcontext;
-	TupleDesc		tupdesc;
-	Tuplestorestate *tupstore;
 	List		   *entries = NIL;
 	ListCell	   *entry;
 	TimeLineHistoryEntry *history;
 	bool			history_match = false;
 	XLogRecPtr		current_seg_lsn;
-	TimeLineID		current_tli;
-	char			xlogfname[MAXFNAMELEN];
-	Datum			values[1];
-	bool			nulls[1];
-	XLogSegNo		logSegNo;
-
-	/* Sanity checks for arguments */
-	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) ||
-		PG_ARGISNULL(2) || PG_ARGISNULL(3))
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("origin or target data cannot be NULL")));
-
-	origin_tli = PG_GETARG_INT32(0);
-	origin_lsn = PG_GETARG_LSN(1);
-	target_tli = PG_GETARG_INT32(2);
-	target_lsn = PG_GETARG_LSN(3);
-	history_buf = PG_ARGISNULL(4) ? NULL :
-		TextDatumGetCString(PG_GETARG_DATUM(4));
-
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not "
-						"allowed in this context")));
-
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
-	tupdesc = CreateTemplateTupleDesc(1, false);
-
-	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "wal_segs", TEXTOID, -1, 0);
-
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
-
-	MemoryContextSwitchTo(oldcontext);
+	XLogRecPtr		target_begin;
+	SegmentRange   *ranges;
+	int				n = 0;
 
 	/* First do sanity checks on target and origin data */
 	if (origin_lsn > target_lsn)
@@ -308,8 +372,8 @@ archive_build_segment_list(PG_FUNCTION_ARGS)
 	 */
 	if (history_buf)
 	{
-		/* parse the history file */
-		entries = parseTimeLineHistory(history_buf);
+		/* parse the history file, or get it from the cache */
+		entries = get_timeline_history(history_buf);
 
 		if (entries == NIL)
 			ereport(ERROR,
@@ -358,11 +422,10 @@ archive_build_segment_list(PG_FUNCTION_ARGS)
 					 errmsg("origin data not a direct parent of target")));
 
 		/*
-		 * Abuse this variable as temporary storage, we want the beginning
-		 * of the last, target timeline to match the end of the last timeline
-		 * tracked in the history file.
+		 * The beginning of the last, target timeline matches the end of the
+		 * last timeline tracked in the history file.
 		 */
-		current_seg_lsn = history->end;
+		target_begin = ((TimeLineHistoryEntry *) llast(entries))->end;
 	}
 	else
 	{
@@ -372,18 +435,15 @@ archive_build_segment_list(PG_FUNCTION_ARGS)
 					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 					 errmsg("origin and target timelines not matching without history file")));
 
-		current_seg_lsn = origin_lsn;
+		target_begin = origin_lsn;
 	}
 
 	/*
-	 * Before listing the list of files, add a last history entry using the
-	 * target data, this simplifies the logic below to build the segment list.
+	 * One range per history entry at most, plus the target timeline and
+	 * the last segment.
 	 */
-	history = (TimeLineHistoryEntry *) palloc(sizeof(TimeLineHistoryEntry));
-	history->tli = target_tli;
-	history->begin = current_seg_lsn;
-	history->end = target_lsn;
-	entries = lappend(entries, history);
+	ranges = (SegmentRange *) palloc(sizeof(SegmentRange) *
+									 (list_length(entries) + 2));
 
 	/*
 	 * Fill in the data by finding all segments between the origin and the
@@ -391,52 +451,147 @@ archive_build_segment_list(PG_FUNCTION_ARGS)
 	 * timeline. Note that when jumping to a new timeline, Postgres
 	 * switches immediately to a new segment with the new timeline, giving
 	 * up on the last, partial segment.
+	 *
+	 * Segments are tracked by the beginning of the segment after them,
+	 * starting at the beginning of the segment following the origin. Each
+	 * timeline gets the segments whose following boundary is between the
+	 * beginning and the end of the timeline.
 	 */
+	current_seg_lsn = (origin_lsn / segsize + 1) * segsize;
 
-	/* Begin tracking at the beginning of the next segment */
-	current_seg_lsn = origin_lsn + XLOG_SEG_SIZE;
-	current_seg_lsn -= current_seg_lsn % XLOG_SEG_SIZE;
-	current_tli = origin_tli;
-
-	foreach(entry, entries)
+	for (entry = list_head(entries); ; entry = lnext(entry))
 	{
-		history = (TimeLineHistoryEntry *) lfirst(entry);
-
-		current_tli = history->tli;
+		TimeLineID	tli;
+		XLogRecPtr	begin;
+		XLogRecPtr	end;
+		uint64		nsegs;
 
-		/* save the segment value */
-		while (current_seg_lsn >= history->begin &&
-			   current_seg_lsn < history->end)
+		/* The target timeline comes after the history entries */
+		if (entry != NULL)
 		{
-			XLByteToPrevSeg(current_seg_lsn, logSegNo);
-			XLogFileName(xlogfname, current_tli, logSegNo);
-			nulls[0] = false;
-			values[0] = CStringGetTextDatum(xlogfname);
-			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			history = (TimeLineHistoryEntry *) lfirst(entry);
+			tli = history->tli;
+			begin = history->begin;
+			end = history->end;
+		}
+		else
+		{
+			tli = target_tli;
+			begin = target_begin;
+			end = target_lsn;
+		}
 
-			/*
-			 * Add equivalent of one segment, and just track the beginning
-			 * of it.
-			 */
-			current_seg_lsn += XLOG_SEG_SIZE;
-			current_seg_lsn -= current_seg_lsn % XLOG_SEG_SIZE;
+		if (current_seg_lsn >= begin && current_seg_lsn < end)
+		{
+			nsegs = (end - current_seg_lsn + segsize - 1) / segsize;
+			ranges[n].tli = tli;
+			ranges[n].first = current_seg_lsn / segsize - 1;
+			ranges[n].last = ranges[n].first + nsegs - 1;
+			n++;
+			current_seg_lsn += nsegs * segsize;
 		}
+
+		if (entry == NULL)
+			break;
 	}
 
 	/*
 	 * Add as well the last segment possible, this is needed to reach
 	 * consistency up to the target point.
 	 */
-	XLByteToPrevSeg(target_lsn, logSegNo);
-	XLogFileName(xlogfname, target_tli, logSegNo);
-	nulls[0] = false;
-	values[0] = CStringGetTextDatum(xlogfname);
-	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	ranges[n].tli = target_tli;
+	XLByteToPrevSeg(target_lsn, ranges[n].first, segsize);
+	ranges[n].last = ranges[n].first;
+	n++;
 
-	/* clean up and return the tuplestore */
-	tuplestore_donestoring(tupstore);
+	*nranges = n;
+	return ranges;
+}
 
-	return (Datum) 0;
+/*
+ * State of archive_build_segment_list across calls.
+ */
+typedef struct SegmentListState
+{
+	SegmentRange *ranges;
+	int			nranges;
+	int			current;		/* current range */
+	XLogSegNo	segno;			/* next segment in current range */
+	int			segsize;
+} SegmentListState;
+
+/*
+ * archive_build_segment_list
+ *
+ * SQL representation of the list of segments built by build_segment_list,
+ * with segment names generated one at a time.
+ */
+Datum
+archive_build_segment_list(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	SegmentListState *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		TimeLineID	origin_tli;
+		XLogRecPtr	origin_lsn;
+		TimeLineID	target_tli;
+		XLogRecPtr	target_lsn;
+		char	   *history_buf;
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		/* Sanity checks for arguments */
+		if (PG_ARGISNULL(0) || PG_ARGISNULL(1) ||
+			PG_ARGISNULL(2) || PG_ARGISNULL(3))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("origin or target data cannot be NULL")));
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		origin_tli = PG_GETARG_INT32(0);
+		origin_lsn = PG_GETARG_LSN(1);
+		target_tli = PG_GETARG_INT32(2);
+		target_lsn = PG_GETARG_LSN(3);
+		history_buf = PG_ARGISNULL(4) ? NULL :
+			TextDatumGetCString(PG_GETARG_DATUM(4));
+
+		state = (SegmentListState *) palloc(sizeof(SegmentListState));
+		state->segsize = get_segment_size(fcinfo, 5);
+		state->ranges = build_segment_list(origin_tli, origin_lsn,
+										   target_tli, target_lsn,
+										   history_buf, state->segsize,
+										   &state->nranges);
+		state->current = 0;
+		state->segno = state->ranges[0].first;
+		funcctx->user_fctx = state;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (SegmentListState *) funcctx->user_fctx;
+
+	if (state->current < state->nranges)
+	{
+		SegmentRange *range = &state->ranges[state->current];
+		char		xlogfname[MAXFNAMELEN];
+
+		XLogFileName(xlogfname, range->tli, state->segno, state->segsize);
+
+		/* Move to the next segment */
+		if (state->segno < range->last)
+			state->segno++;
+		else if (++state->current < state->nranges)
+			state->segno = state->ranges[state->current].first;
+
+		SRF_RETURN_NEXT(funcctx, CStringGetTextDatum(xlogfname));
+	}
+
+	SRF_RETURN_DONE(funcctx);
 }
 
 /*
@@ -602,3 +757,627 @@ archive_get_data(PG_FUNCTION_ARGS)
 
 	PG_RETURN_BYTEA_P(result);
 }
+
+/*
+ * State of a chunked read of an archived file, kept across calls.
+ */
+typedef struct ArchiveChunkState
+{
+	char	   *filepath;
+	int			fd;
+	int64		offset;			/* offset of next chunk to read */
+	int32		chunk_size;
+	ExprContext *econtext;		/* context of the shutdown callback */
+} ArchiveChunkState;
+
+/*
+ * Callback closing the file of a chunked read if the scan is stopped before
+ * the end of the file.
+ */
+static void
+archive_chunks_shutdown(Datum arg)
+{
+	ArchiveChunkState *state = (ArchiveChunkState *) DatumGetPointer(arg);
+
+	if (state->fd >= 0)
+	{
+		CloseTransientFile(state->fd);
+		state->fd = -1;
+	}
+}
+
+/*
+ * Set up a chunked read of an archived file at the first call of a
+ * set-returning function, returning its state.
+ */
+static ArchiveChunkState *
+archive_chunks_init(FunctionCallInfo fcinfo, FuncCallContext *funcctx,
+					int32 max_chunk_size)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	char	   *filename = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int32		chunk_size = PG_GETARG_INT32(1);
+	ArchiveChunkState *state;
+	MemoryContext oldcontext;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to read files"))));
+
+	if (chunk_size <= 0 || chunk_size > max_chunk_size)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("chunk size must be between 1 and %d bytes",
+						max_chunk_size)));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+	state = (ArchiveChunkState *) palloc(sizeof(ArchiveChunkState));
+	state->filepath = check_and_build_filepath(filename);
+	state->offset = 0;
+	state->chunk_size = chunk_size;
+	state->econtext = rsinfo->econtext;
+	state->fd = OpenTransientFile(state->filepath, O_RDONLY | PG_BINARY);
+	if (state->fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m",
+						state->filepath)));
+
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+	(void) posix_fadvise(state->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* Close the file if the scan stops before reaching its end */
+	RegisterExprContextCallback(rsinfo->econtext, archive_chunks_shutdown,
+								PointerGetDatum(state));
+
+	MemoryContextSwitchTo(oldcontext);
+	pfree(filename);
+
+	return state;
+}
+
+/*
+ * Read the next chunk of an archived file in the current memory context,
+ * returning NULL once the end of the file is reached.
+ */
+static bytea *
+archive_chunks_next(ArchiveChunkState *state)
+{
+	bytea	   *result;
+	ssize_t		nbytes;
+
+	if (state->fd < 0)
+		return NULL;
+
+	/* Let the kernel read ahead the chunk after this one */
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	(void) posix_fadvise(state->fd, state->offset + state->chunk_size,
+						 state->chunk_size, POSIX_FADV_WILLNEED);
+#endif
+
+	result = (bytea *) palloc((Size) state->chunk_size + VARHDRSZ);
+
+	/* Chunks are read sequentially, at offsets multiple of the chunk size */
+	nbytes = read(state->fd, VARDATA(result), state->chunk_size);
+	if (nbytes < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", state->filepath)));
+
+	/*
+	 * Close the file at its end. The state is freed once the scan is done,
+	 * so the shutdown callback is not needed anymore.
+	 */
+	if (nbytes == 0)
+	{
+		pfree(result);
+		archive_chunks_shutdown(PointerGetDatum(state));
+		UnregisterExprContextCallback(state->econtext, archive_chunks_shutdown,
+									  PointerGetDatum(state));
+		return NULL;
+	}
+
+	SET_VARSIZE(result, nbytes + VARHDRSZ);
+	state->offset += nbytes;
+	return result;
+}
+
+/*
+ * archive_get_data_chunks
+ *
+ * Read a file in an archive folder defined by PGARCHIVE as a set of chunks
+ * of the size given by caller, returned one at a time with their offset
+ * in the file, so as memory used does not depend on the size of the file.
+ */
+Datum
+archive_get_data_chunks(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	ArchiveChunkState *state;
+	bytea	   *chunk;
+	int64		offset;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		TupleDesc	tupdesc;
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		funcctx->user_fctx = archive_chunks_init(fcinfo, funcctx,
+												 MaxAllocSize - VARHDRSZ);
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (ArchiveChunkState *) funcctx->user_fctx;
+
+	offset = state->offset;
+	chunk = archive_chunks_next(state);
+	if (chunk != NULL)
+	{
+		Datum		values[2];
+		bool		nulls[2];
+		HeapTuple	tuple;
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum(offset);
+		values[1] = PointerGetDatum(chunk);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * archive_copy_data
+ *
+ * Same as archive_get_data_chunks, except that chunks are returned as
+ * hexadecimal text without any prefix. With COPY TO STDOUT, this gives one
+ * line per chunk that can be decoded as-is, with "xxd -r -p" for example.
+ */
+Datum
+archive_copy_data(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	ArchiveChunkState *state;
+	bytea	   *chunk;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		funcctx = SRF_FIRSTCALL_INIT();
+		/* Leave room for the hexadecimal representation of a chunk */
+		funcctx->user_fctx = archive_chunks_init(fcinfo, funcctx,
+												 (MaxAllocSize - VARHDRSZ) / 2);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (ArchiveChunkState *) funcctx->user_fctx;
+
+	chunk = archive_chunks_next(state);
+	if (chunk != NULL)
+	{
+		Size		len = VARSIZE(chunk) - VARHDRSZ;
+		text	   *result;
+
+		result = (text *) palloc(len * 2 + VARHDRSZ);
+		hex_encode(VARDATA(chunk), len, VARDATA(result));
+		SET_VARSIZE(result, len * 2 + VARHDRSZ);
+		pfree(chunk);
+
+		SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Segment being checked by archive_verify_segments, with a buffer of data
+ * read in chunks.
+ */
+#define VERIFY_CHUNK_SIZE	(4 * 1024 * 1024)
+#define VERIFY_MAX_READAHEAD	64
+
+typedef struct VerifySegment
+{
+	char	   *filepath;
+	int			fd;
+	TimeLineID	tli;
+	XLogRecPtr	segstart;
+	int			segsize;
+	char	   *buf;			/* chunk of data in memory */
+	off_t		buf_start;
+	int			buf_len;
+	bool		beyond_end;		/* page requested after segment's end */
+	char	   *error;			/* error found while reading */
+} VerifySegment;
+
+/*
+ * Read data of a segment being checked, through its chunk in memory.
+ */
+static bool
+verify_read(VerifySegment *vs, off_t off, char *dst, int len)
+{
+	if (off < vs->buf_start || off + len > vs->buf_start + vs->buf_len)
+	{
+		int			nbytes;
+
+		if (lseek(vs->fd, off, SEEK_SET) < 0)
+		{
+			vs->error = psprintf("could not seek in file: %m");
+			return false;
+		}
+
+		nbytes = read(vs->fd, vs->buf,
+					  Min(VERIFY_CHUNK_SIZE, vs->segsize - off));
+		if (nbytes < 0)
+		{
+			vs->error = psprintf("could not read file: %m");
+			return false;
+		}
+		vs->buf_start = off;
+		vs->buf_len = nbytes;
+
+		if (off + len > vs->buf_start + vs->buf_len)
+		{
+			vs->error = psprintf("could not read %d bytes at offset %u",
+								 len, (uint32) off);
+			return false;
+		}
+	}
+
+	memcpy(dst, vs->buf + (off - vs->buf_start), len);
+	return true;
+}
+
+/* XLogReader callback reading the pages of a segment being checked */
+static int
+verify_read_page(XLogReaderState *state, XLogRecPtr targetPagePtr,
+				 int reqLen, XLogRecPtr targetRecPtr, char *readBuf,
+				 TimeLineID *pageTLI)
+{
+	VerifySegment *vs = (VerifySegment *) state->private_data;
+
+	/* Records crossing the end of the segment cannot be checked */
+	if (targetPagePtr < vs->segstart ||
+		targetPagePtr >= vs->segstart + vs->segsize)
+	{
+		vs->beyond_end = true;
+		return -1;
+	}
+
+	if (!verify_read(vs, (off_t) (targetPagePtr - vs->segstart), readBuf,
+					 XLOG_BLCKSZ))
+		return -1;
+
+	*pageTLI = vs->tli;
+	return XLOG_BLCKSZ;
+}
+
+/*
+ * Check the page headers and the records of a segment. The first record
+ * beginning in the segment is found by skipping the continuation of a
+ * record from the previous segment, then all the records beginning in
+ * the segment are read, checking their CRC. Returns NULL if the segment
+ * is valid, or a description of the first problem found.
+ */
+static char *
+verify_segment(VerifySegment *vs)
+{
+	PGAlignedXLogBlock page;
+	XLogLongPageHeader longhdr = (XLogLongPageHeader) page.data;
+	XLogReaderState *reader;
+	XLogRecPtr	first_record = InvalidXLogRecPtr;
+	uint32		off;
+
+	if (!verify_read(vs, 0, page.data, XLOG_BLCKSZ))
+		return vs->error;
+
+	if (longhdr->std.xlp_magic != XLOG_PAGE_MAGIC)
+		return psprintf("invalid magic number %04X in first page",
+						longhdr->std.xlp_magic);
+	if ((longhdr->std.xlp_info & XLP_LONG_HEADER) == 0)
+		return pstrdup("first page has no long header");
+	if (longhdr->xlp_seg_size != vs->segsize)
+		return psprintf("WAL segment size %u in first page header different from %d",
+						longhdr->xlp_seg_size, vs->segsize);
+	if (longhdr->xlp_xlog_blcksz != XLOG_BLCKSZ)
+		return psprintf("WAL block size %u in first page header different from %d",
+						longhdr->xlp_xlog_blcksz, XLOG_BLCKSZ);
+	if (longhdr->std.xlp_tli > vs->tli)
+		return psprintf("timeline %u in first page header newer than timeline of segment %u",
+						longhdr->std.xlp_tli, vs->tli);
+
+	/* Find the first record beginning in the segment */
+	for (off = 0; off < vs->segsize; off += XLOG_BLCKSZ)
+	{
+		XLogPageHeader hdr = (XLogPageHeader) page.data;
+		uint32		hdrsize;
+
+		if (off > 0 && !verify_read(vs, off, page.data, XLOG_BLCKSZ))
+			return vs->error;
+
+		if (hdr->xlp_magic != XLOG_PAGE_MAGIC)
+			return psprintf("invalid magic number %04X in page at offset %u",
+							hdr->xlp_magic, off);
+
+		hdrsize = XLogPageHeaderSize(hdr);
+		if ((hdr->xlp_info & XLP_FIRST_IS_CONTRECORD) == 0)
+		{
+			first_record = vs->segstart + off + hdrsize;
+			break;
+		}
+		if (hdrsize + MAXALIGN(hdr->xlp_rem_len) < XLOG_BLCKSZ)
+		{
+			first_record = vs->segstart + off + hdrsize +
+				MAXALIGN(hdr->xlp_rem_len);
+			break;
+		}
+	}
+
+	/* The whole segment is the continuation of a record */
+	if (XLogRecPtrIsInvalid(first_record))
+		return NULL;
+
+	reader = XLogReaderAllocate(vs->segsize, verify_read_page, vs);
+	if (reader == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	vs->error = NULL;
+	for (;;)
+	{
+		XLogRecord *record;
+		char	   *errormsg;
+
+		record = XLogReadRecord(reader, first_record, &errormsg);
+		if (record == NULL)
+		{
+			if (vs->beyond_end)
+				break;
+			if (vs->error == NULL)
+				vs->error = psprintf("invalid record at %X/%X: %s",
+									 (uint32) (reader->EndRecPtr >> 32),
+									 (uint32) reader->EndRecPtr,
+									 errormsg ? errormsg : "no error message");
+			break;
+		}
+		first_record = InvalidXLogRecPtr;
+
+		/* Done once the end of the segment is reached */
+		if (reader->EndRecPtr >= vs->segstart + vs->segsize)
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	XLogReaderFree(reader);
+	return vs->error;
+}
+
+/*
+ * archive_verify_segments
+ *
+ * Check all the segments in the archives needed to join the given origin
+ * to the given target, as listed by archive_build_segment_list, reporting
+ * for each segment if it is present, its size and if its page headers and
+ * records are valid. While a segment is checked, the next ones are opened
+ * and the kernel is told to read them ahead, so as reads of the archives
+ * happen in parallel of the checks.
+ */
+Datum
+archive_verify_segments(PG_FUNCTION_ARGS)
+{
+	TimeLineID	origin_tli;
+	XLogRecPtr	origin_lsn;
+	TimeLineID	target_tli;
+	XLogRecPtr	target_lsn;
+	char	   *history_buf;
+	int			readahead;
+	int			segsize;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	MemoryContext verify_ctx;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	SegmentRange *ranges;
+	int			nranges;
+	TimeLineID *tlis;
+	XLogSegNo  *segnos;
+	int		   *fds;
+	int			nsegments;
+	int			opened = 0;
+	int			i;
+	char	   *buf;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to read files"))));
+
+	/* Sanity checks for arguments */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) ||
+		PG_ARGISNULL(2) || PG_ARGISNULL(3))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("origin or target data cannot be NULL")));
+
+	origin_tli = PG_GETARG_INT32(0);
+	origin_lsn = PG_GETARG_LSN(1);
+	target_tli = PG_GETARG_INT32(2);
+	target_lsn = PG_GETARG_LSN(3);
+	history_buf = PG_ARGISNULL(4) ? NULL :
+		TextDatumGetCString(PG_GETARG_DATUM(4));
+	readahead = PG_ARGISNULL(5) ? 0 : PG_GETARG_INT32(5);
+
+	if (readahead < 0 || readahead > VERIFY_MAX_READAHEAD)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of segments read ahead must be between 0 and %d",
+						VERIFY_MAX_READAHEAD)));
+	segsize = get_segment_size(fcinfo, 6);
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	ranges = build_segment_list(origin_tli, origin_lsn, target_tli,
+								target_lsn, history_buf, segsize, &nranges);
+
+	/*
+	 * Flatten the ranges into a list of segments, files are opened in order
+	 * and their names are built only when needed.
+	 */
+	nsegments = 0;
+	for (i = 0; i < nranges; i++)
+		nsegments += ranges[i].last - ranges[i].first + 1;
+	tlis = (TimeLineID *) palloc(sizeof(TimeLineID) * nsegments);
+	segnos = (XLogSegNo *) palloc(sizeof(XLogSegNo) * nsegments);
+	fds = (int *) palloc(sizeof(int) * nsegments);
+	nsegments = 0;
+	for (i = 0; i < nranges; i++)
+	{
+		XLogSegNo	segno;
+
+		for (segno = ranges[i].first; segno <= ranges[i].last; segno++)
+		{
+			tlis[nsegments] = ranges[i].tli;
+			segnos[nsegments] = segno;
+			fds[nsegments] = -1;
+			nsegments++;
+		}
+	}
+
+	buf = palloc(VERIFY_CHUNK_SIZE);
+	verify_ctx = AllocSetContextCreate(CurrentMemoryContext,
+									   "archive_verify_segments",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	for (i = 0; i < nsegments; i++)
+	{
+		Datum		values[5];
+		bool		nulls[5];
+		VerifySegment vs;
+		char		xlogfname[MAXFNAMELEN];
+		struct stat fst;
+		char	   *error = NULL;
+
+		/* Open the segments to read ahead, and ask for their data */
+		for (; opened < nsegments && opened <= i + readahead; opened++)
+		{
+			char	   *filepath;
+
+			XLogFileName(xlogfname, tlis[opened], segnos[opened], segsize);
+			filepath = check_and_build_filepath(xlogfname);
+
+			fds[opened] = OpenTransientFile(filepath, O_RDONLY | PG_BINARY);
+			if (fds[opened] < 0 && errno != ENOENT)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not open file \"%s\" for reading: %m",
+								filepath)));
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+			if (fds[opened] >= 0)
+				(void) posix_fadvise(fds[opened], 0, 0, POSIX_FADV_WILLNEED);
+#endif
+			pfree(filepath);
+		}
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+		XLogFileName(xlogfname, tlis[i], segnos[i], segsize);
+		values[0] = CStringGetTextDatum(xlogfname);
+
+		/* Missing segment */
+		if (fds[i] < 0)
+		{
+			values[1] = BoolGetDatum(false);
+			nulls[2] = true;
+			values[3] = BoolGetDatum(false);
+			values[4] = CStringGetTextDatum("segment is missing");
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			continue;
+		}
+
+		if (fstat(fds[i], &fst) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not stat file \"%s\": %m", xlogfname)));
+		values[1] = BoolGetDatum(true);
+		values[2] = Int64GetDatum((int64) fst.st_size);
+
+		oldcontext = MemoryContextSwitchTo(verify_ctx);
+		if (fst.st_size != segsize)
+			error = psprintf("size %lld different from WAL segment size %d",
+							 (long long) fst.st_size, segsize);
+		else
+		{
+			MemSet(&vs, 0, sizeof(vs));
+			vs.filepath = xlogfname;
+			vs.fd = fds[i];
+			vs.tli = tlis[i];
+			vs.segsize = segsize;
+			XLogSegNoOffsetToRecPtr(segnos[i], 0, vs.segstart, segsize);
+			vs.buf = buf;
+			vs.buf_start = 0;
+			vs.buf_len = 0;
+			error = verify_segment(&vs);
+		}
+		MemoryContextSwitchTo(oldcontext);
+
+		values[3] = BoolGetDatum(error == NULL);
+		if (error)
+			values[4] = CStringGetTextDatum(error);
+		else
+			nulls[4] = true;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		MemoryContextReset(verify_ctx);
+		CloseTransientFile(fds[i]);
+		fds[i] = -1;
+	}
+
+	MemoryContextDelete(verify_ctx);
+	pfree(buf);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}